@@ -0,0 +1,251 @@
+/*
+ * tcp_fastopen_test: exercise TCP Fast Open over loopback
+ *
+ * Turns on both sides of Fast Open (net.ipv4.tcp_fastopen = 3) for the
+ * duration of the run and connects to a local listener three times with
+ * sendto(MSG_FASTOPEN), checking the TcpExt counters of /proc/net/netstat
+ * after each connection:
+ *
+ *  1. No cookie is cached for the destination yet: the SYN requests one
+ *     and the data follows the handshake (TCPFastOpenCookieReqd).
+ *  2. The cookie is presented with the data in the SYN, and the listener
+ *     accepts the data before the handshake completes
+ *     (TCPFastOpenActive, TCPFastOpenPassive).
+ *  3. The cookie is presented from another source address, for which it
+ *     is not valid: the server ignores the data in the SYN and the client
+ *     retransmits it after the handshake (TCPFastOpenPassiveFail).
+ *
+ * In every case the listener must receive the data.  The inet_peer cache
+ * of cookies can't be flushed from user space, so each run connects to a
+ * new random address in 127.0.0.0/8.
+ *
+ * Must be run as root.  Exits with 0 if all checks passed.
+ *
+ * Released under the General Public License (GPL).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN	23
+#endif
+#ifndef MSG_FASTOPEN
+#define MSG_FASTOPEN	0x20000000
+#endif
+
+#define SYSCTL		"/proc/sys/net/ipv4/tcp_fastopen"
+#define NETSTAT		"/proc/net/netstat"
+
+static char saved_sysctl[16];
+static int failed;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void write_sysctl(const char *val)
+{
+	int fd = open(SYSCTL, O_WRONLY);
+
+	if (fd < 0 || write(fd, val, strlen(val)) < 0)
+		die(SYSCTL);
+	close(fd);
+}
+
+static void restore_sysctl(void)
+{
+	write_sysctl(saved_sysctl);
+}
+
+/* Value of a TcpExt counter, -1 if the kernel does not have it */
+static long tcpext(const char *name)
+{
+	char names[4096], values[4096];
+	char *n, *v, *nsave, *vsave;
+	long ret = -1;
+	FILE *f;
+
+	f = fopen(NETSTAT, "r");
+	if (!f)
+		die(NETSTAT);
+	while (fgets(names, sizeof(names), f) &&
+	       fgets(values, sizeof(values), f)) {
+		if (strncmp(names, "TcpExt:", 7))
+			continue;
+		n = strtok_r(names, " \n", &nsave);
+		v = strtok_r(values, " \n", &vsave);
+		while ((n = strtok_r(NULL, " \n", &nsave)) &&
+		       (v = strtok_r(NULL, " \n", &vsave))) {
+			if (!strcmp(n, name)) {
+				ret = atol(v);
+				break;
+			}
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+struct counters {
+	long cookie_reqd, active, passive, passive_fail;
+};
+
+static void read_counters(struct counters *c)
+{
+	c->cookie_reqd = tcpext("TCPFastOpenCookieReqd");
+	c->active = tcpext("TCPFastOpenActive");
+	c->passive = tcpext("TCPFastOpenPassive");
+	c->passive_fail = tcpext("TCPFastOpenPassiveFail");
+}
+
+static void check(const char *test, const char *what, long got, long want)
+{
+	if (got == want)
+		return;
+	printf("%s: %s went up by %ld, expected %ld\n", test, what, got, want);
+	failed = 1;
+}
+
+/*
+ * Connect from src (if not NULL) to dst with the message in the SYN, and
+ * check that the listener gets it.
+ */
+static void fastopen_connect(int lfd, struct sockaddr_in *src,
+			     struct sockaddr_in *dst, const char *msg,
+			     struct sockaddr_in *used_src)
+{
+	socklen_t len = sizeof(*used_src);
+	size_t n = strlen(msg), got = 0;
+	char buf[64];
+	int fd, afd;
+	ssize_t ret;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		die("socket");
+	if (src && bind(fd, (struct sockaddr *)src, sizeof(*src)) < 0)
+		die("bind");
+	ret = sendto(fd, msg, n, MSG_FASTOPEN, (struct sockaddr *)dst,
+		     sizeof(*dst));
+	if (ret < 0)
+		die("sendto(MSG_FASTOPEN)");
+	if (ret != (ssize_t)n) {
+		printf("%s: sendto() sent %zd of %zu bytes\n", msg, ret, n);
+		failed = 1;
+	}
+	if (used_src && getsockname(fd, (struct sockaddr *)used_src, &len))
+		die("getsockname");
+
+	afd = accept(lfd, NULL, NULL);
+	if (afd < 0)
+		die("accept");
+	while (got < n) {
+		ret = read(afd, buf + got, sizeof(buf) - got);
+		if (ret <= 0)
+			break;
+		got += ret;
+	}
+	if (got != n || memcmp(buf, msg, n)) {
+		printf("%s: listener received %zu bytes \"%.*s\"\n",
+		       msg, got, (int)got, buf);
+		failed = 1;
+	}
+	close(afd);
+	close(fd);
+}
+
+int main(void)
+{
+	struct sockaddr_in dst, src, used;
+	struct counters before, after;
+	socklen_t len = sizeof(dst);
+	int lfd, fd, qlen = 16, one = 1;
+	unsigned int r;
+
+	fd = open(SYSCTL, O_RDONLY);
+	if (fd < 0) {
+		perror(SYSCTL);
+		fprintf(stderr, "The kernel does not support TCP Fast Open\n");
+		return 1;
+	}
+	if (read(fd, saved_sysctl, sizeof(saved_sysctl) - 1) <= 0)
+		die(SYSCTL);
+	close(fd);
+	write_sysctl("3");
+	atexit(restore_sysctl);
+
+	srand(time(NULL) ^ getpid());
+	r = rand();
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_addr.s_addr = htonl(0x7f000000 |
+				    (1 + r % 254) << 16 |
+				    (r >> 8) % 256 << 8 | (1 + (r >> 16) % 254));
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0)
+		die("socket");
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(lfd, (struct sockaddr *)&dst, sizeof(dst)) < 0)
+		die("bind");
+	if (getsockname(lfd, (struct sockaddr *)&dst, &len) < 0)
+		die("getsockname");
+	if (setsockopt(lfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)))
+		die("setsockopt(TCP_FASTOPEN)");
+	if (listen(lfd, 16) < 0)
+		die("listen");
+	printf("listening on %s:%d\n", inet_ntoa(dst.sin_addr),
+	       ntohs(dst.sin_port));
+
+	read_counters(&before);
+	if (before.cookie_reqd < 0 || before.passive < 0) {
+		fprintf(stderr, "The kernel has no Fast Open counters\n");
+		return 1;
+	}
+	fastopen_connect(lfd, NULL, &dst, "cookie request", &used);
+	read_counters(&after);
+	check("cookie request", "TCPFastOpenCookieReqd",
+	      after.cookie_reqd - before.cookie_reqd, 1);
+	check("cookie request", "TCPFastOpenPassive",
+	      after.passive - before.passive, 0);
+
+	before = after;
+	fastopen_connect(lfd, NULL, &dst, "data in SYN", NULL);
+	read_counters(&after);
+	check("data in SYN", "TCPFastOpenActive",
+	      after.active - before.active, 1);
+	check("data in SYN", "TCPFastOpenPassive",
+	      after.passive - before.passive, 1);
+	check("data in SYN", "TCPFastOpenPassiveFail",
+	      after.passive_fail - before.passive_fail, 0);
+
+	/* The cookie is a MAC of both addresses: change the source */
+	memset(&src, 0, sizeof(src));
+	src.sin_family = AF_INET;
+	src.sin_addr.s_addr = used.sin_addr.s_addr != dst.sin_addr.s_addr ?
+			      dst.sin_addr.s_addr : htonl(INADDR_LOOPBACK);
+	before = after;
+	fastopen_connect(lfd, &src, &dst, "bad cookie", NULL);
+	read_counters(&after);
+	check("bad cookie", "TCPFastOpenPassive",
+	      after.passive - before.passive, 0);
+	check("bad cookie", "TCPFastOpenPassiveFail",
+	      after.passive_fail - before.passive_fail, 1);
+
+	close(lfd);
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
@@ -0,0 +1,209 @@
+/*
+ * lru-stress: concurrent fault and reclaim load on the zone LRU lists
+ *
+ * Starts one process per CPU (or -p N), each of which keeps faulting in
+ * a private anonymous area and streaming through a file, so that every
+ * CPU adds, activates and rotates LRU pages while kswapd and direct
+ * reclaim isolate and put back pages of the same zones.  Size the areas
+ * so that together they exceed free memory, otherwise nothing is
+ * reclaimed.
+ *
+ * At the end the number of pages touched per second is reported.  With
+ * CONFIG_LOCK_STAT, /proc/lock_stat is cleared before the run and the
+ * entries of the LRU locks are printed after it, so the contention on
+ * them can be compared between kernels built with different numbers of
+ * LRU shards (CONFIG_NR_LRU_SHARDS).
+ *
+ * Released under the General Public License (GPL).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define LOCK_STAT	"/proc/lock_stat"
+
+static unsigned long page_size;
+static int nr_procs;
+static unsigned long anon_mb = 256;
+static const char *file_name;
+static int duration = 30;
+static volatile sig_atomic_t stop;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-p procs] [-a anon_mb] [-f file] [-t seconds]\n"
+		"  -p  number of processes (default: number of CPUs)\n"
+		"  -a  anonymous memory per process in MB (default 256)\n"
+		"  -f  file to stream through the page cache (default none)\n"
+		"  -t  duration of the run in seconds (default 30)\n",
+		prog);
+	exit(1);
+}
+
+static void on_alarm(int sig)
+{
+	stop = 1;
+}
+
+static unsigned long touch_anon(char *area, unsigned long size)
+{
+	unsigned long off, nr = 0;
+
+	for (off = 0; off < size && !stop; off += page_size, nr++)
+		area[off] = (char)nr;
+	return nr;
+}
+
+static unsigned long stream_file(int fd, char *buf, size_t len)
+{
+	unsigned long nr = 0;
+	ssize_t ret;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return 0;
+	while (!stop && (ret = read(fd, buf, len)) > 0)
+		nr += (ret + page_size - 1) / page_size;
+	return nr;
+}
+
+static void worker(unsigned long *count)
+{
+	unsigned long size = anon_mb << 20;
+	size_t buf_len = 64 * page_size;
+	char *area, *buf;
+	int fd = -1;
+
+	area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	buf = malloc(buf_len);
+	if (area == MAP_FAILED || !buf) {
+		perror("mmap");
+		exit(1);
+	}
+	if (file_name) {
+		fd = open(file_name, O_RDONLY);
+		if (fd < 0) {
+			perror(file_name);
+			exit(1);
+		}
+	}
+
+	while (!stop) {
+		*count += touch_anon(area, size);
+		if (fd >= 0)
+			*count += stream_file(fd, buf, buf_len);
+	}
+	exit(0);
+}
+
+static void clear_lock_stat(void)
+{
+	int fd = open(LOCK_STAT, O_WRONLY);
+
+	if (fd < 0)
+		return;
+	if (write(fd, "0", 1) != 1)
+		perror(LOCK_STAT);
+	close(fd);
+}
+
+static void show_lock_stat(void)
+{
+	char line[512];
+	int header = 0;
+	FILE *f;
+
+	f = fopen(LOCK_STAT, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strstr(line, "lru") || !strchr(line, ':'))
+			continue;
+		if (!header++)
+			printf("\nLRU lock contention (%s):\n", LOCK_STAT);
+		fputs(line, stdout);
+	}
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	struct timeval start, end;
+	unsigned long *counts, total = 0;
+	double secs;
+	int c, i;
+
+	page_size = getpagesize();
+	nr_procs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "p:a:f:t:")) != -1) {
+		switch (c) {
+		case 'p':
+			nr_procs = atoi(optarg);
+			break;
+		case 'a':
+			anon_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			file_name = optarg;
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_procs < 1 || duration < 1)
+		usage(argv[0]);
+
+	counts = mmap(NULL, nr_procs * sizeof(*counts), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (counts == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	signal(SIGALRM, on_alarm);
+	clear_lock_stat();
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_procs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (!pid) {
+			alarm(duration);
+			worker(&counts[i]);
+		}
+	}
+	for (i = 0; i < nr_procs; i++)
+		wait(NULL);
+
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) +
+	       (end.tv_usec - start.tv_usec) / 1e6;
+
+	for (i = 0; i < nr_procs; i++)
+		total += counts[i];
+	printf("%d processes, %lu MB anon each%s%s\n", nr_procs, anon_mb,
+	       file_name ? ", streaming " : "", file_name ? file_name : "");
+	printf("%lu pages touched in %.2f s: %.0f pages/s\n",
+	       total, secs, total / secs);
+
+	show_lock_stat();
+	return 0;
+}
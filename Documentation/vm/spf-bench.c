@@ -0,0 +1,186 @@
+/*
+ * spf-bench: page fault throughput of a threaded process under mmap churn
+ *
+ * Starts -f fault threads, each of which keeps touching every page of its
+ * own private anonymous area and then drops the pages with MADV_DONTNEED,
+ * so that every touch is a fault on memory whose page tables already
+ * exist.  At the same time -m mapper threads keep calling mmap, mprotect
+ * and munmap in the same process, which take mmap_sem for writing.
+ *
+ * At the end the number of faults per second is reported, together with
+ * the speculative_pgfault counters of /proc/vmstat if the kernel has them,
+ * so that kernels with and without CONFIG_SPECULATIVE_PAGE_FAULT can be
+ * compared.
+ *
+ * Released under the General Public License (GPL).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#define VMSTAT	"/proc/vmstat"
+
+static unsigned long page_size;
+static int nr_faulters;
+static int nr_mappers = 1;
+static unsigned long area_mb = 64;
+static int duration = 10;
+static volatile int stop;
+
+struct faulter {
+	pthread_t thread;
+	unsigned long faults;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-f threads] [-m threads] [-a area_mb] [-t seconds]\n"
+		"  -f  number of fault threads (default: number of CPUs)\n"
+		"  -m  number of mmap/munmap threads (default 1)\n"
+		"  -a  anonymous memory per fault thread in MB (default 64)\n"
+		"  -t  duration of the run in seconds (default 10)\n",
+		prog);
+	exit(1);
+}
+
+static void *fault_thread(void *arg)
+{
+	struct faulter *f = arg;
+	unsigned long size = area_mb << 20;
+	unsigned long off;
+	char *area;
+
+	area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	/* Populate the page tables once, only the ptes are dropped below */
+	memset(area, 1, size);
+
+	while (!stop) {
+		madvise(area, size, MADV_DONTNEED);
+		for (off = 0; off < size && !stop; off += page_size) {
+			area[off] = 1;
+			f->faults++;
+		}
+	}
+	return NULL;
+}
+
+static void *map_thread(void *arg)
+{
+	unsigned long size = 16 * page_size;
+	char *p;
+
+	while (!stop) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		p[0] = 1;
+		mprotect(p, size / 2, PROT_READ);
+		munmap(p, size);
+	}
+	return NULL;
+}
+
+static void show_vmstat(const char *when)
+{
+	char line[128];
+	FILE *f;
+
+	f = fopen(VMSTAT, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, "speculative_pgfault", 19))
+			printf("%s %s", when, line);
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	struct timeval start, end;
+	struct faulter *faulters;
+	pthread_t *mappers;
+	unsigned long total = 0;
+	double secs;
+	int c, i;
+
+	page_size = getpagesize();
+	nr_faulters = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "f:m:a:t:")) != -1) {
+		switch (c) {
+		case 'f':
+			nr_faulters = atoi(optarg);
+			break;
+		case 'm':
+			nr_mappers = atoi(optarg);
+			break;
+		case 'a':
+			area_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_faulters < 1 || nr_mappers < 0 || !area_mb || duration < 1)
+		usage(argv[0]);
+
+	faulters = calloc(nr_faulters, sizeof(*faulters));
+	mappers = calloc(nr_mappers + 1, sizeof(*mappers));
+	if (!faulters || !mappers) {
+		perror("calloc");
+		return 1;
+	}
+
+	show_vmstat("before:");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_faulters; i++)
+		if (pthread_create(&faulters[i].thread, NULL, fault_thread,
+				   &faulters[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	for (i = 0; i < nr_mappers; i++)
+		if (pthread_create(&mappers[i], NULL, map_thread, NULL)) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	sleep(duration);
+	stop = 1;
+
+	for (i = 0; i < nr_faulters; i++) {
+		pthread_join(faulters[i].thread, NULL);
+		total += faulters[i].faults;
+	}
+	for (i = 0; i < nr_mappers; i++)
+		pthread_join(mappers[i], NULL);
+	gettimeofday(&end, NULL);
+	show_vmstat("after: ");
+
+	secs = (end.tv_sec - start.tv_sec) +
+	       (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%d fault threads, %d mapper threads, %lu MB each\n",
+	       nr_faulters, nr_mappers, area_mb);
+	printf("%lu faults in %.2f s: %.0f faults/s\n",
+	       total, secs, total / secs);
+	return 0;
+}
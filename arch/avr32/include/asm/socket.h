@@ -60,4 +60,6 @@
 #define SO_PROTOCOL		38
 #define SO_DOMAIN		39
 
+#define SO_ZEROCOPY		60
+
 #endif /* __ASM_AVR32_SOCKET_H */
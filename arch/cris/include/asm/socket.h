@@ -62,6 +62,8 @@
 #define SO_PROTOCOL		38
 #define SO_DOMAIN		39
 
+#define SO_ZEROCOPY		60
+
 #endif /* _ASM_SOCKET_H */
 
 
@@ -182,4 +182,27 @@ static inline unsigned long __cmpxchg_local(volatile void *ptr,
 	cmpxchg_local((ptr), (o), (n));					\
 })
 
+/*
+ * Compare and exchange two adjacent words, the first 16 byte aligned.
+ * There is no lock prefix: this is atomic against interrupts on the local
+ * cpu only.  Needs CMPXCHG16B, which the first x86_64 cpus lack, so check
+ * system_has_cmpxchg_double() first.
+ */
+#define cmpxchg_double_local(p1, p2, o1, o2, n1, n2)			\
+({									\
+	bool __ret;							\
+	__typeof__(*(p1)) __old1 = (o1), __new1 = (n1);			\
+	__typeof__(*(p2)) __old2 = (o2), __new2 = (n2);			\
+	BUILD_BUG_ON(sizeof(*(p1)) != 8 || sizeof(*(p2)) != 8);		\
+	asm volatile("cmpxchg16b %2\n\t"				\
+		     "sete %0"						\
+		     : "=a" (__ret), "+d" (__old2),			\
+		       "+m" (*(p1)), "+m" (*(p2))			\
+		     : "a" (__old1), "b" (__new1), "c" (__new2)		\
+		     : "memory");					\
+	__ret;								\
+})
+
+#define system_has_cmpxchg_double()	cpu_has_cx16
+
 #endif /* _ASM_X86_CMPXCHG_64_H */
@@ -1048,6 +1048,24 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
 		return;
 	}
 
+	/*
+	 * Most faults of threaded programs are on anonymous memory whose
+	 * page tables are already there: try those without mmap_sem.
+	 * Protection faults on reads and instruction fetches are left to
+	 * the full handler, which knows how to fail them.
+	 */
+	if ((error_code & PF_USER) && !(error_code & PF_INSTR) &&
+	    (error_code & (PF_PROT | PF_WRITE)) != PF_PROT) {
+		fault = handle_speculative_fault(mm, address,
+				error_code & PF_WRITE ? FAULT_FLAG_WRITE : 0);
+		if (!(fault & VM_FAULT_RETRY)) {
+			tsk->min_flt++;
+			perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MIN, 1, 0,
+				      regs, address);
+			return;
+		}
+	}
+
 	/*
 	 * When running in the kernel we expect faults to occur only to
 	 * addresses in user space.  All other faults represent errors in
@@ -8,6 +8,7 @@
 #include <linux/mm.h>
 #include <linux/vmstat.h>
 #include <linux/highmem.h>
+#include <linux/hugetlb.h>
 
 #include <asm/pgtable.h>
 
@@ -150,6 +151,13 @@ static int gup_pmd_range(pud_t pud, unsigned long addr, unsigned long end,
 		next = pmd_addr_end(addr, end);
 		if (pmd_none(pmd))
 			return 0;
+		/*
+		 * Transparent huge pmds are left to the slow path, which
+		 * splits them; only hugetlbfs pages are handled here.
+		 */
+		if (unlikely(pmd_trans_huge(pmd)) &&
+		    (!pmd_large(pmd) || !PageHuge(pmd_page(pmd))))
+			return 0;
 		if (unlikely(pmd_large(pmd))) {
 			if (!gup_huge_pmd(pmd, addr, next, write, pages, nr))
 				return 0;
@@ -0,0 +1,171 @@
+/*
+ * Common Block IO controller cgroup interface
+ *
+ * Every blkio cgroup carries a data pointer per registered policy, the
+ * policies allocate it when a cgroup is created and supply the control
+ * files of the cgroup directory.  See Documentation/cgroups/blkio-controller.txt.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/kdev_t.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include "blk-cgroup.h"
+
+struct blkio_cgroup blkio_root_cgroup;
+
+/*
+ * Policies register from initcalls, before the hierarchy can be mounted,
+ * so only the root cgroup exists at that point.  The mutex orders a late
+ * registration against cgroup creation all the same.
+ */
+static DEFINE_MUTEX(blkio_policy_mutex);
+static struct blkio_policy *blkio_policies[BLKIO_NR_POLICIES];
+
+struct blkio_cgroup *cgroup_to_blkio_cgroup(struct cgroup *cgroup)
+{
+	return container_of(cgroup_subsys_state(cgroup, blkio_subsys_id),
+			    struct blkio_cgroup, css);
+}
+
+/*
+ * Must be called under rcu_read_lock(), the cgroup is only freed after
+ * a grace period once the last task has left it.
+ */
+struct blkio_cgroup *task_blkio_cgroup(struct task_struct *tsk)
+{
+	return container_of(task_subsys_state(tsk, blkio_subsys_id),
+			    struct blkio_cgroup, css);
+}
+
+static void blkio_free_pds(struct blkio_cgroup *blkcg)
+{
+	struct blkio_policy *pol;
+	int i;
+
+	for (i = 0; i < BLKIO_NR_POLICIES; i++) {
+		pol = blkio_policies[i];
+		if (pol && blkcg->pd[i]) {
+			pol->free_pd(blkcg, blkcg->pd[i]);
+			blkcg->pd[i] = NULL;
+		}
+	}
+}
+
+int blkio_policy_register(struct blkio_policy *pol)
+{
+	void *pd;
+
+	mutex_lock(&blkio_policy_mutex);
+	if (blkio_policies[pol->id]) {
+		mutex_unlock(&blkio_policy_mutex);
+		return -EBUSY;
+	}
+	pd = pol->alloc_pd(&blkio_root_cgroup);
+	if (!pd) {
+		mutex_unlock(&blkio_policy_mutex);
+		return -ENOMEM;
+	}
+	blkio_root_cgroup.pd[pol->id] = pd;
+	blkio_policies[pol->id] = pol;
+	mutex_unlock(&blkio_policy_mutex);
+	return 0;
+}
+
+/*
+ * Parse the "major:minor value" lines written to the per-device control
+ * files, cgroup_write_string() has already stripped the whitespace.
+ */
+int blkio_parse_dev_value(const char *buf, dev_t *dev, u64 *val)
+{
+	unsigned int major, minor;
+	unsigned long long v;
+	char end;
+
+	if (sscanf(buf, "%u:%u %llu%c", &major, &minor, &v, &end) != 3)
+		return -EINVAL;
+	if (major > MAJOR(~0U) || minor > MINOR(~0U))
+		return -EINVAL;
+
+	*dev = MKDEV(major, minor);
+	*val = v;
+	return 0;
+}
+
+/*
+ * called from kernel/cgroup.c with cgroup_lock() held.
+ */
+static struct cgroup_subsys_state *blkio_create(struct cgroup_subsys *ss,
+						struct cgroup *cgroup)
+{
+	struct blkio_cgroup *blkcg;
+	struct blkio_policy *pol;
+	int i;
+
+	if (!cgroup->parent)
+		return &blkio_root_cgroup.css;
+
+	blkcg = kzalloc(sizeof(*blkcg), GFP_KERNEL);
+	if (!blkcg)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_lock(&blkio_policy_mutex);
+	for (i = 0; i < BLKIO_NR_POLICIES; i++) {
+		pol = blkio_policies[i];
+		if (!pol)
+			continue;
+		blkcg->pd[i] = pol->alloc_pd(blkcg);
+		if (!blkcg->pd[i]) {
+			blkio_free_pds(blkcg);
+			mutex_unlock(&blkio_policy_mutex);
+			kfree(blkcg);
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+	mutex_unlock(&blkio_policy_mutex);
+
+	return &blkcg->css;
+}
+
+static void blkio_destroy(struct cgroup_subsys *ss, struct cgroup *cgroup)
+{
+	struct blkio_cgroup *blkcg = cgroup_to_blkio_cgroup(cgroup);
+
+	mutex_lock(&blkio_policy_mutex);
+	blkio_free_pds(blkcg);
+	mutex_unlock(&blkio_policy_mutex);
+
+	if (blkcg != &blkio_root_cgroup)
+		kfree(blkcg);
+}
+
+static int blkio_populate(struct cgroup_subsys *ss, struct cgroup *cgroup)
+{
+	struct blkio_policy *pol;
+	int i, ret = 0;
+
+	mutex_lock(&blkio_policy_mutex);
+	for (i = 0; i < BLKIO_NR_POLICIES && !ret; i++) {
+		pol = blkio_policies[i];
+		if (pol)
+			ret = cgroup_add_files(cgroup, ss, pol->files,
+					       pol->nr_files);
+	}
+	mutex_unlock(&blkio_policy_mutex);
+	return ret;
+}
+
+struct cgroup_subsys blkio_subsys = {
+	.name = "blkio",
+	.create = blkio_create,
+	.destroy = blkio_destroy,
+	.populate = blkio_populate,
+	.subsys_id = blkio_subsys_id,
+};
@@ -0,0 +1,43 @@
+#ifndef _BLK_CGROUP_H
+#define _BLK_CGROUP_H
+/*
+ * Common Block IO controller cgroup interface
+ *
+ * The blkio cgroup only keeps the per-cgroup state of the I/O control
+ * policies that register with it, the policies themselves live in their
+ * own files and hook into the block layer where they need to.
+ */
+
+#include <linux/cgroup.h>
+
+enum blkio_policy_id {
+	BLKIO_POLICY_THROTL,		/* bps and IOPS limits, blk-throttle.c */
+	BLKIO_POLICY_LATENCY,		/* latency targets, blk-iolatency.c */
+	BLKIO_NR_POLICIES,
+};
+
+struct blkio_cgroup {
+	struct cgroup_subsys_state css;
+	void *pd[BLKIO_NR_POLICIES];	/* per policy data */
+};
+
+struct blkio_policy {
+	enum blkio_policy_id id;
+
+	/* control files added to every blkio cgroup directory */
+	struct cftype *files;
+	int nr_files;
+
+	/* set up and tear down the policy data of one cgroup */
+	void *(*alloc_pd)(struct blkio_cgroup *blkcg);
+	void (*free_pd)(struct blkio_cgroup *blkcg, void *pd);
+};
+
+extern struct blkio_cgroup blkio_root_cgroup;
+
+extern struct blkio_cgroup *cgroup_to_blkio_cgroup(struct cgroup *cgroup);
+extern struct blkio_cgroup *task_blkio_cgroup(struct task_struct *tsk);
+extern int blkio_policy_register(struct blkio_policy *pol);
+extern int blkio_parse_dev_value(const char *buf, dev_t *dev, u64 *val);
+
+#endif
@@ -27,11 +27,13 @@
 #include <linux/writeback.h>
 #include <linux/task_io_accounting_ops.h>
 #include <linux/fault-inject.h>
+#include <linux/blk-mq.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/block.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 EXPORT_TRACEPOINT_SYMBOL_GPL(block_remap);
 EXPORT_TRACEPOINT_SYMBOL_GPL(block_rq_remap);
@@ -54,7 +56,7 @@ struct kmem_cache *blk_requestq_cachep;
  */
 static struct workqueue_struct *kblockd_workqueue;
 
-static void drive_stat_acct(struct request *rq, int new_io)
+void drive_stat_acct(struct request *rq, int new_io)
 {
 	struct hd_struct *part;
 	int rw = rq_data_dir(rq);
@@ -127,6 +129,8 @@ void blk_rq_init(struct request_queue *q, struct request *rq)
 	rq->tag = -1;
 	rq->ref_count = 1;
 	rq->start_time = jiffies;
+	if (q && blk_queue_io_stat(q))
+		rq->start_time_ns = ktime_to_ns(ktime_get());
 }
 EXPORT_SYMBOL(blk_rq_init);
 
@@ -454,6 +458,11 @@ void blk_cleanup_queue(struct request_queue *q)
 	queue_flag_set_unlocked(QUEUE_FLAG_DEAD, q);
 	mutex_unlock(&q->sysfs_lock);
 
+	blk_throtl_exit(q);
+
+	if (q->mq_ops)
+		blk_mq_exit_queue(q);
+
 	if (q->elevator)
 		elevator_exit(q->elevator);
 
@@ -520,7 +529,25 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 	mutex_init(&q->sysfs_lock);
 	spin_lock_init(&q->__queue_lock);
 
+	q->io_hist = alloc_percpu(struct blk_io_hist);
+	if (!q->io_hist)
+		goto fail_bdi;
+
+	if (blk_throtl_init(q))
+		goto fail_hist;
+	if (blk_iolatency_init(q))
+		goto fail_throtl;
+
 	return q;
+
+fail_throtl:
+	blk_throtl_exit(q);
+fail_hist:
+	free_percpu(q->io_hist);
+fail_bdi:
+	bdi_destroy(&q->backing_dev_info);
+	kmem_cache_free(blk_requestq_cachep, q);
+	return NULL;
 }
 EXPORT_SYMBOL(blk_alloc_queue_node);
 
@@ -865,6 +892,9 @@ struct request *blk_get_request(struct request_queue *q, int rw, gfp_t gfp_mask)
 
 	BUG_ON(rw != READ && rw != WRITE);
 
+	if (q->mq_ops)
+		return blk_mq_alloc_request(q, rw, gfp_mask);
+
 	spin_lock_irq(q->queue_lock);
 	if (gfp_mask & __GFP_WAIT) {
 		rq = get_request_wait(q, rw, NULL);
@@ -1074,6 +1104,12 @@ void __blk_put_request(struct request_queue *q, struct request *req)
 	if (unlikely(--req->ref_count))
 		return;
 
+	if (q->mq_ops) {
+		WARN_ON(req->bio != NULL);
+		blk_mq_free_request(req);
+		return;
+	}
+
 	elv_completed_request(q, req);
 
 	/* this is a bio leak */
@@ -1101,6 +1137,11 @@ void blk_put_request(struct request *req)
 	unsigned long flags;
 	struct request_queue *q = req->q;
 
+	if (q->mq_ops) {
+		__blk_put_request(q, req);
+		return;
+	}
+
 	spin_lock_irqsave(q->queue_lock, flags);
 	__blk_put_request(q, req);
 	spin_unlock_irqrestore(q->queue_lock, flags);
@@ -1141,28 +1182,130 @@ void init_request_from_bio(struct request *req, struct bio *bio)
 	blk_rq_bio_prep(req->q, req, bio);
 }
 
+bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
+			    struct bio *bio)
+{
+	const unsigned int ff = bio->bi_rw & REQ_FAILFAST_MASK;
+
+	if (!ll_back_merge_fn(q, req, bio))
+		return false;
+
+	trace_block_bio_backmerge(q, bio);
+
+	if ((req->cmd_flags & REQ_FAILFAST_MASK) != ff)
+		blk_rq_set_mixed_merge(req);
+
+	req->biotail->bi_next = bio;
+	req->biotail = bio;
+	req->__data_len += bio->bi_size;
+	req->ioprio = ioprio_best(req->ioprio, bio_prio(bio));
+	if (!blk_rq_cpu_valid(req))
+		req->cpu = bio->bi_comp_cpu;
+	drive_stat_acct(req, 0);
+	return true;
+}
+
+bool bio_attempt_front_merge(struct request_queue *q, struct request *req,
+			     struct bio *bio)
+{
+	const unsigned int ff = bio->bi_rw & REQ_FAILFAST_MASK;
+
+	if (!ll_front_merge_fn(q, req, bio))
+		return false;
+
+	trace_block_bio_frontmerge(q, bio);
+
+	if ((req->cmd_flags & REQ_FAILFAST_MASK) != ff) {
+		blk_rq_set_mixed_merge(req);
+		req->cmd_flags &= ~REQ_FAILFAST_MASK;
+		req->cmd_flags |= ff;
+	}
+
+	bio->bi_next = req->bio;
+	req->bio = bio;
+
+	/*
+	 * may not be valid. if the low level driver said
+	 * it didn't need a bounce buffer then it better
+	 * not touch req->buffer either...
+	 */
+	req->buffer = bio_data(bio);
+	req->__sector = bio->bi_sector;
+	req->__data_len += bio->bi_size;
+	req->ioprio = ioprio_best(req->ioprio, bio_prio(bio));
+	if (!blk_rq_cpu_valid(req))
+		req->cpu = bio->bi_comp_cpu;
+	drive_stat_acct(req, 0);
+	return true;
+}
+
+/**
+ * blk_attempt_plug_merge - merge a bio into a request on the task's plug
+ * @q:		the queue @bio is for
+ * @bio:	the bio
+ *
+ * Description:
+ *    The requests on current->plug belong to this task alone, so @bio
+ *    is merged into them without taking any lock.  Returns %true if
+ *    @bio was merged.
+ */
+bool blk_attempt_plug_merge(struct request_queue *q, struct bio *bio)
+{
+	struct blk_plug *plug = current->plug;
+	struct request *rq;
+
+	if (!plug || blk_queue_nomerges(q))
+		return false;
+
+	list_for_each_entry_reverse(rq, &plug->list, queuelist) {
+		if (rq->q != q || !elv_rq_merge_ok(rq, bio))
+			continue;
+
+		if (blk_rq_pos(rq) + blk_rq_sectors(rq) == bio->bi_sector) {
+			if (!bio_attempt_back_merge(q, rq, bio))
+				continue;
+		} else if (blk_rq_pos(rq) - bio_sectors(bio) == bio->bi_sector) {
+			if (!bio_attempt_front_merge(q, rq, bio))
+				continue;
+		} else
+			continue;
+
+		if (q->mq_ops)
+			bio->bi_cookie = blk_mq_rq_cookie(rq);
+		return true;
+	}
+	return false;
+}
+
 /*
- * Only disabling plugging for non-rotational devices if it does tagging
- * as well, otherwise we do need the proper merging
+ * Add @rq to @plug, keeping the list sorted by queue and then sector
  */
-static inline bool queue_should_plug(struct request_queue *q)
+void blk_plug_add_request(struct blk_plug *plug, struct request *rq)
 {
-	return !(blk_queue_nonrot(q) && blk_queue_queuing(q));
+	struct request *pos;
+
+	if (plug->count >= BLK_MAX_REQUEST_COUNT)
+		blk_flush_plug_list(plug, false);
+
+	list_for_each_entry_reverse(pos, &plug->list, queuelist) {
+		if (pos->q < rq->q ||
+		    (pos->q == rq->q && blk_rq_pos(pos) <= blk_rq_pos(rq)))
+			break;
+	}
+	list_add(&rq->queuelist, &pos->queuelist);
+	plug->count++;
 }
 
 static int __make_request(struct request_queue *q, struct bio *bio)
 {
 	struct request *req;
 	int el_ret;
-	unsigned int bytes = bio->bi_size;
-	const unsigned short prio = bio_prio(bio);
 	const bool sync = bio_rw_flagged(bio, BIO_RW_SYNCIO);
-	const bool unplug = bio_rw_flagged(bio, BIO_RW_UNPLUG);
-	const unsigned int ff = bio->bi_rw & REQ_FAILFAST_MASK;
+	const bool barrier = bio_rw_flagged(bio, BIO_RW_BARRIER);
+	struct blk_plug *plug;
 	int rw_flags;
 
-	if (bio_rw_flagged(bio, BIO_RW_BARRIER) &&
-	    (q->next_ordered == QUEUE_ORDERED_NONE)) {
+	if (barrier && (q->next_ordered == QUEUE_ORDERED_NONE)) {
 		bio_endio(bio, -EOPNOTSUPP);
 		return 0;
 	}
@@ -1173,9 +1316,26 @@ static int __make_request(struct request_queue *q, struct bio *bio)
 	 */
 	blk_queue_bounce(q, &bio);
 
+	if (unlikely(barrier)) {
+		/*
+		 * Whatever this task has plugged was submitted before the
+		 * barrier and must reach the queue ahead of it.
+		 */
+		blk_flush_plug(current);
+		spin_lock_irq(q->queue_lock);
+		goto get_rq;
+	}
+
+	/*
+	 * Check if we can merge with the plugged list before grabbing
+	 * any locks.
+	 */
+	if (blk_attempt_plug_merge(q, bio))
+		return 0;
+
 	spin_lock_irq(q->queue_lock);
 
-	if (unlikely(bio_rw_flagged(bio, BIO_RW_BARRIER)) || elv_queue_empty(q))
+	if (elv_queue_empty(q))
 		goto get_rq;
 
 	el_ret = elv_merge(q, &req, bio);
@@ -1183,57 +1343,22 @@ static int __make_request(struct request_queue *q, struct bio *bio)
 	case ELEVATOR_BACK_MERGE:
 		BUG_ON(!rq_mergeable(req));
 
-		if (!ll_back_merge_fn(q, req, bio))
+		if (!bio_attempt_back_merge(q, req, bio))
 			break;
 
-		trace_block_bio_backmerge(q, bio);
-
-		if ((req->cmd_flags & REQ_FAILFAST_MASK) != ff)
-			blk_rq_set_mixed_merge(req);
-
-		req->biotail->bi_next = bio;
-		req->biotail = bio;
-		req->__data_len += bytes;
-		req->ioprio = ioprio_best(req->ioprio, prio);
-		if (!blk_rq_cpu_valid(req))
-			req->cpu = bio->bi_comp_cpu;
-		drive_stat_acct(req, 0);
 		if (!attempt_back_merge(q, req))
 			elv_merged_request(q, req, el_ret);
-		goto out;
+		goto out_unlock;
 
 	case ELEVATOR_FRONT_MERGE:
 		BUG_ON(!rq_mergeable(req));
 
-		if (!ll_front_merge_fn(q, req, bio))
+		if (!bio_attempt_front_merge(q, req, bio))
 			break;
 
-		trace_block_bio_frontmerge(q, bio);
-
-		if ((req->cmd_flags & REQ_FAILFAST_MASK) != ff) {
-			blk_rq_set_mixed_merge(req);
-			req->cmd_flags &= ~REQ_FAILFAST_MASK;
-			req->cmd_flags |= ff;
-		}
-
-		bio->bi_next = req->bio;
-		req->bio = bio;
-
-		/*
-		 * may not be valid. if the low level driver said
-		 * it didn't need a bounce buffer then it better
-		 * not touch req->buffer either...
-		 */
-		req->buffer = bio_data(bio);
-		req->__sector = bio->bi_sector;
-		req->__data_len += bytes;
-		req->ioprio = ioprio_best(req->ioprio, prio);
-		if (!blk_rq_cpu_valid(req))
-			req->cpu = bio->bi_comp_cpu;
-		drive_stat_acct(req, 0);
 		if (!attempt_front_merge(q, req))
 			elv_merged_request(q, req, el_ret);
-		goto out;
+		goto out_unlock;
 
 	/* ELV_NO_MERGE: elevator says don't/can't merge. */
 	default:
@@ -1264,16 +1389,26 @@ get_rq:
 	 */
 	init_request_from_bio(req, bio);
 
-	spin_lock_irq(q->queue_lock);
 	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags) ||
 	    bio_flagged(bio, BIO_CPU_AFFINE))
-		req->cpu = blk_cpu_to_group(smp_processor_id());
-	if (queue_should_plug(q) && elv_queue_empty(q))
-		blk_plug_device(q);
+		req->cpu = blk_cpu_to_group(raw_smp_processor_id());
+
+	plug = current->plug;
+	if (plug && !barrier) {
+		drive_stat_acct(req, 1);
+		blk_plug_add_request(plug, req);
+		return 0;
+	}
+
+	/*
+	 * Without a plug the request goes to the driver right away, there
+	 * is no point in holding it back for a timer when nobody is going
+	 * to add anything to it.
+	 */
+	spin_lock_irq(q->queue_lock);
 	add_request(q, req);
-out:
-	if (unplug || !queue_should_plug(q))
-		__generic_unplug_device(q);
+	__blk_run_queue(q);
+out_unlock:
 	spin_unlock_irq(q->queue_lock);
 	return 0;
 }
@@ -1476,6 +1611,13 @@ static inline void __generic_make_request(struct bio *bio)
 			goto end_io;
 		}
 
+		/* over its cgroup's limits, resubmitted from the dispatch work */
+		if (blk_throtl_bio(q, bio))
+			return;
+
+		/* may wait for the cgroup's bios in flight to drop */
+		blk_iolatency_bio(q, bio);
+
 		trace_block_bio_queue(q, bio);
 
 		ret = q->make_request_fn(q, bio);
@@ -1581,6 +1723,109 @@ void submit_bio(int rw, struct bio *bio)
 }
 EXPORT_SYMBOL(submit_bio);
 
+/**
+ * blk_start_plug - hold back the I/O the current task submits
+ * @plug:	the &struct blk_plug, on the caller's stack
+ *
+ * Description:
+ *    Requests the task builds until blk_finish_plug() are kept on @plug
+ *    instead of being queued one by one, see &struct blk_plug.  Plugs
+ *    nest, only the outermost one is flushed.
+ */
+void blk_start_plug(struct blk_plug *plug)
+{
+	struct task_struct *tsk = current;
+
+	INIT_LIST_HEAD(&plug->list);
+	plug->count = 0;
+
+	if (!tsk->plug)
+		tsk->plug = plug;
+}
+EXPORT_SYMBOL(blk_start_plug);
+
+/*
+ * Move the requests at the head of @list that belong to the same queue
+ * as the first one onto @batch, and return that queue.
+ */
+static struct request_queue *plug_next_batch(struct list_head *list,
+					     struct list_head *batch)
+{
+	struct request_queue *q = list_entry_rq(list->next)->q;
+	struct request *rq, *next;
+
+	list_for_each_entry_safe(rq, next, list, queuelist) {
+		if (rq->q != q)
+			break;
+		list_move_tail(&rq->queuelist, batch);
+	}
+	return q;
+}
+
+/**
+ * blk_flush_plug_list - hand the requests held on a plug to their queues
+ * @plug:		the plug
+ * @from_schedule:	called because the task is going to sleep
+ *
+ * Description:
+ *    Each queue is locked once for all the requests queued to it.  From
+ *    schedule() the queues are run by kblockd, so that the driver is not
+ *    entered on top of whatever stack the task sleeps on.
+ */
+void blk_flush_plug_list(struct blk_plug *plug, bool from_schedule)
+{
+	struct request_queue *q;
+	struct request *rq, *next;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	/*
+	 * Take the requests off the plug first, running a queue may sleep
+	 * and come back here through schedule().
+	 */
+	list_splice_init(&plug->list, &list);
+	plug->count = 0;
+
+	while (!list_empty(&list)) {
+		LIST_HEAD(batch);
+
+		q = plug_next_batch(&list, &batch);
+		trace_block_unplug_io(q);
+
+		if (q->mq_ops) {
+			blk_mq_insert_requests(q, &batch, from_schedule);
+			continue;
+		}
+
+		spin_lock_irqsave(q->queue_lock, flags);
+		list_for_each_entry_safe(rq, next, &batch, queuelist) {
+			list_del_init(&rq->queuelist);
+			__elv_add_request(q, rq, ELEVATOR_INSERT_SORT, 0);
+		}
+		if (from_schedule) {
+			queue_flag_set(QUEUE_FLAG_PLUGGED, q);
+			kblockd_schedule_work(q, &q->unplug_work);
+		} else
+			__blk_run_queue(q);
+		spin_unlock_irqrestore(q->queue_lock, flags);
+	}
+}
+EXPORT_SYMBOL(blk_flush_plug_list);
+
+/**
+ * blk_finish_plug - submit the I/O held back since blk_start_plug()
+ * @plug:	the &struct blk_plug passed to blk_start_plug()
+ */
+void blk_finish_plug(struct blk_plug *plug)
+{
+	if (plug != current->plug)
+		return;
+
+	blk_flush_plug_list(plug, false);
+	current->plug = NULL;
+}
+EXPORT_SYMBOL(blk_finish_plug);
+
 /**
  * blk_rq_check_limits - Helper function to check a request for the queue limit
  * @q:  the queue
@@ -1720,7 +1965,45 @@ static void blk_account_io_completion(struct request *req, unsigned int bytes)
 	}
 }
 
-static void blk_account_io_done(struct request *req)
+static inline void blk_hist_add(struct request *req, int cpu, int hist,
+				u64 val)
+{
+	struct blk_io_hist *h = per_cpu_ptr(req->q->io_hist, cpu);
+	int bucket = val ? fls64(val) - 1 : 0;
+
+	if (bucket >= BLK_HIST_BUCKETS)
+		bucket = BLK_HIST_BUCKETS - 1;
+	h->buckets[hist][rq_data_dir(req)][bucket]++;
+}
+
+static inline u64 blk_hist_usecs(u64 start, u64 end)
+{
+	return end > start ? div_u64(end - start, NSEC_PER_USEC) : 0;
+}
+
+/*
+ * Account a request handed to the driver: how long it waited in the
+ * queue and how big it is.  A requeued request is counted again when
+ * it is dispatched again.
+ */
+void blk_account_io_dispatch(struct request *req)
+{
+	if (blk_do_io_stat(req) && req != &req->q->bar_rq) {
+		int cpu;
+
+		req->io_start_ns = ktime_to_ns(ktime_get());
+
+		cpu = get_cpu();
+		if (req->start_time_ns)
+			blk_hist_add(req, cpu, BLK_HIST_QUEUE,
+				     blk_hist_usecs(req->start_time_ns,
+						    req->io_start_ns));
+		blk_hist_add(req, cpu, BLK_HIST_SIZE, blk_rq_sectors(req));
+		put_cpu();
+	}
+}
+
+void blk_account_io_done(struct request *req)
 {
 	/*
 	 * Account IO completion.  bar_rq isn't accounted as a normal
@@ -1736,6 +2019,11 @@ static void blk_account_io_done(struct request *req)
 		cpu = part_stat_lock();
 		part = disk_map_sector_rcu(req->rq_disk, blk_rq_pos(req));
 
+		if (req->io_start_ns)
+			blk_hist_add(req, cpu, BLK_HIST_SERVICE,
+				     blk_hist_usecs(req->io_start_ns,
+						    ktime_to_ns(ktime_get())));
+
 		part_stat_inc(cpu, part, ios[rw]);
 		part_stat_add(cpu, part, ticks[rw], duration);
 		part_round_stats(cpu, part);
@@ -1896,6 +2184,7 @@ void blk_start_request(struct request *req)
 	if (unlikely(blk_bidi_rq(req)))
 		req->next_rq->resid_len = blk_rq_bytes(req->next_rq);
 
+	blk_account_io_dispatch(req);
 	blk_add_timer(req);
 }
 EXPORT_SYMBOL(blk_start_request);
@@ -2492,6 +2781,13 @@ int kblockd_schedule_work(struct request_queue *q, struct work_struct *work)
 }
 EXPORT_SYMBOL(kblockd_schedule_work);
 
+int kblockd_schedule_delayed_work(struct request_queue *q,
+				  struct delayed_work *dwork, unsigned long delay)
+{
+	return queue_delayed_work(kblockd_workqueue, dwork, delay);
+}
+EXPORT_SYMBOL(kblockd_schedule_delayed_work);
+
 int __init blk_dev_init(void)
 {
 	BUILD_BUG_ON(__REQ_NR_BITS > 8 *
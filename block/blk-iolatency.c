@@ -0,0 +1,517 @@
+/*
+ * Block I/O latency targets
+ *
+ * A blkio cgroup may declare the completion latency it expects from a
+ * device.  The latency of every bio is measured from generic_make_request()
+ * to its completion, per cgroup and queue.  At the end of each window, if
+ * more than a tenth of the bios of a group with a target took longer than
+ * that target, the groups with no target or a looser one are made to share
+ * the device less: the number of bios they may have in flight is halved.
+ * Once a window passes with every target met, the limits are raised again
+ * step by step and finally lifted.  The root cgroup is never limited.
+ *
+ * Tasks over their group's limit sleep in generic_make_request() until
+ * one of the group's bios completes.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/genhd.h>
+#include <linux/kdev_t.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/wait.h>
+#include "blk.h"
+#include "blk-cgroup.h"
+
+/* Interval over which the targets are checked */
+#define IOLAT_WINDOW		(HZ / 10)
+
+/* Histogram buckets, bucket i counts bios faster than 32us << i */
+#define IOLAT_NR_BUCKETS	16
+#define IOLAT_BUCKET_SHIFT	5
+
+#define IOLAT_UNLIMITED		UINT_MAX
+
+/* A target written to the cgroup file */
+struct iolat_rule {
+	struct list_head node;
+	dev_t dev;
+	u64 target_ns;
+};
+
+/* Latency state of a blkio cgroup */
+struct iolat_cgroup {
+	struct list_head rules;
+	struct list_head grp_list;	/* the groups of this cgroup */
+};
+
+/*
+ * A cgroup on one queue.  The group list is protected by iod->lock, the
+ * target and the cgroup link by iolat_lock.  Each bio in flight holds a
+ * reference.
+ */
+struct iolat_grp {
+	struct list_head iod_node;	/* on iod->grp_list */
+	struct list_head blkcg_node;	/* on iolat_cgroup->grp_list */
+	struct iolat_data *iod;
+	struct blkio_cgroup *blkcg;	/* NULL once the cgroup is gone */
+	dev_t dev;
+	atomic_t ref;
+
+	u64 target_ns;			/* 0 if the group has no target */
+	unsigned int max_depth;		/* bios allowed in flight */
+	unsigned int peak;		/* most bios in flight this window */
+	atomic_t inflight;
+	wait_queue_head_t wait;
+
+	/* the current window */
+	atomic_t nr_samples;
+	atomic_t nr_missed;
+
+	atomic_long_t hist[IOLAT_NR_BUCKETS];
+};
+
+struct iolat_data {
+	struct request_queue *queue;
+	spinlock_t lock;
+	struct list_head grp_list;
+	unsigned long window_start;
+};
+
+/*
+ * Protects the rule lists and the cgroup side of the groups.  Nests
+ * inside iod->lock.
+ */
+static DEFINE_SPINLOCK(iolat_lock);
+
+/* Targets in all cgroups, without any there is nothing to do */
+static atomic_t iolat_nr_targets = ATOMIC_INIT(0);
+
+static inline struct iolat_cgroup *blkcg_to_ic(struct blkio_cgroup *blkcg)
+{
+	return blkcg->pd[BLKIO_POLICY_LATENCY];
+}
+
+static struct iolat_rule *iolat_find_rule(struct iolat_cgroup *ic, dev_t dev)
+{
+	struct iolat_rule *rule;
+
+	list_for_each_entry(rule, &ic->rules, node)
+		if (rule->dev == dev)
+			return rule;
+	return NULL;
+}
+
+static void iolat_put_grp(struct iolat_grp *grp)
+{
+	if (atomic_dec_and_test(&grp->ref))
+		kfree(grp);
+}
+
+/*
+ * Look up the group of @blkcg on @iod, creating it on first use.  Called
+ * with iod->lock and rcu_read_lock() held, the latter keeps the cgroup
+ * from being destroyed under us.
+ */
+static struct iolat_grp *iolat_get_grp(struct iolat_data *iod,
+				       struct blkio_cgroup *blkcg,
+				       struct block_device *bdev)
+{
+	struct iolat_cgroup *ic = blkcg_to_ic(blkcg);
+	struct iolat_rule *rule;
+	struct iolat_grp *grp;
+
+	list_for_each_entry(grp, &iod->grp_list, iod_node)
+		if (grp->blkcg == blkcg)
+			return grp;
+
+	if (!ic)
+		return NULL;
+	grp = kzalloc(sizeof(*grp), GFP_ATOMIC);
+	if (!grp)
+		return NULL;
+	grp->iod = iod;
+	grp->blkcg = blkcg;
+	grp->dev = disk_devt(bdev->bd_disk);
+	atomic_set(&grp->ref, 1);
+	grp->max_depth = IOLAT_UNLIMITED;
+	init_waitqueue_head(&grp->wait);
+
+	spin_lock(&iolat_lock);
+	rule = iolat_find_rule(ic, grp->dev);
+	grp->target_ns = rule ? rule->target_ns : 0;
+	list_add(&grp->blkcg_node, &ic->grp_list);
+	spin_unlock(&iolat_lock);
+
+	list_add(&grp->iod_node, &iod->grp_list);
+	return grp;
+}
+
+/* Take a slot in flight if the group is below its limit */
+static bool iolat_inc_below(struct iolat_grp *grp)
+{
+	unsigned int cur = atomic_read(&grp->inflight), old;
+
+	for (;;) {
+		if (cur >= grp->max_depth)
+			return false;
+		old = atomic_cmpxchg(&grp->inflight, cur, cur + 1);
+		if (old == cur)
+			break;
+		cur = old;
+	}
+	if (cur + 1 > grp->peak)
+		grp->peak = cur + 1;
+	return true;
+}
+
+static void iolat_scale_down(struct iolat_grp *grp)
+{
+	unsigned int depth = grp->max_depth;
+
+	if (depth == IOLAT_UNLIMITED)
+		depth = grp->peak;
+	grp->max_depth = max(depth / 2, 1U);
+}
+
+static void iolat_scale_up(struct iolat_grp *grp, unsigned int full_depth)
+{
+	if (grp->max_depth == IOLAT_UNLIMITED)
+		return;
+	grp->max_depth += max(grp->max_depth / 4, 1U);
+	if (grp->max_depth >= full_depth)
+		grp->max_depth = IOLAT_UNLIMITED;
+	wake_up_all(&grp->wait);
+}
+
+/*
+ * End of a window: find the tightest target that was missed and limit the
+ * groups that are less latency sensitive than its owner, or let them all
+ * back up if nothing was missed.  Groups of removed cgroups are dropped
+ * here as well.  Called with iod->lock held.
+ */
+static void iolat_check_window(struct iolat_data *iod)
+{
+	struct iolat_grp *grp, *next;
+	unsigned int samples, missed;
+	u64 missed_target = 0;
+
+	list_for_each_entry(grp, &iod->grp_list, iod_node) {
+		samples = atomic_xchg(&grp->nr_samples, 0);
+		missed = atomic_xchg(&grp->nr_missed, 0);
+		if (!grp->target_ns || missed * 10 <= samples)
+			continue;
+		if (!missed_target || grp->target_ns < missed_target)
+			missed_target = grp->target_ns;
+	}
+
+	spin_lock(&iolat_lock);
+	list_for_each_entry_safe(grp, next, &iod->grp_list, iod_node) {
+		if (!grp->blkcg) {
+			list_del(&grp->iod_node);
+			wake_up_all(&grp->wait);
+			iolat_put_grp(grp);
+			continue;
+		}
+		if (grp->blkcg == &blkio_root_cgroup)
+			continue;
+		if (!missed_target)
+			iolat_scale_up(grp, iod->queue->nr_requests);
+		else if (!grp->target_ns || grp->target_ns > missed_target)
+			iolat_scale_down(grp);
+		grp->peak = atomic_read(&grp->inflight);
+	}
+	spin_unlock(&iolat_lock);
+}
+
+/**
+ * blk_iolatency_bio - charge a bio to the latency group of its submitter
+ * @q: queue the bio is submitted to
+ * @bio: the bio
+ *
+ * Called from generic_make_request().  If the group has as many bios in
+ * flight as it is currently allowed, waits for one of them to complete.
+ */
+void blk_iolatency_bio(struct request_queue *q, struct bio *bio)
+{
+	struct iolat_data *iod = q->iod;
+	struct iolat_grp *grp;
+	unsigned long flags;
+	DEFINE_WAIT(wait);
+
+	if (!atomic_read(&iolat_nr_targets) || !iod || bio->bi_iolat)
+		return;
+
+	spin_lock_irqsave(&iod->lock, flags);
+	rcu_read_lock();
+	grp = iolat_get_grp(iod, task_blkio_cgroup(current), bio->bi_bdev);
+	rcu_read_unlock();
+	if (grp)
+		atomic_inc(&grp->ref);
+	spin_unlock_irqrestore(&iod->lock, flags);
+	if (!grp)
+		return;
+
+	/* memory reclaim must not wait behind the I/O of a cgroup */
+	if (!iolat_inc_below(grp)) {
+		if (current->flags & PF_MEMALLOC) {
+			atomic_inc(&grp->inflight);
+		} else {
+			for (;;) {
+				prepare_to_wait_exclusive(&grp->wait, &wait,
+							  TASK_UNINTERRUPTIBLE);
+				if (iolat_inc_below(grp) || !grp->blkcg)
+					break;
+				io_schedule();
+			}
+			finish_wait(&grp->wait, &wait);
+			if (!grp->blkcg)
+				atomic_inc(&grp->inflight);
+		}
+	}
+
+	bio->bi_iolat = grp;
+	bio->bi_issue_ns = ktime_to_ns(ktime_get());
+}
+
+/*
+ * Called from bio_endio() for bios charged by blk_iolatency_bio().
+ */
+void __blk_iolatency_done(struct bio *bio)
+{
+	struct iolat_grp *grp = bio->bi_iolat;
+	struct iolat_data *iod = grp->iod;
+	u64 lat = ktime_to_ns(ktime_get()) - bio->bi_issue_ns;
+	unsigned long us = div_u64(lat, NSEC_PER_USEC) >> IOLAT_BUCKET_SHIFT;
+	unsigned long flags;
+	int bucket;
+
+	bio->bi_iolat = NULL;
+
+	bucket = us ? min(ilog2(us) + 1, IOLAT_NR_BUCKETS - 1) : 0;
+	atomic_long_inc(&grp->hist[bucket]);
+	atomic_inc(&grp->nr_samples);
+	if (grp->target_ns && lat > grp->target_ns)
+		atomic_inc(&grp->nr_missed);
+
+	atomic_dec(&grp->inflight);
+	if (waitqueue_active(&grp->wait))
+		wake_up(&grp->wait);
+
+	if (time_after_eq(jiffies, iod->window_start + IOLAT_WINDOW) &&
+	    spin_trylock_irqsave(&iod->lock, flags)) {
+		if (time_after_eq(jiffies, iod->window_start + IOLAT_WINDOW)) {
+			iod->window_start = jiffies;
+			iolat_check_window(iod);
+		}
+		spin_unlock_irqrestore(&iod->lock, flags);
+	}
+
+	iolat_put_grp(grp);
+}
+
+int blk_iolatency_init(struct request_queue *q)
+{
+	struct iolat_data *iod;
+
+	iod = kzalloc(sizeof(*iod), GFP_KERNEL);
+	if (!iod)
+		return -ENOMEM;
+
+	iod->queue = q;
+	spin_lock_init(&iod->lock);
+	INIT_LIST_HEAD(&iod->grp_list);
+	iod->window_start = jiffies;
+	q->iod = iod;
+	return 0;
+}
+
+/*
+ * Called when the queue is released, no bio can be in flight on it.
+ */
+void blk_iolatency_exit(struct request_queue *q)
+{
+	struct iolat_data *iod = q->iod;
+	struct iolat_grp *grp, *next;
+
+	if (!iod)
+		return;
+
+	spin_lock_irq(&iolat_lock);
+	list_for_each_entry_safe(grp, next, &iod->grp_list, iod_node) {
+		if (grp->blkcg)
+			list_del(&grp->blkcg_node);
+		list_del(&grp->iod_node);
+		iolat_put_grp(grp);
+	}
+	spin_unlock_irq(&iolat_lock);
+
+	q->iod = NULL;
+	kfree(iod);
+}
+
+/*
+ * cgroup interface
+ */
+static int iolat_read_target(struct cgroup *cgroup, struct cftype *cft,
+			     struct seq_file *m)
+{
+	struct iolat_cgroup *ic = blkcg_to_ic(cgroup_to_blkio_cgroup(cgroup));
+	struct iolat_rule *rule;
+
+	spin_lock_irq(&iolat_lock);
+	list_for_each_entry(rule, &ic->rules, node)
+		seq_printf(m, "%u:%u %llu\n", MAJOR(rule->dev), MINOR(rule->dev),
+			   (unsigned long long)div_u64(rule->target_ns,
+						       NSEC_PER_USEC));
+	spin_unlock_irq(&iolat_lock);
+	return 0;
+}
+
+static int iolat_write_target(struct cgroup *cgroup, struct cftype *cft,
+			      const char *buf)
+{
+	struct iolat_cgroup *ic = blkcg_to_ic(cgroup_to_blkio_cgroup(cgroup));
+	struct iolat_rule *rule, *new;
+	struct iolat_grp *grp;
+	u64 val, target_ns;
+	dev_t dev;
+	int ret;
+
+	ret = blkio_parse_dev_value(buf, &dev, &val);
+	if (ret)
+		return ret;
+	if (val > div_u64(ULLONG_MAX, NSEC_PER_USEC))
+		return -EINVAL;
+	target_ns = val * NSEC_PER_USEC;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+	new->dev = dev;
+
+	spin_lock_irq(&iolat_lock);
+	rule = iolat_find_rule(ic, dev);
+	if (!rule) {
+		if (!target_ns)
+			goto out_unlock;
+		rule = new;
+		new = NULL;
+		list_add_tail(&rule->node, &ic->rules);
+		atomic_inc(&iolat_nr_targets);
+	}
+
+	rule->target_ns = target_ns;
+	if (!target_ns) {
+		list_del(&rule->node);
+		atomic_dec(&iolat_nr_targets);
+		new = rule;
+	}
+
+	list_for_each_entry(grp, &ic->grp_list, blkcg_node)
+		if (grp->dev == dev)
+			grp->target_ns = target_ns;
+out_unlock:
+	spin_unlock_irq(&iolat_lock);
+	kfree(new);
+	return 0;
+}
+
+static int iolat_read_stat(struct cgroup *cgroup, struct cftype *cft,
+			   struct seq_file *m)
+{
+	struct iolat_cgroup *ic = blkcg_to_ic(cgroup_to_blkio_cgroup(cgroup));
+	struct iolat_grp *grp;
+	int i;
+
+	spin_lock_irq(&iolat_lock);
+	list_for_each_entry(grp, &ic->grp_list, blkcg_node) {
+		seq_printf(m, "%u:%u depth=", MAJOR(grp->dev), MINOR(grp->dev));
+		if (grp->max_depth == IOLAT_UNLIMITED)
+			seq_printf(m, "max");
+		else
+			seq_printf(m, "%u", grp->max_depth);
+		for (i = 0; i < IOLAT_NR_BUCKETS - 1; i++)
+			seq_printf(m, " %uus=%lu",
+				   1U << (IOLAT_BUCKET_SHIFT + i),
+				   atomic_long_read(&grp->hist[i]));
+		seq_printf(m, " inf=%lu\n", atomic_long_read(&grp->hist[i]));
+	}
+	spin_unlock_irq(&iolat_lock);
+	return 0;
+}
+
+static struct cftype iolat_files[] = {
+	{
+		.name = "latency.target_device",
+		.read_seq_string = iolat_read_target,
+		.write_string = iolat_write_target,
+	},
+	{
+		.name = "latency.stat",
+		.read_seq_string = iolat_read_stat,
+	},
+};
+
+static void *iolat_alloc_pd(struct blkio_cgroup *blkcg)
+{
+	struct iolat_cgroup *ic;
+
+	ic = kzalloc(sizeof(*ic), GFP_KERNEL);
+	if (!ic)
+		return NULL;
+	INIT_LIST_HEAD(&ic->rules);
+	INIT_LIST_HEAD(&ic->grp_list);
+	return ic;
+}
+
+/*
+ * The cgroup is gone.  Its groups are dropped by the next window check of
+ * their queue, tasks still waiting on them are let go.
+ */
+static void iolat_free_pd(struct blkio_cgroup *blkcg, void *pd)
+{
+	struct iolat_cgroup *ic = pd;
+	struct iolat_rule *rule, *rnext;
+	struct iolat_grp *grp, *gnext;
+
+	spin_lock_irq(&iolat_lock);
+	list_for_each_entry_safe(grp, gnext, &ic->grp_list, blkcg_node) {
+		list_del_init(&grp->blkcg_node);
+		grp->blkcg = NULL;
+		grp->target_ns = 0;
+		wake_up_all(&grp->wait);
+	}
+	list_for_each_entry_safe(rule, rnext, &ic->rules, node) {
+		list_del(&rule->node);
+		atomic_dec(&iolat_nr_targets);
+		kfree(rule);
+	}
+	spin_unlock_irq(&iolat_lock);
+	kfree(ic);
+}
+
+static struct blkio_policy blkio_policy_iolat = {
+	.id		= BLKIO_POLICY_LATENCY,
+	.files		= iolat_files,
+	.nr_files	= ARRAY_SIZE(iolat_files),
+	.alloc_pd	= iolat_alloc_pd,
+	.free_pd	= iolat_free_pd,
+};
+
+static int __init iolat_init(void)
+{
+	return blkio_policy_register(&blkio_policy_iolat);
+}
+module_init(iolat_init);
@@ -0,0 +1,108 @@
+/*
+ * Tag allocation for the hardware queues of blk-mq.
+ *
+ * Every hardware queue has a bitmap with one bit per preallocated
+ * request.  Each software queue remembers where its last tag came from
+ * and continues the search there, so CPUs that share a hardware queue
+ * mostly allocate from different words of the bitmap.
+ */
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+
+#include "blk-mq-tag.h"
+
+struct blk_mq_tags {
+	unsigned int		nr_tags;
+	wait_queue_head_t	wait;
+	unsigned long		map[0];
+};
+
+static unsigned int __blk_mq_get_tag(struct blk_mq_tags *tags,
+				     unsigned int *last_tag)
+{
+	unsigned int tag, start = *last_tag;
+
+	if (start >= tags->nr_tags)
+		start = 0;
+
+	for (;;) {
+		tag = find_next_zero_bit(tags->map, tags->nr_tags, start);
+		if (tag >= tags->nr_tags) {
+			tag = find_first_zero_bit(tags->map, tags->nr_tags);
+			if (tag >= tags->nr_tags)
+				return BLK_MQ_TAG_FAIL;
+		}
+		/*
+		 * A full barrier, blk-mq checks for a frozen queue after
+		 * getting the tag
+		 */
+		if (!test_and_set_bit(tag, tags->map))
+			break;
+		/* somebody else got it, keep looking */
+		start = tag + 1;
+	}
+
+	*last_tag = tag + 1;
+	return tag;
+}
+
+unsigned int blk_mq_get_tag(struct blk_mq_tags *tags, unsigned int *last_tag,
+			    gfp_t gfp)
+{
+	DEFINE_WAIT(wait);
+	unsigned int tag;
+
+	tag = __blk_mq_get_tag(tags, last_tag);
+	if (tag != BLK_MQ_TAG_FAIL || !(gfp & __GFP_WAIT))
+		return tag;
+
+	for (;;) {
+		prepare_to_wait_exclusive(&tags->wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		tag = __blk_mq_get_tag(tags, last_tag);
+		if (tag != BLK_MQ_TAG_FAIL)
+			break;
+		io_schedule();
+	}
+	finish_wait(&tags->wait, &wait);
+
+	return tag;
+}
+
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag)
+{
+	BUG_ON(tag >= tags->nr_tags);
+
+	clear_bit_unlock(tag, tags->map);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&tags->wait))
+		wake_up(&tags->wait);
+}
+
+bool blk_mq_tags_busy(struct blk_mq_tags *tags)
+{
+	return find_first_bit(tags->map, tags->nr_tags) < tags->nr_tags;
+}
+
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags, int node)
+{
+	struct blk_mq_tags *tags;
+
+	tags = kzalloc_node(sizeof(*tags) +
+			    BITS_TO_LONGS(nr_tags) * sizeof(unsigned long),
+			    GFP_KERNEL, node);
+	if (!tags)
+		return NULL;
+
+	tags->nr_tags = nr_tags;
+	init_waitqueue_head(&tags->wait);
+	return tags;
+}
+
+void blk_mq_free_tags(struct blk_mq_tags *tags)
+{
+	kfree(tags);
+}
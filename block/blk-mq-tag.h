@@ -0,0 +1,14 @@
+#ifndef INT_BLK_MQ_TAG_H
+#define INT_BLK_MQ_TAG_H
+
+#define BLK_MQ_TAG_FAIL		((unsigned int) -1)
+
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags, int node);
+void blk_mq_free_tags(struct blk_mq_tags *tags);
+
+unsigned int blk_mq_get_tag(struct blk_mq_tags *tags, unsigned int *last_tag,
+			    gfp_t gfp);
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag);
+bool blk_mq_tags_busy(struct blk_mq_tags *tags);
+
+#endif
@@ -0,0 +1,955 @@
+/*
+ * Multi-queue block layer
+ *
+ * Requests are queued on per-cpu software queues (struct blk_mq_ctx) and
+ * sent to the driver by hardware queues (struct blk_mq_hw_ctx), each of
+ * which serves a fixed set of CPUs.  Requests are preallocated for every
+ * hardware queue and handed out by tag, bios are only merged into the
+ * requests that still sit on the software queue they are submitted on,
+ * and nothing on the submission or completion path takes q->queue_lock.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/smp.h>
+#include <linux/workqueue.h>
+#include <linux/writeback.h>
+#include <linux/hrtimer.h>
+#include <linux/completion.h>
+
+#include <trace/events/block.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+#include "blk-mq-tag.h"
+
+/*
+ * How many requests at the tail of a software queue a bio is tried
+ * against for merging
+ */
+#define BLK_MQ_MERGE_DEPTH	8
+
+static struct blk_mq_ctx *__blk_mq_get_ctx(struct request_queue *q,
+					   unsigned int cpu)
+{
+	return per_cpu_ptr(q->queue_ctx, cpu);
+}
+
+static struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q,
+					      unsigned int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+
+unsigned int blk_mq_rq_cookie(struct request *rq)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(rq->q, rq->mq_ctx->cpu);
+
+	return blk_tag_to_qc_t(rq->tag, hctx->queue_num);
+}
+
+static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
+{
+	return !list_empty_careful(&hctx->dispatch) ||
+		find_first_bit(hctx->ctx_map, hctx->nr_ctx) < hctx->nr_ctx;
+}
+
+static void blk_mq_hctx_mark_pending(struct blk_mq_hw_ctx *hctx,
+				     struct blk_mq_ctx *ctx)
+{
+	if (!test_bit(ctx->index_hw, hctx->ctx_map))
+		set_bit(ctx->index_hw, hctx->ctx_map);
+}
+
+static bool blk_mq_queue_busy(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		if (blk_mq_tags_busy(hctx->tags))
+			return true;
+	return false;
+}
+
+/*
+ * Barriers run with the queue frozen: new requests wait in
+ * blk_mq_get_request() until all requests that were allocated before
+ * have completed, and until the barrier itself has completed.
+ */
+static void blk_mq_freeze_queue(struct request_queue *q)
+{
+	q->mq_frozen = 1;
+	smp_mb();
+	wait_event(q->mq_freeze_wq, !blk_mq_queue_busy(q));
+}
+
+static void blk_mq_unfreeze_queue(struct request_queue *q)
+{
+	q->mq_frozen = 0;
+	smp_mb();
+	wake_up_all(&q->mq_freeze_wq);
+}
+
+static void blk_mq_rq_ctx_init(struct request_queue *q, struct blk_mq_ctx *ctx,
+			       struct request *rq, unsigned int tag,
+			       unsigned int rw_flags)
+{
+	blk_rq_init(q, rq);
+	rq->mq_ctx = ctx;
+	rq->tag = tag;
+	rq->cmd_flags = rw_flags;
+	if (blk_queue_io_stat(q))
+		rq->cmd_flags |= REQ_IO_STAT;
+}
+
+static void __blk_mq_free_request(struct blk_mq_hw_ctx *hctx,
+				  struct request *rq)
+{
+	struct request_queue *q = hctx->queue;
+
+	blk_mq_put_tag(hctx->tags, rq->tag);
+	if (unlikely(q->mq_frozen))
+		wake_up_all(&q->mq_freeze_wq);
+}
+
+static struct request *blk_mq_get_request(struct request_queue *q,
+					  unsigned int rw_flags, gfp_t gfp,
+					  bool ignore_freeze)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	unsigned int tag;
+
+	for (;;) {
+		ctx = __blk_mq_get_ctx(q, raw_smp_processor_id());
+		hctx = blk_mq_map_queue(q, ctx->cpu);
+
+		tag = blk_mq_get_tag(hctx->tags, &ctx->last_tag, gfp);
+		if (tag == BLK_MQ_TAG_FAIL)
+			return NULL;
+
+		rq = hctx->rqs[tag];
+		if (likely(!q->mq_frozen) || ignore_freeze)
+			break;
+
+		/* a barrier is draining the queue, wait until it is done */
+		__blk_mq_free_request(hctx, rq);
+		if (!(gfp & __GFP_WAIT))
+			return NULL;
+		wait_event(q->mq_freeze_wq, !q->mq_frozen);
+	}
+
+	blk_mq_rq_ctx_init(q, ctx, rq, tag, rw_flags);
+	return rq;
+}
+
+/**
+ * blk_mq_alloc_request - allocate a request from a blk-mq queue
+ * @q:		the queue
+ * @rw:		%READ or %WRITE
+ * @gfp:	whether to wait for a free tag (%__GFP_WAIT)
+ *
+ * Description:
+ *    blk_get_request() for blk-mq queues.  The request is taken from the
+ *    hardware queue of the current CPU and must be given back with
+ *    blk_mq_free_request() or blk_put_request() if it is not executed.
+ */
+struct request *blk_mq_alloc_request(struct request_queue *q, int rw,
+				     gfp_t gfp)
+{
+	return blk_mq_get_request(q, rw, gfp, false);
+}
+EXPORT_SYMBOL(blk_mq_alloc_request);
+
+void blk_mq_free_request(struct request *rq)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+
+	__blk_mq_free_request(blk_mq_map_queue(rq->q, ctx->cpu), rq);
+}
+EXPORT_SYMBOL(blk_mq_free_request);
+
+/*
+ * Fold the completion time of a request into the average of its hardware
+ * queue.  Racing updates just lose a sample.
+ */
+static void blk_mq_poll_stat(struct request *rq)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(rq->q, rq->mq_ctx->cpu);
+	unsigned long *avg = &hctx->poll_nsec[rq_data_dir(rq)];
+	u64 nsec = ktime_to_ns(ktime_get()) - rq->io_start_ns;
+
+	if (nsec > ULONG_MAX)
+		nsec = ULONG_MAX;
+	if (*avg)
+		*avg = *avg - (*avg >> 3) + ((unsigned long)nsec >> 3);
+	else
+		*avg = nsec;
+}
+
+/**
+ * blk_mq_end_io - complete a request of a blk-mq queue
+ * @rq:		the request
+ * @error:	%0 for success, < %0 for error
+ *
+ * Description:
+ *    Completes all of @rq and gives it back to its hardware queue, or
+ *    calls its end_io callback.  May be called from interrupt context.
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	if (blk_update_request(rq, error, blk_rq_bytes(rq)))
+		BUG();
+
+	if (blk_queue_poll(rq->q) && rq->io_start_ns)
+		blk_mq_poll_stat(rq);
+
+	add_disk_randomness(rq->rq_disk);
+
+	if (unlikely(laptop_mode) && blk_fs_request(rq))
+		laptop_io_completion();
+
+	blk_account_io_done(rq);
+
+	if (rq->end_io)
+		rq->end_io(rq, error);
+	else
+		blk_mq_free_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_end_io);
+
+static void blk_mq_start_request(struct request *rq)
+{
+	trace_block_rq_issue(rq->q, rq);
+	rq->cmd_flags |= REQ_STARTED;
+	blk_account_io_dispatch(rq);
+	if (blk_queue_poll(rq->q) && !blk_do_io_stat(rq))
+		rq->io_start_ns = ktime_to_ns(ktime_get());
+}
+
+static void __blk_mq_insert_request(struct blk_mq_hw_ctx *hctx,
+				    struct request *rq, bool at_head)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+
+	trace_block_rq_insert(hctx->queue, rq);
+
+	spin_lock(&ctx->lock);
+	if (at_head)
+		list_add(&rq->queuelist, &ctx->rq_list);
+	else
+		list_add_tail(&rq->queuelist, &ctx->rq_list);
+	blk_mq_hctx_mark_pending(hctx, ctx);
+	spin_unlock(&ctx->lock);
+}
+
+/**
+ * blk_mq_insert_request - queue a prepared request on a blk-mq queue
+ * @rq:		the request, from blk_mq_alloc_request()
+ * @at_head:	queue it before all other pending requests of its CPU
+ * @run_queue:	run the hardware queue afterwards
+ * @async:	run the hardware queue from kblockd instead of directly
+ */
+void blk_mq_insert_request(struct request *rq, bool at_head, bool run_queue,
+			   bool async)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(rq->q, rq->mq_ctx->cpu);
+
+	__blk_mq_insert_request(hctx, rq, at_head);
+	if (run_queue)
+		blk_mq_run_hw_queue(hctx, async);
+}
+EXPORT_SYMBOL(blk_mq_insert_request);
+
+/*
+ * Queue a batch of requests of @q, from a task's plug, and run the
+ * hardware queues they ended up on.
+ */
+void blk_mq_insert_requests(struct request_queue *q, struct list_head *list,
+			    bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct request *rq, *next;
+
+	list_for_each_entry_safe(rq, next, list, queuelist) {
+		list_del_init(&rq->queuelist);
+		hctx = blk_mq_map_queue(q, rq->mq_ctx->cpu);
+		__blk_mq_insert_request(hctx, rq, false);
+	}
+	blk_mq_run_queues(q, async);
+}
+
+/*
+ * Move the requests of all software queues that have some pending onto
+ * @list
+ */
+static void flush_busy_ctxs(struct blk_mq_hw_ctx *hctx, struct list_head *list)
+{
+	struct blk_mq_ctx *ctx;
+	int bit;
+
+	for_each_bit(bit, hctx->ctx_map, hctx->nr_ctx) {
+		if (!test_and_clear_bit(bit, hctx->ctx_map))
+			continue;
+
+		ctx = hctx->ctxs[bit];
+		spin_lock(&ctx->lock);
+		list_splice_tail_init(&ctx->rq_list, list);
+		spin_unlock(&ctx->lock);
+	}
+}
+
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct request *rq;
+	LIST_HEAD(rq_list);
+	unsigned long queued = 0;
+	int ret;
+
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	hctx->run++;
+
+	flush_busy_ctxs(hctx, &rq_list);
+
+	/*
+	 * Requests that the driver could not take last time go first
+	 */
+	if (!list_empty_careful(&hctx->dispatch)) {
+		spin_lock(&hctx->lock);
+		list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock(&hctx->lock);
+	}
+
+	while (!list_empty(&rq_list)) {
+		rq = list_first_entry(&rq_list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+
+		blk_mq_start_request(rq);
+		ret = q->mq_ops->queue_rq(hctx, rq, list_empty(&rq_list));
+		if (ret == BLK_MQ_RQ_QUEUE_BUSY) {
+			rq->cmd_flags &= ~REQ_STARTED;
+			list_add(&rq->queuelist, &rq_list);
+			break;
+		}
+		if (ret == BLK_MQ_RQ_QUEUE_ERROR)
+			blk_mq_end_io(rq, -EIO);
+		queued++;
+	}
+	hctx->dispatched += queued;
+
+	if (list_empty(&rq_list))
+		return;
+
+	/*
+	 * The driver ran out of resources and stopped the queue, it will
+	 * start it again once some requests complete.  If that already
+	 * happened while we were busy here, run the queue once more so that
+	 * these requests do not sit on the dispatch list until the next
+	 * submission.
+	 */
+	spin_lock(&hctx->lock);
+	list_splice(&rq_list, &hctx->dispatch);
+	spin_unlock(&hctx->lock);
+
+	smp_mb();
+	if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+		kblockd_schedule_work(q, &hctx->run_work);
+}
+
+/**
+ * blk_mq_run_hw_queue - send the pending requests of a hardware queue
+ * @hctx:	the hardware queue
+ * @async:	run it from kblockd
+ *
+ * Description:
+ *    ->queue_rq() is always called in process context, so a synchronous
+ *    run must not be requested from atomic context.
+ */
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (async)
+		kblockd_schedule_work(hctx->queue, &hctx->run_work);
+	else
+		__blk_mq_run_hw_queue(hctx);
+}
+EXPORT_SYMBOL(blk_mq_run_hw_queue);
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		if (blk_mq_hctx_has_pending(hctx))
+			blk_mq_run_hw_queue(hctx, async);
+}
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+/*
+ * A driver that returns BLK_MQ_RQ_QUEUE_BUSY from ->queue_rq() stops
+ * the hardware queue first, and starts it again from its completion
+ * handler.
+ */
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+	__blk_mq_run_hw_queue(hctx);
+}
+EXPORT_SYMBOL(blk_mq_start_hw_queue);
+
+/*
+ * Can be called from interrupt context, the queues are run from kblockd
+ */
+void blk_mq_start_stopped_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			continue;
+
+		clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+		blk_mq_run_hw_queue(hctx, true);
+	}
+}
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+/*
+ * Spinning from the moment a request is issued burns a CPU for the whole
+ * device latency.  Sleep on a hrtimer for q->poll_nsec, or for half the
+ * average completion time of the hardware queue, counted from the issue
+ * of @rq, and spin only for the rest.  Returns true if it slept, the
+ * caller then checks again whether its I/O is done.
+ */
+static bool blk_mq_poll_hybrid_sleep(struct request_queue *q,
+				     struct blk_mq_hw_ctx *hctx,
+				     struct request *rq)
+{
+	struct hrtimer_sleeper hs;
+	u64 nsec, elapsed;
+
+	if (q->poll_nsec < 0)
+		return false;
+	if (q->poll_nsec > 0)
+		nsec = q->poll_nsec;
+	else
+		nsec = hctx->poll_nsec[rq_data_dir(rq)] / 2;
+
+	/*
+	 * @rq may already have completed and been reused, that only
+	 * makes the sleep a bit off.
+	 */
+	elapsed = ktime_to_ns(ktime_get()) - rq->io_start_ns;
+	if (!nsec || elapsed >= nsec)
+		return false;
+
+	hrtimer_init_on_stack(&hs.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hrtimer_set_expires(&hs.timer, ns_to_ktime(nsec - elapsed));
+	hrtimer_init_sleeper(&hs, current);
+
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	hrtimer_start_expires(&hs.timer, HRTIMER_MODE_REL);
+	if (hs.task)
+		io_schedule();
+	hrtimer_cancel(&hs.timer);
+	destroy_hrtimer_on_stack(&hs.timer);
+	__set_current_state(TASK_RUNNING);
+	return true;
+}
+
+/**
+ * blk_poll - poll a queue for the completion of a request
+ * @q:		the queue
+ * @cookie:	bio->bi_cookie of a bio submitted to @q
+ *
+ * Description:
+ *    Called by a task that has set its state to sleep until its I/O
+ *    completes, instead of sleeping.  Returns true if the task should
+ *    check for its completion again, with its state reset to
+ *    TASK_RUNNING, or false if it should go to sleep after all: polling
+ *    is off or unsupported for @q, or the task is needed elsewhere.
+ */
+bool blk_poll(struct request_queue *q, unsigned int cookie)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int queue_num, tag;
+	long state;
+
+	if (!q->mq_ops || !q->mq_ops->poll || !blk_queue_poll(q) ||
+	    !blk_qc_t_valid(cookie))
+		return false;
+
+	queue_num = blk_qc_t_to_queue_num(cookie);
+	tag = blk_qc_t_to_tag(cookie);
+	if (queue_num >= q->nr_hw_queues)
+		return false;
+	hctx = q->queue_hw_ctx[queue_num];
+	if (tag >= hctx->queue_depth)
+		return false;
+
+	if (blk_mq_poll_hybrid_sleep(q, hctx, hctx->rqs[tag]))
+		return true;
+
+	state = current->state;
+	while (!need_resched()) {
+		int ret = q->mq_ops->poll(hctx, tag);
+
+		if (ret > 0) {
+			set_current_state(TASK_RUNNING);
+			return true;
+		}
+		if (signal_pending_state(state, current))
+			set_current_state(TASK_RUNNING);
+		/* completed by someone else, who woke us up */
+		if (current->state == TASK_RUNNING)
+			return true;
+		if (ret < 0)
+			break;
+		cpu_relax();
+	}
+	return false;
+}
+EXPORT_SYMBOL_GPL(blk_poll);
+
+static void blk_mq_run_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(work, struct blk_mq_hw_ctx, run_work);
+	__blk_mq_run_hw_queue(hctx);
+}
+
+/*
+ * Requests are sent to the driver as soon as they are queued, so there
+ * is never anything plugged.  This only catches requests that were left
+ * behind by a stopped queue.
+ */
+static void blk_mq_unplug(struct request_queue *q)
+{
+	blk_mq_run_queues(q, true);
+}
+
+struct blk_mq_sync {
+	struct completion	done;
+	int			error;
+};
+
+static void blk_mq_end_sync_rq(struct request *rq, int error)
+{
+	struct blk_mq_sync *sync = rq->end_io_data;
+
+	sync->error = error;
+	complete(&sync->done);
+}
+
+static int blk_mq_execute_sync(struct request *rq)
+{
+	struct blk_mq_sync sync;
+
+	init_completion(&sync.done);
+	sync.error = 0;
+
+	rq->end_io = blk_mq_end_sync_rq;
+	rq->end_io_data = &sync;
+	blk_mq_insert_request(rq, true, true, false);
+	wait_for_completion(&sync.done);
+
+	blk_mq_free_request(rq);
+	return sync.error;
+}
+
+static int blk_mq_flush(struct request_queue *q, struct gendisk *disk)
+{
+	struct request *rq = blk_mq_get_request(q, READ, GFP_NOIO, true);
+
+	rq->cmd_flags |= REQ_HARDBARRIER;
+	rq->rq_disk = disk;
+	q->prepare_flush_fn(q, rq);
+
+	return blk_mq_execute_sync(rq);
+}
+
+/*
+ * There is no ordered sequence machinery on blk-mq queues.  A barrier
+ * freezes the queue, which drains it, and then issues the pre-flush, a
+ * clone of the barrier bio and the post-flush one after another, as
+ * q->next_ordered asks for.  The barrier bio is completed last.
+ */
+static void blk_mq_barrier(struct request_queue *q, struct bio *bio)
+{
+	const unsigned int ordered = q->next_ordered;
+	struct gendisk *disk = bio->bi_bdev->bd_disk;
+	struct bio *clone, *bounce;
+	struct request *rq;
+	int err = 0;
+
+	mutex_lock(&q->mq_barrier_mutex);
+	blk_mq_freeze_queue(q);
+
+	if (ordered & QUEUE_ORDERED_DO_PREFLUSH)
+		err = blk_mq_flush(q, disk);
+
+	if (!err && bio->bi_size) {
+		bounce = clone = bio_clone(bio, GFP_NOIO);
+		blk_queue_bounce(q, &bounce);
+
+		rq = blk_mq_get_request(q, bio_data_dir(bio) | REQ_RW_SYNC,
+					GFP_NOIO, true);
+		init_request_from_bio(rq, bounce);
+		if (ordered & QUEUE_ORDERED_DO_FUA)
+			rq->cmd_flags |= REQ_FUA;
+		drive_stat_acct(rq, 1);
+
+		err = blk_mq_execute_sync(rq);
+		bio_put(clone);
+
+		if (!err && (ordered & QUEUE_ORDERED_DO_POSTFLUSH))
+			err = blk_mq_flush(q, disk);
+	}
+
+	blk_mq_unfreeze_queue(q);
+	mutex_unlock(&q->mq_barrier_mutex);
+
+	bio_endio(bio, err);
+}
+
+static bool blk_mq_attempt_merge(struct request_queue *q,
+				 struct blk_mq_ctx *ctx, struct bio *bio)
+{
+	struct request *rq;
+	int checked = BLK_MQ_MERGE_DEPTH;
+
+	list_for_each_entry_reverse(rq, &ctx->rq_list, queuelist) {
+		if (!checked--)
+			break;
+
+		if (!elv_rq_merge_ok(rq, bio))
+			continue;
+
+		if (blk_rq_pos(rq) + blk_rq_sectors(rq) == bio->bi_sector) {
+			if (!bio_attempt_back_merge(q, rq, bio))
+				return false;
+		} else if (blk_rq_pos(rq) - bio_sectors(bio) == bio->bi_sector) {
+			if (!bio_attempt_front_merge(q, rq, bio))
+				return false;
+		} else
+			continue;
+
+		bio->bi_cookie = blk_mq_rq_cookie(rq);
+		return true;
+	}
+
+	return false;
+}
+
+static int blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	const int rw = bio_data_dir(bio);
+	const bool sync = bio_rw_flagged(bio, BIO_RW_SYNCIO);
+	const bool unplug = bio_rw_flagged(bio, BIO_RW_UNPLUG);
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct blk_plug *plug;
+	struct request *rq;
+	unsigned int rw_flags;
+	bool merged;
+
+	if (unlikely(bio_rw_flagged(bio, BIO_RW_BARRIER))) {
+		if (q->next_ordered == QUEUE_ORDERED_NONE) {
+			bio_endio(bio, -EOPNOTSUPP);
+			return 0;
+		}
+		if (!bio_rw_flagged(bio, BIO_RW_DISCARD)) {
+			blk_flush_plug(current);
+			blk_mq_barrier(q, bio);
+			return 0;
+		}
+	}
+
+	blk_queue_bounce(q, &bio);
+
+	ctx = __blk_mq_get_ctx(q, raw_smp_processor_id());
+	hctx = blk_mq_map_queue(q, ctx->cpu);
+
+	if ((hctx->flags & BLK_MQ_F_SHOULD_MERGE) && !blk_queue_nomerges(q) &&
+	    !bio_rw_flagged(bio, BIO_RW_BARRIER)) {
+		if (blk_attempt_plug_merge(q, bio))
+			return 0;
+
+		spin_lock(&ctx->lock);
+		merged = blk_mq_attempt_merge(q, ctx, bio);
+		spin_unlock(&ctx->lock);
+
+		if (merged) {
+			if (unplug)
+				blk_mq_run_hw_queue(hctx, false);
+			return 0;
+		}
+	}
+
+	rw_flags = rw;
+	if (sync)
+		rw_flags |= REQ_RW_SYNC;
+
+	trace_block_getrq(q, bio, rw);
+	rq = blk_mq_get_request(q, rw_flags, GFP_NOIO, false);
+	init_request_from_bio(rq, bio);
+	drive_stat_acct(rq, 1);
+	bio->bi_cookie = blk_mq_rq_cookie(rq);
+
+	plug = current->plug;
+	if (plug && !bio_rw_flagged(bio, BIO_RW_BARRIER)) {
+		blk_plug_add_request(plug, rq);
+		return 0;
+	}
+
+	/*
+	 * Reads and sync writes are sent to the driver right away from the
+	 * submitting CPU.  Async writes are left to kblockd, so that a
+	 * stream of them reaches the driver in batches.
+	 */
+	hctx = blk_mq_map_queue(q, rq->mq_ctx->cpu);
+	__blk_mq_insert_request(hctx, rq, false);
+	blk_mq_run_hw_queue(hctx, rw == WRITE && !sync && !unplug);
+	return 0;
+}
+
+static int blk_mq_alloc_rqs(struct blk_mq_hw_ctx *hctx, unsigned int cmd_size)
+{
+	size_t rq_size = L1_CACHE_ALIGN(sizeof(struct request) + cmd_size);
+	unsigned int i;
+
+	hctx->rqs = kzalloc_node(hctx->queue_depth * sizeof(struct request *),
+				 GFP_KERNEL, hctx->numa_node);
+	if (!hctx->rqs)
+		return -ENOMEM;
+
+	for (i = 0; i < hctx->queue_depth; i++) {
+		hctx->rqs[i] = kzalloc_node(rq_size, GFP_KERNEL,
+					    hctx->numa_node);
+		if (!hctx->rqs[i])
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void blk_mq_free_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	if (hctx->rqs) {
+		for (i = 0; i < hctx->queue_depth; i++)
+			kfree(hctx->rqs[i]);
+		kfree(hctx->rqs);
+	}
+	if (hctx->tags)
+		blk_mq_free_tags(hctx->tags);
+	kfree(hctx->ctx_map);
+	kfree(hctx->ctxs);
+	kfree(hctx);
+}
+
+static struct blk_mq_hw_ctx *blk_mq_alloc_hctx(struct request_queue *q,
+					       struct blk_mq_reg *reg,
+					       unsigned int index)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int node = reg->numa_node;
+
+	hctx = kzalloc_node(sizeof(*hctx), GFP_KERNEL, node);
+	if (!hctx)
+		return NULL;
+
+	spin_lock_init(&hctx->lock);
+	INIT_LIST_HEAD(&hctx->dispatch);
+	INIT_WORK(&hctx->run_work, blk_mq_run_work_fn);
+	hctx->queue = q;
+	hctx->queue_num = index;
+	hctx->flags = reg->flags;
+	hctx->queue_depth = reg->queue_depth;
+	hctx->numa_node = node;
+
+	hctx->ctxs = kmalloc_node(nr_cpu_ids * sizeof(void *), GFP_KERNEL,
+				  node);
+	hctx->ctx_map = kzalloc_node(BITS_TO_LONGS(nr_cpu_ids) *
+				     sizeof(unsigned long), GFP_KERNEL, node);
+	hctx->tags = blk_mq_init_tags(reg->queue_depth, node);
+	if (!hctx->ctxs || !hctx->ctx_map || !hctx->tags ||
+	    blk_mq_alloc_rqs(hctx, reg->cmd_size)) {
+		blk_mq_free_hctx(hctx);
+		return NULL;
+	}
+
+	return hctx;
+}
+
+/*
+ * Spread the possible CPUs evenly over the hardware queues, keeping
+ * CPUs with neighbouring numbers together.  Each tag allocation hint
+ * starts in a different part of the tag space of its hardware queue.
+ */
+static void blk_mq_map_swqueues(struct request_queue *q)
+{
+	unsigned int nr_cpus = num_possible_cpus();
+	unsigned int cpu, i, j, n = 0;
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+
+	for_each_possible_cpu(cpu) {
+		ctx = __blk_mq_get_ctx(q, cpu);
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+
+		q->mq_map[cpu] = n++ * q->nr_hw_queues / nr_cpus;
+		hctx = blk_mq_map_queue(q, cpu);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		hctx_for_each_ctx(hctx, ctx, j)
+			ctx->last_tag = j * hctx->queue_depth / hctx->nr_ctx;
+}
+
+/**
+ * blk_mq_init_queue - set up a multi-queue request queue
+ * @reg:	number and depth of the hardware queues, and the driver ops
+ * @driver_data: passed to ->init_hctx(), or stored in hctx->driver_data
+ *
+ * Description:
+ *    Sets up a request queue with one software queue per possible CPU
+ *    and @reg->nr_hw_queues hardware queues, each of which gets
+ *    @reg->queue_depth preallocated requests followed by
+ *    @reg->cmd_size bytes for the driver (see blk_mq_rq_to_pdu()).
+ *    There is no I/O scheduler on such a queue.
+ *
+ *    Like blk_init_queue(), must be paired with blk_cleanup_queue().
+ *    Returns %NULL on failure.
+ */
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct request_queue *q;
+	unsigned int i;
+
+	if (!reg->nr_hw_queues || !reg->ops->queue_rq || !reg->queue_depth ||
+	    reg->queue_depth > BLK_MQ_MAX_DEPTH)
+		return NULL;
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		return NULL;
+	q->node = reg->numa_node;
+
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->mq_map = kzalloc_node(nr_cpu_ids * sizeof(unsigned int),
+				 GFP_KERNEL, q->node);
+	q->queue_hw_ctx = kzalloc_node(reg->nr_hw_queues * sizeof(hctx),
+				       GFP_KERNEL, q->node);
+	if (!q->queue_ctx || !q->mq_map || !q->queue_hw_ctx)
+		goto err_free;
+
+	q->nr_hw_queues = reg->nr_hw_queues;
+	for (i = 0; i < q->nr_hw_queues; i++) {
+		q->queue_hw_ctx[i] = blk_mq_alloc_hctx(q, reg, i);
+		if (!q->queue_hw_ctx[i])
+			goto err_free;
+	}
+
+	blk_mq_map_swqueues(q);
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!reg->ops->init_hctx) {
+			hctx->driver_data = driver_data;
+			continue;
+		}
+		if (reg->ops->init_hctx(hctx, driver_data, i))
+			goto err_exit;
+	}
+
+	init_waitqueue_head(&q->mq_freeze_wq);
+	mutex_init(&q->mq_barrier_mutex);
+
+	/*
+	 * This also sets hw/phys segments, boundary and size
+	 */
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->unplug_fn = blk_mq_unplug;
+	q->queue_flags = QUEUE_FLAG_MQ_DEFAULT;
+	q->nr_requests = reg->nr_hw_queues * reg->queue_depth;
+	q->sg_reserved_size = INT_MAX;
+
+	q->mq_ops = reg->ops;
+	return q;
+
+err_exit:
+	if (reg->ops->exit_hctx)
+		while (i--)
+			reg->ops->exit_hctx(q->queue_hw_ctx[i], i);
+err_free:
+	blk_mq_free_queue(q);
+	blk_put_queue(q);
+	return NULL;
+}
+EXPORT_SYMBOL(blk_mq_init_queue);
+
+/*
+ * Called by blk_cleanup_queue(), no more I/O is submitted at this point
+ */
+void blk_mq_exit_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		cancel_work_sync(&hctx->run_work);
+		if (q->mq_ops->exit_hctx)
+			q->mq_ops->exit_hctx(hctx, i);
+	}
+}
+
+/*
+ * Called when the last reference to the queue is dropped
+ */
+void blk_mq_free_queue(struct request_queue *q)
+{
+	unsigned int i;
+
+	if (q->queue_hw_ctx) {
+		for (i = 0; i < q->nr_hw_queues; i++)
+			if (q->queue_hw_ctx[i])
+				blk_mq_free_hctx(q->queue_hw_ctx[i]);
+		kfree(q->queue_hw_ctx);
+	}
+	kfree(q->mq_map);
+	if (q->queue_ctx)
+		free_percpu(q->queue_ctx);
+
+	q->queue_hw_ctx = NULL;
+	q->mq_map = NULL;
+	q->queue_ctx = NULL;
+	q->nr_hw_queues = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef INT_BLK_MQ_H
+#define INT_BLK_MQ_H
+
+struct blk_mq_ctx {
+	spinlock_t		lock;
+	struct list_head	rq_list;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;	/* index in hctx->ctxs */
+	unsigned int		last_tag;	/* tag allocation hint */
+
+	struct request_queue	*queue;
+} ____cacheline_aligned_in_smp;
+
+unsigned int blk_mq_rq_cookie(struct request *rq);
+void blk_mq_insert_requests(struct request_queue *q, struct list_head *list,
+			    bool async);
+void blk_mq_exit_queue(struct request_queue *q);
+void blk_mq_free_queue(struct request_queue *q);
+
+#endif
@@ -6,8 +6,10 @@
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/blktrace_api.h>
+#include <linux/blk-mq.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 struct queue_sysfs_entry {
 	struct attribute attr;
@@ -239,6 +241,127 @@ static ssize_t queue_iostats_store(struct request_queue *q, const char *page,
 	return ret;
 }
 
+/*
+ * One line of counts per direction, reads first, summed over all cpus.
+ */
+static ssize_t queue_hist_show(struct request_queue *q, char *page, int hist)
+{
+	ssize_t len = 0;
+	int rw, i, cpu;
+
+	for (rw = 0; rw < 2; rw++) {
+		for (i = 0; i < BLK_HIST_BUCKETS; i++) {
+			unsigned long sum = 0;
+
+			for_each_possible_cpu(cpu)
+				sum += per_cpu_ptr(q->io_hist, cpu)->
+					buckets[hist][rw][i];
+			len += sprintf(page + len, "%lu%c", sum,
+				       i == BLK_HIST_BUCKETS - 1 ? '\n' : ' ');
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Writing 0 clears a histogram.  Racing updates just lose a sample.
+ */
+static ssize_t queue_hist_store(struct request_queue *q, const char *page,
+				size_t count, int hist)
+{
+	unsigned long val;
+	ssize_t ret = queue_var_store(&val, page, count);
+	int cpu;
+
+	if (val)
+		return -EINVAL;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(q->io_hist, cpu)->buckets[hist], 0,
+		       sizeof(per_cpu_ptr(q->io_hist, cpu)->buckets[hist]));
+
+	return ret;
+}
+
+static ssize_t queue_queue_hist_show(struct request_queue *q, char *page)
+{
+	return queue_hist_show(q, page, BLK_HIST_QUEUE);
+}
+
+static ssize_t queue_queue_hist_store(struct request_queue *q,
+				      const char *page, size_t count)
+{
+	return queue_hist_store(q, page, count, BLK_HIST_QUEUE);
+}
+
+static ssize_t queue_service_hist_show(struct request_queue *q, char *page)
+{
+	return queue_hist_show(q, page, BLK_HIST_SERVICE);
+}
+
+static ssize_t queue_service_hist_store(struct request_queue *q,
+					const char *page, size_t count)
+{
+	return queue_hist_store(q, page, count, BLK_HIST_SERVICE);
+}
+
+static ssize_t queue_size_hist_show(struct request_queue *q, char *page)
+{
+	return queue_hist_show(q, page, BLK_HIST_SIZE);
+}
+
+static ssize_t queue_size_hist_store(struct request_queue *q,
+				     const char *page, size_t count)
+{
+	return queue_hist_store(q, page, count, BLK_HIST_SIZE);
+}
+
+static ssize_t queue_poll_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(blk_queue_poll(q), page);
+}
+
+static ssize_t queue_poll_store(struct request_queue *q, const char *page,
+				size_t count)
+{
+	unsigned long poll;
+	ssize_t ret;
+
+	if (!q->mq_ops || !q->mq_ops->poll)
+		return -EINVAL;
+
+	ret = queue_var_store(&poll, page, count);
+	spin_lock_irq(q->queue_lock);
+	if (poll)
+		queue_flag_set(QUEUE_FLAG_POLL, q);
+	else
+		queue_flag_clear(QUEUE_FLAG_POLL, q);
+	spin_unlock_irq(q->queue_lock);
+
+	return ret;
+}
+
+static ssize_t queue_poll_delay_show(struct request_queue *q, char *page)
+{
+	if (q->poll_nsec < 0)
+		return sprintf(page, "-1\n");
+	return sprintf(page, "%d\n", q->poll_nsec / 1000);
+}
+
+static ssize_t queue_poll_delay_store(struct request_queue *q,
+				      const char *page, size_t count)
+{
+	long usec;
+
+	if (strict_strtol(page, 10, &usec) || usec < -1 ||
+	    usec > INT_MAX / 1000)
+		return -EINVAL;
+
+	q->poll_nsec = usec < 0 ? -1 : usec * 1000;
+	return count;
+}
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -317,6 +440,36 @@ static struct queue_sysfs_entry queue_iostats_entry = {
 	.store = queue_iostats_store,
 };
 
+static struct queue_sysfs_entry queue_queue_hist_entry = {
+	.attr = {.name = "io_queue_hist", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_queue_hist_show,
+	.store = queue_queue_hist_store,
+};
+
+static struct queue_sysfs_entry queue_service_hist_entry = {
+	.attr = {.name = "io_service_hist", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_service_hist_show,
+	.store = queue_service_hist_store,
+};
+
+static struct queue_sysfs_entry queue_size_hist_entry = {
+	.attr = {.name = "io_size_hist", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_size_hist_show,
+	.store = queue_size_hist_store,
+};
+
+static struct queue_sysfs_entry queue_poll_entry = {
+	.attr = {.name = "io_poll", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_show,
+	.store = queue_poll_store,
+};
+
+static struct queue_sysfs_entry queue_poll_delay_entry = {
+	.attr = {.name = "io_poll_delay", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_delay_show,
+	.store = queue_poll_delay_store,
+};
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -332,6 +485,11 @@ static struct attribute *default_attrs[] = {
 	&queue_nomerges_entry.attr,
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
+	&queue_queue_hist_entry.attr,
+	&queue_service_hist_entry.attr,
+	&queue_size_hist_entry.attr,
+	&queue_poll_entry.attr,
+	&queue_poll_delay_entry.attr,
 	NULL,
 };
 
@@ -408,7 +566,13 @@ static void blk_release_queue(struct kobject *kobj)
 	if (q->queue_tags)
 		__blk_queue_free_tags(q);
 
+	if (q->mq_ops)
+		blk_mq_free_queue(q);
+
+	blk_throtl_exit(q);
+	blk_iolatency_exit(q);
 	blk_trace_shutdown(q);
+	free_percpu(q->io_hist);
 
 	bdi_destroy(&q->backing_dev_info);
 	kmem_cache_free(blk_requestq_cachep, q);
@@ -0,0 +1,599 @@
+/*
+ * Block I/O throttling
+ *
+ * Limits the read and write bandwidth and IOPS a blkio cgroup may use on
+ * a device.  Bios are checked in generic_make_request(), before they reach
+ * the elevator or the make_request_fn of a stacking driver, so the limits
+ * hold whatever I/O scheduler the queue runs.  Bios over the limit are
+ * queued per cgroup and device, and resubmitted from kblockd once their
+ * group may dispatch again.
+ *
+ * Rates are measured over slices of throtl_slice jiffies: since the start
+ * of its slice, a group may dispatch bps bytes and iops bios per second.
+ * The slice is stretched while bios wait and renewed once it has run out
+ * with nothing waiting, so an idle group does not save up a burst.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/genhd.h>
+#include <linux/kdev_t.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include "blk.h"
+#include "blk-cgroup.h"
+
+/* Interval the dispatch rates are measured over */
+static unsigned long throtl_slice = HZ / 10;
+
+/* Bios of one group and direction released per dispatch run */
+static unsigned int throtl_grp_quantum = 8;
+
+/*
+ * A per device limit written to the cgroup files.  Zero means unlimited,
+ * a rule without any limit left is removed.
+ */
+struct throtl_rule {
+	struct list_head node;
+	dev_t dev;
+	u64 bps[2];
+	unsigned int iops[2];
+};
+
+/* Throttling state of a blkio cgroup */
+struct throtl_cgroup {
+	struct list_head rules;
+	struct list_head tg_list;	/* the groups of this cgroup */
+};
+
+/*
+ * A cgroup on one queue.  Protected by the queue lock, except for the
+ * limits and the cgroup link, which are changed under throtl_lock.
+ */
+struct throtl_grp {
+	struct list_head td_node;	/* on td->tg_list */
+	struct list_head blkcg_node;	/* on throtl_cgroup->tg_list */
+	struct list_head pending_node;	/* on td->pending while bios wait */
+	struct throtl_data *td;
+	struct blkio_cgroup *blkcg;	/* NULL once the cgroup is gone */
+	dev_t dev;
+
+	u64 bps[2];
+	unsigned int iops[2];
+
+	unsigned long slice_start[2];
+	unsigned long slice_end[2];
+	u64 bytes_disp[2];
+	unsigned int io_disp[2];
+
+	struct bio_list bios[2];
+	unsigned int nr_queued[2];
+};
+
+struct throtl_data {
+	struct request_queue *queue;
+	struct list_head tg_list;
+	struct list_head pending;	/* groups with queued bios */
+	struct delayed_work dispatch_work;
+};
+
+/*
+ * Protects the rule lists and the cgroup side of the groups.  Nests
+ * inside the queue lock.
+ */
+static DEFINE_SPINLOCK(throtl_lock);
+
+/* Rules in all cgroups, without any there is nothing to throttle */
+static atomic_t throtl_nr_rules = ATOMIC_INIT(0);
+
+static inline struct throtl_cgroup *blkcg_to_tc(struct blkio_cgroup *blkcg)
+{
+	return blkcg->pd[BLKIO_POLICY_THROTL];
+}
+
+static struct throtl_rule *throtl_find_rule(struct throtl_cgroup *tc,
+					    dev_t dev)
+{
+	struct throtl_rule *rule;
+
+	list_for_each_entry(rule, &tc->rules, node)
+		if (rule->dev == dev)
+			return rule;
+	return NULL;
+}
+
+static void tg_set_limits(struct throtl_grp *tg, struct throtl_rule *rule)
+{
+	int rw;
+
+	for (rw = READ; rw <= WRITE; rw++) {
+		tg->bps[rw] = rule ? rule->bps[rw] : 0;
+		tg->iops[rw] = rule ? rule->iops[rw] : 0;
+	}
+}
+
+/*
+ * Arm the dispatch work to run in @delay jiffies, or earlier if it is
+ * armed already.
+ */
+static void throtl_schedule_dispatch(struct throtl_data *td,
+				     unsigned long delay)
+{
+	struct delayed_work *dwork = &td->dispatch_work;
+
+	if (delayed_work_pending(dwork) &&
+	    time_before(jiffies + delay, dwork->timer.expires))
+		__cancel_delayed_work(dwork);
+	kblockd_schedule_delayed_work(td->queue, dwork, delay);
+}
+
+/*
+ * Look up the group of @blkcg on @td, creating it on first use.  Called
+ * with the queue lock and rcu_read_lock() held, the latter keeps the
+ * cgroup from being destroyed under us.
+ */
+static struct throtl_grp *throtl_get_tg(struct throtl_data *td,
+					struct blkio_cgroup *blkcg,
+					struct block_device *bdev)
+{
+	struct throtl_cgroup *tc = blkcg_to_tc(blkcg);
+	struct throtl_grp *tg;
+	int rw;
+
+	list_for_each_entry(tg, &td->tg_list, td_node)
+		if (tg->blkcg == blkcg)
+			return tg;
+
+	if (!tc)
+		return NULL;
+	tg = kzalloc(sizeof(*tg), GFP_ATOMIC);
+	if (!tg)
+		return NULL;
+	INIT_LIST_HEAD(&tg->pending_node);
+	tg->td = td;
+	tg->blkcg = blkcg;
+	tg->dev = disk_devt(bdev->bd_disk);
+	for (rw = READ; rw <= WRITE; rw++) {
+		bio_list_init(&tg->bios[rw]);
+		tg->slice_start[rw] = tg->slice_end[rw] = jiffies;
+	}
+
+	spin_lock(&throtl_lock);
+	tg_set_limits(tg, throtl_find_rule(tc, tg->dev));
+	list_add(&tg->blkcg_node, &tc->tg_list);
+	spin_unlock(&throtl_lock);
+
+	list_add(&tg->td_node, &td->tg_list);
+	return tg;
+}
+
+static void throtl_start_new_slice(struct throtl_grp *tg, int rw)
+{
+	tg->bytes_disp[rw] = 0;
+	tg->io_disp[rw] = 0;
+	tg->slice_start[rw] = jiffies;
+	tg->slice_end[rw] = jiffies + throtl_slice;
+}
+
+/*
+ * Returns true if @bio may be dispatched now, else sets *@wait to the
+ * jiffies until it may.
+ */
+static bool tg_may_dispatch(struct throtl_grp *tg, struct bio *bio,
+			    unsigned long *wait)
+{
+	int rw = bio_data_dir(bio);
+	unsigned long elapsed, elapsed_rnd;
+	unsigned long bps_wait = 0, iops_wait = 0;
+	u64 allowed, extra;
+
+	*wait = 0;
+	if (!tg->bps[rw] && !tg->iops[rw])
+		return true;
+
+	if (time_after_eq(jiffies, tg->slice_end[rw]))
+		throtl_start_new_slice(tg, rw);
+
+	elapsed = jiffies - tg->slice_start[rw];
+	elapsed_rnd = elapsed ? roundup(elapsed, throtl_slice) : throtl_slice;
+
+	if (tg->iops[rw]) {
+		allowed = div_u64((u64)tg->iops[rw] * elapsed_rnd, HZ);
+		if (tg->io_disp[rw] + 1 > allowed) {
+			iops_wait = div_u64((u64)(tg->io_disp[rw] + 1) * HZ,
+					    tg->iops[rw]) + 1;
+			iops_wait = iops_wait > elapsed ? iops_wait - elapsed : 1;
+		}
+	}
+
+	if (tg->bps[rw]) {
+		allowed = div_u64(tg->bps[rw] * elapsed_rnd, HZ);
+		if (tg->bytes_disp[rw] + bio->bi_size > allowed) {
+			extra = tg->bytes_disp[rw] + bio->bi_size - allowed;
+			bps_wait = div64_u64(extra * HZ, tg->bps[rw]);
+			bps_wait = max(bps_wait, 1UL) + elapsed_rnd - elapsed;
+		}
+	}
+
+	*wait = max(bps_wait, iops_wait);
+	if (!*wait)
+		return true;
+
+	/* keep the slice, and what was dispatched in it, until the bio is due */
+	if (time_before(tg->slice_end[rw], jiffies + *wait))
+		tg->slice_end[rw] = jiffies + roundup(*wait, throtl_slice);
+	return false;
+}
+
+static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
+{
+	int rw = bio_data_dir(bio);
+
+	tg->bytes_disp[rw] += bio->bi_size;
+	tg->io_disp[rw]++;
+}
+
+/*
+ * Free the groups whose cgroup is gone once their bios have drained.
+ */
+static void throtl_reap_groups(struct throtl_data *td)
+{
+	struct throtl_grp *tg, *next;
+
+	spin_lock(&throtl_lock);
+	list_for_each_entry_safe(tg, next, &td->tg_list, td_node) {
+		if (tg->blkcg || tg->nr_queued[READ] || tg->nr_queued[WRITE])
+			continue;
+		list_del(&tg->td_node);
+		kfree(tg);
+	}
+	spin_unlock(&throtl_lock);
+}
+
+static void throtl_dispatch_work(struct work_struct *work)
+{
+	struct throtl_data *td =
+		container_of(work, struct throtl_data, dispatch_work.work);
+	struct request_queue *q = td->queue;
+	struct throtl_grp *tg, *next;
+	unsigned long wait, min_wait = ULONG_MAX;
+	struct bio_list bios;
+	struct blk_plug plug;
+	struct bio *bio;
+	unsigned int nr;
+	int rw;
+
+	bio_list_init(&bios);
+
+	spin_lock_irq(q->queue_lock);
+	list_for_each_entry_safe(tg, next, &td->pending, pending_node) {
+		for (rw = READ; rw <= WRITE; rw++) {
+			nr = 0;
+			while ((bio = bio_list_peek(&tg->bios[rw]))) {
+				if (nr == throtl_grp_quantum) {
+					min_wait = 0;
+					break;
+				}
+				if (!tg_may_dispatch(tg, bio, &wait)) {
+					min_wait = min(min_wait, wait);
+					break;
+				}
+				bio_list_pop(&tg->bios[rw]);
+				tg->nr_queued[rw]--;
+				throtl_charge_bio(tg, bio);
+				bio->bi_flags |= 1 << BIO_THROTTLED;
+				bio_list_add(&bios, bio);
+				nr++;
+			}
+		}
+		if (!tg->nr_queued[READ] && !tg->nr_queued[WRITE])
+			list_del_init(&tg->pending_node);
+	}
+	if (!list_empty(&td->pending))
+		throtl_schedule_dispatch(td, min_wait);
+	throtl_reap_groups(td);
+	spin_unlock_irq(q->queue_lock);
+
+	if (bio_list_empty(&bios))
+		return;
+
+	blk_start_plug(&plug);
+	while ((bio = bio_list_pop(&bios)))
+		generic_make_request(bio);
+	blk_finish_plug(&plug);
+}
+
+/**
+ * blk_throtl_bio - apply the throttling limits to a bio
+ * @q: queue the bio is submitted to
+ * @bio: the bio
+ *
+ * Called from generic_make_request() for every bio.  Returns true if the
+ * bio was queued, it is resubmitted once the submitting cgroup is within
+ * its limits on @q again.  Bios coming back from the dispatch work carry
+ * BIO_THROTTLED and are let through, they have been charged already.
+ */
+bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
+{
+	int rw = bio_data_dir(bio);
+	struct throtl_data *td;
+	struct throtl_grp *tg;
+	unsigned long flags, wait;
+	bool queued = false;
+
+	if (bio_flagged(bio, BIO_THROTTLED)) {
+		bio->bi_flags &= ~(1 << BIO_THROTTLED);
+		return false;
+	}
+	if (!atomic_read(&throtl_nr_rules))
+		return false;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	td = q->td;
+	if (!td)
+		goto out;
+
+	rcu_read_lock();
+	tg = throtl_get_tg(td, task_blkio_cgroup(current), bio->bi_bdev);
+	rcu_read_unlock();
+	if (!tg)
+		goto out;
+
+	/* bios of a group go out in order, behind any that are waiting */
+	if (!tg->nr_queued[rw]) {
+		if (tg_may_dispatch(tg, bio, &wait)) {
+			throtl_charge_bio(tg, bio);
+			goto out;
+		}
+		throtl_schedule_dispatch(td, wait);
+	}
+	bio_list_add(&tg->bios[rw], bio);
+	tg->nr_queued[rw]++;
+	if (list_empty(&tg->pending_node))
+		list_add_tail(&tg->pending_node, &td->pending);
+	queued = true;
+out:
+	spin_unlock_irqrestore(q->queue_lock, flags);
+	return queued;
+}
+
+int blk_throtl_init(struct request_queue *q)
+{
+	struct throtl_data *td;
+
+	td = kzalloc(sizeof(*td), GFP_KERNEL);
+	if (!td)
+		return -ENOMEM;
+
+	td->queue = q;
+	INIT_LIST_HEAD(&td->tg_list);
+	INIT_LIST_HEAD(&td->pending);
+	INIT_DELAYED_WORK(&td->dispatch_work, throtl_dispatch_work);
+	q->td = td;
+	return 0;
+}
+
+/*
+ * Called when the queue goes away.  Bios still waiting are failed, the
+ * device is gone.  A queue that never saw a bio may not have a lock.
+ */
+void blk_throtl_exit(struct request_queue *q)
+{
+	struct throtl_data *td = q->td;
+	struct throtl_grp *tg, *next;
+	struct bio_list bios;
+	struct bio *bio;
+	int rw;
+
+	if (!td)
+		return;
+
+	bio_list_init(&bios);
+	if (q->queue_lock)
+		spin_lock_irq(q->queue_lock);
+	q->td = NULL;
+	spin_lock(&throtl_lock);
+	list_for_each_entry(tg, &td->tg_list, td_node) {
+		if (tg->blkcg) {
+			list_del(&tg->blkcg_node);
+			tg->blkcg = NULL;
+		}
+		for (rw = READ; rw <= WRITE; rw++) {
+			bio_list_merge(&bios, &tg->bios[rw]);
+			bio_list_init(&tg->bios[rw]);
+			tg->nr_queued[rw] = 0;
+		}
+		list_del_init(&tg->pending_node);
+	}
+	spin_unlock(&throtl_lock);
+	if (q->queue_lock)
+		spin_unlock_irq(q->queue_lock);
+
+	cancel_delayed_work_sync(&td->dispatch_work);
+
+	list_for_each_entry_safe(tg, next, &td->tg_list, td_node)
+		kfree(tg);
+	kfree(td);
+
+	while ((bio = bio_list_pop(&bios)))
+		bio_endio(bio, -EIO);
+}
+
+/*
+ * cgroup interface
+ */
+enum {
+	THROTL_BPS,
+	THROTL_IOPS,
+};
+
+#define THROTL_FILE(rw, type)		((rw) << 1 | (type))
+#define THROTL_FILE_RW(private)		((private) >> 1)
+#define THROTL_FILE_TYPE(private)	((private) & 1)
+
+static int throtl_read_dev(struct cgroup *cgroup, struct cftype *cft,
+			   struct seq_file *m)
+{
+	struct throtl_cgroup *tc = blkcg_to_tc(cgroup_to_blkio_cgroup(cgroup));
+	int rw = THROTL_FILE_RW(cft->private);
+	int type = THROTL_FILE_TYPE(cft->private);
+	struct throtl_rule *rule;
+	u64 val;
+
+	spin_lock_irq(&throtl_lock);
+	list_for_each_entry(rule, &tc->rules, node) {
+		val = type == THROTL_IOPS ? rule->iops[rw] : rule->bps[rw];
+		if (val)
+			seq_printf(m, "%u:%u %llu\n", MAJOR(rule->dev),
+				   MINOR(rule->dev), (unsigned long long)val);
+	}
+	spin_unlock_irq(&throtl_lock);
+	return 0;
+}
+
+static int throtl_write_dev(struct cgroup *cgroup, struct cftype *cft,
+			    const char *buf)
+{
+	struct throtl_cgroup *tc = blkcg_to_tc(cgroup_to_blkio_cgroup(cgroup));
+	int rw = THROTL_FILE_RW(cft->private);
+	int type = THROTL_FILE_TYPE(cft->private);
+	struct throtl_rule *rule, *new;
+	struct throtl_grp *tg;
+	dev_t dev;
+	u64 val;
+	int ret;
+
+	ret = blkio_parse_dev_value(buf, &dev, &val);
+	if (ret)
+		return ret;
+	if (type == THROTL_IOPS && val > UINT_MAX)
+		return -EINVAL;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+	new->dev = dev;
+
+	spin_lock_irq(&throtl_lock);
+	rule = throtl_find_rule(tc, dev);
+	if (!rule) {
+		if (!val)
+			goto out_unlock;
+		rule = new;
+		new = NULL;
+		list_add_tail(&rule->node, &tc->rules);
+		atomic_inc(&throtl_nr_rules);
+	}
+
+	if (type == THROTL_IOPS)
+		rule->iops[rw] = val;
+	else
+		rule->bps[rw] = val;
+
+	if (!rule->bps[READ] && !rule->bps[WRITE] &&
+	    !rule->iops[READ] && !rule->iops[WRITE]) {
+		list_del(&rule->node);
+		atomic_dec(&throtl_nr_rules);
+		new = rule;
+		rule = NULL;
+	}
+
+	/* waiting bios are looked at again under the new limits */
+	list_for_each_entry(tg, &tc->tg_list, blkcg_node) {
+		if (tg->dev != dev)
+			continue;
+		tg_set_limits(tg, rule);
+		throtl_schedule_dispatch(tg->td, 0);
+	}
+out_unlock:
+	spin_unlock_irq(&throtl_lock);
+	kfree(new);
+	return 0;
+}
+
+static struct cftype throtl_files[] = {
+	{
+		.name = "throttle.read_bps_device",
+		.read_seq_string = throtl_read_dev,
+		.write_string = throtl_write_dev,
+		.private = THROTL_FILE(READ, THROTL_BPS),
+	},
+	{
+		.name = "throttle.write_bps_device",
+		.read_seq_string = throtl_read_dev,
+		.write_string = throtl_write_dev,
+		.private = THROTL_FILE(WRITE, THROTL_BPS),
+	},
+	{
+		.name = "throttle.read_iops_device",
+		.read_seq_string = throtl_read_dev,
+		.write_string = throtl_write_dev,
+		.private = THROTL_FILE(READ, THROTL_IOPS),
+	},
+	{
+		.name = "throttle.write_iops_device",
+		.read_seq_string = throtl_read_dev,
+		.write_string = throtl_write_dev,
+		.private = THROTL_FILE(WRITE, THROTL_IOPS),
+	},
+};
+
+static void *throtl_alloc_pd(struct blkio_cgroup *blkcg)
+{
+	struct throtl_cgroup *tc;
+
+	tc = kzalloc(sizeof(*tc), GFP_KERNEL);
+	if (!tc)
+		return NULL;
+	INIT_LIST_HEAD(&tc->rules);
+	INIT_LIST_HEAD(&tc->tg_list);
+	return tc;
+}
+
+/*
+ * The cgroup is gone.  Its groups lose their limits so that the bios they
+ * still hold drain, the dispatch work frees them after that.
+ */
+static void throtl_free_pd(struct blkio_cgroup *blkcg, void *pd)
+{
+	struct throtl_cgroup *tc = pd;
+	struct throtl_rule *rule, *rnext;
+	struct throtl_grp *tg, *tnext;
+
+	spin_lock_irq(&throtl_lock);
+	list_for_each_entry_safe(tg, tnext, &tc->tg_list, blkcg_node) {
+		list_del_init(&tg->blkcg_node);
+		tg->blkcg = NULL;
+		tg_set_limits(tg, NULL);
+		throtl_schedule_dispatch(tg->td, 0);
+	}
+	list_for_each_entry_safe(rule, rnext, &tc->rules, node) {
+		list_del(&rule->node);
+		atomic_dec(&throtl_nr_rules);
+		kfree(rule);
+	}
+	spin_unlock_irq(&throtl_lock);
+	kfree(tc);
+}
+
+static struct blkio_policy blkio_policy_throtl = {
+	.id		= BLKIO_POLICY_THROTL,
+	.files		= throtl_files,
+	.nr_files	= ARRAY_SIZE(throtl_files),
+	.alloc_pd	= throtl_alloc_pd,
+	.free_pd	= throtl_free_pd,
+};
+
+static int __init throtl_init(void)
+{
+	return blkio_policy_register(&blkio_policy_throtl);
+}
+module_init(throtl_init);
@@ -16,6 +16,15 @@ void blk_rq_bio_prep(struct request_queue *q, struct request *rq,
 int blk_rq_append_bio(struct request_queue *q, struct request *rq,
 		      struct bio *bio);
 void blk_dequeue_request(struct request *rq);
+void drive_stat_acct(struct request *rq, int new_io);
+void blk_account_io_dispatch(struct request *req);
+void blk_account_io_done(struct request *req);
+bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
+			    struct bio *bio);
+bool bio_attempt_front_merge(struct request_queue *q, struct request *req,
+			     struct bio *bio);
+bool blk_attempt_plug_merge(struct request_queue *q, struct bio *bio);
+void blk_plug_add_request(struct blk_plug *plug, struct request *rq);
 void __blk_queue_free_tags(struct request_queue *q);
 
 void blk_unplug_work(struct work_struct *work);
@@ -165,4 +174,48 @@ static inline int blk_do_io_stat(struct request *rq)
 	       (blk_fs_request(rq) || blk_discard_rq(rq));
 }
 
+/*
+ * Log2 histograms of the requests a queue completed, by direction.
+ * Bucket i counts values from 2^i up to 2^(i+1) - 1, the first bucket
+ * also counts 0 and the last everything above.  Times are in
+ * microseconds, sizes in sectors.
+ */
+#define BLK_HIST_BUCKETS	24
+
+enum {
+	BLK_HIST_QUEUE,		/* allocation to dispatch */
+	BLK_HIST_SERVICE,	/* dispatch to completion */
+	BLK_HIST_SIZE,		/* size at dispatch */
+	BLK_HIST_NR,
+};
+
+struct blk_io_hist {
+	unsigned long buckets[BLK_HIST_NR][2][BLK_HIST_BUCKETS];
+};
+
+#ifdef CONFIG_BLK_DEV_THROTTLING
+extern int blk_throtl_init(struct request_queue *q);
+extern void blk_throtl_exit(struct request_queue *q);
+extern bool blk_throtl_bio(struct request_queue *q, struct bio *bio);
+#else
+static inline int blk_throtl_init(struct request_queue *q) { return 0; }
+static inline void blk_throtl_exit(struct request_queue *q) { }
+static inline bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
+{
+	return false;
+}
+#endif
+
+#ifdef CONFIG_BLK_CGROUP_IOLATENCY
+extern int blk_iolatency_init(struct request_queue *q);
+extern void blk_iolatency_exit(struct request_queue *q);
+extern void blk_iolatency_bio(struct request_queue *q, struct bio *bio);
+#else
+static inline int blk_iolatency_init(struct request_queue *q) { return 0; }
+static inline void blk_iolatency_exit(struct request_queue *q) { }
+static inline void blk_iolatency_bio(struct request_queue *q, struct bio *bio)
+{
+}
+#endif
+
 #endif
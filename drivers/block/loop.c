@@ -74,6 +74,8 @@
 #include <linux/gfp.h>
 #include <linux/kthread.h>
 #include <linux/splice.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
 
 #include <asm/uaccess.h>
 
@@ -505,6 +507,359 @@ out:
 	return ret;
 }
 
+/*
+ * Direct I/O mode
+ *
+ * With LO_FLAGS_DIRECT_IO the data does not go through loop_thread and
+ * the page cache of the backing file.  The blocks of the file are mapped
+ * once with bmap(), and each bio is remapped onto the device the file
+ * lives on, split where the file is fragmented.  Many bios are in flight
+ * at once, a loop bio completes when the last of its clones does.  Only
+ * barriers still go through loop_thread, which waits for the bios
+ * submitted before them; bios submitted while a barrier is queued are
+ * queued behind it.
+ *
+ * The file must be fully allocated, and is marked S_SWAPFILE while the
+ * mode is on so that it cannot be truncated.
+ */
+struct loop_dio {
+	struct loop_device	*lo;
+	struct bio		*bio;
+	atomic_t		remaining;
+	int			error;
+	int			epoch;
+	struct completion	*wait;	/* set for synchronous barrier data */
+};
+
+#define LOOP_DIO_POOL_SIZE	64
+
+static mempool_t *loop_dio_pool;
+static struct bio_set *loop_bio_set;
+
+static void loop_unpin_backing(struct inode *inode)
+{
+	mutex_lock(&inode->i_mutex);
+	inode->i_flags &= ~S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+}
+
+static int loop_map_backing(struct loop_device *lo)
+{
+	struct inode *inode = lo->lo_backing_file->f_mapping->host;
+	struct loop_extent *ext = NULL, *new;
+	unsigned int nr = 0, max = 0;
+	sector_t blk, nr_blocks, disk;
+
+	if (S_ISBLK(inode->i_mode)) {
+		ext = vmalloc(sizeof(*ext));
+		if (!ext)
+			return -ENOMEM;
+		ext->start = 0;
+		ext->disk = 0;
+		ext->len = i_size_read(inode) >> 9;
+		lo->lo_dio_bdev = inode->i_bdev;
+		lo->lo_blkbits = 9;
+		nr = 1;
+		goto out;
+	}
+
+	if (!inode->i_mapping->a_ops->bmap || !inode->i_sb->s_bdev ||
+	    (inode->i_sb->s_type->fs_flags & FS_UNSTABLE_BMAP))
+		return -EINVAL;
+
+	/* pinned like a swap file until loop_unmap_backing() */
+	mutex_lock(&inode->i_mutex);
+	if (IS_SWAPFILE(inode)) {
+		mutex_unlock(&inode->i_mutex);
+		return -EBUSY;
+	}
+	inode->i_flags |= S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+
+	nr_blocks = (i_size_read(inode) + (1 << inode->i_blkbits) - 1) >>
+			inode->i_blkbits;
+	for (blk = 0; blk < nr_blocks; blk++) {
+		disk = bmap(inode, blk);
+		if (!disk) {
+			/* a hole, there is nothing to write to */
+			vfree(ext);
+			loop_unpin_backing(inode);
+			return -EINVAL;
+		}
+		if (nr && ext[nr - 1].start + ext[nr - 1].len == blk &&
+		    ext[nr - 1].disk + ext[nr - 1].len == disk) {
+			ext[nr - 1].len++;
+			continue;
+		}
+		if (nr == max) {
+			max = max ? max * 2 : 64;
+			new = vmalloc(max * sizeof(*ext));
+			if (!new) {
+				vfree(ext);
+				loop_unpin_backing(inode);
+				return -ENOMEM;
+			}
+			if (ext)
+				memcpy(new, ext, nr * sizeof(*ext));
+			vfree(ext);
+			ext = new;
+		}
+		ext[nr].start = blk;
+		ext[nr].disk = disk;
+		ext[nr].len = 1;
+		nr++;
+		cond_resched();
+	}
+	lo->lo_dio_bdev = inode->i_sb->s_bdev;
+	lo->lo_blkbits = inode->i_blkbits;
+out:
+	lo->lo_extents = ext;
+	lo->lo_nr_extents = nr;
+	return 0;
+}
+
+/* @file is the backing file that was mapped */
+static void loop_unmap_backing(struct loop_device *lo, struct file *file)
+{
+	struct inode *inode = file->f_mapping->host;
+
+	if (lo->lo_extents && S_ISREG(inode->i_mode))
+		loop_unpin_backing(inode);
+	vfree(lo->lo_extents);
+	lo->lo_extents = NULL;
+	lo->lo_nr_extents = 0;
+	lo->lo_dio_bdev = NULL;
+}
+
+static struct loop_extent *loop_find_extent(struct loop_device *lo,
+					    sector_t blk)
+{
+	unsigned int l = 0, r = lo->lo_nr_extents, mid;
+	struct loop_extent *ext;
+
+	while (l < r) {
+		mid = l + (r - l) / 2;
+		ext = &lo->lo_extents[mid];
+		if (blk < ext->start)
+			r = mid;
+		else if (blk >= ext->start + ext->len)
+			l = mid + 1;
+		else
+			return ext;
+	}
+	return NULL;
+}
+
+/*
+ * Account a bio to the current epoch, called with lo_lock held.
+ */
+static int loop_dio_get(struct loop_device *lo)
+{
+	atomic_inc(&lo->lo_dio_inflight[lo->lo_dio_epoch]);
+	return lo->lo_dio_epoch;
+}
+
+static void loop_dio_put(struct loop_dio *dio)
+{
+	struct loop_device *lo = dio->lo;
+	int epoch = dio->epoch;
+
+	if (!atomic_dec_and_test(&dio->remaining))
+		return;
+
+	if (dio->wait) {
+		complete(dio->wait);
+	} else {
+		bio_endio(dio->bio, dio->error);
+		mempool_free(dio, loop_dio_pool);
+	}
+	if (atomic_dec_and_test(&lo->lo_dio_inflight[epoch]))
+		wake_up(&lo->lo_dio_wait);
+}
+
+static void loop_dio_end_io(struct bio *clone, int error)
+{
+	struct loop_dio *dio = clone->bi_private;
+
+	if (error)
+		dio->error = error;
+	bio_put(clone);
+	loop_dio_put(dio);
+}
+
+static void loop_bio_destructor(struct bio *bio)
+{
+	bio_free(bio, loop_bio_set);
+}
+
+static struct bio *loop_dio_clone(struct loop_dio *dio, sector_t sector,
+				  unsigned int nr_vecs)
+{
+	struct bio *clone;
+
+	clone = bio_alloc_bioset(GFP_NOIO, min_t(unsigned int, nr_vecs,
+						 BIO_MAX_PAGES), loop_bio_set);
+	clone->bi_destructor = loop_bio_destructor;
+	clone->bi_bdev = dio->lo->lo_dio_bdev;
+	clone->bi_sector = sector;
+	clone->bi_rw = dio->bio->bi_rw & ~(1 << BIO_RW_BARRIER);
+	clone->bi_end_io = loop_dio_end_io;
+	clone->bi_private = dio;
+	return clone;
+}
+
+static void loop_dio_issue(struct loop_dio *dio, struct bio *clone)
+{
+	atomic_inc(&dio->remaining);
+	generic_make_request(clone);
+}
+
+/*
+ * Remap the pages of a loop bio onto the blocks of the backing file.
+ * Consumes the reference @dio was set up with.
+ */
+static void loop_dio_submit(struct loop_dio *dio)
+{
+	struct loop_device *lo = dio->lo;
+	struct bio *bio = dio->bio;
+	unsigned int shift = lo->lo_blkbits - 9;
+	sector_t pos = (lo->lo_offset >> 9) + bio->bi_sector;
+	struct loop_extent *ext = NULL;
+	struct bio *clone = NULL;
+	struct bio_vec *bvec;
+	unsigned int off, left, len;
+	sector_t blk, disk, end;
+	int i;
+
+	bio_for_each_segment(bvec, bio, i) {
+		off = bvec->bv_offset;
+		left = bvec->bv_len;
+		if (left & 511) {
+			dio->error = -EIO;
+			goto out;
+		}
+		while (left) {
+			blk = pos >> shift;
+			if (!ext || blk < ext->start ||
+			    blk >= ext->start + ext->len) {
+				ext = loop_find_extent(lo, blk);
+				if (!ext) {
+					dio->error = -EIO;
+					goto out;
+				}
+			}
+			disk = ((ext->disk + blk - ext->start) << shift) +
+				(pos & ((1 << shift) - 1));
+			end = (ext->start + ext->len) << shift;
+			len = min_t(sector_t, left >> 9, end - pos) << 9;
+
+			if (!clone ||
+			    disk != clone->bi_sector + (clone->bi_size >> 9) ||
+			    bio_add_page(clone, bvec->bv_page, len, off) < len) {
+				if (clone)
+					loop_dio_issue(dio, clone);
+				clone = loop_dio_clone(dio, disk, bio->bi_vcnt - i);
+				if (bio_add_page(clone, bvec->bv_page, len, off) < len) {
+					bio_put(clone);
+					clone = NULL;
+					dio->error = -EIO;
+					goto out;
+				}
+			}
+			pos += len >> 9;
+			off += len;
+			left -= len;
+		}
+	}
+out:
+	if (clone)
+		loop_dio_issue(dio, clone);
+	loop_dio_put(dio);
+}
+
+static void loop_dio_start(struct loop_device *lo, struct bio *bio, int epoch)
+{
+	struct loop_dio *dio = mempool_alloc(loop_dio_pool, GFP_NOIO);
+
+	dio->lo = lo;
+	dio->bio = bio;
+	atomic_set(&dio->remaining, 1);
+	dio->error = 0;
+	dio->epoch = epoch;
+	dio->wait = NULL;
+	loop_dio_submit(dio);
+}
+
+static int loop_dio_flush(struct loop_device *lo)
+{
+	int err = blkdev_issue_flush(lo->lo_dio_bdev, NULL);
+
+	return err == -EOPNOTSUPP ? 0 : err;
+}
+
+/*
+ * Barriers are handled by loop_thread: wait for the bios submitted before
+ * the barrier, then flush, write the barrier's data and flush again.
+ */
+static int loop_dio_barrier(struct loop_device *lo, struct bio *bio)
+{
+	DECLARE_COMPLETION_ONSTACK(wait);
+	struct loop_dio dio;
+	int old, err;
+
+	spin_lock_irq(&lo->lo_lock);
+	old = lo->lo_dio_epoch;
+	lo->lo_dio_epoch ^= 1;
+	spin_unlock_irq(&lo->lo_lock);
+
+	wait_event(lo->lo_dio_wait, !atomic_read(&lo->lo_dio_inflight[old]));
+
+	err = loop_dio_flush(lo);
+	if (err || !bio->bi_size)
+		return err;
+
+	spin_lock_irq(&lo->lo_lock);
+	dio.epoch = loop_dio_get(lo);
+	spin_unlock_irq(&lo->lo_lock);
+	dio.lo = lo;
+	dio.bio = bio;
+	atomic_set(&dio.remaining, 1);
+	dio.error = 0;
+	dio.wait = &wait;
+	loop_dio_submit(&dio);
+	wait_for_completion(&wait);
+
+	err = dio.error;
+	if (!err)
+		err = loop_dio_flush(lo);
+	return err;
+}
+
+/*
+ * Turn direct I/O mode on or off from loop_thread, once the bios queued
+ * before have been handled.  Turning it on writes back and drops the page
+ * cache of the backing file, turning it off waits for the bios in flight.
+ */
+static void loop_switch_direct_io(struct loop_device *lo, int on)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+
+	if (on) {
+		filemap_write_and_wait(mapping);
+		invalidate_inode_pages2(mapping);
+		spin_lock_irq(&lo->lo_lock);
+		lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+		spin_unlock_irq(&lo->lo_lock);
+	} else {
+		spin_lock_irq(&lo->lo_lock);
+		lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+		spin_unlock_irq(&lo->lo_lock);
+		wait_event(lo->lo_dio_wait,
+			   !atomic_read(&lo->lo_dio_inflight[0]) &&
+			   !atomic_read(&lo->lo_dio_inflight[1]));
+	}
+}
+
 /*
  * Add bio to back of pending list
  */
@@ -536,6 +891,16 @@ static int loop_make_request(struct request_queue *q, struct bio *old_bio)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
+	if (bio_rw_flagged(old_bio, BIO_RW_BARRIER))
+		lo->lo_dio_barriers++;
+	else if ((lo->lo_flags & LO_FLAGS_DIRECT_IO) &&
+		 !lo->lo_dio_barriers) {
+		int epoch = loop_dio_get(lo);
+
+		spin_unlock_irq(&lo->lo_lock);
+		loop_dio_start(lo, old_bio, epoch);
+		return 0;
+	}
 	loop_add_bio(lo, old_bio);
 	wake_up(&lo->lo_event);
 	spin_unlock_irq(&lo->lo_lock);
@@ -560,6 +925,7 @@ static void loop_unplug(struct request_queue *q)
 
 struct switch_request {
 	struct file *file;
+	int direct_io;		/* 0 or 1 to switch direct I/O mode, else -1 */
 	struct completion wait;
 };
 
@@ -567,13 +933,36 @@ static void do_loop_switch(struct loop_device *, struct switch_request *);
 
 static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 {
+	int barrier = bio->bi_bdev && bio_rw_flagged(bio, BIO_RW_BARRIER);
+
 	if (unlikely(!bio->bi_bdev)) {
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
+	} else if (lo->lo_flags & LO_FLAGS_DIRECT_IO) {
+		/*
+		 * Barriers, bios queued behind them, and bios queued before
+		 * the mode was turned on.
+		 */
+		if (barrier) {
+			bio_endio(bio, loop_dio_barrier(lo, bio));
+		} else {
+			int epoch;
+
+			spin_lock_irq(&lo->lo_lock);
+			epoch = loop_dio_get(lo);
+			spin_unlock_irq(&lo->lo_lock);
+			loop_dio_start(lo, bio, epoch);
+		}
 	} else {
 		int ret = do_bio_filebacked(lo, bio);
 		bio_endio(bio, ret);
 	}
+
+	if (barrier) {
+		spin_lock_irq(&lo->lo_lock);
+		lo->lo_dio_barriers--;
+		spin_unlock_irq(&lo->lo_lock);
+	}
 }
 
 /*
@@ -619,7 +1008,8 @@ static int loop_thread(void *data)
  * First it needs to flush existing IO, it does this by sending a magic
  * BIO down the pipe. The completion of this BIO does the actual switch.
  */
-static int loop_switch(struct loop_device *lo, struct file *file)
+static int __loop_switch(struct loop_device *lo, struct file *file,
+			 int direct_io)
 {
 	struct switch_request w;
 	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
@@ -627,6 +1017,7 @@ static int loop_switch(struct loop_device *lo, struct file *file)
 		return -ENOMEM;
 	init_completion(&w.wait);
 	w.file = file;
+	w.direct_io = direct_io;
 	bio->bi_private = &w;
 	bio->bi_bdev = NULL;
 	loop_make_request(lo->lo_queue, bio);
@@ -634,6 +1025,11 @@ static int loop_switch(struct loop_device *lo, struct file *file)
 	return 0;
 }
 
+static int loop_switch(struct loop_device *lo, struct file *file)
+{
+	return __loop_switch(lo, file, -1);
+}
+
 /*
  * Helper to flush the IOs in loop, but keeping loop thread running
  */
@@ -655,6 +1051,9 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 	struct file *old_file = lo->lo_backing_file;
 	struct address_space *mapping;
 
+	if (p->direct_io >= 0)
+		loop_switch_direct_io(lo, p->direct_io);
+
 	/* if no new file, only flush of queued bios requested */
 	if (!file)
 		goto out;
@@ -712,11 +1111,12 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	if (get_loop_size(lo, file) != get_loop_size(lo, old_file))
 		goto out_putf;
 
-	/* and ... switch */
-	error = loop_switch(lo, file);
+	/* and ... switch, the blocks of the new file are not mapped */
+	error = __loop_switch(lo, file, 0);
 	if (error)
 		goto out_putf;
 
+	loop_unmap_backing(lo, old_file);
 	fput(old_file);
 	if (max_part > 0)
 		ioctl_by_bdev(bdev, BLKRRPART, 0);
@@ -728,6 +1128,58 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	return error;
 }
 
+static int loop_clear_direct_io(struct loop_device *lo)
+{
+	int error;
+
+	if (!(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return 0;
+
+	error = __loop_switch(lo, NULL, 0);
+	if (!error)
+		loop_unmap_backing(lo, lo->lo_backing_file);
+	return error;
+}
+
+/*
+ * LOOP_SET_DIRECT_IO turns direct I/O to the blocks of the backing file on
+ * or off.  Changing the offset, size limit, encryption or capacity turns
+ * it off again.
+ */
+static int loop_set_direct_io(struct loop_device *lo, unsigned long arg)
+{
+	unsigned short bsize;
+	int error;
+
+	if (lo->lo_state != Lo_bound)
+		return -ENXIO;
+	if (!arg == !(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return 0;
+	if (!arg)
+		return loop_clear_direct_io(lo);
+
+	if (lo->lo_encryption)
+		return -EINVAL;
+	error = loop_map_backing(lo);
+	if (error)
+		return error;
+
+	error = -EINVAL;
+	bsize = bdev_logical_block_size(lo->lo_dio_bdev);
+	if (lo->lo_offset & (bsize - 1))
+		goto out_unmap;
+	blk_queue_logical_block_size(lo->lo_queue, bsize);
+
+	error = __loop_switch(lo, NULL, 1);
+	if (error)
+		goto out_unmap;
+	return 0;
+
+out_unmap:
+	loop_unmap_backing(lo, lo->lo_backing_file);
+	return error;
+}
+
 static inline int is_loop_device(struct file *file)
 {
 	struct inode *i = file->f_mapping->host;
@@ -924,6 +1376,14 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 
 	kthread_stop(lo->lo_thread);
 
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO) {
+		wait_event(lo->lo_dio_wait,
+			   !atomic_read(&lo->lo_dio_inflight[0]) &&
+			   !atomic_read(&lo->lo_dio_inflight[1]));
+		loop_unmap_backing(lo, filp);
+		blk_queue_logical_block_size(lo->lo_queue, 512);
+	}
+
 	lo->lo_queue->unplug_fn = NULL;
 	lo->lo_backing_file = NULL;
 
@@ -978,6 +1438,14 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
 
+	if (lo->lo_offset != info->lo_offset ||
+	    lo->lo_sizelimit != info->lo_sizelimit ||
+	    info->lo_encrypt_type) {
+		err = loop_clear_direct_io(lo);
+		if (err)
+			return err;
+	}
+
 	err = loop_release_xfer(lo);
 	if (err)
 		return err;
@@ -1179,6 +1647,9 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	err = -ENXIO;
 	if (unlikely(lo->lo_state != Lo_bound))
 		goto out;
+	err = loop_clear_direct_io(lo);
+	if (unlikely(err))
+		goto out;
 	err = figure_loop_size(lo);
 	if (unlikely(err))
 		goto out;
@@ -1231,6 +1702,11 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
 			err = loop_set_capacity(lo, bdev);
 		break;
+	case LOOP_SET_DIRECT_IO:
+		err = -EPERM;
+		if (capable(CAP_SYS_ADMIN))
+			err = loop_set_direct_io(lo, arg);
+		break;
 	default:
 		err = lo->ioctl ? lo->ioctl(lo, cmd, arg) : -EINVAL;
 	}
@@ -1385,6 +1861,7 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 		arg = (unsigned long) compat_ptr(arg);
 	case LOOP_SET_FD:
 	case LOOP_CHANGE_FD:
+	case LOOP_SET_DIRECT_IO:
 		err = lo_ioctl(bdev, mode, cmd, arg);
 		break;
 	default:
@@ -1516,6 +1993,7 @@ static struct loop_device *loop_alloc(int i)
 	lo->lo_number		= i;
 	lo->lo_thread		= NULL;
 	init_waitqueue_head(&lo->lo_event);
+	init_waitqueue_head(&lo->lo_dio_wait);
 	spin_lock_init(&lo->lo_lock);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
@@ -1614,8 +2092,19 @@ static int __init loop_init(void)
 		range = 1UL << (MINORBITS - part_shift);
 	}
 
-	if (register_blkdev(LOOP_MAJOR, "loop"))
+	loop_dio_pool = mempool_create_kmalloc_pool(LOOP_DIO_POOL_SIZE,
+						    sizeof(struct loop_dio));
+	if (!loop_dio_pool)
+		return -ENOMEM;
+	loop_bio_set = bioset_create(LOOP_DIO_POOL_SIZE, 0);
+	if (!loop_bio_set)
+		goto out_pool;
+
+	if (register_blkdev(LOOP_MAJOR, "loop")) {
+		bioset_free(loop_bio_set);
+		mempool_destroy(loop_dio_pool);
 		return -EIO;
+	}
 
 	for (i = 0; i < nr; i++) {
 		lo = loop_alloc(i);
@@ -1642,6 +2131,9 @@ Enomem:
 		loop_free(lo);
 
 	unregister_blkdev(LOOP_MAJOR, "loop");
+	bioset_free(loop_bio_set);
+out_pool:
+	mempool_destroy(loop_dio_pool);
 	return -ENOMEM;
 }
 
@@ -1657,6 +2149,8 @@ static void __exit loop_exit(void)
 
 	blk_unregister_region(MKDEV(LOOP_MAJOR, 0), range);
 	unregister_blkdev(LOOP_MAJOR, "loop");
+	bioset_free(loop_bio_set);
+	mempool_destroy(loop_dio_pool);
 }
 
 module_init(loop_init);
@@ -0,0 +1,391 @@
+/*
+ * Null block device
+ *
+ * A block device that completes every request without moving any data.
+ * It is meant for measuring the overhead of the block layer itself, and
+ * can be driven through the bio interface, the request_fn interface or
+ * blk-mq, with requests completed inline or from a per-cpu hrtimer.
+ *
+ * See Documentation/block/null_blk.txt for the module parameters.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/interrupt.h>
+
+enum {
+	NULL_Q_BIO	= 0,
+	NULL_Q_RQ	= 1,
+	NULL_Q_MQ	= 2,
+};
+
+enum {
+	NULL_IRQ_NONE	= 0,
+	NULL_IRQ_TIMER	= 1,
+};
+
+struct nullb {
+	struct list_head list;
+	unsigned int index;
+	struct request_queue *q;
+	struct gendisk *disk;
+	spinlock_t lock;
+};
+
+/*
+ * Per request data of blk-mq requests
+ */
+struct nullb_cmd {
+	ktime_t deadline;	/* when the request is due with irqmode=1 */
+};
+
+/*
+ * Requests and bios waiting for the completion timer of one CPU
+ */
+struct completion_queue {
+	struct list_head rqs;
+	struct bio_list bios;
+	struct hrtimer timer;
+};
+
+static DEFINE_PER_CPU(struct completion_queue, completion_queues);
+
+static LIST_HEAD(nullb_list);
+static int null_major;
+
+static int queue_mode = NULL_Q_MQ;
+module_param(queue_mode, int, S_IRUGO);
+MODULE_PARM_DESC(queue_mode, "Block interface: 0 bio, 1 request_fn, 2 blk-mq");
+
+static unsigned int submit_queues = 1;
+module_param(submit_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(submit_queues, "Number of blk-mq hardware queues");
+
+static unsigned int hw_queue_depth = 64;
+module_param(hw_queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Queue depth of each blk-mq hardware queue");
+
+static int irqmode = NULL_IRQ_NONE;
+module_param(irqmode, int, S_IRUGO);
+MODULE_PARM_DESC(irqmode, "Completion: 0 inline, 1 from a per-cpu hrtimer");
+
+static unsigned long completion_nsec = 10000;
+module_param(completion_nsec, ulong, S_IRUGO);
+MODULE_PARM_DESC(completion_nsec, "Completion delay in ns for irqmode=1");
+
+static unsigned int gb = 250;
+module_param(gb, uint, S_IRUGO);
+MODULE_PARM_DESC(gb, "Size of each device in GB");
+
+static unsigned int bs = 512;
+module_param(bs, uint, S_IRUGO);
+MODULE_PARM_DESC(bs, "Logical block size in bytes");
+
+static unsigned int nr_devices = 2;
+module_param(nr_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of devices to create");
+
+static void null_end_request(struct request *rq)
+{
+	if (queue_mode == NULL_Q_MQ)
+		blk_mq_end_io(rq, 0);
+	else
+		blk_end_request_all(rq, 0);
+}
+
+static enum hrtimer_restart null_timer_fn(struct hrtimer *timer)
+{
+	struct completion_queue *cq;
+	struct request *rq, *tmp;
+	struct bio_list bios;
+	struct bio *bio;
+	LIST_HEAD(rqs);
+
+	/* hrtimers run with interrupts off, nothing else touches cq */
+	cq = container_of(timer, struct completion_queue, timer);
+	list_splice_init(&cq->rqs, &rqs);
+	bios = cq->bios;
+	bio_list_init(&cq->bios);
+
+	list_for_each_entry_safe(rq, tmp, &rqs, queuelist) {
+		list_del_init(&rq->queuelist);
+		null_end_request(rq);
+	}
+	while ((bio = bio_list_pop(&bios)))
+		bio_endio(bio, 0);
+
+	return HRTIMER_NORESTART;
+}
+
+static void null_arm_timer(struct completion_queue *cq)
+{
+	hrtimer_start(&cq->timer, ktime_set(0, completion_nsec),
+		      HRTIMER_MODE_REL_PINNED);
+}
+
+static void null_timer_request(struct request *rq)
+{
+	struct completion_queue *cq;
+	unsigned long flags;
+
+	if (queue_mode == NULL_Q_MQ) {
+		struct nullb_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+		cmd->deadline = ktime_add_ns(ktime_get(), completion_nsec);
+	}
+
+	local_irq_save(flags);
+	cq = &__get_cpu_var(completion_queues);
+	if (list_empty(&cq->rqs) && bio_list_empty(&cq->bios))
+		null_arm_timer(cq);
+	list_add_tail(&rq->queuelist, &cq->rqs);
+	local_irq_restore(flags);
+}
+
+static void null_timer_bio(struct bio *bio)
+{
+	struct completion_queue *cq;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cq = &__get_cpu_var(completion_queues);
+	if (list_empty(&cq->rqs) && bio_list_empty(&cq->bios))
+		null_arm_timer(cq);
+	bio_list_add(&cq->bios, bio);
+	local_irq_restore(flags);
+}
+
+static int null_make_request(struct request_queue *q, struct bio *bio)
+{
+	if (irqmode == NULL_IRQ_TIMER)
+		null_timer_bio(bio);
+	else
+		bio_endio(bio, 0);
+	return 0;
+}
+
+static void null_request_fn(struct request_queue *q)
+{
+	struct request *rq;
+
+	while ((rq = blk_fetch_request(q)) != NULL) {
+		if (irqmode == NULL_IRQ_TIMER)
+			null_timer_request(rq);
+		else
+			__blk_end_request_all(rq, 0);
+	}
+}
+
+static int null_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *rq,
+			 bool last)
+{
+	if (irqmode == NULL_IRQ_TIMER)
+		null_timer_request(rq);
+	else
+		blk_mq_end_io(rq, 0);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+/*
+ * Complete the requests of this CPU that are due, before the timer gets
+ * to them.  The polling task normally runs where it submitted its I/O,
+ * requests queued on other CPUs are left to their timers.
+ */
+static int null_poll(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	struct completion_queue *cq;
+	struct request *rq, *tmp;
+	struct nullb_cmd *cmd;
+	unsigned long flags;
+	ktime_t now;
+	LIST_HEAD(done);
+	int nr = 0;
+
+	if (irqmode != NULL_IRQ_TIMER)
+		return -1;
+
+	now = ktime_get();
+	local_irq_save(flags);
+	cq = &__get_cpu_var(completion_queues);
+	list_for_each_entry_safe(rq, tmp, &cq->rqs, queuelist) {
+		cmd = blk_mq_rq_to_pdu(rq);
+		if (ktime_to_ns(ktime_sub(cmd->deadline, now)) > 0)
+			break;
+		list_move_tail(&rq->queuelist, &done);
+	}
+	local_irq_restore(flags);
+
+	list_for_each_entry_safe(rq, tmp, &done, queuelist) {
+		list_del_init(&rq->queuelist);
+		blk_mq_end_io(rq, 0);
+		nr++;
+	}
+	return nr;
+}
+
+static struct blk_mq_ops null_mq_ops = {
+	.queue_rq	= null_queue_rq,
+	.poll		= null_poll,
+};
+
+static struct blk_mq_reg null_mq_reg = {
+	.ops		= &null_mq_ops,
+	.cmd_size	= sizeof(struct nullb_cmd),
+	.numa_node	= -1,
+	.flags		= BLK_MQ_F_SHOULD_MERGE,
+};
+
+static struct block_device_operations null_fops = {
+	.owner		= THIS_MODULE,
+};
+
+static int __init null_add_dev(unsigned int index)
+{
+	struct nullb *nullb;
+	struct gendisk *disk;
+
+	nullb = kzalloc(sizeof(*nullb), GFP_KERNEL);
+	if (!nullb)
+		goto out;
+	nullb->index = index;
+	spin_lock_init(&nullb->lock);
+
+	switch (queue_mode) {
+	case NULL_Q_MQ:
+		null_mq_reg.nr_hw_queues = submit_queues;
+		null_mq_reg.queue_depth = hw_queue_depth;
+		nullb->q = blk_mq_init_queue(&null_mq_reg, nullb);
+		break;
+	case NULL_Q_RQ:
+		nullb->q = blk_init_queue(null_request_fn, &nullb->lock);
+		break;
+	default:
+		nullb->q = blk_alloc_queue(GFP_KERNEL);
+		if (nullb->q)
+			blk_queue_make_request(nullb->q, null_make_request);
+		break;
+	}
+	if (!nullb->q)
+		goto out_free_nullb;
+
+	nullb->q->queuedata = nullb;
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, nullb->q);
+	blk_queue_logical_block_size(nullb->q, bs);
+	blk_queue_physical_block_size(nullb->q, bs);
+
+	disk = nullb->disk = alloc_disk(1);
+	if (!disk)
+		goto out_cleanup_queue;
+
+	disk->major		= null_major;
+	disk->first_minor	= index;
+	disk->fops		= &null_fops;
+	disk->private_data	= nullb;
+	disk->queue		= nullb->q;
+	sprintf(disk->disk_name, "nullb%d", index);
+	set_capacity(disk, (sector_t)gb << (30 - 9));
+
+	list_add_tail(&nullb->list, &nullb_list);
+	add_disk(disk);
+	return 0;
+
+out_cleanup_queue:
+	blk_cleanup_queue(nullb->q);
+out_free_nullb:
+	kfree(nullb);
+out:
+	return -ENOMEM;
+}
+
+static void null_del_dev(struct nullb *nullb)
+{
+	list_del(&nullb->list);
+	del_gendisk(nullb->disk);
+	blk_cleanup_queue(nullb->q);
+	put_disk(nullb->disk);
+	kfree(nullb);
+}
+
+static void null_cancel_timers(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(&per_cpu(completion_queues, cpu).timer);
+}
+
+static int __init null_init(void)
+{
+	struct nullb *nullb, *next;
+	unsigned int i;
+	int cpu;
+
+	if (queue_mode < NULL_Q_BIO || queue_mode > NULL_Q_MQ) {
+		printk(KERN_ERR "null_blk: invalid queue_mode %d\n", queue_mode);
+		return -EINVAL;
+	}
+	if (bs < 512 || bs > PAGE_SIZE || !is_power_of_2(bs)) {
+		printk(KERN_ERR "null_blk: invalid block size %u\n", bs);
+		return -EINVAL;
+	}
+	if (queue_mode == NULL_Q_MQ) {
+		submit_queues = clamp_t(unsigned int, submit_queues, 1,
+					nr_cpu_ids);
+		hw_queue_depth = clamp_t(unsigned int, hw_queue_depth, 1,
+					 BLK_MQ_MAX_DEPTH);
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct completion_queue *cq = &per_cpu(completion_queues, cpu);
+
+		INIT_LIST_HEAD(&cq->rqs);
+		bio_list_init(&cq->bios);
+		hrtimer_init(&cq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		cq->timer.function = null_timer_fn;
+	}
+
+	null_major = register_blkdev(0, "nullb");
+	if (null_major < 0)
+		return null_major;
+
+	for (i = 0; i < nr_devices; i++) {
+		if (null_add_dev(i)) {
+			list_for_each_entry_safe(nullb, next, &nullb_list, list)
+				null_del_dev(nullb);
+			unregister_blkdev(null_major, "nullb");
+			return -ENOMEM;
+		}
+	}
+
+	printk(KERN_INFO "null_blk: %u devices, queue_mode %d, irqmode %d\n",
+	       nr_devices, queue_mode, irqmode);
+	return 0;
+}
+
+static void __exit null_exit(void)
+{
+	struct nullb *nullb, *next;
+
+	list_for_each_entry_safe(nullb, next, &nullb_list, list)
+		null_del_dev(nullb);
+	unregister_blkdev(null_major, "nullb");
+	null_cancel_timers();
+}
+
+module_init(null_init);
+module_exit(null_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Null block device for block layer benchmarking");
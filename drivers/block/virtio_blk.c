@@ -1,6 +1,7 @@
 //#define DEBUG
 #include <linux/spinlock.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/hdreg.h>
 #include <linux/virtio.h>
 #include <linux/virtio_blk.h>
@@ -20,11 +21,6 @@ struct virtio_blk
 	/* The disk structure for the kernel. */
 	struct gendisk *disk;
 
-	/* Request tracking. */
-	struct list_head reqs;
-
-	mempool_t *pool;
-
 	/* What host tells us, plus 2 for header & tailer. */
 	unsigned int sg_elems;
 
@@ -32,9 +28,9 @@ struct virtio_blk
 	struct scatterlist sg[/*sg_elems*/];
 };
 
+/* Lives behind each request of the queue, see blk_mq_rq_to_pdu() */
 struct virtblk_req
 {
-	struct list_head list;
 	struct request *req;
 	struct virtio_blk_outhdr out_hdr;
 	struct virtio_scsi_inhdr in_hdr;
@@ -47,6 +43,7 @@ static void blk_done(struct virtqueue *vq)
 	struct virtblk_req *vbr;
 	unsigned int len;
 	unsigned long flags;
+	bool req_done = false;
 
 	spin_lock_irqsave(&vblk->lock, flags);
 	while ((vbr = vblk->vq->vq_ops->get_buf(vblk->vq, &len)) != NULL) {
@@ -70,25 +67,21 @@ static void blk_done(struct virtqueue *vq)
 			vbr->req->errors = vbr->in_hdr.errors;
 		}
 
-		__blk_end_request_all(vbr->req, error);
-		list_del(&vbr->list);
-		mempool_free(vbr, vblk->pool);
+		blk_mq_end_io(vbr->req, error);
+		req_done = true;
 	}
-	/* In case queue is stopped waiting for more buffers. */
-	blk_start_queue(vblk->disk->queue);
 	spin_unlock_irqrestore(&vblk->lock, flags);
+
+	/* In case queue is stopped waiting for more buffers. */
+	if (req_done)
+		blk_mq_start_stopped_hw_queues(vblk->disk->queue);
 }
 
 static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		   struct request *req)
 {
 	unsigned long num, out = 0, in = 0;
-	struct virtblk_req *vbr;
-
-	vbr = mempool_alloc(vblk->pool, GFP_ATOMIC);
-	if (!vbr)
-		/* When another request finishes we'll try again. */
-		return false;
+	struct virtblk_req *vbr = blk_mq_rq_to_pdu(req);
 
 	vbr->req = req;
 	switch (req->cmd_type) {
@@ -150,36 +143,31 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	if (vblk->vq->vq_ops->add_buf(vblk->vq, vblk->sg, out, in, vbr) < 0) {
-		mempool_free(vbr, vblk->pool);
-		return false;
-	}
-
-	list_add_tail(&vbr->list, &vblk->reqs);
-	return true;
+	return vblk->vq->vq_ops->add_buf(vblk->vq, vblk->sg, out, in, vbr) >= 0;
 }
 
-static void do_virtblk_request(struct request_queue *q)
+static int virtblk_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *req,
+			    bool last)
 {
-	struct virtio_blk *vblk = q->queuedata;
-	struct request *req;
-	unsigned int issued = 0;
+	struct virtio_blk *vblk = hctx->driver_data;
+	unsigned long flags;
 
-	while ((req = blk_peek_request(q)) != NULL) {
-		BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
+	BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
 
-		/* If this request fails, stop queue and wait for something to
+	spin_lock_irqsave(&vblk->lock, flags);
+	if (!do_req(hctx->queue, vblk, req)) {
+		/* The ring is full: stop the queue and wait for something to
 		   finish to restart it. */
-		if (!do_req(q, vblk, req)) {
-			blk_stop_queue(q);
-			break;
-		}
-		blk_start_request(req);
-		issued++;
+		blk_mq_stop_hw_queue(hctx);
+		vblk->vq->vq_ops->kick(vblk->vq);
+		spin_unlock_irqrestore(&vblk->lock, flags);
+		return BLK_MQ_RQ_QUEUE_BUSY;
 	}
-
-	if (issued)
+	if (last)
 		vblk->vq->vq_ops->kick(vblk->vq);
+	spin_unlock_irqrestore(&vblk->lock, flags);
+
+	return BLK_MQ_RQ_QUEUE_OK;
 }
 
 static void virtblk_prepare_flush(struct request_queue *q, struct request *req)
@@ -235,6 +223,20 @@ static const struct block_device_operations virtblk_fops = {
 	.getgeo = virtblk_getgeo,
 };
 
+static struct blk_mq_ops virtio_mq_ops = {
+	.queue_rq	= virtblk_queue_rq,
+};
+
+/* One hardware queue, there is a single virtqueue for requests. */
+static struct blk_mq_reg virtio_mq_reg = {
+	.ops		= &virtio_mq_ops,
+	.nr_hw_queues	= 1,
+	.queue_depth	= 64,
+	.cmd_size	= sizeof(struct virtblk_req),
+	.numa_node	= -1,
+	.flags		= BLK_MQ_F_SHOULD_MERGE,
+};
+
 static int index_to_minor(int index)
 {
 	return index << PART_BITS;
@@ -267,7 +269,6 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 		goto out;
 	}
 
-	INIT_LIST_HEAD(&vblk->reqs);
 	spin_lock_init(&vblk->lock);
 	vblk->vdev = vdev;
 	vblk->sg_elems = sg_elems;
@@ -280,20 +281,14 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 		goto out_free_vblk;
 	}
 
-	vblk->pool = mempool_create_kmalloc_pool(1,sizeof(struct virtblk_req));
-	if (!vblk->pool) {
-		err = -ENOMEM;
-		goto out_free_vq;
-	}
-
 	/* FIXME: How many partitions?  How long is a piece of string? */
 	vblk->disk = alloc_disk(1 << PART_BITS);
 	if (!vblk->disk) {
 		err = -ENOMEM;
-		goto out_mempool;
+		goto out_free_vq;
 	}
 
-	vblk->disk->queue = blk_init_queue(do_virtblk_request, &vblk->lock);
+	vblk->disk->queue = blk_mq_init_queue(&virtio_mq_reg, vblk);
 	if (!vblk->disk->queue) {
 		err = -ENOMEM;
 		goto out_put_disk;
@@ -376,8 +371,6 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 
 out_put_disk:
 	put_disk(vblk->disk);
-out_mempool:
-	mempool_destroy(vblk->pool);
 out_free_vq:
 	vdev->config->del_vqs(vdev);
 out_free_vblk:
@@ -390,16 +383,12 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 {
 	struct virtio_blk *vblk = vdev->priv;
 
-	/* Nothing should be pending. */
-	BUG_ON(!list_empty(&vblk->reqs));
-
 	/* Stop all the virtqueues. */
 	vdev->config->reset(vdev);
 
 	del_gendisk(vblk->disk);
 	blk_cleanup_queue(vblk->disk->queue);
 	put_disk(vblk->disk);
-	mempool_destroy(vblk->pool);
 	vdev->config->del_vqs(vdev);
 	kfree(vblk);
 }
@@ -0,0 +1,1389 @@
+/*
+ * A target that keeps the frequently used blocks of a slow origin
+ * device on a fast cache device, caching writes in write-back mode.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/dm-io.h>
+#include <linux/dm-kcopyd.h>
+
+#include <linux/device-mapper.h>
+
+#define DM_MSG_PREFIX "cache"
+
+/*
+ * On-disk layout of the cache device:
+ *
+ *   sector 0		superblock
+ *   sectors 1..	one disk_entry per cache block
+ *   data_start..	the cache blocks, aligned to the block size
+ *
+ * An entry records which origin block a cache block holds and
+ * whether it is dirty.  The dirty bits on disk are only brought up
+ * to date when the target is suspended, which also marks the cache
+ * clean.  After a crash every valid block is treated as dirty and
+ * written back, so the entries only have to be kept current for
+ * changes of mapping, which are rare compared to writes.
+ */
+#define CACHE_MAGIC		0x64436143
+#define CACHE_VERSION		1
+
+struct disk_super {
+	__le32 magic;
+	__le32 version;
+	__le32 clean;
+	__le32 block_size;	/* in sectors */
+	__le64 nr_blocks;
+} __packed;
+
+struct disk_entry {
+	__le64 oblock;
+	__le32 flags;
+	__le32 pad;
+} __packed;
+
+#define DE_VALID		1
+#define DE_DIRTY		2
+
+#define ENTRIES_PER_SECTOR	((1 << SECTOR_SHIFT) / sizeof(struct disk_entry))
+
+/* Metadata is read and written in chunks of this many sectors */
+#define META_IO_SECTORS		128
+#define META_IO_PAGES		(META_IO_SECTORS >> (PAGE_SHIFT - SECTOR_SHIFT))
+
+#define CACHE_KCOPYD_PAGES	256
+#define MAX_MIGRATIONS		32
+#define ORIGIN_WRITE_BITS	10
+#define EVICTED_BITS		5
+
+#define DEFAULT_PROMOTE_THRESHOLD	4
+#define DEFAULT_DIRTY_PERCENT		50
+
+/* Blocks looked at when searching the LRU lists for an idle block */
+#define SCAN_LIMIT		8
+
+/*
+ * In-core state of one cache block.  A block is on exactly one of the
+ * free, clean or dirty lists, or on none while it is migrating.
+ */
+struct cache_block {
+	struct hlist_node hash;		/* by origin block */
+	struct list_head list;
+	sector_t oblock;
+	unsigned pending;		/* bios in flight to the cache device */
+	unsigned flags;
+	struct bio_list deferred;	/* bios waiting for a migration */
+
+	/* Old mapping of an evicted block, until it is invalid on disk */
+	struct hlist_node old_hash;
+	sector_t old_oblock;
+};
+
+#define CB_VALID		1	/* holds a copy of oblock */
+#define CB_PROMOTE		2	/* being filled from the origin */
+#define CB_WRITEBACK		4	/* being written back to the origin */
+#define CB_EVICTED		8	/* old entry must be invalidated first */
+#define CB_ERROR		16	/* the copy failed */
+
+struct cache_c {
+	struct dm_target *ti;
+	struct dm_dev *cache_dev;
+	struct dm_dev *origin_dev;
+
+	sector_t block_size;
+	unsigned block_shift;
+	unsigned long nr_blocks;
+	sector_t meta_sectors;
+	sector_t data_start;
+
+	spinlock_t lock;
+	struct cache_block *blocks;
+	struct hlist_head *hash;
+	unsigned hash_bits;
+	struct hlist_head evicted[1 << EVICTED_BITS];	/* by old_oblock */
+	struct list_head free;
+	struct list_head clean;		/* in LRU order */
+	struct list_head dirty;		/* in order of last write */
+	unsigned long *dirty_bits;	/* per cache block */
+	unsigned long *meta_dirty;	/* per metadata sector */
+	unsigned long nr_valid;
+	unsigned long nr_dirty;
+	unsigned long dirty_threshold;
+
+	/*
+	 * Access counts of uncached origin blocks, hashed.  Collisions
+	 * only make a block look hotter than it is.
+	 */
+	u8 *hits;
+	unsigned hits_bits;
+	unsigned long misses;
+
+	/*
+	 * Writes in flight to uncached origin blocks, hashed.  A block
+	 * is not promoted while one of them might still change it.
+	 */
+	unsigned origin_writes[1 << ORIGIN_WRITE_BITS];
+
+	unsigned promote_threshold;
+	unsigned dirty_percent;
+
+	struct list_head migrations;	/* blocks to start copying */
+	struct list_head completed;	/* migrations that finished */
+	struct bio_list deferred;	/* to be mapped again */
+	unsigned nr_migrations;
+	unsigned nr_writeback;
+	int quiesce;
+	int flushing;
+	int loaded;
+
+	struct workqueue_struct *wq;
+	struct work_struct worker;
+	struct delayed_work waker;
+	wait_queue_head_t migration_wait;
+
+	struct dm_io_client *io_client;
+	struct dm_kcopyd_client *kcopyd_client;
+	mempool_t *migration_pool;
+	struct mutex meta_lock;
+	void *meta_buf;
+
+	unsigned long read_hits;
+	unsigned long read_misses;
+	unsigned long write_hits;
+	unsigned long write_misses;
+	unsigned long promotions;
+	unsigned long writebacks;
+};
+
+struct dm_cache_migration {
+	struct list_head list;
+	struct cache_c *c;
+	struct cache_block *cb;
+	int error;
+};
+
+static struct kmem_cache *migration_cache;
+
+/*
+ * map_info->ll of a bio that went to the cache device holds the cache
+ * block, that of a write to the origin the origin block.
+ */
+#define MAP_CACHE		(1ULL << 63)
+#define MAP_ORIGIN_WRITE	(1ULL << 62)
+#define MAP_MASK		(MAP_ORIGIN_WRITE - 1)
+
+static sector_t get_dev_size(struct block_device *bdev)
+{
+	return i_size_read(bdev->bd_inode) >> SECTOR_SHIFT;
+}
+
+static unsigned long block_index(struct cache_c *c, struct cache_block *cb)
+{
+	return cb - c->blocks;
+}
+
+static sector_t origin_blocks(struct cache_c *c)
+{
+	return (c->ti->len + c->block_size - 1) >> c->block_shift;
+}
+
+/*-----------------------------------------------------------------
+ * Lookup, LRU and promotion decisions.  All under c->lock.
+ *---------------------------------------------------------------*/
+static struct hlist_head *hash_bucket(struct cache_c *c, sector_t oblock)
+{
+	return c->hash + hash_long((unsigned long) oblock, c->hash_bits);
+}
+
+static struct cache_block *lookup_block(struct cache_c *c, sector_t oblock)
+{
+	struct cache_block *cb;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(cb, n, hash_bucket(c, oblock), hash)
+		if (cb->oblock == oblock)
+			return cb;
+
+	return NULL;
+}
+
+/*
+ * A clean block that was evicted for a promotion still holds its old
+ * origin block until its entry has been invalidated on disk.
+ */
+static struct cache_block *lookup_evicted(struct cache_c *c, sector_t oblock)
+{
+	struct cache_block *cb;
+	struct hlist_node *n;
+	struct hlist_head *head;
+
+	head = c->evicted + hash_long((unsigned long) oblock, EVICTED_BITS);
+	hlist_for_each_entry(cb, n, head, old_hash)
+		if (cb->old_oblock == oblock)
+			return cb;
+
+	return NULL;
+}
+
+static unsigned *origin_write_count(struct cache_c *c, sector_t oblock)
+{
+	return c->origin_writes +
+	       hash_long((unsigned long) oblock, ORIGIN_WRITE_BITS);
+}
+
+static void mark_meta_dirty(struct cache_c *c, unsigned long index)
+{
+	set_bit(index / ENTRIES_PER_SECTOR, c->meta_dirty);
+}
+
+/*
+ * Find a block to promote into: a free one, or the least recently
+ * used clean block that has no I/O in flight.
+ */
+static struct cache_block *alloc_block(struct cache_c *c)
+{
+	struct cache_block *cb;
+	unsigned scanned = 0;
+
+	if (!list_empty(&c->free)) {
+		cb = list_first_entry(&c->free, struct cache_block, list);
+		list_del_init(&cb->list);
+		return cb;
+	}
+
+	list_for_each_entry(cb, &c->clean, list) {
+		if (!cb->pending) {
+			list_del_init(&cb->list);
+			hlist_del_init(&cb->hash);
+			cb->old_oblock = cb->oblock;
+			hlist_add_head(&cb->old_hash, c->evicted +
+				       hash_long((unsigned long) cb->oblock,
+						 EVICTED_BITS));
+			cb->flags = CB_EVICTED;
+			c->nr_valid--;
+			return cb;
+		}
+		if (++scanned >= SCAN_LIMIT)
+			break;
+	}
+
+	return NULL;
+}
+
+static void maybe_promote(struct cache_c *c, sector_t oblock)
+{
+	u8 *hit = c->hits + hash_long((unsigned long) oblock, c->hits_bits);
+	struct cache_block *cb;
+
+	c->misses++;
+	if (*hit < 255)
+		(*hit)++;
+
+	if (*hit < c->promote_threshold || c->quiesce ||
+	    c->nr_migrations >= MAX_MIGRATIONS ||
+	    *origin_write_count(c, oblock))
+		return;
+
+	cb = alloc_block(c);
+	if (!cb)
+		return;
+
+	*hit = 0;
+	cb->oblock = oblock;
+	cb->flags |= CB_PROMOTE;
+	hlist_add_head(&cb->hash, hash_bucket(c, oblock));
+	list_add_tail(&cb->list, &c->migrations);
+	c->nr_migrations++;
+
+	queue_work(c->wq, &c->worker);
+}
+
+/*
+ * Remap a bio to the cache or the origin device.  Bios for a block
+ * that is being promoted, or that was evicted for a promotion, and
+ * writes to a block that is being written back, wait on the block
+ * until the copy is done.
+ */
+static int __cache_map(struct cache_c *c, struct bio *bio,
+		       union map_info *map_context)
+{
+	sector_t offset = bio->bi_sector - c->ti->begin;
+	sector_t oblock = offset >> c->block_shift;
+	int rw = bio_data_dir(bio);
+	struct cache_block *cb;
+	unsigned long flags, index;
+
+	spin_lock_irqsave(&c->lock, flags);
+
+	cb = lookup_block(c, oblock);
+	if (!cb)
+		cb = lookup_evicted(c, oblock);
+	if (cb && ((cb->flags & CB_PROMOTE) ||
+		   (rw == WRITE && (cb->flags & CB_WRITEBACK)))) {
+		bio_list_add(&cb->deferred, bio);
+		spin_unlock_irqrestore(&c->lock, flags);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	if (!cb) {
+		if (rw == WRITE) {
+			c->write_misses++;
+			(*origin_write_count(c, oblock))++;
+			map_context->ll = MAP_ORIGIN_WRITE | oblock;
+		} else {
+			c->read_misses++;
+			map_context->ll = 0;
+		}
+		maybe_promote(c, oblock);
+		spin_unlock_irqrestore(&c->lock, flags);
+
+		bio->bi_bdev = c->origin_dev->bdev;
+		bio->bi_sector = offset;
+		return DM_MAPIO_REMAPPED;
+	}
+
+	index = block_index(c, cb);
+	cb->pending++;
+	if (rw == WRITE) {
+		c->write_hits++;
+		if (!test_and_set_bit(index, c->dirty_bits)) {
+			c->nr_dirty++;
+			mark_meta_dirty(c, index);
+		}
+		if (!(cb->flags & CB_WRITEBACK))
+			list_move_tail(&cb->list, &c->dirty);
+	} else {
+		c->read_hits++;
+		if (!(cb->flags & CB_WRITEBACK) &&
+		    !test_bit(index, c->dirty_bits))
+			list_move_tail(&cb->list, &c->clean);
+	}
+	map_context->ll = MAP_CACHE | index;
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	bio->bi_bdev = c->cache_dev->bdev;
+	bio->bi_sector = c->data_start + ((sector_t) index << c->block_shift) +
+			 (offset & (c->block_size - 1));
+	return DM_MAPIO_REMAPPED;
+}
+
+/*-----------------------------------------------------------------
+ * Metadata I/O
+ *---------------------------------------------------------------*/
+static int meta_io(struct cache_c *c, int rw, sector_t sector,
+		   sector_t count)
+{
+	struct dm_io_region where = {
+		.bdev = c->cache_dev->bdev,
+		.sector = sector,
+		.count = count,
+	};
+	struct dm_io_request io_req = {
+		.bi_rw = rw,
+		.mem.type = DM_IO_VMA,
+		.mem.ptr.vma = c->meta_buf,
+		.client = c->io_client,
+		.notify.fn = NULL,
+	};
+
+	return dm_io(&io_req, 1, &where, NULL);
+}
+
+static int write_super(struct cache_c *c, int clean)
+{
+	struct disk_super *ds = c->meta_buf;
+	int r;
+
+	mutex_lock(&c->meta_lock);
+	memset(ds, 0, 1 << SECTOR_SHIFT);
+	ds->magic = cpu_to_le32(CACHE_MAGIC);
+	ds->version = cpu_to_le32(CACHE_VERSION);
+	ds->clean = cpu_to_le32(clean);
+	ds->block_size = cpu_to_le32(c->block_size);
+	ds->nr_blocks = cpu_to_le64(c->nr_blocks);
+	r = meta_io(c, WRITE_BARRIER, 0, 1);
+	mutex_unlock(&c->meta_lock);
+
+	return r;
+}
+
+/*
+ * Fill the metadata buffer with the entries of count sectors starting
+ * at metadata sector first, from the in-core state.
+ */
+static void fill_entries(struct cache_c *c, unsigned long first,
+			 unsigned count)
+{
+	struct disk_entry *de = c->meta_buf;
+	unsigned long index = first * ENTRIES_PER_SECTOR;
+	unsigned i;
+
+	memset(de, 0, count << SECTOR_SHIFT);
+
+	spin_lock_irq(&c->lock);
+	for (i = 0; i < count * ENTRIES_PER_SECTOR; i++, index++) {
+		struct cache_block *cb;
+
+		if (index >= c->nr_blocks)
+			break;
+		cb = c->blocks + index;
+		if (!(cb->flags & CB_VALID))
+			continue;
+		de[i].oblock = cpu_to_le64(cb->oblock);
+		de[i].flags = cpu_to_le32(DE_VALID |
+			(test_bit(index, c->dirty_bits) ? DE_DIRTY : 0));
+	}
+	spin_unlock_irq(&c->lock);
+}
+
+/*
+ * Write the metadata sector holding the entry of one cache block, with
+ * a barrier so the data copied into the block before is on disk first.
+ */
+static int write_entry(struct cache_c *c, struct cache_block *cb)
+{
+	unsigned long sector = block_index(c, cb) / ENTRIES_PER_SECTOR;
+	int r;
+
+	mutex_lock(&c->meta_lock);
+	clear_bit(sector, c->meta_dirty);
+	fill_entries(c, sector, 1);
+	r = meta_io(c, WRITE_BARRIER, 1 + sector, 1);
+	mutex_unlock(&c->meta_lock);
+
+	return r;
+}
+
+/*
+ * Write out the metadata sectors that changed, or all of them.
+ */
+static int commit_entries(struct cache_c *c, int all)
+{
+	unsigned long nr = c->meta_sectors - 1, sector, count, i;
+	int r = 0;
+
+	mutex_lock(&c->meta_lock);
+	for (sector = 0; sector < nr && !r; sector += count) {
+		count = min_t(unsigned long, nr - sector, META_IO_SECTORS);
+		if (!all && find_next_bit(c->meta_dirty, sector + count,
+					  sector) >= sector + count)
+			continue;
+
+		for (i = sector; i < sector + count; i++)
+			clear_bit(i, c->meta_dirty);
+		fill_entries(c, sector, count);
+		r = meta_io(c, WRITE, 1 + sector, count);
+	}
+	mutex_unlock(&c->meta_lock);
+
+	return r;
+}
+
+/*-----------------------------------------------------------------
+ * Migrations: promotion of origin blocks into the cache, and
+ * write-back of dirty blocks to the origin, both done by kcopyd.
+ *---------------------------------------------------------------*/
+static void wake_worker(struct cache_c *c)
+{
+	queue_work(c->wq, &c->worker);
+}
+
+static void copy_complete(int read_err, unsigned long write_err,
+			  void *context)
+{
+	struct dm_cache_migration *mg = context;
+	struct cache_c *c = mg->c;
+	unsigned long flags;
+
+	mg->error = read_err || write_err;
+
+	spin_lock_irqsave(&c->lock, flags);
+	list_add_tail(&mg->list, &c->completed);
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	wake_worker(c);
+}
+
+static void block_regions(struct cache_c *c, struct cache_block *cb,
+			  struct dm_io_region *cache,
+			  struct dm_io_region *origin)
+{
+	sector_t start = cb->oblock << c->block_shift;
+
+	origin->bdev = c->origin_dev->bdev;
+	origin->sector = start;
+	origin->count = min(c->block_size, c->ti->len - start);
+
+	cache->bdev = c->cache_dev->bdev;
+	cache->sector = c->data_start +
+			((sector_t) block_index(c, cb) << c->block_shift);
+	cache->count = origin->count;
+}
+
+/*
+ * The old entry of an evicted block could not be invalidated, so the
+ * block goes back to holding the old origin block, whose data it still
+ * has.
+ */
+static void abort_eviction(struct cache_c *c, struct cache_block *cb)
+{
+	sector_t oblock = cb->oblock;
+
+	spin_lock_irq(&c->lock);
+	hlist_del_init(&cb->hash);
+	hlist_del_init(&cb->old_hash);
+	cb->oblock = cb->old_oblock;
+	cb->flags = CB_VALID;
+	hlist_add_head(&cb->hash, hash_bucket(c, cb->oblock));
+	mark_meta_dirty(c, block_index(c, cb));
+	c->nr_valid++;
+	list_add_tail(&cb->list, &c->clean);
+	bio_list_merge(&c->deferred, &cb->deferred);
+	bio_list_init(&cb->deferred);
+	c->nr_migrations--;
+	spin_unlock_irq(&c->lock);
+
+	wake_up(&c->migration_wait);
+	DMERR_LIMIT("Promotion of block %llu failed",
+		    (unsigned long long) oblock);
+}
+
+static void start_migration(struct cache_c *c, struct cache_block *cb)
+{
+	struct dm_cache_migration *mg;
+	struct dm_io_region cache, origin;
+
+	mg = mempool_alloc(c->migration_pool, GFP_NOIO);
+	mg->c = c;
+	mg->cb = cb;
+	mg->error = 0;
+
+	block_regions(c, cb, &cache, &origin);
+
+	if (!(cb->flags & CB_PROMOTE)) {
+		dm_kcopyd_copy(c->kcopyd_client, &cache, 1, &origin, 0,
+			       copy_complete, mg);
+		return;
+	}
+
+	/*
+	 * The entry of an evicted block has to be invalid on disk before
+	 * the block gets overwritten, and before bios to its old origin
+	 * block stop waiting for it.
+	 */
+	if (cb->flags & CB_EVICTED) {
+		if (write_entry(c, cb)) {
+			abort_eviction(c, cb);
+			mempool_free(mg, c->migration_pool);
+			return;
+		}
+		spin_lock_irq(&c->lock);
+		hlist_del_init(&cb->old_hash);
+		spin_unlock_irq(&c->lock);
+	}
+
+	dm_kcopyd_copy(c->kcopyd_client, &origin, 1, &cache, 0,
+		       copy_complete, mg);
+}
+
+static void complete_promotion(struct cache_c *c,
+			       struct dm_cache_migration *mg)
+{
+	struct cache_block *cb = mg->cb;
+
+	/* The new mapping goes to disk before the block is used */
+	if (!mg->error) {
+		spin_lock_irq(&c->lock);
+		cb->flags |= CB_VALID;
+		spin_unlock_irq(&c->lock);
+		mg->error = write_entry(c, cb);
+	}
+
+	spin_lock_irq(&c->lock);
+	if (mg->error) {
+		/* Whatever the entry says on disk, it must be invalidated */
+		hlist_del_init(&cb->hash);
+		cb->flags = CB_EVICTED;
+		list_add(&cb->list, &c->free);
+	} else {
+		cb->flags = CB_VALID;
+		c->nr_valid++;
+		c->promotions++;
+		list_add_tail(&cb->list, &c->clean);
+	}
+	bio_list_merge(&c->deferred, &cb->deferred);
+	bio_list_init(&cb->deferred);
+	c->nr_migrations--;
+	spin_unlock_irq(&c->lock);
+
+	if (mg->error)
+		DMERR_LIMIT("Promotion of block %llu failed",
+			    (unsigned long long) cb->oblock);
+}
+
+static void complete_writeback(struct cache_c *c,
+			       struct dm_cache_migration *mg)
+{
+	struct cache_block *cb = mg->cb;
+	unsigned long index = block_index(c, cb);
+
+	spin_lock_irq(&c->lock);
+	cb->flags &= ~CB_WRITEBACK;
+	if (mg->error)
+		list_add_tail(&cb->list, &c->dirty);
+	else {
+		clear_bit(index, c->dirty_bits);
+		c->nr_dirty--;
+		mark_meta_dirty(c, index);
+		c->writebacks++;
+		list_add_tail(&cb->list, &c->clean);
+	}
+	bio_list_merge(&c->deferred, &cb->deferred);
+	bio_list_init(&cb->deferred);
+	c->nr_writeback--;
+	c->nr_migrations--;
+	spin_unlock_irq(&c->lock);
+
+	if (mg->error)
+		DMERR_LIMIT("Write-back of block %llu failed",
+			    (unsigned long long) cb->oblock);
+}
+
+/*
+ * Write back the least recently written dirty blocks while there are
+ * more of them than the threshold allows, or all of them after a
+ * "flush" message.  Blocks with writes in flight are skipped.
+ */
+static void queue_writeback(struct cache_c *c)
+{
+	struct cache_block *cb, *next;
+	unsigned long threshold;
+	unsigned scanned = 0;
+	LIST_HEAD(writeback);
+
+	spin_lock_irq(&c->lock);
+	threshold = c->flushing ? 0 : c->dirty_threshold;
+	list_for_each_entry_safe(cb, next, &c->dirty, list) {
+		if (c->quiesce || c->nr_migrations >= MAX_MIGRATIONS ||
+		    c->nr_dirty - c->nr_writeback <= threshold)
+			break;
+		if (cb->pending) {
+			if (++scanned >= SCAN_LIMIT)
+				break;
+			continue;
+		}
+		cb->flags |= CB_WRITEBACK;
+		list_move_tail(&cb->list, &writeback);
+		c->nr_writeback++;
+		c->nr_migrations++;
+	}
+	if (c->flushing && !c->nr_dirty)
+		c->flushing = 0;
+	spin_unlock_irq(&c->lock);
+
+	list_for_each_entry_safe(cb, next, &writeback, list) {
+		list_del_init(&cb->list);
+		start_migration(c, cb);
+	}
+}
+
+static void do_worker(struct work_struct *ws)
+{
+	struct cache_c *c = container_of(ws, struct cache_c, worker);
+	struct dm_cache_migration *mg, *tmp;
+	struct cache_block *cb, *next;
+	LIST_HEAD(starting);
+	LIST_HEAD(completed);
+	struct bio_list bios;
+	struct bio *bio;
+
+	spin_lock_irq(&c->lock);
+	list_splice_init(&c->migrations, &starting);
+	list_splice_init(&c->completed, &completed);
+	spin_unlock_irq(&c->lock);
+
+	list_for_each_entry_safe(cb, next, &starting, list) {
+		list_del_init(&cb->list);
+		start_migration(c, cb);
+	}
+
+	list_for_each_entry_safe(mg, tmp, &completed, list) {
+		if (mg->cb->flags & CB_PROMOTE)
+			complete_promotion(c, mg);
+		else
+			complete_writeback(c, mg);
+		mempool_free(mg, c->migration_pool);
+	}
+	if (!list_empty(&completed))
+		wake_up(&c->migration_wait);
+
+	spin_lock_irq(&c->lock);
+	bios = c->deferred;
+	bio_list_init(&c->deferred);
+	spin_unlock_irq(&c->lock);
+
+	while ((bio = bio_list_pop(&bios)))
+		if (__cache_map(c, bio, dm_get_mapinfo(bio)) ==
+		    DM_MAPIO_REMAPPED)
+			generic_make_request(bio);
+
+	queue_writeback(c);
+}
+
+/*
+ * Age the access counts once there have been as many misses as the
+ * cache has blocks, so that blocks have to stay hot to be promoted.
+ * Racing updates from the map function only lose a count.
+ */
+static void decay_hits(struct cache_c *c)
+{
+	unsigned long i;
+
+	if (c->misses < c->nr_blocks)
+		return;
+
+	c->misses = 0;
+	for (i = 0; i < (1UL << c->hits_bits); i++)
+		c->hits[i] >>= 1;
+}
+
+static void do_waker(struct work_struct *ws)
+{
+	struct cache_c *c = container_of(to_delayed_work(ws), struct cache_c,
+					 waker);
+
+	decay_hits(c);
+	wake_worker(c);
+	queue_delayed_work(c->wq, &c->waker, HZ);
+}
+
+/*-----------------------------------------------------------------
+ * Loading and formatting the metadata
+ *---------------------------------------------------------------*/
+static void reset_blocks(struct cache_c *c)
+{
+	unsigned long i;
+
+	INIT_LIST_HEAD(&c->free);
+	INIT_LIST_HEAD(&c->clean);
+	INIT_LIST_HEAD(&c->dirty);
+	for (i = 0; i < (1UL << c->hash_bits); i++)
+		INIT_HLIST_HEAD(c->hash + i);
+	for (i = 0; i < (1UL << EVICTED_BITS); i++)
+		INIT_HLIST_HEAD(c->evicted + i);
+	bitmap_zero(c->dirty_bits, c->nr_blocks);
+	bitmap_zero(c->meta_dirty, c->meta_sectors - 1);
+	c->nr_valid = 0;
+	c->nr_dirty = 0;
+
+	for (i = 0; i < c->nr_blocks; i++) {
+		struct cache_block *cb = c->blocks + i;
+
+		INIT_HLIST_NODE(&cb->hash);
+		INIT_HLIST_NODE(&cb->old_hash);
+		cb->oblock = 0;
+		cb->pending = 0;
+		cb->flags = 0;
+		bio_list_init(&cb->deferred);
+		list_add_tail(&cb->list, &c->free);
+	}
+}
+
+static int sector_is_zero(void *data)
+{
+	unsigned long *p = data;
+	unsigned i;
+
+	for (i = 0; i < (1 << SECTOR_SHIFT) / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+static int format_cache(struct cache_c *c)
+{
+	int r;
+
+	DMINFO("Formatting cache device %s", c->cache_dev->name);
+
+	r = commit_entries(c, 1);
+	if (r)
+		return r;
+
+	return write_super(c, 1);
+}
+
+/*
+ * Entries beyond the end of the origin, or duplicates, leave their
+ * block free, but it still has to be invalidated on disk before it is
+ * reused.  Returns 1 if dirty data was dropped that way.
+ */
+static int load_entry(struct cache_c *c, struct cache_block *cb,
+		      struct disk_entry *de, int clean)
+{
+	unsigned long index = block_index(c, cb);
+	sector_t oblock = le64_to_cpu(de->oblock);
+	u32 flags = le32_to_cpu(de->flags);
+
+	if (!(flags & DE_VALID))
+		return 0;
+
+	if (oblock >= origin_blocks(c) || lookup_block(c, oblock)) {
+		cb->flags = CB_EVICTED;
+		mark_meta_dirty(c, index);
+		return (flags & DE_DIRTY) || !clean;
+	}
+
+	cb->oblock = oblock;
+	cb->flags = CB_VALID;
+	hlist_add_head(&cb->hash, hash_bucket(c, oblock));
+	c->nr_valid++;
+
+	if (clean && !(flags & DE_DIRTY)) {
+		list_move_tail(&cb->list, &c->clean);
+		return 0;
+	}
+
+	set_bit(index, c->dirty_bits);
+	c->nr_dirty++;
+	if (!(flags & DE_DIRTY))
+		mark_meta_dirty(c, index);
+	list_move_tail(&cb->list, &c->dirty);
+	return 0;
+}
+
+static int load_cache(struct cache_c *c)
+{
+	struct disk_super *ds = c->meta_buf;
+	unsigned long nr = c->meta_sectors - 1, sector, count, index, i;
+	unsigned long lost = 0;
+	int clean, r;
+
+	reset_blocks(c);
+
+	r = meta_io(c, READ, 0, 1);
+	if (r)
+		return r;
+
+	if (le32_to_cpu(ds->magic) != CACHE_MAGIC) {
+		if (sector_is_zero(ds))
+			return format_cache(c);
+		DMERR("Cache device %s holds no cache and is not zeroed",
+		      c->cache_dev->name);
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(ds->version) != CACHE_VERSION) {
+		DMERR("Unsupported metadata version %u",
+		      le32_to_cpu(ds->version));
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(ds->block_size) != c->block_size ||
+	    le64_to_cpu(ds->nr_blocks) != c->nr_blocks) {
+		DMERR("Cache geometry does not match the metadata on %s",
+		      c->cache_dev->name);
+		return -EINVAL;
+	}
+
+	clean = le32_to_cpu(ds->clean);
+	if (!clean)
+		DMWARN("%s was not shut down cleanly, writing back all blocks",
+		       c->cache_dev->name);
+
+	for (sector = 0; sector < nr; sector += count) {
+		struct disk_entry *de = c->meta_buf;
+
+		count = min_t(unsigned long, nr - sector, META_IO_SECTORS);
+		r = meta_io(c, READ, 1 + sector, count);
+		if (r)
+			return r;
+
+		index = sector * ENTRIES_PER_SECTOR;
+		for (i = 0; i < count * ENTRIES_PER_SECTOR &&
+			    index < c->nr_blocks; i++, index++)
+			lost += load_entry(c, c->blocks + index, de + i, clean);
+	}
+
+	if (lost)
+		DMWARN("Dropped %lu dirty blocks not mapping to the origin",
+		       lost);
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------
+ * Target methods
+ *---------------------------------------------------------------*/
+
+/*
+ * Lay out the cache device: the superblock, then the entries, then as
+ * many blocks as fit behind them.
+ */
+static int cache_geometry(struct cache_c *c)
+{
+	sector_t dev_size = get_dev_size(c->cache_dev->bdev);
+	sector_t nr = dev_size >> c->block_shift;
+	sector_t meta, start;
+
+	meta = 1 + dm_sector_div_up(nr, ENTRIES_PER_SECTOR);
+	nr -= min(nr, (meta + c->block_size - 1) >> c->block_shift);
+
+	for (;;) {
+		if (!nr)
+			return -ENOSPC;
+
+		meta = 1 + dm_sector_div_up(nr, ENTRIES_PER_SECTOR);
+		start = ((meta + c->block_size - 1) >> c->block_shift) <<
+			c->block_shift;
+		if (start + (nr << c->block_shift) <= dev_size)
+			break;
+		nr--;
+	}
+
+	if (nr > ULONG_MAX / sizeof(struct cache_block))
+		return -EFBIG;
+
+	c->nr_blocks = nr;
+	c->meta_sectors = meta;
+	c->data_start = start;
+	return 0;
+}
+
+static void free_tables(struct cache_c *c)
+{
+	vfree(c->meta_buf);
+	vfree(c->meta_dirty);
+	vfree(c->dirty_bits);
+	vfree(c->hits);
+	vfree(c->hash);
+	vfree(c->blocks);
+}
+
+static int alloc_tables(struct cache_c *c)
+{
+	unsigned long nr = c->nr_blocks;
+
+	c->hash_bits = ilog2(roundup_pow_of_two(max(nr / 4, 64UL)));
+	c->hits_bits = ilog2(roundup_pow_of_two(max(nr * 2, 64UL)));
+
+	c->blocks = vmalloc(nr * sizeof(struct cache_block));
+	c->hash = vmalloc(sizeof(struct hlist_head) << c->hash_bits);
+	c->hits = vmalloc(1UL << c->hits_bits);
+	c->dirty_bits = vmalloc(BITS_TO_LONGS(nr) * sizeof(long));
+	c->meta_dirty = vmalloc(BITS_TO_LONGS(c->meta_sectors) *
+				sizeof(long));
+	c->meta_buf = vmalloc(META_IO_SECTORS << SECTOR_SHIFT);
+
+	if (!c->blocks || !c->hash || !c->hits || !c->dirty_bits ||
+	    !c->meta_dirty || !c->meta_buf) {
+		free_tables(c);
+		return -ENOMEM;
+	}
+
+	memset(c->hits, 0, 1UL << c->hits_bits);
+	reset_blocks(c);
+	return 0;
+}
+
+static void set_dirty_threshold(struct cache_c *c)
+{
+	c->dirty_threshold = c->nr_blocks / 100 * c->dirty_percent +
+			     c->nr_blocks % 100 * c->dirty_percent / 100;
+}
+
+/*
+ * Construct a cache mapping:
+ *    <cache_dev> <origin_dev> <block_size> [<promote_threshold>
+ *    [<dirty_percent>]]
+ *
+ * The block size is in sectors.  A block is promoted into the cache
+ * after promote_threshold misses, and dirty blocks are written back
+ * while they make up more than dirty_percent of the cache.
+ */
+static int cache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
+{
+	struct cache_c *c;
+	unsigned long long tmp;
+	int r = -EINVAL;
+
+	if (argc < 3 || argc > 5) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c) {
+		ti->error = "Cannot allocate cache context";
+		return -ENOMEM;
+	}
+	c->ti = ti;
+	c->promote_threshold = DEFAULT_PROMOTE_THRESHOLD;
+	c->dirty_percent = DEFAULT_DIRTY_PERCENT;
+
+	if (sscanf(argv[2], "%llu", &tmp) != 1 || !is_power_of_2(tmp) ||
+	    tmp < (PAGE_SIZE >> SECTOR_SHIFT) || tmp > UINT_MAX) {
+		ti->error = "Invalid block size";
+		goto bad;
+	}
+	c->block_size = tmp;
+	c->block_shift = ilog2(tmp);
+
+	if (argc > 3 && (sscanf(argv[3], "%u", &c->promote_threshold) != 1 ||
+			 c->promote_threshold > 255)) {
+		ti->error = "Invalid promote threshold";
+		goto bad;
+	}
+
+	if (argc > 4 && (sscanf(argv[4], "%u", &c->dirty_percent) != 1 ||
+			 c->dirty_percent > 100)) {
+		ti->error = "Invalid dirty percentage";
+		goto bad;
+	}
+
+	if (dm_get_device(ti, argv[0], 0, 0, FMODE_READ | FMODE_WRITE,
+			  &c->cache_dev)) {
+		ti->error = "Cache device lookup failed";
+		goto bad;
+	}
+
+	if (dm_get_device(ti, argv[1], 0, ti->len,
+			  dm_table_get_mode(ti->table), &c->origin_dev)) {
+		ti->error = "Origin device lookup failed";
+		goto bad_origin;
+	}
+
+	r = cache_geometry(c);
+	if (r) {
+		ti->error = r == -ENOSPC ? "Cache device too small" :
+					   "Too many cache blocks";
+		goto bad_tables;
+	}
+
+	r = alloc_tables(c);
+	if (r) {
+		ti->error = "Cannot allocate cache block tables";
+		goto bad_tables;
+	}
+
+	c->io_client = dm_io_client_create(META_IO_PAGES);
+	if (IS_ERR(c->io_client)) {
+		r = PTR_ERR(c->io_client);
+		ti->error = "Cannot create io client";
+		goto bad_io_client;
+	}
+
+	r = dm_kcopyd_client_create(CACHE_KCOPYD_PAGES, &c->kcopyd_client);
+	if (r) {
+		ti->error = "Cannot create kcopyd client";
+		goto bad_kcopyd;
+	}
+
+	c->migration_pool = mempool_create_slab_pool(MAX_MIGRATIONS,
+						     migration_cache);
+	if (!c->migration_pool) {
+		r = -ENOMEM;
+		ti->error = "Cannot allocate migration pool";
+		goto bad_pool;
+	}
+
+	c->wq = create_singlethread_workqueue("kcached");
+	if (!c->wq) {
+		r = -ENOMEM;
+		ti->error = "Cannot create workqueue";
+		goto bad_wq;
+	}
+
+	spin_lock_init(&c->lock);
+	mutex_init(&c->meta_lock);
+	INIT_LIST_HEAD(&c->migrations);
+	INIT_LIST_HEAD(&c->completed);
+	bio_list_init(&c->deferred);
+	INIT_WORK(&c->worker, do_worker);
+	INIT_DELAYED_WORK(&c->waker, do_waker);
+	init_waitqueue_head(&c->migration_wait);
+	set_dirty_threshold(c);
+
+	/* Nothing is promoted or written back until the first resume */
+	c->quiesce = 1;
+
+	ti->split_io = c->block_size;
+	ti->num_flush_requests = 2;
+	ti->private = c;
+	return 0;
+
+bad_wq:
+	mempool_destroy(c->migration_pool);
+bad_pool:
+	dm_kcopyd_client_destroy(c->kcopyd_client);
+bad_kcopyd:
+	dm_io_client_destroy(c->io_client);
+bad_io_client:
+	free_tables(c);
+bad_tables:
+	dm_put_device(ti, c->origin_dev);
+bad_origin:
+	dm_put_device(ti, c->cache_dev);
+bad:
+	kfree(c);
+	return r;
+}
+
+static void cache_dtr(struct dm_target *ti)
+{
+	struct cache_c *c = ti->private;
+
+	cancel_delayed_work_sync(&c->waker);
+	destroy_workqueue(c->wq);
+	mempool_destroy(c->migration_pool);
+	dm_kcopyd_client_destroy(c->kcopyd_client);
+	dm_io_client_destroy(c->io_client);
+	free_tables(c);
+	dm_put_device(ti, c->origin_dev);
+	dm_put_device(ti, c->cache_dev);
+	kfree(c);
+}
+
+static int cache_map(struct dm_target *ti, struct bio *bio,
+		     union map_info *map_context)
+{
+	struct cache_c *c = ti->private;
+
+	if (unlikely(bio_empty_barrier(bio))) {
+		if (map_context->flush_request)
+			bio->bi_bdev = c->origin_dev->bdev;
+		else
+			bio->bi_bdev = c->cache_dev->bdev;
+		return DM_MAPIO_REMAPPED;
+	}
+
+	return __cache_map(c, bio, map_context);
+}
+
+static int cache_end_io(struct dm_target *ti, struct bio *bio,
+			int error, union map_info *map_context)
+{
+	struct cache_c *c = ti->private;
+	unsigned long long ll = map_context->ll;
+	unsigned long flags;
+
+	if (bio_empty_barrier(bio) || !(ll & (MAP_CACHE | MAP_ORIGIN_WRITE)))
+		return error;
+
+	spin_lock_irqsave(&c->lock, flags);
+	if (ll & MAP_CACHE)
+		c->blocks[ll & MAP_MASK].pending--;
+	else
+		(*origin_write_count(c, ll & MAP_MASK))--;
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	return error;
+}
+
+static void cache_presuspend(struct dm_target *ti)
+{
+	struct cache_c *c = ti->private;
+
+	spin_lock_irq(&c->lock);
+	c->quiesce = 1;
+	spin_unlock_irq(&c->lock);
+}
+
+/*
+ * Let the migrations finish and write out the metadata, marking the
+ * cache clean.  The origin is flushed first so that blocks written
+ * back are on disk before their entries say they are clean.
+ */
+static void cache_postsuspend(struct dm_target *ti)
+{
+	struct cache_c *c = ti->private;
+
+	wait_event(c->migration_wait, !c->nr_migrations);
+	cancel_delayed_work_sync(&c->waker);
+	flush_workqueue(c->wq);
+
+	if (!c->loaded)
+		return;
+
+	blkdev_issue_flush(c->origin_dev->bdev, NULL);
+
+	if (commit_entries(c, 0) || write_super(c, 1))
+		DMERR("Failed to commit metadata to %s", c->cache_dev->name);
+}
+
+/*
+ * The metadata is only read on the first resume: an earlier table
+ * using the same cache device may still be live when this one is
+ * constructed.
+ */
+static int cache_preresume(struct dm_target *ti)
+{
+	struct cache_c *c = ti->private;
+	int r;
+
+	if (!c->loaded) {
+		r = load_cache(c);
+		if (r)
+			return r;
+		c->loaded = 1;
+	}
+
+	return write_super(c, 0);
+}
+
+static void cache_resume(struct dm_target *ti)
+{
+	struct cache_c *c = ti->private;
+
+	spin_lock_irq(&c->lock);
+	c->quiesce = 0;
+	spin_unlock_irq(&c->lock);
+
+	queue_delayed_work(c->wq, &c->waker, HZ);
+}
+
+static int cache_status(struct dm_target *ti, status_type_t type,
+			char *result, unsigned maxlen)
+{
+	struct cache_c *c = ti->private;
+	unsigned long flags;
+	int sz = 0;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		spin_lock_irqsave(&c->lock, flags);
+		DMEMIT("%lu %lu %lu %lu %lu %lu %lu %lu %lu",
+		       c->nr_blocks, c->nr_valid, c->nr_dirty,
+		       c->read_hits, c->read_misses,
+		       c->write_hits, c->write_misses,
+		       c->promotions, c->writebacks);
+		spin_unlock_irqrestore(&c->lock, flags);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s %s %llu %u %u", c->cache_dev->name,
+		       c->origin_dev->name,
+		       (unsigned long long) c->block_size,
+		       c->promote_threshold, c->dirty_percent);
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Messages:
+ *    flush			write back all dirty blocks
+ *    promote_threshold <n>
+ *    dirty_percent <n>
+ */
+static int cache_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct cache_c *c = ti->private;
+	unsigned val;
+
+	if (argc == 1 && !strcmp(argv[0], "flush")) {
+		spin_lock_irq(&c->lock);
+		c->flushing = 1;
+		spin_unlock_irq(&c->lock);
+		wake_worker(c);
+		return 0;
+	}
+
+	if (argc != 2 || sscanf(argv[1], "%u", &val) != 1)
+		goto bad;
+
+	if (!strcmp(argv[0], "promote_threshold") && val <= 255) {
+		spin_lock_irq(&c->lock);
+		c->promote_threshold = val;
+		spin_unlock_irq(&c->lock);
+		return 0;
+	}
+
+	if (!strcmp(argv[0], "dirty_percent") && val <= 100) {
+		spin_lock_irq(&c->lock);
+		c->dirty_percent = val;
+		set_dirty_threshold(c);
+		spin_unlock_irq(&c->lock);
+		wake_worker(c);
+		return 0;
+	}
+
+bad:
+	DMWARN("Unrecognised cache message received.");
+	return -EINVAL;
+}
+
+static int cache_iterate_devices(struct dm_target *ti,
+				 iterate_devices_callout_fn fn, void *data)
+{
+	struct cache_c *c = ti->private;
+	int r;
+
+	r = fn(ti, c->cache_dev, 0, c->data_start +
+	       ((sector_t) c->nr_blocks << c->block_shift), data);
+	if (r)
+		return r;
+
+	return fn(ti, c->origin_dev, 0, ti->len, data);
+}
+
+static struct target_type cache_target = {
+	.name	     = "cache",
+	.version     = {1, 0, 0},
+	.module      = THIS_MODULE,
+	.ctr	     = cache_ctr,
+	.dtr	     = cache_dtr,
+	.map	     = cache_map,
+	.end_io	     = cache_end_io,
+	.presuspend  = cache_presuspend,
+	.postsuspend = cache_postsuspend,
+	.preresume   = cache_preresume,
+	.resume	     = cache_resume,
+	.status	     = cache_status,
+	.message     = cache_message,
+	.iterate_devices = cache_iterate_devices,
+};
+
+static int __init dm_cache_init(void)
+{
+	int r;
+
+	migration_cache = KMEM_CACHE(dm_cache_migration, 0);
+	if (!migration_cache) {
+		DMERR("Couldn't create migration cache.");
+		return -ENOMEM;
+	}
+
+	r = dm_register_target(&cache_target);
+	if (r < 0) {
+		DMERR("register failed %d", r);
+		kmem_cache_destroy(migration_cache);
+	}
+
+	return r;
+}
+
+static void __exit dm_cache_exit(void)
+{
+	dm_unregister_target(&cache_target);
+	kmem_cache_destroy(migration_cache);
+}
+
+/* Module hooks */
+module_init(dm_cache_init);
+module_exit(dm_cache_exit);
+
+MODULE_DESCRIPTION(DM_NAME " write-back cache target");
+MODULE_LICENSE("GPL");
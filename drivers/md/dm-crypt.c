@@ -17,6 +17,9 @@
 #include <linux/slab.h>
 #include <linux/crypto.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
 #include <linux/backing-dev.h>
 #include <asm/atomic.h>
 #include <linux/scatterlist.h>
@@ -50,6 +53,7 @@ struct dm_crypt_io {
 	struct dm_target *target;
 	struct bio *base_bio;
 	struct work_struct work;
+	struct rb_node rb_node;		/* in the write tree */
 
 	struct convert_context ctx;
 
@@ -86,6 +90,15 @@ struct iv_benbi_private {
 	int shift;
 };
 
+/*
+ * Duplicated per CPU state for cipher.  Only used from the kcryptd
+ * thread of that CPU.
+ */
+struct crypt_cpu {
+	struct ablkcipher_request *req;
+	struct crypto_ablkcipher *tfm;
+};
+
 /*
  * Crypt: maps a linear range of a block device
  * and encrypts / decrypts at the same time.
@@ -107,6 +120,15 @@ struct crypt_config {
 	struct workqueue_struct *io_queue;
 	struct workqueue_struct *crypt_queue;
 
+	/*
+	 * Encrypted writes, sorted by sector, waiting for the write
+	 * thread to submit them.
+	 */
+	struct task_struct *write_thread;
+	wait_queue_head_t write_thread_wait;
+	spinlock_t write_thread_lock;
+	struct rb_root write_tree;
+
 	/*
 	 * crypto related data
 	 */
@@ -133,11 +155,11 @@ struct crypt_config {
 	 * correctly aligned.
 	 */
 	unsigned int dmreq_start;
-	struct ablkcipher_request *req;
+
+	struct crypt_cpu *cpu;
 
 	char cipher[CRYPTO_MAX_ALG_NAME];
 	char chainmode[CRYPTO_MAX_ALG_NAME];
-	struct crypto_ablkcipher *tfm;
 	unsigned long flags;
 	unsigned int key_size;
 	u8 key[0];
@@ -152,6 +174,23 @@ static struct kmem_cache *_crypt_io_pool;
 static void clone_init(struct dm_crypt_io *, struct bio *);
 static void kcryptd_queue_crypt(struct dm_crypt_io *io);
 
+/*
+ * The kcryptd threads are bound to their CPU, so they can use its
+ * state without disabling preemption.
+ */
+static struct crypt_cpu *this_crypt_config(struct crypt_config *cc)
+{
+	return per_cpu_ptr(cc->cpu, smp_processor_id());
+}
+
+/*
+ * Use this to access cipher attributes that are the same for each CPU.
+ */
+static struct crypto_ablkcipher *any_tfm(struct crypt_config *cc)
+{
+	return per_cpu_ptr(cc->cpu, raw_smp_processor_id())->tfm;
+}
+
 /*
  * Different IV generation algorithms:
  *
@@ -261,7 +300,7 @@ static int crypt_iv_essiv_ctr(struct crypt_config *cc, struct dm_target *ti,
 		goto bad;
 	}
 	if (crypto_cipher_blocksize(essiv_tfm) !=
-	    crypto_ablkcipher_ivsize(cc->tfm)) {
+	    crypto_ablkcipher_ivsize(any_tfm(cc))) {
 		ti->error = "Block size of ESSIV cipher does "
 			    "not match IV size of block cipher";
 		err = -EINVAL;
@@ -294,7 +333,7 @@ static int crypt_iv_essiv_gen(struct crypt_config *cc, u8 *iv, sector_t sector)
 static int crypt_iv_benbi_ctr(struct crypt_config *cc, struct dm_target *ti,
 			      const char *opts)
 {
-	unsigned bs = crypto_ablkcipher_blocksize(cc->tfm);
+	unsigned bs = crypto_ablkcipher_blocksize(any_tfm(cc));
 	int log = ilog2(bs);
 
 	/* we need to calculate how far we must shift the sector count
@@ -399,7 +438,7 @@ static int crypt_convert_block(struct crypt_config *cc,
 
 	dmreq = dmreq_of_req(cc, req);
 	iv = (u8 *)ALIGN((unsigned long)(dmreq + 1),
-			 crypto_ablkcipher_alignmask(cc->tfm) + 1);
+			 crypto_ablkcipher_alignmask(any_tfm(cc)) + 1);
 
 	dmreq->ctx = ctx;
 	sg_init_table(&dmreq->sg_in, 1);
@@ -444,13 +483,16 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 static void crypt_alloc_req(struct crypt_config *cc,
 			    struct convert_context *ctx)
 {
-	if (!cc->req)
-		cc->req = mempool_alloc(cc->req_pool, GFP_NOIO);
-	ablkcipher_request_set_tfm(cc->req, cc->tfm);
-	ablkcipher_request_set_callback(cc->req, CRYPTO_TFM_REQ_MAY_BACKLOG |
+	struct crypt_cpu *this_cc = this_crypt_config(cc);
+
+	if (!this_cc->req)
+		this_cc->req = mempool_alloc(cc->req_pool, GFP_NOIO);
+	ablkcipher_request_set_tfm(this_cc->req, this_cc->tfm);
+	ablkcipher_request_set_callback(this_cc->req,
+					CRYPTO_TFM_REQ_MAY_BACKLOG |
 					CRYPTO_TFM_REQ_MAY_SLEEP,
 					kcryptd_async_done,
-					dmreq_of_req(cc, cc->req));
+					dmreq_of_req(cc, this_cc->req));
 }
 
 /*
@@ -459,6 +501,7 @@ static void crypt_alloc_req(struct crypt_config *cc,
 static int crypt_convert(struct crypt_config *cc,
 			 struct convert_context *ctx)
 {
+	struct crypt_cpu *this_cc = this_crypt_config(cc);
 	int r;
 
 	atomic_set(&ctx->pending, 1);
@@ -470,7 +513,7 @@ static int crypt_convert(struct crypt_config *cc,
 
 		atomic_inc(&ctx->pending);
 
-		r = crypt_convert_block(cc, ctx, cc->req);
+		r = crypt_convert_block(cc, ctx, this_cc->req);
 
 		switch (r) {
 		/* async */
@@ -479,7 +522,7 @@ static int crypt_convert(struct crypt_config *cc,
 			INIT_COMPLETION(ctx->restart);
 			/* fall through*/
 		case -EINPROGRESS:
-			cc->req = NULL;
+			this_cc->req = NULL;
 			ctx->sector++;
 			continue;
 
@@ -631,9 +674,16 @@ static void crypt_dec_pending(struct dm_crypt_io *io)
  * Needed because it would be very unwise to do decryption in an
  * interrupt context.
  *
- * kcryptd performs the actual encryption or decryption.
+ * kcryptd performs the actual encryption or decryption.  It has a
+ * thread per CPU and encrypts writes on the CPU that submitted them,
+ * decrypts reads on the CPU that completed them.
  *
- * kcryptd_io performs the IO submission.
+ * kcryptd_io performs the IO submission of reads that could not be
+ * submitted directly from the map function.
+ *
+ * The write thread submits the encrypted writes.  The kcryptd threads
+ * finish them in no particular order, so they are sorted by sector
+ * before submission.
  *
  * They must be separated as otherwise the final stages could be
  * starved by new requests which can block in the first stages due
@@ -678,25 +728,22 @@ static void clone_init(struct dm_crypt_io *io, struct bio *clone)
 	clone->bi_destructor = dm_crypt_bio_destructor;
 }
 
-static void kcryptd_io_read(struct dm_crypt_io *io)
+static int kcryptd_io_read(struct dm_crypt_io *io, gfp_t gfp)
 {
 	struct crypt_config *cc = io->target->private;
 	struct bio *base_bio = io->base_bio;
 	struct bio *clone;
 
-	crypt_inc_pending(io);
-
 	/*
 	 * The block layer might modify the bvec array, so always
 	 * copy the required bvecs because we need the original
 	 * one in order to decrypt the whole bio data *afterwards*.
 	 */
-	clone = bio_alloc_bioset(GFP_NOIO, bio_segments(base_bio), cc->bs);
-	if (unlikely(!clone)) {
-		io->error = -ENOMEM;
-		crypt_dec_pending(io);
-		return;
-	}
+	clone = bio_alloc_bioset(gfp, bio_segments(base_bio), cc->bs);
+	if (!clone)
+		return 1;
+
+	crypt_inc_pending(io);
 
 	clone_init(io, clone);
 	clone->bi_idx = 0;
@@ -707,22 +754,17 @@ static void kcryptd_io_read(struct dm_crypt_io *io)
 	       sizeof(struct bio_vec) * clone->bi_vcnt);
 
 	generic_make_request(clone);
-}
-
-static void kcryptd_io_write(struct dm_crypt_io *io)
-{
-	struct bio *clone = io->ctx.bio_out;
-	generic_make_request(clone);
+	return 0;
 }
 
 static void kcryptd_io(struct work_struct *work)
 {
 	struct dm_crypt_io *io = container_of(work, struct dm_crypt_io, work);
 
-	if (bio_data_dir(io->base_bio) == READ)
-		kcryptd_io_read(io);
-	else
-		kcryptd_io_write(io);
+	crypt_inc_pending(io);
+	if (kcryptd_io_read(io, GFP_NOIO))
+		io->error = -ENOMEM;
+	crypt_dec_pending(io);
 }
 
 static void kcryptd_queue_io(struct dm_crypt_io *io)
@@ -733,11 +775,47 @@ static void kcryptd_queue_io(struct dm_crypt_io *io)
 	queue_work(cc->io_queue, &io->work);
 }
 
-static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io,
-					  int error, int async)
+static struct dm_crypt_io *crypt_io_from_node(struct rb_node *node)
+{
+	return rb_entry(node, struct dm_crypt_io, rb_node);
+}
+
+static int dmcrypt_write(void *data)
+{
+	struct crypt_config *cc = data;
+	struct rb_root write_tree;
+	struct blk_plug plug;
+	struct dm_crypt_io *io;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(cc->write_thread_wait,
+					 !RB_EMPTY_ROOT(&cc->write_tree) ||
+					 kthread_should_stop());
+
+		spin_lock_irq(&cc->write_thread_lock);
+		write_tree = cc->write_tree;
+		cc->write_tree = RB_ROOT;
+		spin_unlock_irq(&cc->write_thread_lock);
+
+		blk_start_plug(&plug);
+		while (!RB_EMPTY_ROOT(&write_tree)) {
+			io = crypt_io_from_node(rb_first(&write_tree));
+			rb_erase(&io->rb_node, &write_tree);
+			generic_make_request(io->ctx.bio_out);
+		}
+		blk_finish_plug(&plug);
+	}
+
+	return 0;
+}
+
+static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io, int error)
 {
 	struct bio *clone = io->ctx.bio_out;
 	struct crypt_config *cc = io->target->private;
+	struct rb_node **rbp, *parent;
+	unsigned long flags;
+	int empty;
 
 	if (unlikely(error < 0)) {
 		crypt_free_buffer_pages(cc, clone);
@@ -752,10 +830,23 @@ static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io,
 
 	clone->bi_sector = cc->start + io->sector;
 
-	if (async)
-		kcryptd_queue_io(io);
-	else
-		generic_make_request(clone);
+	spin_lock_irqsave(&cc->write_thread_lock, flags);
+	empty = RB_EMPTY_ROOT(&cc->write_tree);
+	rbp = &cc->write_tree.rb_node;
+	parent = NULL;
+	while (*rbp) {
+		parent = *rbp;
+		if (io->sector < crypt_io_from_node(parent)->sector)
+			rbp = &parent->rb_left;
+		else
+			rbp = &parent->rb_right;
+	}
+	rb_link_node(&io->rb_node, parent, rbp);
+	rb_insert_color(&io->rb_node, &cc->write_tree);
+	spin_unlock_irqrestore(&cc->write_thread_lock, flags);
+
+	if (empty)
+		wake_up(&cc->write_thread_wait);
 }
 
 static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
@@ -798,7 +889,7 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 
 		/* Encryption was already finished, submit io now */
 		if (crypt_finished) {
-			kcryptd_crypt_write_io_submit(io, r, 0);
+			kcryptd_crypt_write_io_submit(io, r);
 
 			/*
 			 * If there was an error, do not try next fragments.
@@ -806,8 +897,6 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 			 */
 			if (unlikely(r < 0))
 				break;
-
-			io->sector = sector;
 		}
 
 		/*
@@ -818,10 +907,12 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 			congestion_wait(BLK_RW_ASYNC, HZ/100);
 
 		/*
-		 * With async crypto it is unsafe to share the crypto context
-		 * between fragments, so switch to a new dm_crypt_io structure.
+		 * The io sits in the write tree until the write thread
+		 * submits it, and with async crypto it is unsafe to share
+		 * the crypto context between fragments, so switch to a new
+		 * dm_crypt_io structure.
 		 */
-		if (unlikely(!crypt_finished && remaining)) {
+		if (unlikely(remaining)) {
 			new_io = crypt_io_alloc(io->target, io->base_bio,
 						sector);
 			crypt_inc_pending(new_io);
@@ -896,7 +987,7 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 	if (bio_data_dir(io->base_bio) == READ)
 		kcryptd_crypt_read_done(io, error);
 	else
-		kcryptd_crypt_write_io_submit(io, error, 1);
+		kcryptd_crypt_write_io_submit(io, error);
 }
 
 static void kcryptd_crypt(struct work_struct *work)
@@ -983,6 +1074,59 @@ static int crypt_wipe_key(struct crypt_config *cc)
 	return 0;
 }
 
+static void crypt_free_tfms(struct crypt_config *cc)
+{
+	int cpu;
+
+	if (!cc->cpu)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct crypt_cpu *cs = per_cpu_ptr(cc->cpu, cpu);
+
+		if (cs->tfm)
+			crypto_free_ablkcipher(cs->tfm);
+	}
+
+	free_percpu(cc->cpu);
+	cc->cpu = NULL;
+}
+
+static int crypt_alloc_tfms(struct crypt_config *cc, char *ciphermode)
+{
+	struct crypto_ablkcipher *tfm;
+	int cpu;
+
+	cc->cpu = alloc_percpu(struct crypt_cpu);
+	if (!cc->cpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_ablkcipher(ciphermode, 0, 0);
+		if (IS_ERR(tfm)) {
+			crypt_free_tfms(cc);
+			return PTR_ERR(tfm);
+		}
+		per_cpu_ptr(cc->cpu, cpu)->tfm = tfm;
+	}
+
+	return 0;
+}
+
+static int crypt_setkey_allcpus(struct crypt_config *cc)
+{
+	int cpu, err = 0, r;
+
+	for_each_possible_cpu(cpu) {
+		r = crypto_ablkcipher_setkey(per_cpu_ptr(cc->cpu, cpu)->tfm,
+					     cc->key, cc->key_size);
+		if (r)
+			err = r;
+	}
+
+	return err;
+}
+
 /*
  * Construct an encryption mapping:
  * <cipher> <key> <iv_offset> <dev_path> <start>
@@ -990,7 +1134,6 @@ static int crypt_wipe_key(struct crypt_config *cc)
 static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
 	struct crypt_config *cc;
-	struct crypto_ablkcipher *tfm;
 	char *tmp;
 	char *cipher;
 	char *chainmode;
@@ -1044,15 +1187,13 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_cipher;
 	}
 
-	tfm = crypto_alloc_ablkcipher(cc->cipher, 0, 0);
-	if (IS_ERR(tfm)) {
+	if (crypt_alloc_tfms(cc, cc->cipher) < 0) {
 		ti->error = "Error allocating crypto tfm";
 		goto bad_cipher;
 	}
 
 	strcpy(cc->cipher, cipher);
 	strcpy(cc->chainmode, chainmode);
-	cc->tfm = tfm;
 
 	/*
 	 * Choose ivmode. Valid modes: "plain", "essiv:<esshash>", "benbi".
@@ -1084,7 +1225,7 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_slab_pool;
 	}
 
-	cc->iv_size = crypto_ablkcipher_ivsize(tfm);
+	cc->iv_size = crypto_ablkcipher_ivsize(any_tfm(cc));
 	if (cc->iv_size)
 		/* at least a 64 bit sector number should fit in our buffer */
 		cc->iv_size = max(cc->iv_size,
@@ -1105,9 +1246,9 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 
 	cc->dmreq_start = sizeof(struct ablkcipher_request);
-	cc->dmreq_start += crypto_ablkcipher_reqsize(tfm);
+	cc->dmreq_start += crypto_ablkcipher_reqsize(any_tfm(cc));
 	cc->dmreq_start = ALIGN(cc->dmreq_start, crypto_tfm_ctx_alignment());
-	cc->dmreq_start += crypto_ablkcipher_alignmask(tfm) &
+	cc->dmreq_start += crypto_ablkcipher_alignmask(any_tfm(cc)) &
 			   ~(crypto_tfm_ctx_alignment() - 1);
 
 	cc->req_pool = mempool_create_kmalloc_pool(MIN_IOS, cc->dmreq_start +
@@ -1116,7 +1257,6 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		ti->error = "Cannot allocate crypt request mempool";
 		goto bad_req_pool;
 	}
-	cc->req = NULL;
 
 	cc->page_pool = mempool_create_page_pool(MIN_POOL_PAGES, 0);
 	if (!cc->page_pool) {
@@ -1130,7 +1270,7 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_bs;
 	}
 
-	if (crypto_ablkcipher_setkey(tfm, cc->key, key_size) < 0) {
+	if (crypt_setkey_allcpus(cc) < 0) {
 		ti->error = "Error setting key";
 		goto bad_device;
 	}
@@ -1171,16 +1311,28 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_io_queue;
 	}
 
-	cc->crypt_queue = create_singlethread_workqueue("kcryptd");
+	cc->crypt_queue = create_workqueue("kcryptd");
 	if (!cc->crypt_queue) {
 		ti->error = "Couldn't create kcryptd queue";
 		goto bad_crypt_queue;
 	}
 
+	init_waitqueue_head(&cc->write_thread_wait);
+	spin_lock_init(&cc->write_thread_lock);
+	cc->write_tree = RB_ROOT;
+
+	cc->write_thread = kthread_run(dmcrypt_write, cc, "dmcrypt_write");
+	if (IS_ERR(cc->write_thread)) {
+		ti->error = "Couldn't spawn write thread";
+		goto bad_write_thread;
+	}
+
 	ti->num_flush_requests = 1;
 	ti->private = cc;
 	return 0;
 
+bad_write_thread:
+	destroy_workqueue(cc->crypt_queue);
 bad_crypt_queue:
 	destroy_workqueue(cc->io_queue);
 bad_io_queue:
@@ -1199,7 +1351,7 @@ bad_slab_pool:
 	if (cc->iv_gen_ops && cc->iv_gen_ops->dtr)
 		cc->iv_gen_ops->dtr(cc);
 bad_ivmode:
-	crypto_free_ablkcipher(tfm);
+	crypt_free_tfms(cc);
 bad_cipher:
 	/* Must zero key material before freeing */
 	kzfree(cc);
@@ -1209,12 +1361,19 @@ bad_cipher:
 static void crypt_dtr(struct dm_target *ti)
 {
 	struct crypt_config *cc = (struct crypt_config *) ti->private;
+	struct crypt_cpu *cs;
+	int cpu;
+
+	kthread_stop(cc->write_thread);
 
 	destroy_workqueue(cc->io_queue);
 	destroy_workqueue(cc->crypt_queue);
 
-	if (cc->req)
-		mempool_free(cc->req, cc->req_pool);
+	for_each_possible_cpu(cpu) {
+		cs = per_cpu_ptr(cc->cpu, cpu);
+		if (cs->req)
+			mempool_free(cs->req, cc->req_pool);
+	}
 
 	bioset_free(cc->bs);
 	mempool_destroy(cc->page_pool);
@@ -1224,7 +1383,7 @@ static void crypt_dtr(struct dm_target *ti)
 	kfree(cc->iv_mode);
 	if (cc->iv_gen_ops && cc->iv_gen_ops->dtr)
 		cc->iv_gen_ops->dtr(cc);
-	crypto_free_ablkcipher(cc->tfm);
+	crypt_free_tfms(cc);
 	dm_put_device(ti, cc->dev);
 
 	/* Must zero key material before freeing */
@@ -1245,9 +1404,10 @@ static int crypt_map(struct dm_target *ti, struct bio *bio,
 
 	io = crypt_io_alloc(ti, bio, bio->bi_sector - ti->begin);
 
-	if (bio_data_dir(io->base_bio) == READ)
-		kcryptd_queue_io(io);
-	else
+	if (bio_data_dir(io->base_bio) == READ) {
+		if (kcryptd_io_read(io, GFP_NOWAIT))
+			kcryptd_queue_io(io);
+	} else
 		kcryptd_queue_crypt(io);
 
 	return DM_MAPIO_SUBMITTED;
@@ -1335,6 +1495,9 @@ static int crypt_message(struct dm_target *ti, unsigned argc, char **argv)
 		}
 		if (argc == 3 && !strnicmp(argv[1], MESG_STR("set"))) {
 			ret = crypt_set_key(cc, argv[2]);
+			if (ret)
+				return ret;
+			ret = crypt_setkey_allcpus(cc);
 			if (ret)
 				return ret;
 			if (cc->iv_gen_ops && cc->iv_gen_ops->init)
@@ -1381,7 +1544,7 @@ static int crypt_iterate_devices(struct dm_target *ti,
 
 static struct target_type crypt_target = {
 	.name   = "crypt",
-	.version = {1, 7, 0},
+	.version = {1, 8, 0},
 	.module = THIS_MODULE,
 	.ctr    = crypt_ctr,
 	.dtr    = crypt_dtr,
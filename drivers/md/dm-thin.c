@@ -0,0 +1,2521 @@
+/*
+ * Thin provisioning: virtual devices allocating blocks on demand from
+ * a shared pool, with snapshots that share blocks with their origin.
+ *
+ * This file is released under the GPL.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mempool.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/crc32c.h>
+#include <linux/backing-dev.h>
+#include <linux/workqueue.h>
+#include <linux/dm-io.h>
+#include <linux/dm-kcopyd.h>
+
+#include <linux/device-mapper.h>
+
+#define DM_MSG_PREFIX "thin"
+
+typedef u64 dm_block_t;
+
+/*
+ * The metadata device is managed in blocks of 4k:
+ *
+ *   block 0		superblock
+ *   other blocks	btree nodes and the device table, allocated
+ *			as needed
+ *
+ * Each thin device maps its virtual blocks to data blocks with a btree.
+ * A snapshot starts out as a second reference to the btree of its
+ * origin.  Nodes and data blocks are reference counted, and a node or
+ * block with more than one reference is copied before it is changed,
+ * so a write to either device breaks the sharing for the blocks it
+ * touches once, however many snapshots share them.
+ *
+ * The reference counts only tell what is shared now, while a crash
+ * goes back to what was shared at the last commit.  So each mapping
+ * also records the pool time it was made at, which goes up with every
+ * snapshot, and each device the time of its last snapshot.  A block
+ * mapped before the device was last snapshotted is copied on write,
+ * whatever its reference count says, so that a block shared by the
+ * metadata on disk is never written in place.
+ *
+ * Nothing on disk is ever overwritten in place except the superblock.
+ * A commit writes the changed nodes and the device table to free
+ * blocks, flushes the data device, and then writes the superblock
+ * pointing at the new device table, so a crash leaves the state of
+ * the previous commit.  Blocks freed since that commit cannot be
+ * reused until the next one is done.
+ *
+ * The btrees and reference counts are held in memory while the pool
+ * is active.  They are read when the pool is first resumed and only
+ * written back, never read again, after that.
+ */
+#define THIN_SUPER_MAGIC	0x6e696874
+#define THIN_VERSION		2
+#define THIN_NODE_MAGIC		0x65646f6e
+#define THIN_TABLE_MAGIC	0x6c626174
+
+#define META_BLOCK_SIZE		4096
+#define META_BLOCK_SECTORS	(META_BLOCK_SIZE >> SECTOR_SHIFT)
+
+struct disk_super {
+	__le32 csum;
+	__le32 magic;
+	__le32 version;
+	__le32 data_block_size;	/* in sectors */
+	__le64 transaction_id;
+	__le64 nr_data_blocks;
+	__le64 nr_meta_blocks;
+	__le64 dev_table;	/* first block of the device table */
+	__le32 time;		/* of the last snapshot */
+} __packed;
+
+struct disk_node_header {
+	__le32 csum;
+	__le32 magic;
+	__le32 flags;
+	__le32 nr_entries;
+	__le64 blocknr;
+} __packed;
+
+#define NODE_LEAF		1
+
+/*
+ * Keys, then as many values: nodes in internal nodes, and in leaves the
+ * data block shifted left by TIME_BITS, or'ed with the time of the
+ * mapping.
+ */
+#define MAX_ENTRIES		((META_BLOCK_SIZE - \
+				  sizeof(struct disk_node_header)) / \
+				 (2 * sizeof(__le64)))
+
+struct disk_table_header {
+	__le32 csum;
+	__le32 magic;
+	__le32 nr_entries;
+	__le32 pad;
+	__le64 blocknr;
+	__le64 next;
+} __packed;
+
+struct disk_dev_entry {
+	__le64 dev_id;
+	__le64 root;
+	__le64 mapped_blocks;
+	__le32 snap_time;
+	__le32 pad;
+} __packed;
+
+#define TABLE_ENTRIES		((META_BLOCK_SIZE - \
+				  sizeof(struct disk_table_header)) / \
+				 sizeof(struct disk_dev_entry))
+
+/*
+ * Nodes are split on the way down when full, so an insertion needs at
+ * most two new nodes per level plus a new root.  No tree gets near
+ * this depth, it only bounds the reserve.
+ */
+#define MAX_DEPTH		16
+#define MAX_RESERVE		(2 * MAX_DEPTH + 2)
+
+#define TIME_BITS		24
+#define MAX_TIME		((1U << TIME_BITS) - 1)
+#define MAX_DATA_BLOCKS		(1ULL << (64 - TIME_BITS))
+
+#define COMMIT_PERIOD		HZ
+#define THIN_KCOPYD_PAGES	256
+#define MIN_MAPPINGS		64
+#define META_IO_PAGES		16
+#define CELL_BITS		8
+#define LOAD_HASH_BITS		12
+
+/*
+ * In-core btree node.  Internal nodes hold the lowest key of each
+ * child.  A node is written to a new location at the first commit
+ * after it changed, where is 0 until then.
+ */
+struct btree_node {
+	struct hlist_node hash;		/* by location, while loading */
+	dm_block_t where;
+	unsigned refs;
+	unsigned leaf;
+	unsigned nr_entries;
+	u64 keys[MAX_ENTRIES];
+	union {
+		u64 values[MAX_ENTRIES];	/* see pack_value() */
+		struct btree_node *children[MAX_ENTRIES];
+	} v;
+};
+
+struct thin_dev {
+	struct list_head list;
+	u64 id;
+	struct btree_node *root;
+	dm_block_t mapped_blocks;
+	u32 snap_time;			/* pool time of the last snapshot */
+	unsigned open_count;
+};
+
+struct pool_c;
+
+struct pool {
+	struct list_head list;		/* on the global pool list */
+	struct mapped_device *pool_md;
+	unsigned ref;
+
+	struct pool_c *pc;		/* table currently bound */
+	struct block_device *metadata_bdev;
+	struct block_device *data_bdev;
+
+	sector_t sectors_per_block;
+	unsigned block_shift;
+	dm_block_t nr_data_blocks;
+	dm_block_t nr_meta_blocks;
+	dm_block_t low_water_blocks;
+
+	/*
+	 * metadata_lock serializes all changes to the metadata and the
+	 * commits.  tree_lock is only taken around the changes to btrees,
+	 * device roots and reference counts, against the lookups done
+	 * in the map function.
+	 */
+	struct mutex metadata_lock;
+	rwlock_t tree_lock;
+	int loaded;
+	int failed;
+	int dirty;
+	int low_water_triggered;
+	u64 transaction_id;
+	u32 time;			/* of the last snapshot */
+
+	struct list_head devs;
+	unsigned nr_devs;
+	dm_block_t *table_blocks;
+	unsigned nr_table_blocks;
+
+	struct btree_node *reserve[MAX_RESERVE];
+	unsigned nr_reserve;
+
+	/* Reference counts of data blocks, by leaf entries */
+	u32 *data_refs;
+	unsigned long *data_pending;	/* freed since the last commit */
+	dm_block_t nr_free_data;
+	dm_block_t data_hint;
+
+	unsigned long *meta_used;
+	unsigned long *meta_pending;
+	dm_block_t nr_free_meta;
+	dm_block_t meta_hint;
+
+	/*
+	 * Bios remapped to data blocks that may be freed are counted in
+	 * the current epoch.  A commit starts a new epoch and waits for
+	 * the old one to drain before the blocks it frees can be reused.
+	 */
+	unsigned epoch;
+	atomic_t inflight[2];
+	wait_queue_head_t epoch_wait;
+
+	spinlock_t lock;
+	struct list_head thins;		/* active thin targets */
+	struct list_head prepared;	/* mappings whose I/O finished */
+	struct hlist_head cells[1 << CELL_BITS];
+	struct dm_thin_new_mapping *next_mapping;
+
+	struct dm_io_client *io_client;
+	struct dm_kcopyd_client *kcopyd_client;
+	mempool_t *mapping_pool;
+	mempool_t *page_pool;
+
+	struct workqueue_struct *wq;
+	struct work_struct worker;
+	struct delayed_work waker;
+};
+
+/* Per pool target */
+struct pool_c {
+	struct dm_target *ti;
+	struct pool *pool;
+	struct dm_dev *metadata_dev;
+	struct dm_dev *data_dev;
+	dm_block_t low_water_blocks;
+};
+
+/* Per thin target */
+struct thin_c {
+	struct list_head list;		/* on pool->thins */
+	struct dm_dev *pool_dev;
+	struct pool *pool;
+	struct thin_dev *td;
+	struct bio_list deferred;
+};
+
+/*
+ * A data block being allocated for a virtual block, either zeroed or
+ * copied from the block it shared.  Bios to the virtual block wait on
+ * the mapping until it is in the btree.  A bio overwriting the whole
+ * block is written to the new block instead, and is held back until
+ * then too.
+ */
+struct dm_thin_new_mapping {
+	struct hlist_node hash;
+	struct list_head list;
+	struct thin_c *tc;
+	dm_block_t vblock;
+	dm_block_t data_block;
+	int err;
+	struct bio_list bios;
+	struct bio *bio;
+	bio_end_io_t *saved_bi_end_io;
+	void *saved_bi_private;
+};
+
+static struct kmem_cache *node_cache;
+static struct kmem_cache *mapping_cache;
+
+static struct page_list zero_page_list;
+
+static DEFINE_MUTEX(pool_list_lock);
+static LIST_HEAD(pool_list);
+
+static sector_t get_dev_size(struct block_device *bdev)
+{
+	return i_size_read(bdev->bd_inode) >> SECTOR_SHIFT;
+}
+
+static dm_block_t get_bio_block(struct pool *pool, struct bio *bio)
+{
+	return bio->bi_sector >> pool->block_shift;
+}
+
+/* A leaf value: the data block, and the pool time it was mapped at */
+static u64 pack_value(dm_block_t block, u32 time)
+{
+	return (block << TIME_BITS) | time;
+}
+
+static dm_block_t value_block(u64 value)
+{
+	return value >> TIME_BITS;
+}
+
+static u32 value_time(u64 value)
+{
+	return value & MAX_TIME;
+}
+
+static void wake_worker(struct pool *pool)
+{
+	queue_work(pool->wq, &pool->worker);
+}
+
+/*-----------------------------------------------------------------
+ * Space maps.  Freed blocks go to the pending bitmaps and become
+ * free again after the next commit.
+ *---------------------------------------------------------------*/
+static void check_low_water(struct pool *pool)
+{
+	if (pool->nr_free_data >= pool->low_water_blocks ||
+	    pool->low_water_triggered || !pool->pc)
+		return;
+
+	DMWARN("%s: reached low water mark, %llu free data blocks",
+	       dm_device_name(pool->pool_md),
+	       (unsigned long long) pool->nr_free_data);
+	pool->low_water_triggered = 1;
+	dm_table_event(pool->pc->ti->table);
+}
+
+static int alloc_data_block(struct pool *pool, dm_block_t *result)
+{
+	dm_block_t b = pool->data_hint, i;
+
+	if (!pool->nr_free_data)
+		return -ENOSPC;
+
+	for (i = 0; i < pool->nr_data_blocks; i++, b++) {
+		if (b >= pool->nr_data_blocks)
+			b = 0;
+		if (!pool->data_refs[b] && !test_bit(b, pool->data_pending))
+			break;
+	}
+	BUG_ON(i == pool->nr_data_blocks);
+
+	pool->data_refs[b] = 1;
+	pool->nr_free_data--;
+	pool->data_hint = b + 1;
+	check_low_water(pool);
+
+	*result = b;
+	return 0;
+}
+
+static void dec_data(struct pool *pool, dm_block_t b)
+{
+	BUG_ON(!pool->data_refs[b]);
+
+	if (!--pool->data_refs[b])
+		set_bit(b, pool->data_pending);
+}
+
+static int alloc_meta_block(struct pool *pool, dm_block_t *result)
+{
+	dm_block_t b;
+
+	if (!pool->nr_free_meta)
+		return -ENOSPC;
+
+	b = find_next_zero_bit(pool->meta_used, pool->nr_meta_blocks,
+			       pool->meta_hint);
+	if (b >= pool->nr_meta_blocks)
+		b = find_first_zero_bit(pool->meta_used, pool->nr_meta_blocks);
+	BUG_ON(b >= pool->nr_meta_blocks);
+
+	set_bit(b, pool->meta_used);
+	pool->nr_free_meta--;
+	pool->meta_hint = b + 1;
+
+	*result = b;
+	return 0;
+}
+
+static void free_meta_block(struct pool *pool, dm_block_t b)
+{
+	set_bit(b, pool->meta_pending);
+}
+
+/*
+ * Called after a commit, when the blocks freed before it are no longer
+ * referenced by the metadata on disk.
+ */
+static void release_pending(struct pool *pool)
+{
+	unsigned long b;
+
+	for (b = find_first_bit(pool->meta_pending, pool->nr_meta_blocks);
+	     b < pool->nr_meta_blocks;
+	     b = find_next_bit(pool->meta_pending, pool->nr_meta_blocks, b + 1)) {
+		clear_bit(b, pool->meta_pending);
+		clear_bit(b, pool->meta_used);
+		pool->nr_free_meta++;
+	}
+
+	for (b = find_first_bit(pool->data_pending, pool->nr_data_blocks);
+	     b < pool->nr_data_blocks;
+	     b = find_next_bit(pool->data_pending, pool->nr_data_blocks, b + 1)) {
+		clear_bit(b, pool->data_pending);
+		if (!pool->data_refs[b])
+			pool->nr_free_data++;
+	}
+
+	if (pool->nr_free_data >= pool->low_water_blocks)
+		pool->low_water_triggered = 0;
+}
+
+/*-----------------------------------------------------------------
+ * Btrees.  All changes are made with metadata_lock held, and the
+ * nodes they need are taken from a reserve filled beforehand so that
+ * tree_lock can be held across the whole change.
+ *---------------------------------------------------------------*/
+static unsigned tree_height(struct btree_node *n)
+{
+	unsigned h = 0;
+
+	for (; n; h++)
+		n = n->leaf ? NULL : n->v.children[0];
+
+	return h;
+}
+
+static int fill_reserve(struct pool *pool, struct btree_node *root)
+{
+	unsigned nr = 2 * tree_height(root) + 2;
+
+	if (nr > MAX_RESERVE)
+		return -EFBIG;
+
+	while (pool->nr_reserve < nr) {
+		struct btree_node *n = kmem_cache_alloc(node_cache, GFP_NOIO);
+
+		if (!n) {
+			congestion_wait(BLK_RW_ASYNC, HZ / 50);
+			continue;
+		}
+		pool->reserve[pool->nr_reserve++] = n;
+	}
+
+	return 0;
+}
+
+static struct btree_node *alloc_node(struct pool *pool, unsigned leaf)
+{
+	struct btree_node *n;
+
+	BUG_ON(!pool->nr_reserve);
+	n = pool->reserve[--pool->nr_reserve];
+
+	INIT_HLIST_NODE(&n->hash);
+	n->where = 0;
+	n->refs = 1;
+	n->leaf = leaf;
+	n->nr_entries = 0;
+
+	return n;
+}
+
+/*
+ * Drop a reference to a node, freeing it and dropping the references
+ * it holds when it was the last one.
+ */
+static void dec_node(struct pool *pool, struct btree_node *n)
+{
+	unsigned i;
+
+	if (--n->refs)
+		return;
+
+	for (i = 0; i < n->nr_entries; i++) {
+		if (n->leaf)
+			dec_data(pool, value_block(n->v.values[i]));
+		else
+			dec_node(pool, n->v.children[i]);
+	}
+
+	if (n->where)
+		free_meta_block(pool, n->where);
+	kmem_cache_free(node_cache, n);
+	cond_resched();
+}
+
+static void copy_entries(struct btree_node *dest, unsigned d,
+			 struct btree_node *src, unsigned s, unsigned count)
+{
+	memmove(dest->keys + d, src->keys + s, count * sizeof(u64));
+	if (src->leaf)
+		memmove(dest->v.values + d, src->v.values + s,
+			count * sizeof(u64));
+	else
+		memmove(dest->v.children + d, src->v.children + s,
+			count * sizeof(struct btree_node *));
+}
+
+/*
+ * Make the node referenced by *ref private to the tree being changed,
+ * copying it if it is shared.  The copy takes references to whatever
+ * the node points to.  A node that was committed needs a new location
+ * once it changes, the old one is freed.
+ */
+static struct btree_node *make_mutable(struct pool *pool,
+				       struct btree_node **ref)
+{
+	struct btree_node *n = *ref, *copy;
+	unsigned i;
+
+	if (n->refs == 1) {
+		if (n->where) {
+			free_meta_block(pool, n->where);
+			n->where = 0;
+		}
+		return n;
+	}
+
+	copy = alloc_node(pool, n->leaf);
+	copy->nr_entries = n->nr_entries;
+	copy_entries(copy, 0, n, 0, n->nr_entries);
+	for (i = 0; i < n->nr_entries; i++) {
+		if (n->leaf)
+			pool->data_refs[value_block(n->v.values[i])]++;
+		else
+			n->v.children[i]->refs++;
+	}
+
+	n->refs--;
+	*ref = copy;
+	return copy;
+}
+
+/*
+ * Index of the last key not above key, -1 if there is none.
+ */
+static int lower_bound(struct btree_node *n, u64 key)
+{
+	int lo = -1, hi = n->nr_entries;
+
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (n->keys[mid] == key)
+			return mid;
+		if (n->keys[mid] < key)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Look up a virtual block of a device.  *shared is set if the mapping
+ * is reached through a shared node, the data block is shared, or it
+ * was mapped before the last snapshot of the device and may still be
+ * shared in the last commit.  The block must not be written in place
+ * then.
+ */
+static int btree_lookup(struct pool *pool, struct thin_dev *td, u64 key,
+			dm_block_t *result, int *shared)
+{
+	struct btree_node *n = td->root;
+	int i;
+
+	*shared = 0;
+	while (n) {
+		if (n->refs > 1)
+			*shared = 1;
+
+		i = lower_bound(n, key);
+		if (i < 0)
+			break;
+
+		if (n->leaf) {
+			if (n->keys[i] != key)
+				break;
+			*result = value_block(n->v.values[i]);
+			if (pool->data_refs[*result] > 1 ||
+			    value_time(n->v.values[i]) < td->snap_time)
+				*shared = 1;
+			return 0;
+		}
+
+		n = n->v.children[i];
+	}
+
+	return -ENODATA;
+}
+
+/*
+ * Split the full child i of parent in two halves.  Both are mutable.
+ */
+static void split_child(struct pool *pool, struct btree_node *parent,
+			unsigned i)
+{
+	struct btree_node *left = parent->v.children[i], *right;
+	unsigned nr_left = left->nr_entries / 2;
+
+	right = alloc_node(pool, left->leaf);
+	right->nr_entries = left->nr_entries - nr_left;
+	copy_entries(right, 0, left, nr_left, right->nr_entries);
+	left->nr_entries = nr_left;
+
+	copy_entries(parent, i + 2, parent, i + 1,
+		     parent->nr_entries - i - 1);
+	parent->keys[i + 1] = right->keys[0];
+	parent->v.children[i + 1] = right;
+	parent->nr_entries++;
+}
+
+/*
+ * Insert a leaf value, or replace the existing one for the key, in
+ * which case 1 is returned and the old value in *old.  Called with
+ * tree_lock held for writing and a full reserve.
+ */
+static int btree_insert(struct pool *pool, struct btree_node **root,
+			u64 key, u64 value, u64 *old)
+{
+	struct btree_node *n, *c;
+	int i;
+
+	if (!*root) {
+		n = *root = alloc_node(pool, 1);
+		n->keys[0] = key;
+		n->v.values[0] = value;
+		n->nr_entries = 1;
+		return 0;
+	}
+
+	n = make_mutable(pool, root);
+	if (n->nr_entries == MAX_ENTRIES) {
+		struct btree_node *r = alloc_node(pool, 0);
+
+		r->keys[0] = n->keys[0];
+		r->v.children[0] = n;
+		r->nr_entries = 1;
+		split_child(pool, r, 0);
+		*root = n = r;
+	}
+
+	while (!n->leaf) {
+		i = lower_bound(n, key);
+		if (i < 0) {
+			i = 0;
+			n->keys[0] = key;
+		}
+
+		c = make_mutable(pool, &n->v.children[i]);
+		if (c->nr_entries == MAX_ENTRIES) {
+			split_child(pool, n, i);
+			if (key >= n->keys[i + 1])
+				c = n->v.children[i + 1];
+		}
+		n = c;
+	}
+
+	i = lower_bound(n, key);
+	if (i >= 0 && n->keys[i] == key) {
+		*old = n->v.values[i];
+		n->v.values[i] = value;
+		return 1;
+	}
+
+	i++;
+	copy_entries(n, i + 1, n, i, n->nr_entries - i);
+	n->keys[i] = key;
+	n->v.values[i] = value;
+	n->nr_entries++;
+	return 0;
+}
+
+/*
+ * Map vblock of a thin device to a data block at the current time,
+ * dropping the reference to the block it was mapped to before.
+ */
+static int insert_mapping(struct pool *pool, struct thin_dev *td,
+			  dm_block_t vblock, dm_block_t data_block)
+{
+	u64 old;
+	int r;
+
+	r = fill_reserve(pool, td->root);
+	if (r)
+		return r;
+
+	write_lock(&pool->tree_lock);
+	r = btree_insert(pool, &td->root, vblock,
+			 pack_value(data_block, pool->time), &old);
+	if (r)
+		dec_data(pool, value_block(old));
+	else
+		td->mapped_blocks++;
+	write_unlock(&pool->tree_lock);
+
+	pool->dirty = 1;
+	return 0;
+}
+
+/*-----------------------------------------------------------------
+ * Metadata I/O
+ *---------------------------------------------------------------*/
+static u32 block_csum(void *data)
+{
+	return crc32c(~(u32) 0, data + sizeof(__le32),
+		      META_BLOCK_SIZE - sizeof(__le32));
+}
+
+static int meta_io(struct pool *pool, int rw, dm_block_t b, void *data,
+		   io_notify_fn fn, void *context)
+{
+	struct dm_io_region where = {
+		.bdev = pool->metadata_bdev,
+		.sector = b * META_BLOCK_SECTORS,
+		.count = META_BLOCK_SECTORS,
+	};
+	struct dm_io_request io_req = {
+		.bi_rw = rw,
+		.mem.type = DM_IO_KMEM,
+		.mem.ptr.addr = data,
+		.client = pool->io_client,
+		.notify.fn = fn,
+		.notify.context = context,
+	};
+
+	return dm_io(&io_req, 1, &where, NULL);
+}
+
+static int read_block(struct pool *pool, dm_block_t b, void *data)
+{
+	int r;
+
+	r = meta_io(pool, READ, b, data, NULL, NULL);
+	if (r)
+		return r;
+
+	if (le32_to_cpu(*(__le32 *) data) != block_csum(data)) {
+		DMERR("%s: checksum error in metadata block %llu",
+		      dm_device_name(pool->pool_md), (unsigned long long) b);
+		return -EILSEQ;
+	}
+
+	return 0;
+}
+
+/*
+ * The nodes and device table of a commit are written asynchronously,
+ * each from its own page.
+ */
+struct commit_io {
+	struct pool *pool;
+	atomic_t count;
+	int error;
+	struct completion done;
+};
+
+static void put_commit_io(struct commit_io *ci)
+{
+	if (atomic_dec_and_test(&ci->count))
+		complete(&ci->done);
+}
+
+static void commit_write_complete(unsigned long error, void *context)
+{
+	struct page *page = context;
+	struct commit_io *ci = (struct commit_io *) page_private(page);
+
+	if (error)
+		ci->error = -EIO;
+	mempool_free(page, ci->pool->page_pool);
+	put_commit_io(ci);
+}
+
+static void *get_commit_page(struct commit_io *ci)
+{
+	struct page *page = mempool_alloc(ci->pool->page_pool, GFP_NOIO);
+
+	set_page_private(page, (unsigned long) ci);
+	memset(page_address(page), 0, META_BLOCK_SIZE);
+	return page_address(page);
+}
+
+static int write_commit_page(struct commit_io *ci, dm_block_t b, void *data)
+{
+	struct page *page = virt_to_page(data);
+	int r;
+
+	*(__le32 *) data = cpu_to_le32(block_csum(data));
+
+	atomic_inc(&ci->count);
+	r = meta_io(ci->pool, WRITE, b, data, commit_write_complete, page);
+	if (r) {
+		mempool_free(page, ci->pool->page_pool);
+		put_commit_io(ci);
+	}
+
+	return r;
+}
+
+/*
+ * Write the nodes that changed since the last commit, children first
+ * so that their new locations are known to the parent.
+ */
+static int write_node(struct commit_io *ci, struct btree_node *n)
+{
+	struct pool *pool = ci->pool;
+	struct disk_node_header *h;
+	__le64 *keys, *values;
+	dm_block_t b;
+	unsigned i;
+	int r;
+
+	if (n->where)
+		return 0;
+
+	for (i = 0; !n->leaf && i < n->nr_entries; i++) {
+		r = write_node(ci, n->v.children[i]);
+		if (r)
+			return r;
+	}
+
+	r = alloc_meta_block(pool, &b);
+	if (r)
+		return r;
+	n->where = b;
+
+	h = get_commit_page(ci);
+	h->magic = cpu_to_le32(THIN_NODE_MAGIC);
+	h->flags = cpu_to_le32(n->leaf ? NODE_LEAF : 0);
+	h->nr_entries = cpu_to_le32(n->nr_entries);
+	h->blocknr = cpu_to_le64(b);
+
+	keys = (__le64 *) (h + 1);
+	values = keys + MAX_ENTRIES;
+	for (i = 0; i < n->nr_entries; i++) {
+		keys[i] = cpu_to_le64(n->keys[i]);
+		values[i] = cpu_to_le64(n->leaf ? n->v.values[i] :
+					n->v.children[i]->where);
+	}
+
+	return write_commit_page(ci, b, h);
+}
+
+/*
+ * The device table is small and rewritten to new blocks as a whole.
+ */
+static int write_dev_table(struct commit_io *ci)
+{
+	struct pool *pool = ci->pool;
+	unsigned nr = DIV_ROUND_UP(pool->nr_devs, TABLE_ENTRIES), i, j;
+	struct disk_table_header *h;
+	struct disk_dev_entry *de;
+	struct thin_dev *td;
+	dm_block_t *blocks;
+	int r;
+
+	blocks = kmalloc(max(nr, 1U) * sizeof(*blocks), GFP_NOIO);
+	if (!blocks)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		r = alloc_meta_block(pool, blocks + i);
+		if (r) {
+			while (i--)
+				free_meta_block(pool, blocks[i]);
+			kfree(blocks);
+			return r;
+		}
+	}
+
+	for (i = 0; i < pool->nr_table_blocks; i++)
+		free_meta_block(pool, pool->table_blocks[i]);
+	kfree(pool->table_blocks);
+	pool->table_blocks = blocks;
+	pool->nr_table_blocks = nr;
+
+	td = list_entry(pool->devs.next, struct thin_dev, list);
+	for (i = 0; i < nr; i++) {
+		h = get_commit_page(ci);
+		h->magic = cpu_to_le32(THIN_TABLE_MAGIC);
+		h->blocknr = cpu_to_le64(blocks[i]);
+		h->next = cpu_to_le64(i + 1 < nr ? blocks[i + 1] : 0);
+
+		de = (struct disk_dev_entry *) (h + 1);
+		for (j = 0; j < TABLE_ENTRIES && &td->list != &pool->devs;
+		     j++, td = list_entry(td->list.next, struct thin_dev, list)) {
+			de[j].dev_id = cpu_to_le64(td->id);
+			de[j].root = cpu_to_le64(td->root ? td->root->where : 0);
+			de[j].mapped_blocks = cpu_to_le64(td->mapped_blocks);
+			de[j].snap_time = cpu_to_le32(td->snap_time);
+		}
+		h->nr_entries = cpu_to_le32(j);
+
+		r = write_commit_page(ci, blocks[i], h);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+static int write_super(struct pool *pool, u64 transaction_id)
+{
+	struct disk_super *ds;
+	int r;
+
+	ds = kzalloc(META_BLOCK_SIZE, GFP_NOIO);
+	if (!ds)
+		return -ENOMEM;
+
+	ds->magic = cpu_to_le32(THIN_SUPER_MAGIC);
+	ds->version = cpu_to_le32(THIN_VERSION);
+	ds->data_block_size = cpu_to_le32(pool->sectors_per_block);
+	ds->transaction_id = cpu_to_le64(transaction_id);
+	ds->nr_data_blocks = cpu_to_le64(pool->nr_data_blocks);
+	ds->nr_meta_blocks = cpu_to_le64(pool->nr_meta_blocks);
+	ds->dev_table = cpu_to_le64(pool->nr_table_blocks ?
+				    pool->table_blocks[0] : 0);
+	ds->time = cpu_to_le32(pool->time);
+	ds->csum = cpu_to_le32(block_csum(ds));
+
+	r = meta_io(pool, WRITE_BARRIER, 0, ds, NULL, NULL);
+	kfree(ds);
+
+	return r;
+}
+
+/*
+ * Make the current state durable.  Called with metadata_lock held.
+ * A pool whose metadata cannot be written fails all further writes,
+ * since the in-core state no longer matches the disk.
+ */
+static int commit(struct pool *pool)
+{
+	struct commit_io ci;
+	struct thin_dev *td;
+	unsigned old_epoch;
+	int r = 0;
+
+	if (pool->failed)
+		return -EIO;
+
+	write_lock(&pool->tree_lock);
+	old_epoch = pool->epoch;
+	pool->epoch ^= 1;
+	write_unlock(&pool->tree_lock);
+
+	ci.pool = pool;
+	atomic_set(&ci.count, 1);
+	ci.error = 0;
+	init_completion(&ci.done);
+
+	list_for_each_entry(td, &pool->devs, list) {
+		if (td->root) {
+			r = write_node(&ci, td->root);
+			if (r)
+				break;
+		}
+	}
+	if (!r)
+		r = write_dev_table(&ci);
+
+	put_commit_io(&ci);
+	wait_for_completion(&ci.done);
+	if (!r)
+		r = ci.error;
+
+	if (!r) {
+		r = blkdev_issue_flush(pool->data_bdev, NULL);
+		if (r == -EOPNOTSUPP)
+			r = 0;
+	}
+
+	if (!r)
+		r = write_super(pool, pool->transaction_id + 1);
+
+	if (r) {
+		DMERR("%s: metadata commit failed: %d",
+		      dm_device_name(pool->pool_md), r);
+		pool->failed = 1;
+		return r;
+	}
+
+	pool->transaction_id++;
+	pool->dirty = 0;
+
+	wait_event(pool->epoch_wait, !atomic_read(&pool->inflight[old_epoch]));
+	release_pending(pool);
+
+	return 0;
+}
+
+/*
+ * Complete a flush: commit if anything changed, else the data device
+ * only has to be flushed.
+ */
+static int pool_flush(struct pool *pool)
+{
+	int r;
+
+	if (pool->dirty || pool->failed)
+		return commit(pool);
+
+	r = blkdev_issue_flush(pool->data_bdev, NULL);
+	return r == -EOPNOTSUPP ? 0 : r;
+}
+
+/*-----------------------------------------------------------------
+ * Loading the metadata
+ *---------------------------------------------------------------*/
+static void free_metadata(struct pool *pool)
+{
+	struct thin_dev *td, *tmp;
+
+	list_for_each_entry_safe(td, tmp, &pool->devs, list) {
+		if (td->root)
+			dec_node(pool, td->root);
+		list_del(&td->list);
+		kfree(td);
+	}
+	pool->nr_devs = 0;
+
+	while (pool->nr_reserve)
+		kmem_cache_free(node_cache, pool->reserve[--pool->nr_reserve]);
+
+	kfree(pool->table_blocks);
+	pool->table_blocks = NULL;
+	pool->nr_table_blocks = 0;
+}
+
+static void reset_space_maps(struct pool *pool)
+{
+	memset(pool->data_refs, 0, pool->nr_data_blocks * sizeof(u32));
+	memset(pool->data_pending, 0,
+	       BITS_TO_LONGS(pool->nr_data_blocks) * sizeof(long));
+	memset(pool->meta_used, 0,
+	       BITS_TO_LONGS(pool->nr_meta_blocks) * sizeof(long));
+	memset(pool->meta_pending, 0,
+	       BITS_TO_LONGS(pool->nr_meta_blocks) * sizeof(long));
+
+	set_bit(0, pool->meta_used);
+	pool->nr_free_meta = pool->nr_meta_blocks - 1;
+	pool->nr_free_data = pool->nr_data_blocks;
+	pool->data_hint = pool->meta_hint = 0;
+}
+
+struct load_context {
+	struct pool *pool;
+	struct hlist_head hash[1 << LOAD_HASH_BITS];
+};
+
+static struct hlist_head *load_bucket(struct load_context *lc, dm_block_t b)
+{
+	return lc->hash + hash_long((unsigned long) b, LOAD_HASH_BITS);
+}
+
+/*
+ * Read the node at b and everything below it.  Nodes shared by several
+ * trees are read once and get a reference per parent.
+ */
+static struct btree_node *load_node(struct load_context *lc, dm_block_t b,
+				    unsigned depth)
+{
+	struct pool *pool = lc->pool;
+	struct disk_node_header *h;
+	struct btree_node *n;
+	struct hlist_node *pos;
+	__le64 *keys, *values;
+	unsigned i;
+	int r;
+
+	hlist_for_each_entry(n, pos, load_bucket(lc, b), hash)
+		if (n->where == b) {
+			n->refs++;
+			return n;
+		}
+
+	if (!b || b >= pool->nr_meta_blocks || depth >= MAX_DEPTH)
+		return ERR_PTR(-EINVAL);
+
+	h = kmalloc(META_BLOCK_SIZE, GFP_KERNEL);
+	n = kmem_cache_alloc(node_cache, GFP_KERNEL);
+	if (!h || !n) {
+		r = -ENOMEM;
+		goto bad;
+	}
+
+	r = read_block(pool, b, h);
+	if (r)
+		goto bad;
+
+	r = -EINVAL;
+	if (le32_to_cpu(h->magic) != THIN_NODE_MAGIC ||
+	    le64_to_cpu(h->blocknr) != b ||
+	    !le32_to_cpu(h->nr_entries) ||
+	    le32_to_cpu(h->nr_entries) > MAX_ENTRIES ||
+	    test_bit(b, pool->meta_used))
+		goto bad;
+
+	INIT_HLIST_NODE(&n->hash);
+	n->where = b;
+	n->refs = 1;
+	n->leaf = !!(le32_to_cpu(h->flags) & NODE_LEAF);
+	n->nr_entries = 0;
+	set_bit(b, pool->meta_used);
+	pool->nr_free_meta--;
+
+	keys = (__le64 *) (h + 1);
+	values = keys + MAX_ENTRIES;
+	for (i = 0; i < le32_to_cpu(h->nr_entries); i++) {
+		n->keys[i] = le64_to_cpu(keys[i]);
+		if (n->leaf) {
+			u64 value = le64_to_cpu(values[i]);
+			dm_block_t data_block = value_block(value);
+
+			if (data_block >= pool->nr_data_blocks ||
+			    value_time(value) > pool->time)
+				goto bad_entries;
+			if (!pool->data_refs[data_block]++)
+				pool->nr_free_data--;
+			n->v.values[i] = value;
+		} else {
+			struct btree_node *c;
+
+			c = load_node(lc, le64_to_cpu(values[i]), depth + 1);
+			if (IS_ERR(c)) {
+				r = PTR_ERR(c);
+				goto bad_entries;
+			}
+			n->v.children[i] = c;
+		}
+		n->nr_entries++;
+	}
+
+	hlist_add_head(&n->hash, load_bucket(lc, b));
+	kfree(h);
+	return n;
+
+bad_entries:
+	dec_node(pool, n);
+	n = NULL;
+bad:
+	if (n)
+		kmem_cache_free(node_cache, n);
+	kfree(h);
+	DMERR("%s: cannot load metadata block %llu",
+	      dm_device_name(pool->pool_md), (unsigned long long) b);
+	return ERR_PTR(r);
+}
+
+static int load_dev_table(struct load_context *lc, dm_block_t b)
+{
+	struct pool *pool = lc->pool;
+	struct disk_table_header *h;
+	struct disk_dev_entry *de;
+	struct thin_dev *td;
+	dm_block_t *blocks;
+	unsigned i;
+	int r = 0;
+
+	h = kmalloc(META_BLOCK_SIZE, GFP_KERNEL);
+	if (!h)
+		return -ENOMEM;
+
+	for (; b && !r; b = le64_to_cpu(h->next)) {
+		if (b >= pool->nr_meta_blocks || test_bit(b, pool->meta_used)) {
+			r = -EINVAL;
+			break;
+		}
+
+		r = read_block(pool, b, h);
+		if (r)
+			break;
+
+		if (le32_to_cpu(h->magic) != THIN_TABLE_MAGIC ||
+		    le64_to_cpu(h->blocknr) != b ||
+		    le32_to_cpu(h->nr_entries) > TABLE_ENTRIES) {
+			r = -EINVAL;
+			break;
+		}
+
+		blocks = krealloc(pool->table_blocks,
+			(pool->nr_table_blocks + 1) * sizeof(*blocks),
+			GFP_KERNEL);
+		if (!blocks) {
+			r = -ENOMEM;
+			break;
+		}
+		blocks[pool->nr_table_blocks++] = b;
+		pool->table_blocks = blocks;
+		set_bit(b, pool->meta_used);
+		pool->nr_free_meta--;
+
+		de = (struct disk_dev_entry *) (h + 1);
+		for (i = 0; i < le32_to_cpu(h->nr_entries); i++) {
+			td = kzalloc(sizeof(*td), GFP_KERNEL);
+			if (!td) {
+				r = -ENOMEM;
+				break;
+			}
+			td->id = le64_to_cpu(de[i].dev_id);
+			td->mapped_blocks = le64_to_cpu(de[i].mapped_blocks);
+			td->snap_time = le32_to_cpu(de[i].snap_time);
+			list_add_tail(&td->list, &pool->devs);
+			pool->nr_devs++;
+
+			if (!de[i].root)
+				continue;
+			td->root = load_node(lc, le64_to_cpu(de[i].root), 0);
+			if (IS_ERR(td->root)) {
+				r = PTR_ERR(td->root);
+				td->root = NULL;
+				break;
+			}
+		}
+	}
+
+	kfree(h);
+	return r;
+}
+
+static int block_is_zero(void *data)
+{
+	unsigned long *p = data;
+	unsigned i;
+
+	for (i = 0; i < META_BLOCK_SIZE / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+static int format_metadata(struct pool *pool)
+{
+	int r;
+
+	DMINFO("%s: formatting metadata device",
+	       dm_device_name(pool->pool_md));
+
+	pool->transaction_id = 0;
+	pool->time = 0;
+	r = write_super(pool, 0);
+	if (r)
+		DMERR("%s: cannot write superblock",
+		      dm_device_name(pool->pool_md));
+
+	return r;
+}
+
+static int load_metadata(struct pool *pool)
+{
+	struct load_context *lc;
+	struct disk_super *ds;
+	unsigned i;
+	int r;
+
+	reset_space_maps(pool);
+
+	ds = kmalloc(META_BLOCK_SIZE, GFP_KERNEL);
+	lc = kmalloc(sizeof(*lc), GFP_KERNEL);
+	if (!ds || !lc) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = meta_io(pool, READ, 0, ds, NULL, NULL);
+	if (r)
+		goto out;
+
+	/*
+	 * Only a zeroed device is formatted, so that passing the wrong
+	 * device does not destroy what is on it.
+	 */
+	if (le32_to_cpu(ds->magic) != THIN_SUPER_MAGIC) {
+		if (block_is_zero(ds))
+			r = format_metadata(pool);
+		else {
+			DMERR("%s: metadata device holds no pool and is not "
+			      "zeroed", dm_device_name(pool->pool_md));
+			r = -EINVAL;
+		}
+		goto out;
+	}
+
+	r = -EINVAL;
+	if (le32_to_cpu(ds->csum) != block_csum(ds)) {
+		DMERR("%s: superblock checksum error",
+		      dm_device_name(pool->pool_md));
+		goto out;
+	}
+	if (le32_to_cpu(ds->version) != THIN_VERSION) {
+		DMERR("%s: unsupported metadata version %u",
+		      dm_device_name(pool->pool_md), le32_to_cpu(ds->version));
+		goto out;
+	}
+	if (le32_to_cpu(ds->data_block_size) != pool->sectors_per_block) {
+		DMERR("%s: data block size does not match the metadata",
+		      dm_device_name(pool->pool_md));
+		goto out;
+	}
+	if (le64_to_cpu(ds->nr_data_blocks) > pool->nr_data_blocks ||
+	    le64_to_cpu(ds->nr_meta_blocks) > pool->nr_meta_blocks) {
+		DMERR("%s: pool is smaller than the metadata says",
+		      dm_device_name(pool->pool_md));
+		goto out;
+	}
+
+	lc->pool = pool;
+	for (i = 0; i < ARRAY_SIZE(lc->hash); i++)
+		INIT_HLIST_HEAD(lc->hash + i);
+	pool->time = le32_to_cpu(ds->time);
+
+	r = load_dev_table(lc, le64_to_cpu(ds->dev_table));
+	if (r) {
+		free_metadata(pool);
+		reset_space_maps(pool);
+		goto out;
+	}
+	pool->transaction_id = le64_to_cpu(ds->transaction_id);
+
+	/* The nodes stay in the hash heads, which go away */
+	for (i = 0; i < ARRAY_SIZE(lc->hash); i++) {
+		struct hlist_node *pos, *tmp;
+
+		hlist_for_each_safe(pos, tmp, lc->hash + i)
+			INIT_HLIST_NODE(pos);
+	}
+
+out:
+	kfree(lc);
+	kfree(ds);
+	return r;
+}
+
+/*
+ * Grow the data space maps to the current size of the pool target.
+ * Called with metadata_lock held.
+ */
+static int resize_data(struct pool *pool, dm_block_t nr_blocks)
+{
+	unsigned long *pending;
+	u32 *refs;
+
+	if (nr_blocks == pool->nr_data_blocks)
+		return 0;
+
+	if (nr_blocks < pool->nr_data_blocks) {
+		DMERR("%s: pool cannot shrink", dm_device_name(pool->pool_md));
+		return -EINVAL;
+	}
+
+	refs = vmalloc(nr_blocks * sizeof(u32));
+	pending = vmalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!refs || !pending) {
+		vfree(refs);
+		vfree(pending);
+		return -ENOMEM;
+	}
+
+	memset(refs, 0, nr_blocks * sizeof(u32));
+	memset(pending, 0, BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	memcpy(refs, pool->data_refs, pool->nr_data_blocks * sizeof(u32));
+	memcpy(pending, pool->data_pending,
+	       BITS_TO_LONGS(pool->nr_data_blocks) * sizeof(long));
+
+	write_lock(&pool->tree_lock);
+	swap(refs, pool->data_refs);
+	write_unlock(&pool->tree_lock);
+	swap(pending, pool->data_pending);
+	vfree(refs);
+	vfree(pending);
+
+	pool->nr_free_data += nr_blocks - pool->nr_data_blocks;
+	pool->nr_data_blocks = nr_blocks;
+	if (pool->nr_free_data >= pool->low_water_blocks)
+		pool->low_water_triggered = 0;
+	pool->dirty = 1;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------
+ * Thin devices
+ *---------------------------------------------------------------*/
+static struct thin_dev *find_dev(struct pool *pool, u64 id)
+{
+	struct thin_dev *td;
+
+	list_for_each_entry(td, &pool->devs, list)
+		if (td->id == id)
+			return td;
+
+	return NULL;
+}
+
+static int create_dev(struct pool *pool, u64 id, struct thin_dev *origin)
+{
+	struct thin_dev *td;
+
+	if (find_dev(pool, id))
+		return -EEXIST;
+
+	if (origin && pool->time == MAX_TIME)
+		return -ENOSPC;
+
+	td = kzalloc(sizeof(*td), GFP_KERNEL);
+	if (!td)
+		return -ENOMEM;
+	td->id = id;
+
+	/*
+	 * A snapshot takes a reference to the root of its origin, the
+	 * btrees come apart as either of them is written.  Both copy the
+	 * blocks mapped until now before writing them.
+	 */
+	if (origin) {
+		write_lock(&pool->tree_lock);
+		td->root = origin->root;
+		if (td->root)
+			td->root->refs++;
+		td->mapped_blocks = origin->mapped_blocks;
+		td->snap_time = origin->snap_time = ++pool->time;
+		write_unlock(&pool->tree_lock);
+	}
+
+	list_add_tail(&td->list, &pool->devs);
+	pool->nr_devs++;
+	pool->dirty = 1;
+
+	return 0;
+}
+
+static int delete_dev(struct pool *pool, u64 id)
+{
+	struct thin_dev *td = find_dev(pool, id);
+
+	if (!td)
+		return -ENODEV;
+	if (td->open_count)
+		return -EBUSY;
+
+	list_del(&td->list);
+	pool->nr_devs--;
+	if (td->root)
+		dec_node(pool, td->root);
+	kfree(td);
+	pool->dirty = 1;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------
+ * Bio processing
+ *---------------------------------------------------------------*/
+static void remap(struct pool *pool, struct bio *bio, dm_block_t block)
+{
+	bio->bi_bdev = pool->data_bdev;
+	bio->bi_sector = (block << pool->block_shift) +
+			 (bio->bi_sector & (pool->sectors_per_block - 1));
+}
+
+/*
+ * Remap a bio in the current epoch, so that the block stays allocated
+ * until it completes.  Called from the worker, which commits itself.
+ */
+static void remap_and_issue(struct pool *pool, struct bio *bio,
+			    dm_block_t block)
+{
+	dm_get_mapinfo(bio)->ll = pool->epoch + 1;
+	atomic_inc(&pool->inflight[pool->epoch]);
+	remap(pool, bio, block);
+	generic_make_request(bio);
+}
+
+static void thin_defer_bio(struct thin_c *tc, struct bio *bio)
+{
+	struct pool *pool = tc->pool;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	bio_list_add(&tc->deferred, bio);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	wake_worker(pool);
+}
+
+static struct hlist_head *cell_bucket(struct pool *pool, struct thin_dev *td,
+				      dm_block_t vblock)
+{
+	unsigned long h = (unsigned long) vblock ^ (unsigned long) td;
+
+	return pool->cells + hash_long(h, CELL_BITS);
+}
+
+static struct dm_thin_new_mapping *find_cell(struct pool *pool,
+					     struct thin_dev *td,
+					     dm_block_t vblock)
+{
+	struct dm_thin_new_mapping *m;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(m, pos, cell_bucket(pool, td, vblock), hash)
+		if (m->tc->td == td && m->vblock == vblock)
+			return m;
+
+	return NULL;
+}
+
+static void mapping_prepared(struct dm_thin_new_mapping *m)
+{
+	struct pool *pool = m->tc->pool;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	list_add_tail(&m->list, &pool->prepared);
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	wake_worker(pool);
+}
+
+static void copy_complete(int read_err, unsigned long write_err,
+			  void *context)
+{
+	struct dm_thin_new_mapping *m = context;
+
+	m->err = read_err || write_err ? -EIO : 0;
+	mapping_prepared(m);
+}
+
+static void zero_complete(unsigned long error, void *context)
+{
+	struct dm_thin_new_mapping *m = context;
+
+	m->err = error ? -EIO : 0;
+	mapping_prepared(m);
+}
+
+static void overwrite_endio(struct bio *bio, int err)
+{
+	struct dm_thin_new_mapping *m = bio->bi_private;
+
+	bio->bi_end_io = m->saved_bi_end_io;
+	bio->bi_private = m->saved_bi_private;
+	m->err = err;
+	mapping_prepared(m);
+}
+
+static int io_overwrites_block(struct pool *pool, struct bio *bio)
+{
+	return bio_data_dir(bio) == WRITE &&
+	       bio->bi_size == (pool->sectors_per_block << SECTOR_SHIFT);
+}
+
+/*
+ * Allocate a data block for a write to vblock, copying the contents of
+ * the shared block old_block, or zeroing it when there is none.  The
+ * copy is not needed if the bio overwrites the whole block.
+ */
+static void schedule_mapping(struct thin_c *tc, struct bio *bio,
+			     dm_block_t vblock, int copy,
+			     dm_block_t old_block)
+{
+	struct pool *pool = tc->pool;
+	struct dm_thin_new_mapping *m;
+	dm_block_t data_block;
+	int r;
+
+	r = alloc_data_block(pool, &data_block);
+	if (r) {
+		DMERR_LIMIT("%s: out of data space",
+			    dm_device_name(pool->pool_md));
+		bio_endio(bio, r);
+		return;
+	}
+
+	m = pool->next_mapping;
+	pool->next_mapping = NULL;
+
+	m->tc = tc;
+	m->vblock = vblock;
+	m->data_block = data_block;
+	m->err = 0;
+	m->bio = NULL;
+	bio_list_init(&m->bios);
+	hlist_add_head(&m->hash, cell_bucket(pool, tc->td, vblock));
+
+	if (io_overwrites_block(pool, bio)) {
+		/* The block is new, it need not be held by the epoch */
+		m->bio = bio;
+		m->saved_bi_end_io = bio->bi_end_io;
+		m->saved_bi_private = bio->bi_private;
+		bio->bi_end_io = overwrite_endio;
+		bio->bi_private = m;
+		remap(pool, bio, data_block);
+		generic_make_request(bio);
+		return;
+	}
+
+	bio_list_add(&m->bios, bio);
+
+	if (copy) {
+		struct dm_io_region from = {
+			.bdev = pool->data_bdev,
+			.sector = old_block << pool->block_shift,
+			.count = pool->sectors_per_block,
+		};
+		struct dm_io_region to = {
+			.bdev = pool->data_bdev,
+			.sector = data_block << pool->block_shift,
+			.count = pool->sectors_per_block,
+		};
+
+		r = dm_kcopyd_copy(pool->kcopyd_client, &from, 1, &to, 0,
+				   copy_complete, m);
+	} else {
+		struct dm_io_region to = {
+			.bdev = pool->data_bdev,
+			.sector = data_block << pool->block_shift,
+			.count = pool->sectors_per_block,
+		};
+		struct dm_io_request io_req = {
+			.bi_rw = WRITE,
+			.mem.type = DM_IO_PAGE_LIST,
+			.mem.ptr.pl = &zero_page_list,
+			.client = pool->io_client,
+			.notify.fn = zero_complete,
+			.notify.context = m,
+		};
+
+		r = dm_io(&io_req, 1, &to, NULL);
+	}
+
+	if (r) {
+		m->err = r;
+		mapping_prepared(m);
+	}
+}
+
+static void process_bio(struct thin_c *tc, struct bio *bio)
+{
+	struct pool *pool = tc->pool;
+	dm_block_t vblock = get_bio_block(pool, bio), block;
+	struct dm_thin_new_mapping *m;
+	int r, shared;
+
+	if (bio_empty_barrier(bio)) {
+		bio_endio(bio, pool_flush(pool));
+		return;
+	}
+
+	m = find_cell(pool, tc->td, vblock);
+	if (m) {
+		bio_list_add(&m->bios, bio);
+		return;
+	}
+
+	r = btree_lookup(pool, tc->td, vblock, &block, &shared);
+	if (bio_data_dir(bio) == READ) {
+		if (r) {
+			zero_fill_bio(bio);
+			bio_endio(bio, 0);
+		} else
+			remap_and_issue(pool, bio, block);
+		return;
+	}
+
+	if (pool->failed) {
+		bio_endio(bio, -EIO);
+		return;
+	}
+
+	if (r)
+		schedule_mapping(tc, bio, vblock, 0, 0);
+	else if (shared)
+		schedule_mapping(tc, bio, vblock, 1, block);
+	else
+		remap_and_issue(pool, bio, block);
+}
+
+static void process_mapping(struct dm_thin_new_mapping *m)
+{
+	struct thin_c *tc = m->tc;
+	struct pool *pool = tc->pool;
+	struct bio *bio;
+	int r = m->err;
+
+	if (!r) {
+		r = insert_mapping(pool, tc->td, m->vblock, m->data_block);
+		if (r)
+			DMERR_LIMIT("%s: cannot insert mapping: %d",
+				    dm_device_name(pool->pool_md), r);
+	}
+	if (r)
+		dec_data(pool, m->data_block);
+
+	hlist_del(&m->hash);
+	if (m->bio)
+		bio_endio(m->bio, r);
+
+	if (r) {
+		while ((bio = bio_list_pop(&m->bios)))
+			bio_endio(bio, r);
+	} else {
+		spin_lock_irq(&pool->lock);
+		bio_list_merge_head(&tc->deferred, &m->bios);
+		spin_unlock_irq(&pool->lock);
+	}
+
+	mempool_free(m, pool->mapping_pool);
+}
+
+/*
+ * A mapping is allocated before each deferred bio is looked at, the
+ * worker cannot wait for one since only it frees them.  The bios left
+ * are processed once a mapping completes.
+ */
+static int ensure_next_mapping(struct pool *pool)
+{
+	if (!pool->next_mapping)
+		pool->next_mapping = mempool_alloc(pool->mapping_pool,
+						   GFP_NOWAIT);
+
+	return pool->next_mapping ? 0 : -ENOMEM;
+}
+
+/*
+ * The list is searched from the start each time the lock was dropped:
+ * a thin target with no bios left in flight may go away meanwhile.
+ */
+static struct thin_c *next_deferred(struct pool *pool)
+{
+	struct thin_c *tc;
+
+	list_for_each_entry(tc, &pool->thins, list)
+		if (!bio_list_empty(&tc->deferred))
+			return tc;
+
+	return NULL;
+}
+
+static void process_deferred_bios(struct pool *pool)
+{
+	struct thin_c *tc;
+	struct bio_list bios;
+	struct bio *bio;
+
+	spin_lock_irq(&pool->lock);
+	while ((tc = next_deferred(pool))) {
+		bios = tc->deferred;
+		bio_list_init(&tc->deferred);
+		spin_unlock_irq(&pool->lock);
+
+		while ((bio = bio_list_pop(&bios))) {
+			if (ensure_next_mapping(pool)) {
+				bio_list_add_head(&bios, bio);
+				break;
+			}
+			process_bio(tc, bio);
+		}
+
+		spin_lock_irq(&pool->lock);
+		if (!bio_list_empty(&bios)) {
+			bio_list_merge_head(&tc->deferred, &bios);
+			break;
+		}
+	}
+	spin_unlock_irq(&pool->lock);
+}
+
+static void do_worker(struct work_struct *ws)
+{
+	struct pool *pool = container_of(ws, struct pool, worker);
+	struct dm_thin_new_mapping *m, *tmp;
+	LIST_HEAD(prepared);
+
+	mutex_lock(&pool->metadata_lock);
+
+	spin_lock_irq(&pool->lock);
+	list_splice_init(&pool->prepared, &prepared);
+	spin_unlock_irq(&pool->lock);
+
+	list_for_each_entry_safe(m, tmp, &prepared, list)
+		process_mapping(m);
+
+	process_deferred_bios(pool);
+
+	mutex_unlock(&pool->metadata_lock);
+}
+
+static void do_waker(struct work_struct *ws)
+{
+	struct pool *pool = container_of(to_delayed_work(ws), struct pool,
+					 waker);
+
+	mutex_lock(&pool->metadata_lock);
+	if (pool->dirty && !pool->failed)
+		commit(pool);
+	mutex_unlock(&pool->metadata_lock);
+
+	queue_delayed_work(pool->wq, &pool->waker, COMMIT_PERIOD);
+}
+
+/*-----------------------------------------------------------------
+ * Pool objects are shared by all tables of a pool device, and by the
+ * thin devices using it.
+ *---------------------------------------------------------------*/
+static struct pool *find_pool(struct mapped_device *md)
+{
+	struct pool *pool;
+
+	list_for_each_entry(pool, &pool_list, list)
+		if (pool->pool_md == md)
+			return pool;
+
+	return NULL;
+}
+
+static void destroy_pool(struct pool *pool)
+{
+	cancel_delayed_work_sync(&pool->waker);
+	free_metadata(pool);
+	if (pool->next_mapping)
+		mempool_free(pool->next_mapping, pool->mapping_pool);
+
+	destroy_workqueue(pool->wq);
+	mempool_destroy(pool->page_pool);
+	mempool_destroy(pool->mapping_pool);
+	dm_kcopyd_client_destroy(pool->kcopyd_client);
+	dm_io_client_destroy(pool->io_client);
+	vfree(pool->meta_pending);
+	vfree(pool->meta_used);
+	vfree(pool->data_pending);
+	vfree(pool->data_refs);
+	kfree(pool);
+}
+
+static struct pool *create_pool(struct mapped_device *md,
+				sector_t block_size, dm_block_t nr_data_blocks,
+				dm_block_t nr_meta_blocks, char **error)
+{
+	struct pool *pool;
+	unsigned i;
+	int r;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool) {
+		*error = "Cannot allocate pool";
+		return ERR_PTR(-ENOMEM);
+	}
+
+	pool->pool_md = md;
+	pool->ref = 1;
+	pool->sectors_per_block = block_size;
+	pool->block_shift = ilog2(block_size);
+	pool->nr_data_blocks = nr_data_blocks;
+	pool->nr_meta_blocks = nr_meta_blocks;
+
+	mutex_init(&pool->metadata_lock);
+	rwlock_init(&pool->tree_lock);
+	INIT_LIST_HEAD(&pool->devs);
+	init_waitqueue_head(&pool->epoch_wait);
+	atomic_set(&pool->inflight[0], 0);
+	atomic_set(&pool->inflight[1], 0);
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->thins);
+	INIT_LIST_HEAD(&pool->prepared);
+	for (i = 0; i < ARRAY_SIZE(pool->cells); i++)
+		INIT_HLIST_HEAD(pool->cells + i);
+	INIT_WORK(&pool->worker, do_worker);
+	INIT_DELAYED_WORK(&pool->waker, do_waker);
+
+	r = -ENOMEM;
+	pool->data_refs = vmalloc(nr_data_blocks * sizeof(u32));
+	pool->data_pending = vmalloc(BITS_TO_LONGS(nr_data_blocks) *
+				     sizeof(long));
+	pool->meta_used = vmalloc(BITS_TO_LONGS(nr_meta_blocks) *
+				  sizeof(long));
+	pool->meta_pending = vmalloc(BITS_TO_LONGS(nr_meta_blocks) *
+				     sizeof(long));
+	if (!pool->data_refs || !pool->data_pending ||
+	    !pool->meta_used || !pool->meta_pending) {
+		*error = "Cannot allocate space maps";
+		goto bad_maps;
+	}
+
+	pool->io_client = dm_io_client_create(META_IO_PAGES);
+	if (IS_ERR(pool->io_client)) {
+		r = PTR_ERR(pool->io_client);
+		*error = "Cannot create io client";
+		goto bad_maps;
+	}
+
+	r = dm_kcopyd_client_create(THIN_KCOPYD_PAGES, &pool->kcopyd_client);
+	if (r) {
+		*error = "Cannot create kcopyd client";
+		goto bad_kcopyd;
+	}
+
+	r = -ENOMEM;
+	pool->mapping_pool = mempool_create_slab_pool(MIN_MAPPINGS,
+						      mapping_cache);
+	if (!pool->mapping_pool) {
+		*error = "Cannot allocate mapping pool";
+		goto bad_mapping_pool;
+	}
+
+	pool->page_pool = mempool_create_page_pool(META_IO_PAGES, 0);
+	if (!pool->page_pool) {
+		*error = "Cannot allocate page pool";
+		goto bad_page_pool;
+	}
+
+	pool->wq = create_singlethread_workqueue("dm-thin");
+	if (!pool->wq) {
+		*error = "Cannot create workqueue";
+		goto bad_wq;
+	}
+
+	reset_space_maps(pool);
+	list_add(&pool->list, &pool_list);
+	return pool;
+
+bad_wq:
+	mempool_destroy(pool->page_pool);
+bad_page_pool:
+	mempool_destroy(pool->mapping_pool);
+bad_mapping_pool:
+	dm_kcopyd_client_destroy(pool->kcopyd_client);
+bad_kcopyd:
+	dm_io_client_destroy(pool->io_client);
+bad_maps:
+	vfree(pool->meta_pending);
+	vfree(pool->meta_used);
+	vfree(pool->data_pending);
+	vfree(pool->data_refs);
+	kfree(pool);
+	return ERR_PTR(r);
+}
+
+static void pool_put(struct pool *pool)
+{
+	mutex_lock(&pool_list_lock);
+	if (!--pool->ref) {
+		list_del(&pool->list);
+		destroy_pool(pool);
+	}
+	mutex_unlock(&pool_list_lock);
+}
+
+/*-----------------------------------------------------------------
+ * Pool target
+ *
+ * thin-pool <metadata_dev> <data_dev> <data_block_size> [<low_water_blocks>]
+ *---------------------------------------------------------------*/
+static int pool_ctr(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct mapped_device *md;
+	unsigned long long tmp;
+	sector_t block_size;
+	dm_block_t nr_meta_blocks;
+	struct pool_c *pc;
+	struct pool *pool;
+	int r = -EINVAL;
+
+	if (argc < 3 || argc > 4) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+
+	if (sscanf(argv[2], "%llu", &tmp) != 1 || !is_power_of_2(tmp) ||
+	    tmp < (PAGE_SIZE >> SECTOR_SHIFT) || tmp > UINT_MAX) {
+		ti->error = "Invalid data block size";
+		return -EINVAL;
+	}
+	block_size = tmp;
+
+	if (ti->len < block_size) {
+		ti->error = "Pool smaller than a data block";
+		return -EINVAL;
+	}
+
+	if ((ti->len >> ilog2(block_size)) > MAX_DATA_BLOCKS) {
+		ti->error = "Too many data blocks";
+		return -EINVAL;
+	}
+
+	pc = kzalloc(sizeof(*pc), GFP_KERNEL);
+	if (!pc) {
+		ti->error = "Cannot allocate pool context";
+		return -ENOMEM;
+	}
+	pc->ti = ti;
+
+	if (argc > 3 && sscanf(argv[3], "%llu", &tmp) != 1) {
+		ti->error = "Invalid low water mark";
+		goto bad;
+	}
+	pc->low_water_blocks = argc > 3 ? tmp : 0;
+
+	if (dm_get_device(ti, argv[0], 0, 0, FMODE_READ | FMODE_WRITE,
+			  &pc->metadata_dev)) {
+		ti->error = "Metadata device lookup failed";
+		goto bad;
+	}
+
+	if (dm_get_device(ti, argv[1], 0, ti->len,
+			  FMODE_READ | FMODE_WRITE, &pc->data_dev)) {
+		ti->error = "Data device lookup failed";
+		goto bad_data;
+	}
+
+	nr_meta_blocks = get_dev_size(pc->metadata_dev->bdev) >>
+			 ilog2(META_BLOCK_SECTORS);
+	if (nr_meta_blocks < 2) {
+		ti->error = "Metadata device too small";
+		goto bad_pool;
+	}
+
+	/* The table is not bound to the device yet, but the device exists */
+	md = dm_table_get_md(ti->table);
+	dm_put(md);
+
+	mutex_lock(&pool_list_lock);
+	pool = find_pool(md);
+	if (pool) {
+		if (pool->sectors_per_block != block_size ||
+		    pool->metadata_bdev != pc->metadata_dev->bdev ||
+		    pool->data_bdev != pc->data_dev->bdev) {
+			mutex_unlock(&pool_list_lock);
+			ti->error = "Pool reloaded with different devices";
+			goto bad_pool;
+		}
+		pool->ref++;
+	} else {
+		char *error = NULL;
+
+		pool = create_pool(md, block_size, ti->len >> ilog2(block_size),
+				   nr_meta_blocks, &error);
+		if (IS_ERR(pool)) {
+			mutex_unlock(&pool_list_lock);
+			r = PTR_ERR(pool);
+			ti->error = error;
+			goto bad_pool;
+		}
+		pool->metadata_bdev = pc->metadata_dev->bdev;
+		pool->data_bdev = pc->data_dev->bdev;
+	}
+	mutex_unlock(&pool_list_lock);
+
+	pc->pool = pool;
+	ti->num_flush_requests = 1;
+	ti->private = pc;
+	return 0;
+
+bad_pool:
+	dm_put_device(ti, pc->data_dev);
+bad_data:
+	dm_put_device(ti, pc->metadata_dev);
+bad:
+	kfree(pc);
+	return r;
+}
+
+static void pool_dtr(struct dm_target *ti)
+{
+	struct pool_c *pc = ti->private;
+	struct pool *pool = pc->pool;
+
+	mutex_lock(&pool->metadata_lock);
+	if (pool->pc == pc)
+		pool->pc = NULL;
+	mutex_unlock(&pool->metadata_lock);
+
+	pool_put(pool);
+	dm_put_device(ti, pc->data_dev);
+	dm_put_device(ti, pc->metadata_dev);
+	kfree(pc);
+}
+
+/*
+ * The pool device maps straight onto the data device.  It exists to
+ * carry the pool, nothing should do I/O to it.
+ */
+static int pool_map(struct dm_target *ti, struct bio *bio,
+		    union map_info *map_context)
+{
+	struct pool_c *pc = ti->private;
+
+	bio->bi_bdev = pc->data_dev->bdev;
+	return DM_MAPIO_REMAPPED;
+}
+
+static void pool_postsuspend(struct dm_target *ti)
+{
+	struct pool_c *pc = ti->private;
+	struct pool *pool = pc->pool;
+
+	cancel_delayed_work_sync(&pool->waker);
+	flush_workqueue(pool->wq);
+
+	mutex_lock(&pool->metadata_lock);
+	if (pool->dirty && !pool->failed)
+		commit(pool);
+	mutex_unlock(&pool->metadata_lock);
+}
+
+/*
+ * Bind the table to the pool, reading the metadata on the first
+ * resume and growing the pool if the table did.
+ */
+static int pool_preresume(struct dm_target *ti)
+{
+	struct pool_c *pc = ti->private;
+	struct pool *pool = pc->pool;
+	int r = 0;
+
+	mutex_lock(&pool->metadata_lock);
+	pool->pc = pc;
+	pool->low_water_blocks = pc->low_water_blocks;
+
+	if (!pool->loaded) {
+		r = load_metadata(pool);
+		if (r)
+			goto out;
+		pool->loaded = 1;
+	}
+
+	r = resize_data(pool, ti->len >> pool->block_shift);
+	if (!r && pool->dirty && !pool->failed)
+		r = commit(pool);
+out:
+	mutex_unlock(&pool->metadata_lock);
+
+	return r;
+}
+
+static void pool_resume(struct dm_target *ti)
+{
+	struct pool_c *pc = ti->private;
+	struct pool *pool = pc->pool;
+
+	queue_delayed_work(pool->wq, &pool->waker, COMMIT_PERIOD);
+	wake_worker(pool);
+}
+
+static int pool_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct pool_c *pc = ti->private;
+	struct pool *pool = pc->pool;
+	unsigned long long id, origin_id;
+	struct thin_dev *origin;
+	int r = -EINVAL;
+
+	mutex_lock(&pool->metadata_lock);
+	if (!pool->loaded || pool->failed) {
+		DMWARN("%s: pool is not usable", dm_device_name(pool->pool_md));
+		goto out;
+	}
+
+	if (argc == 2 && !strcmp(argv[0], "create_thin") &&
+	    sscanf(argv[1], "%llu", &id) == 1)
+		r = create_dev(pool, id, NULL);
+
+	else if (argc == 3 && !strcmp(argv[0], "create_snap") &&
+		 sscanf(argv[1], "%llu", &id) == 1 &&
+		 sscanf(argv[2], "%llu", &origin_id) == 1) {
+		origin = find_dev(pool, origin_id);
+		r = origin ? create_dev(pool, id, origin) : -ENODEV;
+
+	} else if (argc == 2 && !strcmp(argv[0], "delete") &&
+		   sscanf(argv[1], "%llu", &id) == 1)
+		r = delete_dev(pool, id);
+
+	else {
+		DMWARN("Unrecognised pool message received.");
+		goto out;
+	}
+
+	if (!r)
+		r = commit(pool);
+	else
+		DMWARN("%s: message %s failed: %d",
+		       dm_device_name(pool->pool_md), argv[0], r);
+out:
+	mutex_unlock(&pool->metadata_lock);
+
+	return r;
+}
+
+static int pool_status(struct dm_target *ti, status_type_t type,
+		       char *result, unsigned maxlen)
+{
+	struct pool_c *pc = ti->private;
+	struct pool *pool = pc->pool;
+	char buf[BDEVNAME_SIZE], buf2[BDEVNAME_SIZE];
+	unsigned sz = 0;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		mutex_lock(&pool->metadata_lock);
+		if (pool->failed)
+			DMEMIT("Fail");
+		else
+			DMEMIT("%llu %llu/%llu %llu/%llu",
+			       (unsigned long long) pool->transaction_id,
+			       (unsigned long long) (pool->nr_meta_blocks -
+						     pool->nr_free_meta),
+			       (unsigned long long) pool->nr_meta_blocks,
+			       (unsigned long long) (pool->nr_data_blocks -
+						     pool->nr_free_data),
+			       (unsigned long long) pool->nr_data_blocks);
+		mutex_unlock(&pool->metadata_lock);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s %s %llu %llu",
+		       format_dev_t(buf, pc->metadata_dev->bdev->bd_dev),
+		       format_dev_t(buf2, pc->data_dev->bdev->bd_dev),
+		       (unsigned long long) pool->sectors_per_block,
+		       (unsigned long long) pc->low_water_blocks);
+		break;
+	}
+
+	return 0;
+}
+
+static int pool_iterate_devices(struct dm_target *ti,
+				iterate_devices_callout_fn fn, void *data)
+{
+	struct pool_c *pc = ti->private;
+
+	return fn(ti, pc->data_dev, 0, ti->len, data);
+}
+
+static struct target_type pool_target = {
+	.name	     = "thin-pool",
+	.version     = {1, 0, 0},
+	.module      = THIS_MODULE,
+	.ctr	     = pool_ctr,
+	.dtr	     = pool_dtr,
+	.map	     = pool_map,
+	.postsuspend = pool_postsuspend,
+	.preresume   = pool_preresume,
+	.resume	     = pool_resume,
+	.message     = pool_message,
+	.status	     = pool_status,
+	.iterate_devices = pool_iterate_devices,
+};
+
+/*-----------------------------------------------------------------
+ * Thin target
+ *
+ * thin <pool_dev> <dev_id>
+ *---------------------------------------------------------------*/
+static int thin_ctr(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct mapped_device *pool_md;
+	unsigned long long id;
+	struct thin_c *tc;
+	struct pool *pool;
+	int r = -EINVAL;
+
+	if (argc != 2) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+
+	if (sscanf(argv[1], "%llu", &id) != 1) {
+		ti->error = "Invalid device id";
+		return -EINVAL;
+	}
+
+	tc = kzalloc(sizeof(*tc), GFP_KERNEL);
+	if (!tc) {
+		ti->error = "Cannot allocate thin context";
+		return -ENOMEM;
+	}
+	bio_list_init(&tc->deferred);
+
+	if (dm_get_device(ti, argv[0], 0, 0, dm_table_get_mode(ti->table),
+			  &tc->pool_dev)) {
+		ti->error = "Pool device lookup failed";
+		goto bad;
+	}
+
+	pool_md = dm_get_md(tc->pool_dev->bdev->bd_dev);
+	if (!pool_md) {
+		ti->error = "Pool device is not a device-mapper device";
+		goto bad_pool;
+	}
+
+	mutex_lock(&pool_list_lock);
+	pool = find_pool(pool_md);
+	if (pool)
+		pool->ref++;
+	mutex_unlock(&pool_list_lock);
+	dm_put(pool_md);
+
+	if (!pool) {
+		ti->error = "Pool device is not a thin pool";
+		goto bad_pool;
+	}
+	tc->pool = pool;
+
+	mutex_lock(&pool->metadata_lock);
+	if (!pool->loaded) {
+		ti->error = "Pool is not active";
+		goto bad_dev;
+	}
+
+	tc->td = find_dev(pool, id);
+	if (!tc->td) {
+		ti->error = "Thin device does not exist";
+		goto bad_dev;
+	}
+	tc->td->open_count++;
+	mutex_unlock(&pool->metadata_lock);
+
+	spin_lock_irq(&pool->lock);
+	list_add_tail(&tc->list, &pool->thins);
+	spin_unlock_irq(&pool->lock);
+
+	ti->split_io = pool->sectors_per_block;
+	ti->num_flush_requests = 1;
+	ti->private = tc;
+	return 0;
+
+bad_dev:
+	mutex_unlock(&pool->metadata_lock);
+	pool_put(pool);
+bad_pool:
+	dm_put_device(ti, tc->pool_dev);
+bad:
+	kfree(tc);
+	return r;
+}
+
+static void thin_dtr(struct dm_target *ti)
+{
+	struct thin_c *tc = ti->private;
+	struct pool *pool = tc->pool;
+
+	spin_lock_irq(&pool->lock);
+	list_del(&tc->list);
+	spin_unlock_irq(&pool->lock);
+
+	mutex_lock(&pool->metadata_lock);
+	tc->td->open_count--;
+	mutex_unlock(&pool->metadata_lock);
+
+	pool_put(pool);
+	dm_put_device(ti, tc->pool_dev);
+	kfree(tc);
+}
+
+/*
+ * Reads and writes of blocks that are mapped and not shared are
+ * remapped here.  Everything else goes to the worker, except reads of
+ * unmapped blocks, which return zeroes.
+ */
+static int thin_map(struct dm_target *ti, struct bio *bio,
+		    union map_info *map_context)
+{
+	struct thin_c *tc = ti->private;
+	struct pool *pool = tc->pool;
+	dm_block_t block;
+	int r, shared;
+
+	if (bio_empty_barrier(bio)) {
+		thin_defer_bio(tc, bio);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	read_lock(&pool->tree_lock);
+	r = btree_lookup(pool, tc->td, get_bio_block(pool, bio), &block,
+			 &shared);
+	if (!r && (bio_data_dir(bio) == READ || !shared)) {
+		map_context->ll = pool->epoch + 1;
+		atomic_inc(&pool->inflight[pool->epoch]);
+		read_unlock(&pool->tree_lock);
+
+		remap(pool, bio, block);
+		return DM_MAPIO_REMAPPED;
+	}
+	read_unlock(&pool->tree_lock);
+
+	if (r && bio_data_dir(bio) == READ) {
+		zero_fill_bio(bio);
+		bio_endio(bio, 0);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	thin_defer_bio(tc, bio);
+	return DM_MAPIO_SUBMITTED;
+}
+
+static int thin_end_io(struct dm_target *ti, struct bio *bio, int error,
+		       union map_info *map_context)
+{
+	struct thin_c *tc = ti->private;
+	struct pool *pool = tc->pool;
+
+	if (map_context->ll &&
+	    atomic_dec_and_test(&pool->inflight[map_context->ll - 1]))
+		wake_up(&pool->epoch_wait);
+
+	return error;
+}
+
+static int thin_status(struct dm_target *ti, status_type_t type,
+		       char *result, unsigned maxlen)
+{
+	struct thin_c *tc = ti->private;
+	char buf[BDEVNAME_SIZE];
+	unsigned sz = 0;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		DMEMIT("%llu", (unsigned long long) tc->td->mapped_blocks *
+		       tc->pool->sectors_per_block);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s %llu", format_dev_t(buf, tc->pool_dev->bdev->bd_dev),
+		       (unsigned long long) tc->td->id);
+		break;
+	}
+
+	return 0;
+}
+
+static int thin_iterate_devices(struct dm_target *ti,
+				iterate_devices_callout_fn fn, void *data)
+{
+	struct thin_c *tc = ti->private;
+	sector_t len = get_dev_size(tc->pool_dev->bdev);
+
+	return fn(ti, tc->pool_dev, 0, min(ti->len, len), data);
+}
+
+static struct target_type thin_target = {
+	.name	     = "thin",
+	.version     = {1, 0, 0},
+	.module      = THIS_MODULE,
+	.ctr	     = thin_ctr,
+	.dtr	     = thin_dtr,
+	.map	     = thin_map,
+	.end_io	     = thin_end_io,
+	.status	     = thin_status,
+	.iterate_devices = thin_iterate_devices,
+};
+
+static int __init dm_thin_init(void)
+{
+	int r = -ENOMEM;
+
+	node_cache = kmem_cache_create("dm_thin_node",
+				       sizeof(struct btree_node), 0, 0, NULL);
+	if (!node_cache)
+		goto bad_node_cache;
+
+	mapping_cache = KMEM_CACHE(dm_thin_new_mapping, 0);
+	if (!mapping_cache)
+		goto bad_mapping_cache;
+
+	zero_page_list.next = &zero_page_list;
+	zero_page_list.page = ZERO_PAGE(0);
+
+	r = dm_register_target(&pool_target);
+	if (r < 0) {
+		DMERR("register failed %d", r);
+		goto bad_pool_target;
+	}
+
+	r = dm_register_target(&thin_target);
+	if (r < 0) {
+		DMERR("register failed %d", r);
+		goto bad_thin_target;
+	}
+
+	return 0;
+
+bad_thin_target:
+	dm_unregister_target(&pool_target);
+bad_pool_target:
+	kmem_cache_destroy(mapping_cache);
+bad_mapping_cache:
+	kmem_cache_destroy(node_cache);
+bad_node_cache:
+	return r;
+}
+
+static void __exit dm_thin_exit(void)
+{
+	dm_unregister_target(&thin_target);
+	dm_unregister_target(&pool_target);
+	kmem_cache_destroy(mapping_cache);
+	kmem_cache_destroy(node_cache);
+}
+
+/* Module hooks */
+module_init(dm_thin_init);
+module_exit(dm_thin_exit);
+
+MODULE_DESCRIPTION(DM_NAME " thin provisioning target");
+MODULE_LICENSE("GPL");
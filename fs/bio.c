@@ -1419,6 +1419,8 @@ void bio_endio(struct bio *bio, int error)
 	else if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
 		error = -EIO;
 
+	blk_iolatency_done(bio);
+
 	if (bio->bi_end_io)
 		bio->bi_end_io(bio, error);
 }
@@ -1474,6 +1476,8 @@ struct bio_pair *bio_split(struct bio *bi, int first_sectors)
 	bp->error = 0;
 	bp->bio1 = *bi;
 	bp->bio2 = *bi;
+	blk_iolatency_clear(&bp->bio1);
+	blk_iolatency_clear(&bp->bio2);
 	bp->bio2.bi_sector += first_sectors;
 	bp->bio2.bi_size -= first_sectors << 9;
 	bp->bio1.bi_size = first_sectors << 9;
@@ -125,6 +125,8 @@ struct dio {
 	unsigned long refcount;		/* direct_io_worker() and bios */
 	struct bio *bio_list;		/* singly linked via bi_private */
 	struct task_struct *waiter;	/* waiting task (NULL if none) */
+	struct block_device *bio_bdev;	/* last bio submitted, for polling */
+	unsigned int bio_cookie;
 
 	/* AIO related stuff */
 	struct kiocb *iocb;		/* kiocb */
@@ -342,6 +344,15 @@ static void dio_bio_submit(struct dio *dio)
 
 	submit_bio(dio->rw, bio);
 
+	/*
+	 * Only dio_await_one() frees the bios of a synchronous dio, so the
+	 * bio is still there even if it has completed already.
+	 */
+	if (!dio->is_async) {
+		dio->bio_bdev = bio->bi_bdev;
+		dio->bio_cookie = bio->bi_cookie;
+	}
+
 	dio->bio = NULL;
 	dio->boundary = 0;
 }
@@ -378,7 +389,9 @@ static struct bio *dio_await_one(struct dio *dio)
 		__set_current_state(TASK_UNINTERRUPTIBLE);
 		dio->waiter = current;
 		spin_unlock_irqrestore(&dio->bio_lock, flags);
-		io_schedule();
+		if (!dio->bio_bdev ||
+		    !blk_poll(bdev_get_queue(dio->bio_bdev), dio->bio_cookie))
+			io_schedule();
 		/* wake up sets us TASK_RUNNING */
 		spin_lock_irqsave(&dio->bio_lock, flags);
 		dio->waiter = NULL;
@@ -936,6 +949,7 @@ direct_io_worker(int rw, struct kiocb *iocb, struct inode *inode,
 {
 	unsigned long user_addr; 
 	unsigned long flags;
+	struct blk_plug plug;
 	int seg;
 	ssize_t ret = 0;
 	ssize_t ret2;
@@ -972,6 +986,8 @@ direct_io_worker(int rw, struct kiocb *iocb, struct inode *inode,
 				- user_addr/PAGE_SIZE);
 	}
 
+	blk_start_plug(&plug);
+
 	for (seg = 0; seg < nr_segs; seg++) {
 		user_addr = (unsigned long)iov[seg].iov_base;
 		dio->size += bytes = iov[seg].iov_len;
@@ -1029,7 +1045,7 @@ direct_io_worker(int rw, struct kiocb *iocb, struct inode *inode,
 		dio_bio_submit(dio);
 
 	/* All IO is now issued, send it on its way */
-	blk_run_address_space(inode->i_mapping);
+	blk_finish_plug(&plug);
 
 	/*
 	 * It is possible that, we return short IO due to end of file.
@@ -21,6 +21,7 @@
 #include <linux/mm.h>
 #include <linux/pagemap.h>
 #include <linux/bio.h>
+#include <linux/blkdev.h>
 
 /*
  * Default IO end handler for temporary BJ_IO buffer_heads.
@@ -319,6 +320,7 @@ void journal_commit_transaction(journal_t *journal)
 	int tag_flag;
 	int i;
 	int write_op = WRITE;
+	struct blk_plug plug;
 
 	/*
 	 * First job: lock down the current transaction and wait for
@@ -442,6 +444,7 @@ void journal_commit_transaction(journal_t *journal)
 	 * Now start flushing things to disk, in the order they appear
 	 * on the transaction lists.  Data blocks go first.
 	 */
+	blk_start_plug(&plug);
 	err = journal_submit_data_buffers(journal, commit_transaction,
 					  write_op);
 
@@ -696,6 +699,8 @@ start_journal_io:
 	   so we incur less scheduling load.
 	*/
 
+	blk_finish_plug(&plug);
+
 	jbd_debug(3, "JBD: commit phase 4\n");
 
 	/*
@@ -369,6 +369,7 @@ void jbd2_journal_commit_transaction(journal_t *journal)
 	struct buffer_head *cbh = NULL; /* For transactional checksums */
 	__u32 crc32_sum = ~0;
 	int write_op = WRITE;
+	struct blk_plug plug;
 
 	/*
 	 * First job: lock down the current transaction and wait for
@@ -504,6 +505,7 @@ void jbd2_journal_commit_transaction(journal_t *journal)
 	 * Now start flushing things to disk, in the order they appear
 	 * on the transaction lists.  Data blocks go first.
 	 */
+	blk_start_plug(&plug);
 	err = journal_submit_data_buffers(journal, commit_transaction);
 	if (err)
 		jbd2_journal_abort(journal, err);
@@ -748,6 +750,8 @@ start_journal_io:
 	   so we incur less scheduling load.
 	*/
 
+	blk_finish_plug(&plug);
+
 	jbd_debug(3, "JBD: commit phase 3\n");
 
 	/*
@@ -1241,7 +1241,7 @@ static struct file_system_type ocfs2_fs_type = {
 					* the fs? */
 	.kill_sb        = ocfs2_kill_sb,
 
-	.fs_flags       = FS_REQUIRES_DEV|FS_RENAME_DOES_D_MOVE,
+	.fs_flags       = FS_REQUIRES_DEV|FS_RENAME_DOES_D_MOVE|FS_UNSTABLE_BMAP,
 	.next           = NULL
 };
 
@@ -339,6 +339,7 @@ static int stack_usage_pte_range(pmd_t *pmd, unsigned long addr,
 	spinlock_t *ptl;
 	int ret = 0;
 
+	split_huge_page_pmd(vma->vm_mm, pmd);
 	pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
 	for (; addr != end; pte++, addr += PAGE_SIZE) {
 		ptent = *pte;
@@ -328,6 +328,30 @@ static int proc_pid_wchan(struct task_struct *task, char *buffer)
 }
 #endif /* CONFIG_KALLSYMS */
 
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Provides /proc/PID/numa_faults: the NUMA hinting faults of a task per
+ * node, decayed at each full scan of its address space, and what automatic
+ * NUMA balancing made of them.
+ */
+static int proc_pid_numa_faults(struct seq_file *m, struct pid_namespace *ns,
+				struct pid *pid, struct task_struct *task)
+{
+	unsigned long *faults = ACCESS_ONCE(task->numa_faults);
+	int nid;
+
+	seq_printf(m, "preferred_node %d\n", task->numa_preferred_nid);
+	seq_printf(m, "scan_period_ms %u\n", task->numa_scan_period);
+	seq_printf(m, "faults_local %lu\n", task->numa_faults_local);
+	seq_printf(m, "faults_remote %lu\n", task->numa_faults_remote);
+	seq_printf(m, "pages_migrated %lu\n", task->numa_pages_migrated);
+	for_each_online_node(nid)
+		seq_printf(m, "node%d %lu\n", nid,
+			   faults ? faults[nid] + faults[nr_node_ids + nid] : 0);
+	return 0;
+}
+#endif
+
 #ifdef CONFIG_STACKTRACE
 
 #define MAX_STACK_TRACE_DEPTH	64
@@ -2549,6 +2573,9 @@ static const struct pid_entry tgid_base_stuff[] = {
 #ifdef CONFIG_STACKTRACE
 	ONE("stack",      S_IRUSR, proc_pid_stack),
 #endif
+#ifdef CONFIG_NUMA_BALANCING
+	ONE("numa_faults", S_IRUGO, proc_pid_numa_faults),
+#endif
 #ifdef CONFIG_SCHEDSTATS
 	INF("schedstat",  S_IRUGO, proc_pid_schedstat),
 #endif
@@ -2882,6 +2909,9 @@ static const struct pid_entry tid_base_stuff[] = {
 #ifdef CONFIG_STACKTRACE
 	ONE("stack",      S_IRUSR, proc_pid_stack),
 #endif
+#ifdef CONFIG_NUMA_BALANCING
+	ONE("numa_faults", S_IRUGO, proc_pid_numa_faults),
+#endif
 #ifdef CONFIG_SCHEDSTATS
 	INF("schedstat", S_IRUGO, proc_pid_schedstat),
 #endif
@@ -335,10 +335,56 @@ struct mem_size_stats {
 	unsigned long private_clean;
 	unsigned long private_dirty;
 	unsigned long referenced;
+	unsigned long anonymous_thp;
 	unsigned long swap;
 	u64 pss;
 };
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Account a huge pmd as a whole instead of splitting it: reading smaps
+ * must not change how the memory is mapped.  Returns 1 if @pmd was huge.
+ */
+static int smaps_huge_pmd(pmd_t *pmd, struct mem_size_stats *mss)
+{
+	struct mm_struct *mm = mss->vma->vm_mm;
+	struct page *page;
+	int mapcount;
+
+	spin_lock(&mm->page_table_lock);
+	if (!pmd_trans_huge(*pmd)) {
+		spin_unlock(&mm->page_table_lock);
+		return 0;
+	}
+	page = pmd_page(*pmd);
+	mss->resident += HPAGE_PMD_SIZE;
+	mss->anonymous_thp += HPAGE_PMD_SIZE;
+	if (pmd_young(*pmd) || PageReferenced(page))
+		mss->referenced += HPAGE_PMD_SIZE;
+	mapcount = page_mapcount(page);
+	if (mapcount >= 2) {
+		if (pmd_dirty(*pmd))
+			mss->shared_dirty += HPAGE_PMD_SIZE;
+		else
+			mss->shared_clean += HPAGE_PMD_SIZE;
+		mss->pss += ((u64)HPAGE_PMD_SIZE << PSS_SHIFT) / mapcount;
+	} else {
+		if (pmd_dirty(*pmd))
+			mss->private_dirty += HPAGE_PMD_SIZE;
+		else
+			mss->private_clean += HPAGE_PMD_SIZE;
+		mss->pss += (u64)HPAGE_PMD_SIZE << PSS_SHIFT;
+	}
+	spin_unlock(&mm->page_table_lock);
+	return 1;
+}
+#else
+static inline int smaps_huge_pmd(pmd_t *pmd, struct mem_size_stats *mss)
+{
+	return 0;
+}
+#endif
+
 static int smaps_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 			   struct mm_walk *walk)
 {
@@ -349,6 +395,11 @@ static int smaps_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 	struct page *page;
 	int mapcount;
 
+	if (pmd_trans_huge(*pmd) && smaps_huge_pmd(pmd, mss)) {
+		cond_resched();
+		return 0;
+	}
+
 	pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
 	for (; addr != end; pte++, addr += PAGE_SIZE) {
 		ptent = *pte;
@@ -418,6 +469,7 @@ static int show_smap(struct seq_file *m, void *v)
 		   "Private_Clean:  %8lu kB\n"
 		   "Private_Dirty:  %8lu kB\n"
 		   "Referenced:     %8lu kB\n"
+		   "AnonHugePages:  %8lu kB\n"
 		   "Swap:           %8lu kB\n"
 		   "KernelPageSize: %8lu kB\n"
 		   "MMUPageSize:    %8lu kB\n",
@@ -429,6 +481,7 @@ static int show_smap(struct seq_file *m, void *v)
 		   mss.private_clean >> 10,
 		   mss.private_dirty >> 10,
 		   mss.referenced >> 10,
+		   mss.anonymous_thp >> 10,
 		   mss.swap >> 10,
 		   vma_kernel_pagesize(vma) >> 10,
 		   vma_mmu_pagesize(vma) >> 10);
@@ -465,6 +518,7 @@ static int clear_refs_pte_range(pmd_t *pmd, unsigned long addr,
 	spinlock_t *ptl;
 	struct page *page;
 
+	split_huge_page_pmd(walk->mm, pmd);
 	pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
 	for (; addr != end; pte++, addr += PAGE_SIZE) {
 		ptent = *pte;
@@ -621,6 +675,8 @@ static int pagemap_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 	pte_t *pte;
 	int err = 0;
 
+	split_huge_page_pmd(walk->mm, pmd);
+
 	/* find the first VMA at or above 'addr' */
 	vma = find_vma(walk->mm, addr);
 	for (; addr != end; addr += PAGE_SIZE) {
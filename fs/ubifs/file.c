@@ -1536,6 +1536,7 @@ out_unlock:
 
 static const struct vm_operations_struct ubifs_file_vm_ops = {
 	.fault        = filemap_fault,
+	.map_pages    = filemap_map_pages,
 	.page_mkwrite = ubifs_vm_page_mkwrite,
 };
 
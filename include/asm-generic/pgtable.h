@@ -162,6 +162,22 @@ static inline void ptep_set_wrprotect(struct mm_struct *mm, unsigned long addres
 })
 #endif
 
+#ifndef CONFIG_NUMA_BALANCING
+static inline int pte_numa(pte_t pte)
+{
+	return 0;
+}
+#endif
+
+#ifndef CONFIG_TRANSPARENT_HUGEPAGE
+static inline int pmd_trans_huge(pmd_t pmd)
+{
+	return 0;
+}
+
+#define pmdp_clear_flush_young(__vma, __address, __pmdp) ({ BUG(); 0; })
+#endif
+
 /*
  * When walking page tables, we usually want to skip any p?d_none entries;
  * and any p?d_bad entries - reporting the error before resetting to none.
@@ -52,6 +52,7 @@ struct bio_vec {
 struct bio_set;
 struct bio;
 struct bio_integrity_payload;
+struct iolat_grp;
 typedef void (bio_end_io_t) (struct bio *, int);
 typedef void (bio_destructor_t) (struct bio *);
 
@@ -89,6 +90,7 @@ struct bio {
 	unsigned int		bi_max_vecs;	/* max bvl_vecs we can hold */
 
 	unsigned int		bi_comp_cpu;	/* completion CPU */
+	unsigned int		bi_cookie;	/* blk-mq request, for polling */
 
 	atomic_t		bi_cnt;		/* pin count */
 
@@ -100,6 +102,10 @@ struct bio {
 #if defined(CONFIG_BLK_DEV_INTEGRITY)
 	struct bio_integrity_payload *bi_integrity;  /* data integrity */
 #endif
+#ifdef CONFIG_BLK_CGROUP_IOLATENCY
+	struct iolat_grp	*bi_iolat;	/* latency group charged */
+	u64			bi_issue_ns;	/* when it was charged */
+#endif
 
 	bio_destructor_t	*bi_destructor;	/* destructor */
 
@@ -126,6 +132,7 @@ struct bio {
 #define BIO_NULL_MAPPED 9	/* contains invalid user pages */
 #define BIO_FS_INTEGRITY 10	/* fs owns integrity data, not block layer */
 #define BIO_QUIET	11	/* Make BIO Quiet */
+#define BIO_THROTTLED	12	/* already charged to its throttle group */
 #define bio_flagged(bio, flag)	((bio)->bi_flags & (1 << (flag)))
 
 /*
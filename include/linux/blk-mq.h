@@ -0,0 +1,127 @@
+#ifndef BLK_MQ_H
+#define BLK_MQ_H
+
+#include <linux/blkdev.h>
+
+struct blk_mq_tags;
+
+struct blk_mq_hw_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	dispatch;
+	} ____cacheline_aligned_in_smp;
+
+	unsigned long		state;		/* BLK_MQ_S_* flags */
+	struct work_struct	run_work;
+
+	unsigned long		flags;		/* BLK_MQ_F_* flags */
+
+	struct request_queue	*queue;
+	unsigned int		queue_num;
+	void			*driver_data;
+
+	/* software queues that map to this hardware queue */
+	unsigned int		nr_ctx;
+	struct blk_mq_ctx	**ctxs;
+	unsigned long		*ctx_map;	/* ctxs with pending requests */
+
+	struct blk_mq_tags	*tags;
+	struct request		**rqs;		/* indexed by tag */
+	unsigned int		queue_depth;
+
+	unsigned long		run;
+	unsigned long		dispatched;
+
+	/* average completion time of polled reads and writes, in ns */
+	unsigned long		poll_nsec[2];
+
+	int			numa_node;
+};
+
+typedef int (queue_rq_fn)(struct blk_mq_hw_ctx *, struct request *, bool);
+typedef int (init_hctx_fn)(struct blk_mq_hw_ctx *, void *, unsigned int);
+typedef void (exit_hctx_fn)(struct blk_mq_hw_ctx *, unsigned int);
+typedef int (poll_fn)(struct blk_mq_hw_ctx *, unsigned int);
+
+struct blk_mq_ops {
+	/*
+	 * Queue one request to the hardware.  The last argument is true if
+	 * no more requests follow in this run, the driver can defer telling
+	 * the hardware about new requests until then.
+	 */
+	queue_rq_fn		*queue_rq;
+
+	/*
+	 * Called when a hardware queue is set up and torn down, to attach
+	 * driver data to it.  Without init_hctx, driver_data is set to the
+	 * data passed to blk_mq_init_queue().
+	 */
+	init_hctx_fn		*init_hctx;
+	exit_hctx_fn		*exit_hctx;
+
+	/*
+	 * Optional: reap the completions that are ready on a hardware
+	 * queue, the caller is waiting for the request with the given tag.
+	 * Returns the number of requests completed, or < 0 if polling this
+	 * queue cannot make progress.  Needed for QUEUE_FLAG_POLL.
+	 */
+	poll_fn			*poll;
+};
+
+struct blk_mq_reg {
+	struct blk_mq_ops	*ops;
+	unsigned int		nr_hw_queues;
+	unsigned int		queue_depth;	/* tags per hardware queue */
+	unsigned int		cmd_size;	/* per-request driver data */
+	int			numa_node;
+	unsigned int		flags;		/* BLK_MQ_F_* */
+};
+
+enum {
+	BLK_MQ_RQ_QUEUE_OK	= 0,	/* queued fine */
+	BLK_MQ_RQ_QUEUE_BUSY	= 1,	/* requeue IO for later */
+	BLK_MQ_RQ_QUEUE_ERROR	= 2,	/* end IO with error */
+
+	BLK_MQ_F_SHOULD_MERGE	= 1 << 0,
+
+	BLK_MQ_S_STOPPED	= 0,
+
+	BLK_MQ_MAX_DEPTH	= 2048,
+};
+
+extern struct request_queue *blk_mq_init_queue(struct blk_mq_reg *, void *);
+
+extern struct request *blk_mq_alloc_request(struct request_queue *, int,
+					    gfp_t);
+extern void blk_mq_free_request(struct request *);
+extern void blk_mq_insert_request(struct request *, bool, bool, bool);
+extern void blk_mq_end_io(struct request *, int);
+
+extern void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *, bool);
+extern void blk_mq_run_queues(struct request_queue *, bool);
+extern void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *);
+extern void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *);
+extern void blk_mq_start_stopped_hw_queues(struct request_queue *);
+
+/*
+ * Driver command data is allocated right behind the request
+ */
+static inline void *blk_mq_rq_to_pdu(struct request *rq)
+{
+	return (void *) (rq + 1);
+}
+
+static inline struct request *blk_mq_rq_from_pdu(void *pdu)
+{
+	return pdu - sizeof(struct request);
+}
+
+#define queue_for_each_hw_ctx(q, hctx, i)				\
+	for ((i) = 0; (i) < (q)->nr_hw_queues &&			\
+	     ({ hctx = (q)->queue_hw_ctx[i]; 1; }); (i)++)
+
+#define hctx_for_each_ctx(hctx, ctx, i)					\
+	for ((i) = 0; (i) < (hctx)->nr_ctx &&				\
+	     ({ ctx = (hctx)->ctxs[i]; 1; }); (i)++)
+
+#endif
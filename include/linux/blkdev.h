@@ -28,8 +28,14 @@ struct request_queue;
 struct elevator_queue;
 struct request_pm_state;
 struct blk_trace;
+struct throtl_data;
+struct iolat_data;
+struct blk_io_hist;
 struct request;
 struct sg_io_hdr;
+struct blk_mq_ops;
+struct blk_mq_ctx;
+struct blk_mq_hw_ctx;
 
 #define BLKDEV_MIN_RQ	4
 #define BLKDEV_MAX_RQ	128	/* Default maximum */
@@ -161,6 +167,7 @@ struct request {
 	int cpu;
 
 	struct request_queue *q;
+	struct blk_mq_ctx *mq_ctx;
 
 	unsigned int cmd_flags;
 	enum rq_cmd_type_bits cmd_type;
@@ -193,6 +200,8 @@ struct request {
 
 	struct gendisk *rq_disk;
 	unsigned long start_time;
+	u64 start_time_ns;	/* allocation, for the latency histograms */
+	u64 io_start_ns;	/* issue time, for polling and the histograms */
 
 	/* Number of scatter-gather DMA addr+len pairs after
 	 * physical address coalescing is performed.
@@ -435,6 +444,31 @@ struct request_queue
 
 	struct mutex		sysfs_lock;
 
+	/*
+	 * multi-queue state, only set up by blk_mq_init_queue()
+	 */
+	struct blk_mq_ops	*mq_ops;
+	struct blk_mq_ctx	*queue_ctx;	/* per-cpu software queues */
+	unsigned int		*mq_map;	/* cpu to hardware queue */
+	struct blk_mq_hw_ctx	**queue_hw_ctx;
+	unsigned int		nr_hw_queues;
+	int			mq_frozen;
+	wait_queue_head_t	mq_freeze_wq;
+	struct mutex		mq_barrier_mutex;
+	int			poll_nsec;	/* -1 spin, 0 adaptive, > 0 sleep */
+
+	/* per-cpu latency and size histograms, see block/blk.h */
+	struct blk_io_hist	*io_hist;
+
+#ifdef CONFIG_BLK_DEV_THROTTLING
+	/* cgroup bps and IOPS limits, see block/blk-throttle.c */
+	struct throtl_data	*td;
+#endif
+#ifdef CONFIG_BLK_CGROUP_IOLATENCY
+	/* cgroup latency targets, see block/blk-iolatency.c */
+	struct iolat_data	*iod;
+#endif
+
 #if defined(CONFIG_BLK_DEV_BSG)
 	struct bsg_class_device bsg_dev;
 #endif
@@ -459,12 +493,16 @@ struct request_queue
 #define QUEUE_FLAG_IO_STAT     15	/* do IO stats */
 #define QUEUE_FLAG_CQ	       16	/* hardware does queuing */
 #define QUEUE_FLAG_DISCARD     17	/* supports DISCARD */
+#define QUEUE_FLAG_POLL	       18	/* poll for completion of sync I/O */
 
 #define QUEUE_FLAG_DEFAULT	((1 << QUEUE_FLAG_IO_STAT) |		\
 				 (1 << QUEUE_FLAG_CLUSTER) |		\
 				 (1 << QUEUE_FLAG_STACKABLE)	|	\
 				 (1 << QUEUE_FLAG_SAME_COMP))
 
+#define QUEUE_FLAG_MQ_DEFAULT	((1 << QUEUE_FLAG_IO_STAT) |		\
+				 (1 << QUEUE_FLAG_CLUSTER))
+
 static inline int queue_is_locked(struct request_queue *q)
 {
 #ifdef CONFIG_SMP
@@ -591,6 +629,7 @@ enum {
 #define blk_queue_stackable(q)	\
 	test_bit(QUEUE_FLAG_STACKABLE, &(q)->queue_flags)
 #define blk_queue_discard(q)	test_bit(QUEUE_FLAG_DISCARD, &(q)->queue_flags)
+#define blk_queue_poll(q)	test_bit(QUEUE_FLAG_POLL, &(q)->queue_flags)
 
 #define blk_fs_request(rq)	((rq)->cmd_type == REQ_TYPE_FS)
 #define blk_pc_request(rq)	((rq)->cmd_type == REQ_TYPE_BLOCK_PC)
@@ -818,6 +857,64 @@ extern void blk_execute_rq_nowait(struct request_queue *, struct gendisk *,
 				  struct request *, int, rq_end_io_fn *);
 extern void blk_unplug(struct request_queue *q);
 
+/*
+ * A bio submitted to a blk-mq queue records the hardware queue and tag of
+ * the request it ended up in, so that its submitter can poll for it.
+ */
+#define BLK_QC_T_NONE		0U
+#define BLK_QC_T_VALID		(1U << 31)
+#define BLK_QC_T_SHIFT		16
+
+static inline unsigned int blk_tag_to_qc_t(unsigned int tag,
+					   unsigned int queue_num)
+{
+	return BLK_QC_T_VALID | (queue_num << BLK_QC_T_SHIFT) | tag;
+}
+
+static inline bool blk_qc_t_valid(unsigned int cookie)
+{
+	return cookie & BLK_QC_T_VALID;
+}
+
+static inline unsigned int blk_qc_t_to_queue_num(unsigned int cookie)
+{
+	return (cookie & ~BLK_QC_T_VALID) >> BLK_QC_T_SHIFT;
+}
+
+static inline unsigned int blk_qc_t_to_tag(unsigned int cookie)
+{
+	return cookie & ((1U << BLK_QC_T_SHIFT) - 1);
+}
+
+extern bool blk_poll(struct request_queue *q, unsigned int cookie);
+
+#ifdef CONFIG_BLK_CGROUP_IOLATENCY
+extern void __blk_iolatency_done(struct bio *bio);
+
+static inline void blk_iolatency_done(struct bio *bio)
+{
+	if (bio->bi_iolat)
+		__blk_iolatency_done(bio);
+}
+
+/*
+ * Only the bio that was charged releases the charge, so a bio made by
+ * copying the struct of another one must not look charged.
+ */
+static inline void blk_iolatency_clear(struct bio *bio)
+{
+	bio->bi_iolat = NULL;
+}
+#else
+static inline void blk_iolatency_done(struct bio *bio)
+{
+}
+
+static inline void blk_iolatency_clear(struct bio *bio)
+{
+}
+#endif
+
 static inline struct request_queue *bdev_get_queue(struct block_device *bdev)
 {
 	return bdev->bd_disk->queue;
@@ -836,6 +933,47 @@ static inline void blk_run_address_space(struct address_space *mapping)
 		blk_run_backing_dev(mapping->backing_dev_info, NULL);
 }
 
+/*
+ * A task that submits a batch of I/O can plug it on the stack with
+ * blk_start_plug() and blk_finish_plug().  The requests built in between
+ * are held on the plug, where further bios are merged into them without
+ * the queue lock, and are handed to their queues in one go, sorted by
+ * queue and sector, when the plug is finished, when it holds
+ * BLK_MAX_REQUEST_COUNT requests, or when the task goes to sleep.
+ */
+struct blk_plug {
+	struct list_head list;
+	unsigned int count;
+};
+#define BLK_MAX_REQUEST_COUNT	16
+
+extern void blk_start_plug(struct blk_plug *);
+extern void blk_finish_plug(struct blk_plug *);
+extern void blk_flush_plug_list(struct blk_plug *, bool);
+
+static inline void blk_flush_plug(struct task_struct *tsk)
+{
+	struct blk_plug *plug = tsk->plug;
+
+	if (plug)
+		blk_flush_plug_list(plug, false);
+}
+
+static inline void blk_schedule_flush_plug(struct task_struct *tsk)
+{
+	struct blk_plug *plug = tsk->plug;
+
+	if (plug)
+		blk_flush_plug_list(plug, true);
+}
+
+static inline bool blk_needs_flush_plug(struct task_struct *tsk)
+{
+	struct blk_plug *plug = tsk->plug;
+
+	return plug && !list_empty(&plug->list);
+}
+
 /*
  * blk_rq_pos()			: the current sector
  * blk_rq_bytes()		: bytes left in the entire request
@@ -1182,6 +1320,8 @@ static inline void put_dev_sector(Sector p)
 
 struct work_struct;
 int kblockd_schedule_work(struct request_queue *q, struct work_struct *work);
+int kblockd_schedule_delayed_work(struct request_queue *q,
+				  struct delayed_work *dwork, unsigned long delay);
 
 #define MODULE_ALIAS_BLOCKDEV(major,minor) \
 	MODULE_ALIAS("block-major-" __stringify(major) "-" __stringify(minor))
@@ -1290,6 +1430,30 @@ static inline long nr_blockdev_pages(void)
 	return 0;
 }
 
+struct blk_plug {
+};
+
+static inline void blk_start_plug(struct blk_plug *plug)
+{
+}
+
+static inline void blk_finish_plug(struct blk_plug *plug)
+{
+}
+
+static inline void blk_flush_plug(struct task_struct *tsk)
+{
+}
+
+static inline void blk_schedule_flush_plug(struct task_struct *tsk)
+{
+}
+
+static inline bool blk_needs_flush_plug(struct task_struct *tsk)
+{
+	return false;
+}
+
 #endif /* CONFIG_BLOCK */
 
 #endif
@@ -28,6 +28,16 @@ enum {
 
 struct loop_func_table;
 
+/*
+ * A run of blocks of the backing file that is contiguous on disk, in
+ * units of the file system block size.  Used with LO_FLAGS_DIRECT_IO.
+ */
+struct loop_extent {
+	sector_t	start;		/* first block in the file */
+	sector_t	disk;		/* its block on lo_dio_bdev */
+	sector_t	len;		/* number of blocks */
+};
+
 struct loop_device {
 	int		lo_number;
 	int		lo_refcnt;
@@ -65,6 +75,16 @@ struct loop_device {
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
 	struct list_head	lo_list;
+
+	/* direct I/O to the blocks of the backing file */
+	struct block_device	*lo_dio_bdev;
+	struct loop_extent	*lo_extents;
+	unsigned int		lo_nr_extents;
+	unsigned int		lo_blkbits;
+	int			lo_dio_epoch;	/* barriers drain the other */
+	int			lo_dio_barriers; /* queued to loop_thread */
+	atomic_t		lo_dio_inflight[2];
+	wait_queue_head_t	lo_dio_wait;
 };
 
 #endif /* __KERNEL__ */
@@ -76,6 +96,7 @@ enum {
 	LO_FLAGS_READ_ONLY	= 1,
 	LO_FLAGS_USE_AOPS	= 2,
 	LO_FLAGS_AUTOCLEAR	= 4,
+	LO_FLAGS_DIRECT_IO	= 16,
 };
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
@@ -160,5 +181,6 @@ int loop_unregister_transfer(int number);
 #define LOOP_GET_STATUS64	0x4C05
 #define LOOP_CHANGE_FD		0x4C06
 #define LOOP_SET_CAPACITY	0x4C07
+#define LOOP_SET_DIRECT_IO	0x4C08
 
 #endif
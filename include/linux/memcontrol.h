@@ -22,6 +22,7 @@
 #include <linux/cgroup.h>
 struct mem_cgroup;
 struct page_cgroup;
+struct lru_shard;
 struct page;
 struct mm_struct;
 
@@ -63,6 +64,7 @@ extern unsigned long mem_cgroup_isolate_pages(unsigned long nr_to_scan,
 					struct list_head *dst,
 					unsigned long *scanned, int order,
 					int mode, struct zone *z,
+					struct lru_shard *shard,
 					struct mem_cgroup *mem_cont,
 					int active, int file);
 extern void mem_cgroup_out_of_memory(struct mem_cgroup *mem, gfp_t gfp_mask);
@@ -222,6 +222,13 @@ extern int mpol_to_str(char *buffer, int maxlen, struct mempolicy *pol,
 			int no_context);
 #endif
 
+#ifdef CONFIG_NUMA_BALANCING
+extern int mpol_misplaced(struct page *page, struct vm_area_struct *vma,
+			  unsigned long addr);
+extern unsigned long change_prot_numa(struct vm_area_struct *vma,
+			unsigned long start, unsigned long end);
+#endif
+
 /* Check if a vma is migratable */
 static inline int vma_migratable(struct vm_area_struct *vma)
 {
@@ -19,11 +19,29 @@ static inline int page_is_file_cache(struct page *page)
 	return !PageSwapBacked(page);
 }
 
+/**
+ * page_lru_shard - which LRU shard of its zone does a page belong to?
+ * @page: the page to test
+ *
+ * Returns the shard whose lists @page goes on.  The shard lock protects
+ * PageLRU and the LRU linkage of @page.
+ */
+static inline struct lru_shard *page_lru_shard(struct page *page)
+{
+	unsigned long block = page_to_pfn(page) >> LRU_SHARD_SHIFT;
+
+	return &page_zone(page)->lru_shard[block % NR_LRU_SHARDS];
+}
+
+/*
+ * A huge page counts for HPAGE_PMD_NR pages in the LRU statistics, as
+ * it does in NR_ANON_PAGES.
+ */
 static inline void
 add_page_to_lru_list(struct zone *zone, struct page *page, enum lru_list l)
 {
-	list_add(&page->lru, &zone->lru[l].list);
-	__inc_zone_state(zone, NR_LRU_BASE + l);
+	list_add(&page->lru, &page_lru_shard(page)->list[l]);
+	__mod_zone_page_state(zone, NR_LRU_BASE + l, hpage_nr_pages(page));
 	mem_cgroup_add_lru_list(page, l);
 }
 
@@ -31,7 +49,7 @@ static inline void
 del_page_from_lru_list(struct zone *zone, struct page *page, enum lru_list l)
 {
 	list_del(&page->lru);
-	__dec_zone_state(zone, NR_LRU_BASE + l);
+	__mod_zone_page_state(zone, NR_LRU_BASE + l, -hpage_nr_pages(page));
 	mem_cgroup_del_lru_list(page, l);
 }
 
@@ -66,7 +84,7 @@ del_page_from_lru(struct zone *zone, struct page *page)
 			l += LRU_ACTIVE;
 		}
 	}
-	__dec_zone_state(zone, NR_LRU_BASE + l);
+	__mod_zone_page_state(zone, NR_LRU_BASE + l, -hpage_nr_pages(page));
 	mem_cgroup_del_lru_list(page, l);
 }
 
@@ -9,6 +9,7 @@
 #include <linux/prio_tree.h>
 #include <linux/rbtree.h>
 #include <linux/rwsem.h>
+#include <linux/seqlock.h>
 #include <linux/completion.h>
 #include <linux/cpumask.h>
 #include <linux/page-debug-flags.h>
@@ -79,7 +80,7 @@ struct page {
 		void *freelist;		/* SLUB: freelist req. slab lock */
 	};
 	struct list_head lru;		/* Pageout list, eg. active_list
-					 * protected by zone->lru_lock !
+					 * protected by the LRU shard lock !
 					 */
 	/*
 	 * On machines where all RAM is mapped into kernel address space,
@@ -186,6 +187,14 @@ struct vm_area_struct {
 #ifdef CONFIG_NUMA
 	struct mempolicy *vm_policy;	/* NUMA policy for the VMA */
 #endif
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	/*
+	 * Odd while the fields a speculative page fault relies on are being
+	 * changed, and left odd once the vma has been unlinked.
+	 */
+	seqcount_t vm_sequence;
+	atomic_t vm_ref_count;		/* speculative faults using the vma */
+#endif
 };
 
 struct core_thread {
@@ -202,6 +211,9 @@ struct core_state {
 struct mm_struct {
 	struct vm_area_struct * mmap;		/* list of VMAs */
 	struct rb_root mm_rb;
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	rwlock_t mm_rb_lock;			/* mm_rb against speculative faults */
+#endif
 	struct vm_area_struct * mmap_cache;	/* last find_vma result */
 	unsigned long (*get_unmapped_area) (struct file *filp,
 				unsigned long addr, unsigned long len,
@@ -284,9 +296,21 @@ struct mm_struct {
 	struct file *exe_file;
 	unsigned long num_exe_file_vmas;
 #endif
+#ifdef CONFIG_NUMA_BALANCING
+	/* jiffies after which the next NUMA scan pass may start */
+	unsigned long numa_next_scan;
+	/* where the next NUMA scan pass starts */
+	unsigned long numa_scan_offset;
+	/* bumped when the NUMA scan wraps around the address space */
+	int numa_scan_seq;
+#endif
 #ifdef CONFIG_MMU_NOTIFIER
 	struct mmu_notifier_mm *mmu_notifier_mm;
 #endif
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	/* page tables set aside to split huge pmds, see huge_memory.c */
+	pgtable_t pmd_huge_pte;
+#endif
 };
 
 /* Future-safe accessor for struct mm_struct's cpu_vm_mask. */
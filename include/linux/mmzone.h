@@ -62,7 +62,7 @@ struct free_area {
 struct pglist_data;
 
 /*
- * zone->lock and zone->lru_lock are two of the hottest locks in the kernel.
+ * zone->lock and the LRU locks are two of the hottest locks in the kernel.
  * So add a wild amount of padding here to ensure that they fall into separate
  * cachelines.  There are very few zone structures in the machine, so space
  * consumption is not a concern here.
@@ -104,6 +104,7 @@ enum zone_stat_item {
 	NR_ISOLATED_ANON,	/* Temporary isolated pages from anon lru */
 	NR_ISOLATED_FILE,	/* Temporary isolated pages from file lru */
 	NR_SHMEM,		/* shmem pages (included tmpfs/GEM pages) */
+	NR_ANON_TRANSPARENT_HUGEPAGES,	/* huge pmd mapped anonymous pages */
 #ifdef CONFIG_NUMA
 	NUMA_HIT,		/* allocated in intended node */
 	NUMA_MISS,		/* allocated in non intended node */
@@ -283,6 +284,30 @@ struct zone_reclaim_stat {
 	unsigned long		nr_saved_scan[NR_LRU_LISTS];
 };
 
+/*
+ * The LRU lists of a zone are split into NR_LRU_SHARDS shards, each with
+ * its own lock, so that CPUs adding, rotating and reclaiming pages in
+ * different parts of a large zone do not all serialize on one lock.
+ *
+ * The shard of a page is given by the MAX_ORDER block it lies in (see
+ * page_lru_shard()).  Every path can find the lock of a page from the page
+ * alone, and compound pages, lumpy reclaim and compaction never have to
+ * deal with more than one shard at a time.
+ */
+#ifdef CONFIG_NR_LRU_SHARDS
+#define NR_LRU_SHARDS		CONFIG_NR_LRU_SHARDS
+#else
+#define NR_LRU_SHARDS		1
+#endif
+#define LRU_SHARD_SHIFT		(MAX_ORDER - 1)
+
+struct lru_shard {
+	spinlock_t		lock;
+	struct list_head	list[NR_LRU_LISTS];
+	/* only recent_rotated and recent_scanned are kept per shard */
+	struct zone_reclaim_stat reclaim_stat;
+} ____cacheline_aligned_in_smp;
+
 struct zone {
 	/* Fields commonly accessed by the page allocator */
 
@@ -329,17 +354,30 @@ struct zone {
 #endif /* CONFIG_SPARSEMEM */
 
 
+#ifdef CONFIG_COMPACTION
+	/*
+	 * On compaction failure, 1<<compact_defer_shift compactions
+	 * are skipped before trying again. The number attempted since
+	 * last failure is tracked with compact_considered.
+	 */
+	unsigned int		compact_considered;
+	unsigned int		compact_defer_shift;
+#endif
+
 	ZONE_PADDING(_pad1_)
 
 	/* Fields commonly accessed by the page reclaim scanner */
-	spinlock_t		lru_lock;	
-	struct zone_lru {
-		struct list_head list;
-	} lru[NR_LRU_LISTS];
+	struct lru_shard	lru_shard[NR_LRU_SHARDS];
+	/*
+	 * Next shard reclaim scans, for each list.  Reclaimers of different
+	 * shards run concurrently, so this and pages_scanned are atomic.
+	 */
+	atomic_t		lru_shard_next[NR_LRU_LISTS];
 
+	/* only nr_saved_scan is kept per zone, the rest lives in lru_shard */
 	struct zone_reclaim_stat reclaim_stat;
 
-	unsigned long		pages_scanned;	   /* since last reclaim */
+	atomic_long_t		pages_scanned;	   /* since last reclaim */
 	unsigned long		flags;		   /* zone flags, see below */
 
 	/* Zone statistics */
@@ -35,9 +35,46 @@ struct anon_vma {
 	 * mm_take_all_locks() (mm_all_locks_mutex).
 	 */
 	struct list_head head;	/* List of private "related" vmas */
+#ifdef CONFIG_MIGRATION
+	/*
+	 * Page migration may run without holding mmap_sem of any mm
+	 * mapping the page (memory compaction does), so it pins the
+	 * anon_vma to keep it from being freed while migration ptes
+	 * point at it.
+	 */
+	atomic_t external_refcount;
+#endif
 };
 
 #ifdef CONFIG_MMU
+#ifdef CONFIG_MIGRATION
+static inline void anonvma_external_refcount_init(struct anon_vma *anon_vma)
+{
+	atomic_set(&anon_vma->external_refcount, 0);
+}
+
+static inline int anonvma_external_refcount(struct anon_vma *anon_vma)
+{
+	return atomic_read(&anon_vma->external_refcount);
+}
+#else
+static inline void anonvma_external_refcount_init(struct anon_vma *anon_vma)
+{
+}
+
+static inline int anonvma_external_refcount(struct anon_vma *anon_vma)
+{
+	return 0;
+}
+#endif /* CONFIG_MIGRATION */
+
+static inline struct anon_vma *page_anon_vma(struct page *page)
+{
+	if (!PageAnon(page))
+		return NULL;
+	return (struct anon_vma *)
+		((unsigned long)page->mapping - PAGE_MAPPING_ANON);
+}
 
 static inline void anon_vma_lock(struct vm_area_struct *vma)
 {
@@ -127,6 +164,13 @@ struct anon_vma *page_lock_anon_vma(struct page *page);
 void page_unlock_anon_vma(struct anon_vma *anon_vma);
 int page_mapped_in_vma(struct page *page, struct vm_area_struct *vma);
 
+/*
+ * Used by split_huge_page() to find the huge pmd in each vma.
+ */
+unsigned long vma_address(struct page *page, struct vm_area_struct *vma);
+
+void drop_anon_vma(struct anon_vma *anon_vma);
+
 #else	/* !CONFIG_MMU */
 
 #define anon_vma_init()		do {} while (0)
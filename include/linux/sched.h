@@ -99,6 +99,7 @@ struct exec_domain;
 struct futex_pi_state;
 struct robust_list_head;
 struct bio;
+struct blk_plug;
 struct fs_struct;
 struct bts_context;
 struct perf_event_context;
@@ -492,6 +493,7 @@ extern int get_dumpable(struct mm_struct *mm);
 #endif
 					/* leave room for more dump flags */
 #define MMF_VM_MERGEABLE	16	/* KSM may merge identical pages */
+#define MMF_VM_HUGEPAGE		17	/* set when VM_HUGEPAGE is set on vma */
 #ifdef CONFIG_IPIPE
 #define MMF_VM_PINNED		31	/* ondemand load up and COW disabled */
 #endif
@@ -1472,6 +1474,11 @@ struct task_struct {
 /* stacked block device info */
 	struct bio *bio_list, **bio_tail;
 
+#ifdef CONFIG_BLOCK
+/* stack plugging */
+	struct blk_plug *plug;
+#endif
+
 /* VM state */
 	struct reclaim_state *reclaim_state;
 
@@ -1513,6 +1520,21 @@ struct task_struct {
 #ifdef CONFIG_NUMA
 	struct mempolicy *mempolicy;	/* Protected by alloc_lock */
 	short il_next;
+#endif
+#ifdef CONFIG_NUMA_BALANCING
+	int numa_scan_seq;		/* mm->numa_scan_seq last placed at */
+	unsigned int numa_scan_period;	/* msecs between NUMA scan passes */
+	u64 node_stamp;			/* runtime of the last scan request */
+	int numa_preferred_nid;
+	/*
+	 * Hinting faults per node, decayed at each full scan, followed by
+	 * the faults taken since the last full scan.
+	 */
+	unsigned long *numa_faults;
+	unsigned long *numa_faults_buffer;
+	unsigned long numa_faults_local;
+	unsigned long numa_faults_remote;
+	unsigned long numa_pages_migrated;
 #endif
 	atomic_t fs_excl;	/* holding fs exclusive resources */
 	struct rcu_head rcu;
@@ -1930,6 +1952,27 @@ extern unsigned int sysctl_sched_wakeup_granularity;
 extern unsigned int sysctl_sched_shares_ratelimit;
 extern unsigned int sysctl_sched_shares_thresh;
 extern unsigned int sysctl_sched_child_runs_first;
+#ifdef CONFIG_NUMA_BALANCING
+extern unsigned int sysctl_numa_balancing;
+extern unsigned int sysctl_numa_balancing_scan_delay;
+extern unsigned int sysctl_numa_balancing_scan_period_min;
+extern unsigned int sysctl_numa_balancing_scan_period_max;
+extern unsigned int sysctl_numa_balancing_scan_size;
+
+extern void task_numa_fault(int node, int pages, int migrated);
+extern void task_numa_work(void);
+extern void task_numa_free(struct task_struct *p);
+#else
+static inline void task_numa_fault(int node, int pages, int migrated)
+{
+}
+static inline void task_numa_work(void)
+{
+}
+static inline void task_numa_free(struct task_struct *p)
+{
+}
+#endif
 #ifdef CONFIG_SCHED_DEBUG
 extern unsigned int sysctl_sched_features;
 extern unsigned int sysctl_sched_migration_cost;
@@ -169,6 +169,8 @@ struct skb_shared_hwtstamps {
  * @software:		generate software time stamp
  * @in_progress:	device driver is going to provide
  *			hardware time stamp
+ * @zerocopy:		paged data is pinned user memory described by
+ *			the &ubuf_info in destructor_arg
  * @flags:		all shared_tx flags
  *
  * These flags are attached to packets as part of the
@@ -178,11 +180,32 @@ union skb_shared_tx {
 	struct {
 		__u8	hardware:1,
 			software:1,
-			in_progress:1;
+			in_progress:1,
+			zerocopy:1;
 	};
 	__u8 flags;
 };
 
+/**
+ * struct ubuf_info - completion state of a zero-copy transmit
+ * @callback:	called once the last skb referencing the user pages
+ *		has released its data
+ * @refcnt:	one reference per skb data area plus one for the sender
+ * @sk:		socket to notify, holds a reference
+ * @id:		per-socket sequence number of the sendmsg() call
+ * @copied:	some of the data had to be copied after all
+ *
+ * Lives in the cb[] of the skb that is later queued on the socket error
+ * queue as the completion notification.
+ */
+struct ubuf_info {
+	void		(*callback)(struct ubuf_info *);
+	atomic_t	refcnt;
+	struct sock	*sk;
+	u32		id;
+	u8		copied;
+};
+
 /* This data is invariant across clones and lives at
  * the end of the header data, ie. at skb->end.
  */
@@ -243,6 +266,8 @@ enum {
 	SKB_GSO_TCPV6 = 1 << 4,
 
 	SKB_GSO_FCOE = 1 << 5,
+
+	SKB_GSO_UDP_L4 = 1 << 6,
 };
 
 #if BITS_PER_LONG > 32
@@ -536,6 +561,37 @@ static inline union skb_shared_tx *skb_tx(struct sk_buff *skb)
 	return &skb_shinfo(skb)->tx_flags;
 }
 
+static inline struct ubuf_info *skb_zcopy(struct sk_buff *skb)
+{
+	if (skb_shinfo(skb)->tx_flags.zerocopy)
+		return skb_shinfo(skb)->destructor_arg;
+	return NULL;
+}
+
+static inline void sock_zerocopy_get(struct ubuf_info *uarg)
+{
+	atomic_inc(&uarg->refcnt);
+}
+
+static inline void sock_zerocopy_put(struct ubuf_info *uarg)
+{
+	if (atomic_dec_and_test(&uarg->refcnt))
+		uarg->callback(uarg);
+}
+
+static inline void skb_zcopy_set(struct sk_buff *skb, struct ubuf_info *uarg)
+{
+	sock_zerocopy_get(uarg);
+	skb_shinfo(skb)->destructor_arg = uarg;
+	skb_shinfo(skb)->tx_flags.zerocopy = 1;
+}
+
+extern struct ubuf_info *sock_zerocopy_alloc(struct sock *sk);
+extern void sock_zerocopy_put_abort(struct ubuf_info *uarg);
+extern int skb_zerocopy_clone(struct sk_buff *nskb, struct sk_buff *orig);
+extern int skb_zerocopy_add_frags(struct sock *sk, struct sk_buff *skb,
+				  unsigned char __user *from, int copy);
+
 /**
  *	skb_queue_empty - check if a queue is empty
  *	@list: queue head
@@ -1734,6 +1790,8 @@ static inline void skb_frag_add_head(struct sk_buff *skb, struct sk_buff *frag)
 #define skb_walk_frags(skb, iter)	\
 	for (iter = skb_shinfo(skb)->frag_list; iter; iter = iter->next)
 
+extern int	       __skb_wait_for_more_packets(struct sock *sk, int *err,
+						   long *timeo_p);
 extern struct sk_buff *__skb_recv_datagram(struct sock *sk, unsigned flags,
 					   int *peeked, int *err);
 extern struct sk_buff *skb_recv_datagram(struct sock *sk, unsigned flags,
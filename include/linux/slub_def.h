@@ -32,10 +32,14 @@ enum stat_item {
 	DEACTIVATE_TO_TAIL,	/* Cpu slab was moved to the tail of partials */
 	DEACTIVATE_REMOTE_FREES,/* Slab contained remotely freed objects */
 	ORDER_FALLBACK,		/* Number of times fallback was necessary */
+	CMPXCHG_DOUBLE_CPU_FAIL,/* Lockless fastpath raced with an interrupt */
 	NR_SLUB_STAT_ITEMS };
 
 struct kmem_cache_cpu {
 	void **freelist;	/* Pointer to first free per cpu object */
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	unsigned long tid;	/* Changes with every change of freelist */
+#endif
 	struct page *page;	/* The slab from which we are allocating */
 	int node;		/* The node of the page (or -1 for debug) */
 	unsigned int offset;	/* Freepointer offset (in word units) */
@@ -43,7 +47,11 @@ struct kmem_cache_cpu {
 #ifdef CONFIG_SLUB_STATS
 	unsigned stat[NR_SLUB_STAT_ITEMS];
 #endif
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+} __aligned(2 * sizeof(void *));	/* freelist and tid are exchanged together */
+#else
 };
+#endif
 
 struct kmem_cache_node {
 	spinlock_t list_lock;	/* Protect partial list and nr_partial */
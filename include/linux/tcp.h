@@ -96,6 +96,7 @@ enum {
 #define TCP_QUICKACK		12	/* Block/reenable quick acks */
 #define TCP_CONGESTION		13	/* Congestion control algorithm */
 #define TCP_MD5SIG		14	/* TCP MD5 Signature (RFC2385) */
+#define TCP_FASTOPEN		23	/* Enable FastOpen on listeners */
 
 #define TCPI_OPT_TIMESTAMPS	1
 #define TCPI_OPT_SACK		2
@@ -237,6 +238,20 @@ struct tcp_request_sock {
 #endif
 	u32			 	rcv_isn;
 	u32			 	snt_isn;
+	u32				rcv_nxt; /* the ack # by SYNACK. For
+						  * FastOpen it's the seq#
+						  * after data-in-SYN.
+						  */
+};
+
+/* TCP Fast Open cookie as carried in the option */
+#define TCP_FASTOPEN_COOKIE_MIN	4	/* Min Fast Open Cookie size in bytes */
+#define TCP_FASTOPEN_COOKIE_MAX	16	/* Max Fast Open Cookie size in bytes */
+#define TCP_FASTOPEN_COOKIE_SIZE 8	/* the size employed by this impl. */
+
+struct tcp_fastopen_cookie {
+	s8	len;	/* -1: none, 0: request, else cookie length */
+	u8	val[TCP_FASTOPEN_COOKIE_MAX];
 };
 
 static inline struct tcp_request_sock *tcp_rsk(const struct request_sock *req)
@@ -300,6 +315,24 @@ struct tcp_sock {
 	u8	frto_counter;	/* Number of new acks after RTO */
 	u8	nonagle;	/* Disable Nagle algorithm?             */
 
+/* TCP small queues */
+	unsigned long	tsq_flags;	/* TSQ_* bits, see net/tcp.h	*/
+	struct list_head tsq_node;	/* anchor in the per-CPU tsq list */
+
+/* TCP Fast Open */
+	u8	syn_fastopen:1,	/* SYN includes Fast Open option */
+		syn_data:1;	/* SYN includes data */
+	u16	fastopen_qlen;	/* listener: max pending Fast Open children */
+	struct tcp_fastopen_request *fastopen_req;
+	/* fastopen_req is only used on the client side of a connect() that
+	 * sends data in the SYN, and freed once that connect() returns.
+	 */
+	struct request_sock *fastopen_rsk;
+	/* fastopen_rsk points to the request_sock of a passive Fast Open
+	 * socket in SYN_RECV, used to retransmit the SYN-ACK until the
+	 * three way handshake completes.
+	 */
+
 /* RTT measurement */
 	u32	srtt;		/* smoothed round trip time << 3	*/
 	u32	mdev;		/* medium deviation			*/
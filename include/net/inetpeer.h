@@ -27,6 +27,10 @@ struct inet_peer
 	atomic_t		rid;		/* Frag reception counter */
 	__u32			tcp_ts;
 	unsigned long		tcp_ts_stamp;
+	/* TCP Fast Open client cookie cache, see net/ipv4/tcp_fastopen.c */
+	__u16			tcp_fastopen_mss;
+	__s8			tcp_fastopen_cookie_len;
+	__u8			tcp_fastopen_cookie[16];
 };
 
 void			inet_initpeers(void) __init;
@@ -60,6 +60,8 @@ struct fib_nh {
 #endif
 	int			nh_oif;
 	__be32			nh_gw;
+	/* per-CPU forwarding result, used when the route cache is off */
+	struct rtable		**nh_pcpu_rth_input;
 };
 
 /*
@@ -137,6 +137,13 @@ extern int	udp_sendmsg(struct kiocb *iocb, struct sock *sk,
 extern void	udp_flush_pending_frames(struct sock *sk);
 
 extern int	udp_rcv(struct sk_buff *skb);
+extern int	udp_init_sock(struct sock *sk);
+extern void	udp_lib_set_gro(struct sock *sk, int on);
+extern int	__udp_enqueue_schedule_skb(struct sock *sk, struct sk_buff *skb);
+extern struct sk_buff *__skb_recv_udp(struct sock *sk, unsigned int flags,
+				      int noblock, int *peeked, int *err);
+extern int	udp_kill_datagram(struct sock *sk, struct sk_buff *skb,
+				  unsigned int flags);
 extern int	udp_ioctl(struct sock *sk, int cmd, unsigned long arg);
 extern int	udp_disconnect(struct sock *sk, int flags);
 extern unsigned int udp_poll(struct file *file, struct socket *sock,
@@ -151,6 +158,28 @@ extern struct sock *udp4_lib_lookup(struct net *net, __be32 saddr, __be16 sport,
 				    __be32 daddr, __be16 dport,
 				    int dif);
 
+/*
+ * Receive memory of a UDP socket is returned by the skb destructor, so
+ * in-kernel readers must not go through skb_free_datagram(), which would
+ * reclaim forward_alloc behind the back of the lockless enqueue path.
+ */
+static inline void skb_consume_udp(struct sock *sk, struct sk_buff *skb)
+{
+	consume_skb(skb);
+}
+
+/* Tell a UDP_GRO reader the segment size of a coalesced datagram */
+static inline void udp_cmsg_recv(struct msghdr *msg, struct sock *sk,
+				 struct sk_buff *skb)
+{
+	int gso_size;
+
+	if (udp_sk(sk)->gro_enabled && skb_is_gso(skb)) {
+		gso_size = skb_shinfo(skb)->gso_size;
+		put_cmsg(msg, SOL_UDP, UDP_GRO, sizeof(gso_size), &gso_size);
+	}
+}
+
 /*
  * 	SNMP statistics for UDP and UDP-Lite
  */
@@ -210,4 +239,7 @@ extern void udp_init(void);
 
 extern int udp4_ufo_send_check(struct sk_buff *skb);
 extern struct sk_buff *udp4_ufo_fragment(struct sk_buff *skb, int features);
+extern struct sk_buff **udp4_gro_receive(struct sk_buff **head,
+					 struct sk_buff *skb);
+extern int udp4_gro_complete(struct sk_buff *skb);
 #endif	/* _UDP_H */
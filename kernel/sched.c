@@ -58,6 +58,7 @@
 #include <linux/kthread.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/blkdev.h>
 #include <linux/sysctl.h>
 #include <linux/syscalls.h>
 #include <linux/times.h>
@@ -71,6 +72,8 @@
 #include <linux/debugfs.h>
 #include <linux/ctype.h>
 #include <linux/ftrace.h>
+#include <linux/mempolicy.h>
+#include <linux/tracehook.h>
 
 #include <asm/tlb.h>
 #include <asm/irq_regs.h>
@@ -2506,6 +2509,18 @@ static void __sched_fork(struct task_struct *p)
 	p->se.avg_wakeup		= sysctl_sched_wakeup_granularity;
 	p->se.avg_running		= 0;
 
+#ifdef CONFIG_NUMA_BALANCING
+	p->numa_scan_seq		= 0;
+	p->numa_scan_period		= sysctl_numa_balancing_scan_period_min;
+	p->node_stamp			= 0;
+	p->numa_preferred_nid		= -1;
+	p->numa_faults			= NULL;
+	p->numa_faults_buffer		= NULL;
+	p->numa_faults_local		= 0;
+	p->numa_faults_remote		= 0;
+	p->numa_pages_migrated		= 0;
+#endif
+
 #ifdef CONFIG_SCHEDSTATS
 	p->se.wait_start			= 0;
 	p->se.wait_max				= 0;
@@ -3209,6 +3224,27 @@ static void pull_task(struct rq *src_rq, struct task_struct *p,
 	check_preempt_curr(this_rq, p, 0);
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Moving a task off the node holding most of its memory costs it like
+ * moving it off a cache hot CPU.
+ */
+static int migrate_degrades_locality(struct task_struct *p, int dst_cpu)
+{
+	int nid = p->numa_preferred_nid;
+
+	if (!sysctl_numa_balancing || nid == -1)
+		return 0;
+	return cpu_to_node(task_cpu(p)) == nid && cpu_to_node(dst_cpu) != nid;
+}
+#else
+static inline int migrate_degrades_locality(struct task_struct *p,
+					    int dst_cpu)
+{
+	return 0;
+}
+#endif
+
 /*
  * can_migrate_task - may task p from runqueue rq be migrated to this_cpu?
  */
@@ -3241,7 +3277,8 @@ int can_migrate_task(struct task_struct *p, struct rq *rq, int this_cpu,
 	 * 2) too many balance attempts have failed.
 	 */
 
-	tsk_cache_hot = task_hot(p, rq->clock, sd);
+	tsk_cache_hot = task_hot(p, rq->clock, sd) ||
+			migrate_degrades_locality(p, this_cpu);
 	if (!tsk_cache_hot ||
 		sd->nr_balance_failed > sd->cache_nice_tries) {
 #ifdef CONFIG_SCHEDSTATS
@@ -5475,6 +5512,19 @@ pick_next_task(struct rq *rq)
 	}
 }
 
+static inline void sched_submit_work(struct task_struct *tsk)
+{
+	if (!tsk->state || (tsk->state & TASK_ATOMICSWITCH) ||
+	    (preempt_count() & PREEMPT_ACTIVE))
+		return;
+	/*
+	 * If we are going to sleep and we have plugged IO queued,
+	 * make sure to submit it to avoid deadlocks.
+	 */
+	if (blk_needs_flush_plug(tsk))
+		blk_schedule_flush_plug(tsk);
+}
+
 /*
  * schedule() is the main scheduler function.
  */
@@ -5485,6 +5535,7 @@ asmlinkage int __sched schedule(void)
 	struct rq *rq;
 	int cpu;
 
+	sched_submit_work(current);
 need_resched:
 	preempt_disable();
 	cpu = smp_processor_id();
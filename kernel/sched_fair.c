@@ -1896,6 +1896,235 @@ static void rq_offline_fair(struct rq *rq)
 
 #endif /* CONFIG_SMP */
 
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Automatic NUMA balancing: every numa_scan_period of its runtime, a task
+ * turns the ptes of the next scan_size MB of its address space into NUMA
+ * hinting ptes.  The hinting faults that follow migrate misplaced pages to
+ * the node of the faulting CPU and are counted per node; after each full
+ * pass over the address space the task prefers the node where most of its
+ * faults were, and is moved there.
+ */
+unsigned int sysctl_numa_balancing;
+
+/* Delay before the first scan of a new address space, in ms */
+unsigned int sysctl_numa_balancing_scan_delay = 1000;
+
+/* Bounds of the scan period of a task, in ms of its runtime */
+unsigned int sysctl_numa_balancing_scan_period_min = 1000;
+unsigned int sysctl_numa_balancing_scan_period_max = 60000;
+
+/* Amount of address space scanned per pass, in MB */
+unsigned int sysctl_numa_balancing_scan_size = 256;
+
+static void sched_migrate_task(struct task_struct *p, int dest_cpu);
+
+/*
+ * Move the task to the least loaded CPU of its preferred node, if that does
+ * not leave the CPU more loaded than the one the task runs on now.
+ */
+static void task_numa_migrate(struct task_struct *p)
+{
+	int nid = p->numa_preferred_nid;
+	int this_cpu = task_cpu(p);
+	int cpu, best_cpu = -1;
+	unsigned long load, min_load;
+
+	min_load = weighted_cpuload(this_cpu) - p->se.load.weight;
+	if ((long)min_load < 0)
+		min_load = 0;
+
+	for_each_cpu_and(cpu, cpumask_of_node(nid), &p->cpus_allowed) {
+		if (!cpu_active(cpu))
+			continue;
+		load = weighted_cpuload(cpu);
+		if (load <= min_load) {
+			min_load = load;
+			best_cpu = cpu;
+		}
+	}
+
+	if (best_cpu != -1)
+		sched_migrate_task(p, best_cpu);
+}
+
+/*
+ * Called once per full scan of the address space: age the fault counts,
+ * pick the node with most faults and move there.
+ */
+static void task_numa_placement(struct task_struct *p)
+{
+	int seq, nid, max_nid = -1;
+	unsigned long max_faults = 0;
+
+	if (!p->numa_faults)
+		return;
+	seq = ACCESS_ONCE(p->mm->numa_scan_seq);
+	if (p->numa_scan_seq == seq)
+		return;
+	p->numa_scan_seq = seq;
+
+	for_each_online_node(nid) {
+		unsigned long faults;
+
+		faults = p->numa_faults[nid] / 2 + p->numa_faults_buffer[nid];
+		p->numa_faults[nid] = faults;
+		p->numa_faults_buffer[nid] = 0;
+		if (faults > max_faults) {
+			max_faults = faults;
+			max_nid = nid;
+		}
+	}
+
+	if (max_nid != -1 && max_nid != p->numa_preferred_nid) {
+		p->numa_preferred_nid = max_nid;
+		/* Sample the new placement quickly */
+		p->numa_scan_period = sysctl_numa_balancing_scan_period_min;
+	}
+
+	if (p->numa_preferred_nid != -1 &&
+	    cpu_to_node(task_cpu(p)) != p->numa_preferred_nid)
+		task_numa_migrate(p);
+}
+
+/*
+ * Account a NUMA hinting fault on pages found on node, after any migration.
+ */
+void task_numa_fault(int node, int pages, int migrated)
+{
+	struct task_struct *p = current;
+
+	if (!sysctl_numa_balancing)
+		return;
+
+	if (unlikely(!p->numa_faults)) {
+		unsigned long *faults;
+
+		faults = kzalloc(2 * nr_node_ids * sizeof(*faults), GFP_KERNEL);
+		if (!faults)
+			return;
+		p->numa_faults_buffer = faults + nr_node_ids;
+		p->numa_faults = faults;
+	}
+
+	/*
+	 * Back off scanning while the faults find the memory where it
+	 * should be already.
+	 */
+	if (migrated)
+		p->numa_pages_migrated += pages;
+	else
+		p->numa_scan_period = min(sysctl_numa_balancing_scan_period_max,
+					  p->numa_scan_period + 10);
+
+	if (node == numa_node_id())
+		p->numa_faults_local += pages;
+	else
+		p->numa_faults_remote += pages;
+	p->numa_faults_buffer[node] += pages;
+}
+
+void task_numa_free(struct task_struct *p)
+{
+	kfree(p->numa_faults);
+}
+
+/*
+ * The scan pass requested by task_tick_numa(), run on the way back to user
+ * mode.  Only one thread of a process scans per scan period.
+ */
+void task_numa_work(void)
+{
+	struct task_struct *p = current;
+	struct mm_struct *mm = p->mm;
+	struct vm_area_struct *vma;
+	unsigned long now = jiffies;
+	unsigned long migrate, next_scan;
+	unsigned long start, end;
+	long pages;
+
+	if (!mm || (p->flags & PF_EXITING) || !sysctl_numa_balancing)
+		return;
+
+	task_numa_placement(p);
+
+	migrate = mm->numa_next_scan;
+	if (time_before(now, migrate))
+		return;
+	if (p->numa_scan_period == 0)
+		p->numa_scan_period = sysctl_numa_balancing_scan_period_min;
+	next_scan = now + msecs_to_jiffies(p->numa_scan_period);
+	if (cmpxchg(&mm->numa_next_scan, migrate, next_scan) != migrate)
+		return;
+
+	pages = (long)sysctl_numa_balancing_scan_size << (20 - PAGE_SHIFT);
+	start = mm->numa_scan_offset;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, start);
+	if (!vma) {
+		ACCESS_ONCE(mm->numa_scan_seq)++;
+		start = 0;
+		vma = mm->mmap;
+	}
+	for (; vma; vma = vma->vm_next) {
+		/*
+		 * vma_migratable() leaves out VM_IO and hugetlb vmas.  Locked
+		 * memory is skipped too: whoever mlocked it, typically a
+		 * real-time task, does not expect to take faults on it.
+		 */
+		if (!vma_migratable(vma) || (vma->vm_flags & VM_LOCKED) ||
+		    !(vma->vm_flags & (VM_READ | VM_WRITE | VM_EXEC)))
+			continue;
+
+		do {
+			start = max(start, vma->vm_start);
+			end = start + (pages << PAGE_SHIFT);
+			end = min(end, vma->vm_end);
+			pages -= (end - start) >> PAGE_SHIFT;
+			change_prot_numa(vma, start, end);
+			start = end;
+			if (pages <= 0)
+				goto out;
+		} while (end != vma->vm_end);
+	}
+out:
+	/*
+	 * Start the next pass where this one stopped, or from the beginning
+	 * once the end of the address space has been reached.
+	 */
+	if (vma)
+		mm->numa_scan_offset = start;
+	else {
+		mm->numa_scan_offset = 0;
+		ACCESS_ONCE(mm->numa_scan_seq)++;
+	}
+	up_read(&mm->mmap_sem);
+}
+
+/*
+ * Ask for a scan pass each time the task has run for its scan period.
+ */
+static void task_tick_numa(struct rq *rq, struct task_struct *curr)
+{
+	u64 period, now;
+
+	if (!curr->mm || (curr->flags & PF_EXITING))
+		return;
+
+	now = curr->se.sum_exec_runtime;
+	if (!curr->numa_scan_period)
+		curr->numa_scan_period = sysctl_numa_balancing_scan_period_min;
+	period = (u64)curr->numa_scan_period * NSEC_PER_MSEC;
+
+	if (now - curr->node_stamp > period) {
+		curr->node_stamp = now;
+		if (!time_before(jiffies, curr->mm->numa_next_scan))
+			set_notify_resume(curr);
+	}
+}
+#endif /* CONFIG_NUMA_BALANCING */
+
 /*
  * scheduler tick hitting a task of our scheduling class:
  */
@@ -1908,6 +2137,11 @@ static void task_tick_fair(struct rq *rq, struct task_struct *curr, int queued)
 		cfs_rq = cfs_rq_of(se);
 		entity_tick(cfs_rq, se, queued);
 	}
+
+#ifdef CONFIG_NUMA_BALANCING
+	if (sysctl_numa_balancing)
+		task_tick_numa(rq, curr);
+#endif
 }
 
 /*
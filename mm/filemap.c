@@ -33,6 +33,7 @@
 #include <linux/cpuset.h>
 #include <linux/hardirq.h> /* for BUG_ON(!in_atomic()) only */
 #include <linux/memcontrol.h>
+#include <linux/rmap.h>
 #include <linux/mm_inline.h> /* for page_is_file_cache() */
 #include "internal.h"
 
@@ -94,8 +95,8 @@
  *    ->swap_lock		(try_to_unmap_one)
  *    ->private_lock		(try_to_unmap_one)
  *    ->tree_lock		(try_to_unmap_one)
- *    ->zone.lru_lock		(follow_page->mark_page_accessed)
- *    ->zone.lru_lock		(check_pte_range->isolate_lru_page)
+ *    ->lru_shard.lock		(follow_page->mark_page_accessed)
+ *    ->lru_shard.lock		(check_pte_range->isolate_lru_page)
  *    ->private_lock		(page_remove_rmap->set_page_dirty)
  *    ->tree_lock		(page_remove_rmap->set_page_dirty)
  *    ->inode_lock		(page_remove_rmap->set_page_dirty)
@@ -1612,8 +1613,76 @@ page_not_uptodate:
 }
 EXPORT_SYMBOL(filemap_fault);
 
+/**
+ * filemap_map_pages - map page cache pages around a read fault
+ * @vma:	vma in which the fault was taken
+ * @vmf:	pgoff, max_pgoff, pte and virtual_address of the window
+ *
+ * Called by the fault path after filemap_fault(), with the page table lock
+ * held, to map the pages of the window that are already uptodate in the page
+ * cache.  All of them are found with one gang lookup, and the rss counter is
+ * updated once for the lot.  Nothing here may sleep: pages that are locked,
+ * not uptodate, or due to start async readahead are left to filemap_fault().
+ */
+void filemap_map_pages(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct address_space *mapping = vma->vm_file->f_mapping;
+	struct page *pages[FAULT_AROUND_MAX_PAGES];
+	unsigned long address = (unsigned long)vmf->virtual_address;
+	unsigned int nr, i, mapped = 0;
+	pgoff_t size;
+
+	nr = min_t(pgoff_t, vmf->max_pgoff - vmf->pgoff + 1,
+		   FAULT_AROUND_MAX_PAGES);
+	nr = find_get_pages(mapping, vmf->pgoff, nr, pages);
+	size = (i_size_read(mapping->host) + PAGE_CACHE_SIZE - 1) >>
+							PAGE_CACHE_SHIFT;
+
+	for (i = 0; i < nr; i++) {
+		struct page *page = pages[i];
+		unsigned long addr;
+		pte_t *pte, entry;
+
+		if (page->index > vmf->max_pgoff)
+			goto skip;
+		pte = vmf->pte + (page->index - vmf->pgoff);
+		if (!pte_none(*pte))
+			goto skip;
+		if (!PageUptodate(page) || PageReadahead(page) ||
+		    PageHWPoison(page))
+			goto skip;
+		if (!trylock_page(page))
+			goto skip;
+		/* Truncated or invalidated since the lookup? */
+		if (page->mapping != mapping || !PageUptodate(page) ||
+		    page->index >= size)
+			goto unlock;
+
+		addr = address + ((page->index - vmf->pgoff) << PAGE_SHIFT);
+		flush_icache_page(vma, page);
+		entry = mk_pte(page, vma->vm_page_prot);
+		page_add_file_rmap(page);
+		set_pte_at(vma->vm_mm, addr, pte, entry);
+		/* no need to invalidate: a not-present page won't be cached */
+		update_mmu_cache(vma, addr, entry);
+		unlock_page(page);
+		/* the reference from find_get_pages() now belongs to the pte */
+		mapped++;
+		continue;
+unlock:
+		unlock_page(page);
+skip:
+		page_cache_release(page);
+	}
+
+	if (mapped)
+		add_mm_counter(vma->vm_mm, file_rss, mapped);
+}
+EXPORT_SYMBOL(filemap_map_pages);
+
 const struct vm_operations_struct generic_file_vm_ops = {
 	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
 };
 
 /* This is used for a general mmap of a disk file */
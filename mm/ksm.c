@@ -74,6 +74,21 @@
  *    take 10 attempts to find a page in the unstable tree, once it is found,
  *    it is secured in the stable tree.  (When we scan a new page, we first
  *    compare it against the stable tree, and then against the unstable tree.)
+ *
+ * Both trees are sorted by the checksum of the page first, and only by the
+ * content of the page among nodes of equal checksum.  A tree node keeps the
+ * checksum its page had when it was inserted, so walking a tree compares
+ * integers, and only a node whose checksum equals that of the scanned page
+ * costs a lookup of its page and a full comparison: most pages that have no
+ * duplicate go through both trees without any page being compared.
+ *
+ * The scanning itself is done by one or more ksmd threads (scan_threads in
+ * sysfs).  Each one claims the next mm_slot off the list and scans all of
+ * it; walking page tables and checksumming pages proceeds in parallel, the
+ * tree lookups and merging are serialized by ksm_tree_mutex.  A full scan
+ * ends once the cursor has gone round the list and the last claimed mm_slot
+ * has been scanned, so that every rmap_item is still visited exactly once
+ * between two flushes of the unstable tree.
  */
 
 /**
@@ -82,28 +97,51 @@
  * @mm_list: link into the mm_slots list, rooted in ksm_mm_head
  * @rmap_list: head for this mm_slot's list of rmap_items
  * @mm: the mm that this information is valid for
+ * @worker: the ksmd thread scanning this mm, if any
  */
 struct mm_slot {
 	struct hlist_node link;
 	struct list_head mm_list;
 	struct list_head rmap_list;
 	struct mm_struct *mm;
+	struct ksm_worker *worker;
 };
 
 /**
  * struct ksm_scan - cursor for scanning
- * @mm_slot: the current mm_slot we are scanning
- * @address: the next address inside that to be scanned
- * @rmap_item: the current rmap that we are scanning inside the rmap_list
+ * @mm_slot: the mm_slot most recently handed out to a ksmd thread
+ * @nr_scanning: number of mm_slots handed out and not yet fully scanned
  * @seqnr: count of completed full scans (needed when removing unstable node)
  *
- * There is only the one ksm_scan instance of this cursor structure.
+ * There is only the one ksm_scan instance of this cursor structure, shared
+ * by all ksmd threads under ksm_mmlist_lock.
  */
 struct ksm_scan {
+	struct mm_slot *mm_slot;
+	unsigned int nr_scanning;
+	unsigned long seqnr;
+};
+
+/**
+ * struct ksm_worker - a ksmd thread
+ * @thread: the thread, NULL if not running
+ * @mm_slot: the mm_slot it is scanning, NULL between two mm_slots
+ * @address: the next address inside that to be scanned
+ * @rmap_item: the current rmap that we are scanning inside the rmap_list
+ * @pages_scanned: pages it has scanned
+ * @mm_slots_scanned: mm_slots it has scanned to the end
+ * @pages_merged: pages it has merged into the stable tree
+ * @kobj: its directory in sysfs, holding the three counters above
+ */
+struct ksm_worker {
+	struct task_struct *thread;
 	struct mm_slot *mm_slot;
 	unsigned long address;
 	struct rmap_item *rmap_item;
-	unsigned long seqnr;
+	unsigned long pages_scanned;
+	unsigned long mm_slots_scanned;
+	unsigned long pages_merged;
+	struct kobject *kobj;
 };
 
 /**
@@ -111,19 +149,18 @@ struct ksm_scan {
  * @link: link into mm_slot's rmap_list (rmap_list is per mm)
  * @mm: the memory structure this rmap_item is pointing into
  * @address: the virtual address this rmap_item tracks (+ flags in low bits)
- * @oldchecksum: previous checksum of the page at that virtual address
- * @node: rb_node of this rmap_item in either unstable or stable tree
+ * @checksum: previous checksum of the page at that virtual address; for a
+ *	      node of either tree, the checksum it is sorted by
  * @next: next rmap_item hanging off the same node of the stable tree
+ * @node: rb_node of this rmap_item in either unstable or stable tree
  * @prev: previous rmap_item hanging off the same node of the stable tree
  */
 struct rmap_item {
 	struct list_head link;
 	struct mm_struct *mm;
 	unsigned long address;		/* + low bits used for flags below */
-	union {
-		unsigned int oldchecksum;		/* when unstable */
-		struct rmap_item *next;			/* when stable */
-	};
+	unsigned int checksum;
+	struct rmap_item *next;				/* when stable */
 	union {
 		struct rb_node node;			/* when tree node */
 		struct rmap_item *prev;			/* in stable list */
@@ -172,13 +209,28 @@ static unsigned int ksm_thread_pages_to_scan = 100;
 /* Milliseconds ksmd should sleep between batches */
 static unsigned int ksm_thread_sleep_millisecs = 20;
 
+#define KSM_MAX_SCAN_THREADS	32
+
+/* Number of ksmd threads scanning in parallel */
+static unsigned int ksm_nr_scan_threads;
+static struct ksm_worker ksm_workers[KSM_MAX_SCAN_THREADS];
+
 #define KSM_RUN_STOP	0
 #define KSM_RUN_MERGE	1
 #define KSM_RUN_UNMERGE	2
 static unsigned int ksm_run = KSM_RUN_STOP;
 
 static DECLARE_WAIT_QUEUE_HEAD(ksm_thread_wait);
+/* Serializes changes to ksm_run and to the number of ksmd threads */
 static DEFINE_MUTEX(ksm_thread_mutex);
+/* Held for read by ksmd threads while scanning, for write to unmerge all */
+static DECLARE_RWSEM(ksm_scan_sem);
+/*
+ * Protects both trees, the rmap_items and rmap_lists, and the counters
+ * above.  Nests outside mmap_sem: must never be taken while holding one.
+ */
+static DEFINE_MUTEX(ksm_tree_mutex);
+/* Protects the mm_slots list and hash, ksm_scan and mm_slot->worker */
 static DEFINE_SPINLOCK(ksm_mmlist_lock);
 
 #define KSM_KMEM_CACHE(__struct, __flags) kmem_cache_create("ksm_"#__struct,\
@@ -436,6 +488,7 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 						&next_item->node,
 						&root_stable_tree);
 				next_item->address |= NODE_FLAG;
+				next_item->checksum = rmap_item->checksum;
 				ksm_pages_sharing--;
 			} else {
 				rb_erase(&rmap_item->node, &root_stable_tree);
@@ -476,11 +529,15 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 	cond_resched();		/* we're called from many long loops */
 }
 
+/*
+ * Called without mmap_sem: ksm_tree_mutex must not nest inside it.
+ */
 static void remove_trailing_rmap_items(struct mm_slot *mm_slot,
 				       struct list_head *cur)
 {
 	struct rmap_item *rmap_item;
 
+	mutex_lock(&ksm_tree_mutex);
 	while (cur != &mm_slot->rmap_list) {
 		rmap_item = list_entry(cur, struct rmap_item, link);
 		cur = cur->next;
@@ -488,6 +545,7 @@ static void remove_trailing_rmap_items(struct mm_slot *mm_slot,
 		list_del(&rmap_item->link);
 		free_rmap_item(rmap_item);
 	}
+	mutex_unlock(&ksm_tree_mutex);
 }
 
 /*
@@ -522,16 +580,26 @@ static int unmerge_ksm_pages(struct vm_area_struct *vma,
 
 #ifdef CONFIG_SYSFS
 /*
- * Only called through the sysfs control interface:
+ * Only called through the sysfs control interface, with ksm_scan_sem held
+ * for write: no ksmd thread is in the middle of a batch.
  */
 static int unmerge_and_remove_all_rmap_items(void)
 {
 	struct mm_slot *mm_slot;
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
-	int err = 0;
+	int i, err = 0;
 
 	spin_lock(&ksm_mmlist_lock);
+	/* The ksmd threads lose their places and start a new scan */
+	for (i = 0; i < KSM_MAX_SCAN_THREADS; i++) {
+		mm_slot = ksm_workers[i].mm_slot;
+		if (mm_slot) {
+			mm_slot->worker = NULL;
+			ksm_workers[i].mm_slot = NULL;
+		}
+	}
+	ksm_scan.nr_scanning = 0;
 	ksm_scan.mm_slot = list_entry(ksm_mm_head.mm_list.next,
 						struct mm_slot, mm_list);
 	spin_unlock(&ksm_mmlist_lock);
@@ -550,6 +618,7 @@ static int unmerge_and_remove_all_rmap_items(void)
 			if (err)
 				goto error;
 		}
+		up_read(&mm->mmap_sem);
 
 		remove_trailing_rmap_items(mm_slot, mm_slot->rmap_list.next);
 
@@ -563,12 +632,9 @@ static int unmerge_and_remove_all_rmap_items(void)
 
 			free_mm_slot(mm_slot);
 			clear_bit(MMF_VM_MERGEABLE, &mm->flags);
-			up_read(&mm->mmap_sem);
 			mmdrop(mm);
-		} else {
+		} else
 			spin_unlock(&ksm_mmlist_lock);
-			up_read(&mm->mmap_sem);
-		}
 	}
 
 	ksm_scan.seqnr = 0;
@@ -871,6 +937,7 @@ out:
 /*
  * stable_tree_search - search page inside the stable tree
  * @page: the page that we are searching identical pages to.
+ * @checksum: checksum of the content of page
  * @page2: pointer into identical page that we are holding inside the stable
  *	   tree that we have found.
  * @rmap_item: the reverse mapping item
@@ -882,6 +949,7 @@ out:
  * NULL otherwise.
  */
 static struct rmap_item *stable_tree_search(struct page *page,
+					    unsigned int checksum,
 					    struct page **page2,
 					    struct rmap_item *rmap_item)
 {
@@ -892,6 +960,15 @@ static struct rmap_item *stable_tree_search(struct page *page,
 		int ret;
 
 		tree_rmap_item = rb_entry(node, struct rmap_item, node);
+		if (checksum < tree_rmap_item->checksum) {
+			node = node->rb_left;
+			continue;
+		}
+		if (checksum > tree_rmap_item->checksum) {
+			node = node->rb_right;
+			continue;
+		}
+
 		while (tree_rmap_item) {
 			BUG_ON(!in_stable_tree(tree_rmap_item));
 			cond_resched();
@@ -936,6 +1013,13 @@ static struct rmap_item *stable_tree_insert(struct page *page,
 {
 	struct rb_node **new = &root_stable_tree.rb_node;
 	struct rb_node *parent = NULL;
+	unsigned int checksum;
+
+	/*
+	 * The page is write-protected by now: checksum what is actually
+	 * being inserted, not what was scanned a moment ago.
+	 */
+	checksum = calc_checksum(page);
 
 	while (*new) {
 		struct rmap_item *tree_rmap_item, *next_rmap_item;
@@ -943,6 +1027,15 @@ static struct rmap_item *stable_tree_insert(struct page *page,
 		int ret;
 
 		tree_rmap_item = rb_entry(*new, struct rmap_item, node);
+		if (checksum != tree_rmap_item->checksum) {
+			parent = *new;
+			if (checksum < tree_rmap_item->checksum)
+				new = &parent->rb_left;
+			else
+				new = &parent->rb_right;
+			continue;
+		}
+
 		while (tree_rmap_item) {
 			BUG_ON(!in_stable_tree(tree_rmap_item));
 			cond_resched();
@@ -975,6 +1068,7 @@ static struct rmap_item *stable_tree_insert(struct page *page,
 	}
 
 	rmap_item->address |= NODE_FLAG | STABLE_FLAG;
+	rmap_item->checksum = checksum;
 	rmap_item->next = NULL;
 	rb_link_node(&rmap_item->node, parent, new);
 	rb_insert_color(&rmap_item->node, &root_stable_tree);
@@ -989,7 +1083,7 @@ static struct rmap_item *stable_tree_insert(struct page *page,
  * @page: the page that we are going to search for identical page or to insert
  *	  into the unstable tree
  * @page2: pointer into identical page that was found inside the unstable tree
- * @rmap_item: the reverse mapping item of page
+ * @rmap_item: the reverse mapping item of page, whose checksum is that of page
  *
  * This function searches for a page in the unstable tree identical to the
  * page currently being scanned; and if no identical page is found in the
@@ -1014,6 +1108,16 @@ static struct rmap_item *unstable_tree_search_insert(struct page *page,
 
 		cond_resched();
 		tree_rmap_item = rb_entry(*new, struct rmap_item, node);
+		parent = *new;
+		if (rmap_item->checksum < tree_rmap_item->checksum) {
+			new = &parent->rb_left;
+			continue;
+		}
+		if (rmap_item->checksum > tree_rmap_item->checksum) {
+			new = &parent->rb_right;
+			continue;
+		}
+
 		page2[0] = get_mergeable_page(tree_rmap_item);
 		if (!page2[0])
 			return NULL;
@@ -1029,7 +1133,6 @@ static struct rmap_item *unstable_tree_search_insert(struct page *page,
 
 		ret = memcmp_pages(page, page2[0]);
 
-		parent = *new;
 		if (ret < 0) {
 			put_page(page2[0]);
 			new = &parent->rb_left;
@@ -1077,20 +1180,23 @@ static void stable_tree_append(struct rmap_item *rmap_item,
  * both transferred to the stable tree.
  *
  * @page: the page that we are searching identical page to.
+ * @checksum: checksum of the content of page
  * @rmap_item: the reverse mapping into the virtual address of this page
+ *
+ * Called with ksm_tree_mutex held.  Returns 1 if the page was merged.
  */
-static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
+static int cmp_and_merge_page(struct page *page, unsigned int checksum,
+			      struct rmap_item *rmap_item)
 {
 	struct page *page2[1];
 	struct rmap_item *tree_rmap_item;
-	unsigned int checksum;
 	int err;
 
 	if (in_stable_tree(rmap_item))
 		remove_rmap_item_from_tree(rmap_item);
 
 	/* We first start with searching the page inside the stable tree */
-	tree_rmap_item = stable_tree_search(page, page2, rmap_item);
+	tree_rmap_item = stable_tree_search(page, checksum, page2, rmap_item);
 	if (tree_rmap_item) {
 		if (page == page2[0])			/* forked */
 			err = 0;
@@ -1106,8 +1212,9 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			 * add its rmap_item to the stable tree.
 			 */
 			stable_tree_append(rmap_item, tree_rmap_item);
+			return 1;
 		}
-		return;
+		return 0;
 	}
 
 	/*
@@ -1125,10 +1232,9 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	 * don't want to insert it to the unstable tree, and we don't want to
 	 * waste our time to search if there is something identical to it there.
 	 */
-	checksum = calc_checksum(page);
-	if (rmap_item->oldchecksum != checksum) {
-		rmap_item->oldchecksum = checksum;
-		return;
+	if (rmap_item->checksum != checksum) {
+		rmap_item->checksum = checksum;
+		return 0;
 	}
 
 	tree_rmap_item = unstable_tree_search_insert(page, page2, rmap_item);
@@ -1159,11 +1265,14 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 				break_cow(tree_rmap_item->mm,
 						tree_rmap_item->address);
 				break_cow(rmap_item->mm, rmap_item->address);
+				err = -EFAULT;
 			}
 		}
 
 		put_page(page2[0]);
+		return !err;
 	}
+	return 0;
 }
 
 static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
@@ -1197,28 +1306,127 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 	return rmap_item;
 }
 
-static struct rmap_item *scan_get_next_rmap_item(struct page **page)
+/*
+ * Hand the next mm_slot on the list to a ksmd thread.  The unstable tree is
+ * flushed when the cursor has gone round the list and no other thread is
+ * still scanning an mm_slot it claimed in that full scan.
+ */
+static struct mm_slot *ksm_claim_mm_slot(struct ksm_worker *worker)
 {
-	struct mm_struct *mm;
 	struct mm_slot *slot;
+
+	mutex_lock(&ksm_tree_mutex);
+	spin_lock(&ksm_mmlist_lock);
+	slot = list_entry(ksm_scan.mm_slot->mm_list.next,
+						struct mm_slot, mm_list);
+	if (slot == &ksm_mm_head) {
+		if (ksm_scan.nr_scanning) {
+			/* let the others finish this full scan */
+			slot = NULL;
+			goto out;
+		}
+		if (ksm_scan.mm_slot != &ksm_mm_head) {
+			ksm_scan.seqnr++;
+			root_unstable_tree = RB_ROOT;
+		}
+		slot = list_entry(ksm_mm_head.mm_list.next,
+						struct mm_slot, mm_list);
+		if (slot == &ksm_mm_head) {
+			ksm_scan.mm_slot = &ksm_mm_head;
+			slot = NULL;
+			goto out;
+		}
+	}
+	ksm_scan.mm_slot = slot;
+	ksm_scan.nr_scanning++;
+	slot->worker = worker;
+	worker->mm_slot = slot;
+	worker->address = 0;
+	worker->rmap_item = list_entry(&slot->rmap_list,
+					struct rmap_item, link);
+out:
+	spin_unlock(&ksm_mmlist_lock);
+	mutex_unlock(&ksm_tree_mutex);
+	return slot;
+}
+
+/*
+ * Give back the mm_slot a ksmd thread was scanning.  If it was not scanned
+ * to the end, it is put right after the cursor to be scanned again from the
+ * start: every rmap_item must be visited in each full scan.
+ */
+static void ksm_release_mm_slot(struct ksm_worker *worker, int finished)
+{
+	struct mm_slot *slot = worker->mm_slot;
+
+	spin_lock(&ksm_mmlist_lock);
+	slot->worker = NULL;
+	ksm_scan.nr_scanning--;
+	if (!finished) {
+		if (ksm_scan.mm_slot == slot)
+			ksm_scan.mm_slot = list_entry(slot->mm_list.prev,
+						struct mm_slot, mm_list);
+		else
+			list_move(&slot->mm_list, &ksm_scan.mm_slot->mm_list);
+	}
+	spin_unlock(&ksm_mmlist_lock);
+	worker->mm_slot = NULL;
+}
+
+/*
+ * Free the mm_slot a ksmd thread was scanning, which has no rmap_items left
+ * because its mm is exiting or has no VM_MERGEABLE area any more.  Called
+ * with mmap_sem held for read; the caller does the mmdrop.
+ */
+static void ksm_free_mm_slot(struct ksm_worker *worker)
+{
+	struct mm_slot *slot = worker->mm_slot;
+	struct mm_struct *mm = slot->mm;
+
+	spin_lock(&ksm_mmlist_lock);
+	ksm_scan.nr_scanning--;
+	if (ksm_scan.mm_slot == slot)
+		ksm_scan.mm_slot = list_entry(slot->mm_list.prev,
+						struct mm_slot, mm_list);
+	hlist_del(&slot->link);
+	list_del(&slot->mm_list);
+	spin_unlock(&ksm_mmlist_lock);
+
+	worker->mm_slot = NULL;
+	free_mm_slot(slot);
+	clear_bit(MMF_VM_MERGEABLE, &mm->flags);
+}
+
+static int ksm_has_mergeable_vma(struct mm_struct *mm)
+{
 	struct vm_area_struct *vma;
-	struct rmap_item *rmap_item;
 
-	if (list_empty(&ksm_mm_head.mm_list))
-		return NULL;
+	for (vma = mm->mmap; vma; vma = vma->vm_next)
+		if (vma->vm_flags & VM_MERGEABLE)
+			return 1;
+	return 0;
+}
 
-	slot = ksm_scan.mm_slot;
-	if (slot == &ksm_mm_head) {
-		root_unstable_tree = RB_ROOT;
+/*
+ * scan_get_next_page - find the next page for a ksmd thread to look at
+ *
+ * Returns the page, with a reference held, at worker->address in the mm of
+ * worker->mm_slot; or NULL when there is nothing left to scan for now.
+ * mmap_sem is dropped before returning, as ksm_tree_mutex will be taken.
+ */
+static struct page *scan_get_next_page(struct ksm_worker *worker)
+{
+	struct mm_struct *mm;
+	struct mm_slot *slot;
+	struct vm_area_struct *vma;
+	struct page *page;
 
-		spin_lock(&ksm_mmlist_lock);
-		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
-		ksm_scan.mm_slot = slot;
-		spin_unlock(&ksm_mmlist_lock);
+	slot = worker->mm_slot;
+	if (!slot) {
 next_mm:
-		ksm_scan.address = 0;
-		ksm_scan.rmap_item = list_entry(&slot->rmap_list,
-						struct rmap_item, link);
+		slot = ksm_claim_mm_slot(worker);
+		if (!slot)
+			return NULL;
 	}
 
 	mm = slot->mm;
@@ -1226,111 +1434,126 @@ next_mm:
 	if (ksm_test_exit(mm))
 		vma = NULL;
 	else
-		vma = find_vma(mm, ksm_scan.address);
+		vma = find_vma(mm, worker->address);
 
 	for (; vma; vma = vma->vm_next) {
 		if (!(vma->vm_flags & VM_MERGEABLE))
 			continue;
-		if (ksm_scan.address < vma->vm_start)
-			ksm_scan.address = vma->vm_start;
+		if (worker->address < vma->vm_start)
+			worker->address = vma->vm_start;
 		if (!vma->anon_vma)
-			ksm_scan.address = vma->vm_end;
+			worker->address = vma->vm_end;
 
-		while (ksm_scan.address < vma->vm_end) {
+		while (worker->address < vma->vm_end) {
 			if (ksm_test_exit(mm))
 				break;
-			*page = follow_page(vma, ksm_scan.address, FOLL_GET);
-			if (*page && PageAnon(*page)) {
-				flush_anon_page(vma, *page, ksm_scan.address);
-				flush_dcache_page(*page);
-				rmap_item = get_next_rmap_item(slot,
-					ksm_scan.rmap_item->link.next,
-					ksm_scan.address);
-				if (rmap_item) {
-					ksm_scan.rmap_item = rmap_item;
-					ksm_scan.address += PAGE_SIZE;
-				} else
-					put_page(*page);
+			page = follow_page(vma, worker->address, FOLL_GET);
+			if (page && PageAnon(page)) {
+				flush_anon_page(vma, page, worker->address);
+				flush_dcache_page(page);
 				up_read(&mm->mmap_sem);
-				return rmap_item;
+				return page;
 			}
-			if (*page)
-				put_page(*page);
-			ksm_scan.address += PAGE_SIZE;
+			if (page)
+				put_page(page);
+			worker->address += PAGE_SIZE;
 			cond_resched();
 		}
 	}
 
 	if (ksm_test_exit(mm)) {
-		ksm_scan.address = 0;
-		ksm_scan.rmap_item = list_entry(&slot->rmap_list,
+		worker->address = 0;
+		worker->rmap_item = list_entry(&slot->rmap_list,
 						struct rmap_item, link);
 	}
+	up_read(&mm->mmap_sem);
+
 	/*
 	 * Nuke all the rmap_items that are above this current rmap:
 	 * because there were no VM_MERGEABLE vmas with such addresses.
 	 */
-	remove_trailing_rmap_items(slot, ksm_scan.rmap_item->link.next);
+	remove_trailing_rmap_items(slot, worker->rmap_item->link.next);
 
-	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(slot->mm_list.next,
-						struct mm_slot, mm_list);
-	if (ksm_scan.address == 0) {
+	worker->mm_slots_scanned++;
+
+	if (worker->address == 0) {
 		/*
-		 * We've completed a full scan of all vmas, holding mmap_sem
-		 * throughout, and found no VM_MERGEABLE: so do the same as
-		 * __ksm_exit does to remove this mm from all our lists now.
-		 * This applies either when cleaning up after __ksm_exit
-		 * (but beware: we can reach here even before __ksm_exit),
-		 * or when all VM_MERGEABLE areas have been unmapped (and
-		 * mmap_sem then protects against race with MADV_MERGEABLE).
+		 * We've completed a full scan of all vmas and found no
+		 * VM_MERGEABLE: so do the same as __ksm_exit does to remove
+		 * this mm from all our lists now.  This applies either when
+		 * cleaning up after __ksm_exit (but beware: we can reach here
+		 * even before __ksm_exit), or when all VM_MERGEABLE areas have
+		 * been unmapped.  mmap_sem is taken again to check that, and
+		 * then protects against race with MADV_MERGEABLE; our claim
+		 * on the mm_slot keeps __ksm_exit from freeing it meanwhile.
 		 */
-		hlist_del(&slot->link);
-		list_del(&slot->mm_list);
-		spin_unlock(&ksm_mmlist_lock);
-
-		free_mm_slot(slot);
-		clear_bit(MMF_VM_MERGEABLE, &mm->flags);
-		up_read(&mm->mmap_sem);
-		mmdrop(mm);
-	} else {
-		spin_unlock(&ksm_mmlist_lock);
+		down_read(&mm->mmap_sem);
+		if (ksm_test_exit(mm) || !ksm_has_mergeable_vma(mm)) {
+			ksm_free_mm_slot(worker);
+			up_read(&mm->mmap_sem);
+			mmdrop(mm);
+			goto next_mm;
+		}
 		up_read(&mm->mmap_sem);
 	}
+	ksm_release_mm_slot(worker, 1);
 
 	/* Repeat until we've completed scanning the whole list */
-	slot = ksm_scan.mm_slot;
-	if (slot != &ksm_mm_head)
-		goto next_mm;
-
-	ksm_scan.seqnr++;
-	return NULL;
+	goto next_mm;
 }
 
 /**
  * ksm_do_scan  - the ksm scanner main worker function.
+ * @worker - the ksmd thread scanning
  * @scan_npages - number of pages we want to scan before we return.
  */
-static void ksm_do_scan(unsigned int scan_npages)
+static void ksm_do_scan(struct ksm_worker *worker, unsigned int scan_npages)
 {
 	struct rmap_item *rmap_item;
 	struct page *page;
+	unsigned int checksum = 0;
 
 	while (scan_npages--) {
 		cond_resched();
-		rmap_item = scan_get_next_rmap_item(&page);
-		if (!rmap_item)
+		page = scan_get_next_page(worker);
+		if (!page)
 			return;
-		if (!PageKsm(page) || !in_stable_tree(rmap_item))
-			cmp_and_merge_page(page, rmap_item);
-		else if (page_mapcount(page) == 1) {
+
+		/*
+		 * Checksumming is most of the work of scanning a page that
+		 * has no duplicate: do it before serializing on the trees.
+		 * A ksm page in the stable tree needs no checksum.
+		 */
+		if (!PageKsm(page))
+			checksum = calc_checksum(page);
+
+		mutex_lock(&ksm_tree_mutex);
+		rmap_item = get_next_rmap_item(worker->mm_slot,
+					       worker->rmap_item->link.next,
+					       worker->address);
+		if (!rmap_item) {
+			mutex_unlock(&ksm_tree_mutex);
+			put_page(page);
+			return;
+		}
+		worker->rmap_item = rmap_item;
+		worker->address += PAGE_SIZE;
+		worker->pages_scanned++;
+
+		if (!PageKsm(page) || !in_stable_tree(rmap_item)) {
+			if (PageKsm(page))
+				checksum = calc_checksum(page);
+			if (cmp_and_merge_page(page, checksum, rmap_item))
+				worker->pages_merged++;
+		} else if (page_mapcount(page) == 1) {
 			/*
 			 * Replace now-unshared ksm page by ordinary page.
 			 */
 			break_cow(rmap_item->mm, rmap_item->address);
 			remove_rmap_item_from_tree(rmap_item);
-			rmap_item->oldchecksum = calc_checksum(page);
+			rmap_item->checksum = calc_checksum(page);
 		}
+		mutex_unlock(&ksm_tree_mutex);
 		put_page(page);
 	}
 }
@@ -1340,15 +1563,17 @@ static int ksmd_should_run(void)
 	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
 }
 
-static int ksm_scan_thread(void *nothing)
+static int ksm_scan_thread(void *data)
 {
+	struct ksm_worker *worker = data;
+
 	set_user_nice(current, 5);
 
 	while (!kthread_should_stop()) {
-		mutex_lock(&ksm_thread_mutex);
+		down_read(&ksm_scan_sem);
 		if (ksmd_should_run())
-			ksm_do_scan(ksm_thread_pages_to_scan);
-		mutex_unlock(&ksm_thread_mutex);
+			ksm_do_scan(worker, ksm_thread_pages_to_scan);
+		up_read(&ksm_scan_sem);
 
 		if (ksmd_should_run()) {
 			schedule_timeout_interruptible(
@@ -1358,6 +1583,50 @@ static int ksm_scan_thread(void *nothing)
 				ksmd_should_run() || kthread_should_stop());
 		}
 	}
+
+	/* Leave what we were scanning to the remaining threads */
+	down_read(&ksm_scan_sem);
+	if (worker->mm_slot)
+		ksm_release_mm_slot(worker, 0);
+	up_read(&ksm_scan_sem);
+	return 0;
+}
+
+static void ksm_add_worker_sysfs(struct ksm_worker *worker, int nr);
+static void ksm_remove_worker_sysfs(struct ksm_worker *worker);
+
+/*
+ * Start or stop ksmd threads to have nr of them.  Called with
+ * ksm_thread_mutex held.
+ */
+static int ksm_set_scan_threads(unsigned int nr)
+{
+	struct ksm_worker *worker;
+	struct task_struct *thread;
+
+	while (ksm_nr_scan_threads < nr) {
+		worker = &ksm_workers[ksm_nr_scan_threads];
+		if (ksm_nr_scan_threads)
+			thread = kthread_run(ksm_scan_thread, worker,
+					     "ksmd/%u", ksm_nr_scan_threads);
+		else
+			thread = kthread_run(ksm_scan_thread, worker, "ksmd");
+		if (IS_ERR(thread)) {
+			printk(KERN_ERR "ksm: creating kthread failed\n");
+			return PTR_ERR(thread);
+		}
+		worker->thread = thread;
+		ksm_add_worker_sysfs(worker, ksm_nr_scan_threads);
+		ksm_nr_scan_threads++;
+	}
+
+	while (ksm_nr_scan_threads > nr) {
+		worker = &ksm_workers[ksm_nr_scan_threads - 1];
+		kthread_stop(worker->thread);
+		worker->thread = NULL;
+		ksm_remove_worker_sysfs(worker);
+		ksm_nr_scan_threads--;
+	}
 	return 0;
 }
 
@@ -1443,7 +1712,8 @@ void __ksm_exit(struct mm_struct *mm)
 	/*
 	 * This process is exiting: if it's straightforward (as is the
 	 * case when ksmd was never running), free mm_slot immediately.
-	 * But if it's at the cursor or has rmap_items linked to it, use
+	 * But if it's at the cursor, is being scanned by a ksmd thread, or
+	 * has rmap_items linked to it, use
 	 * mmap_sem to synchronize with any break_cows before pagetables
 	 * are freed, and leave the mm_slot on the list for ksmd to free.
 	 * Beware: ksm may already have noticed it exiting and freed the slot.
@@ -1451,7 +1721,7 @@ void __ksm_exit(struct mm_struct *mm)
 
 	spin_lock(&ksm_mmlist_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && ksm_scan.mm_slot != mm_slot) {
+	if (mm_slot && !mm_slot->worker && ksm_scan.mm_slot != mm_slot) {
 		if (list_empty(&mm_slot->rmap_list)) {
 			hlist_del(&mm_slot->link);
 			list_del(&mm_slot->mm_list);
@@ -1560,7 +1830,9 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 		ksm_run = flags;
 		if (flags & KSM_RUN_UNMERGE) {
 			current->flags |= PF_OOM_ORIGIN;
+			down_write(&ksm_scan_sem);
 			err = unmerge_and_remove_all_rmap_items();
+			up_write(&ksm_scan_sem);
 			current->flags &= ~PF_OOM_ORIGIN;
 			if (err) {
 				ksm_run = KSM_RUN_STOP;
@@ -1577,6 +1849,31 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 }
 KSM_ATTR(run);
 
+static ssize_t scan_threads_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_nr_scan_threads);
+}
+
+static ssize_t scan_threads_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int err;
+	unsigned long nr;
+
+	err = strict_strtoul(buf, 10, &nr);
+	if (err || nr < 1 || nr > KSM_MAX_SCAN_THREADS)
+		return -EINVAL;
+
+	mutex_lock(&ksm_thread_mutex);
+	err = ksm_set_scan_threads(nr);
+	mutex_unlock(&ksm_thread_mutex);
+
+	return err ? err : count;
+}
+KSM_ATTR(scan_threads);
+
 static ssize_t max_kernel_pages_store(struct kobject *kobj,
 				      struct kobj_attribute *attr,
 				      const char *buf, size_t count)
@@ -1649,6 +1946,7 @@ static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
 	&run_attr.attr,
+	&scan_threads_attr.attr,
 	&max_kernel_pages_attr.attr,
 	&pages_shared_attr.attr,
 	&pages_sharing_attr.attr,
@@ -1660,13 +1958,86 @@ static struct attribute *ksm_attrs[] = {
 
 static struct attribute_group ksm_attr_group = {
 	.attrs = ksm_attrs,
-	.name = "ksm",
 };
+
+static struct kobject *ksm_kobj;
+
+static struct ksm_worker *kobj_to_worker(struct kobject *kobj)
+{
+	int i;
+
+	for (i = 0; i < KSM_MAX_SCAN_THREADS; i++)
+		if (ksm_workers[i].kobj == kobj)
+			return &ksm_workers[i];
+	BUG();
+	return NULL;
+}
+
+#define KSM_WORKER_ATTR(_name)						\
+static ssize_t worker_##_name##_show(struct kobject *kobj,		\
+				struct kobj_attribute *attr, char *buf)	\
+{									\
+	return sprintf(buf, "%lu\n", kobj_to_worker(kobj)->_name);	\
+}									\
+static struct kobj_attribute worker_##_name##_attr =			\
+	__ATTR(_name, 0444, worker_##_name##_show, NULL)
+
+KSM_WORKER_ATTR(pages_scanned);
+KSM_WORKER_ATTR(mm_slots_scanned);
+KSM_WORKER_ATTR(pages_merged);
+
+static struct attribute *ksm_worker_attrs[] = {
+	&worker_pages_scanned_attr.attr,
+	&worker_mm_slots_scanned_attr.attr,
+	&worker_pages_merged_attr.attr,
+	NULL,
+};
+
+static struct attribute_group ksm_worker_attr_group = {
+	.attrs = ksm_worker_attrs,
+};
+
+/* Statistics of each ksmd thread show in /sys/kernel/mm/ksm/worker<nr> */
+static void ksm_add_worker_sysfs(struct ksm_worker *worker, int nr)
+{
+	char name[16];
+
+	worker->pages_scanned = 0;
+	worker->mm_slots_scanned = 0;
+	worker->pages_merged = 0;
+
+	if (!ksm_kobj)
+		return;
+	snprintf(name, sizeof(name), "worker%d", nr);
+	worker->kobj = kobject_create_and_add(name, ksm_kobj);
+	if (!worker->kobj)
+		return;
+	if (sysfs_create_group(worker->kobj, &ksm_worker_attr_group)) {
+		kobject_put(worker->kobj);
+		worker->kobj = NULL;
+	}
+}
+
+static void ksm_remove_worker_sysfs(struct ksm_worker *worker)
+{
+	if (worker->kobj) {
+		sysfs_remove_group(worker->kobj, &ksm_worker_attr_group);
+		kobject_put(worker->kobj);
+		worker->kobj = NULL;
+	}
+}
+#else
+static void ksm_add_worker_sysfs(struct ksm_worker *worker, int nr)
+{
+}
+
+static void ksm_remove_worker_sysfs(struct ksm_worker *worker)
+{
+}
 #endif /* CONFIG_SYSFS */
 
 static int __init ksm_init(void)
 {
-	struct task_struct *ksm_thread;
 	int err;
 
 	ksm_max_kernel_pages = totalram_pages / 4;
@@ -1679,27 +2050,41 @@ static int __init ksm_init(void)
 	if (err)
 		goto out_free1;
 
-	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
-	if (IS_ERR(ksm_thread)) {
-		printk(KERN_ERR "ksm: creating kthread failed\n");
-		err = PTR_ERR(ksm_thread);
+#ifdef CONFIG_SYSFS
+	ksm_kobj = kobject_create_and_add("ksm", mm_kobj);
+	if (!ksm_kobj) {
+		printk(KERN_ERR "ksm: register sysfs failed\n");
+		err = -ENOMEM;
 		goto out_free2;
 	}
-
-#ifdef CONFIG_SYSFS
-	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
+	err = sysfs_create_group(ksm_kobj, &ksm_attr_group);
 	if (err) {
 		printk(KERN_ERR "ksm: register sysfs failed\n");
-		kthread_stop(ksm_thread);
-		goto out_free2;
+		goto out_free3;
 	}
 #else
 	ksm_run = KSM_RUN_MERGE;	/* no way for user to start it */
 
 #endif /* CONFIG_SYSFS */
 
+	mutex_lock(&ksm_thread_mutex);
+	err = ksm_set_scan_threads(1);
+	mutex_unlock(&ksm_thread_mutex);
+	if (err) {
+#ifdef CONFIG_SYSFS
+		sysfs_remove_group(ksm_kobj, &ksm_attr_group);
+		kobject_put(ksm_kobj);
+#endif
+		goto out_free2;
+	}
+
 	return 0;
 
+#ifdef CONFIG_SYSFS
+out_free3:
+	kobject_put(ksm_kobj);
+#endif
+
 out_free2:
 	mm_slots_hash_free();
 out_free1:
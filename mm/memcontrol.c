@@ -705,35 +705,35 @@ void mem_cgroup_add_lru_list(struct page *page, enum lru_list lru)
  * lru because the page may.be reused after it's fully uncharged (because of
  * SwapCache behavior).To handle that, unlink page_cgroup from LRU when charge
  * it again. This function is only used to charge SwapCache. It's done under
- * lock_page and expected that zone->lru_lock is never held.
+ * lock_page and expected that the LRU lock is never held.
  */
 static void mem_cgroup_lru_del_before_commit_swapcache(struct page *page)
 {
 	unsigned long flags;
-	struct zone *zone = page_zone(page);
+	struct lru_shard *shard = page_lru_shard(page);
 	struct page_cgroup *pc = lookup_page_cgroup(page);
 
-	spin_lock_irqsave(&zone->lru_lock, flags);
+	spin_lock_irqsave(&shard->lock, flags);
 	/*
 	 * Forget old LRU when this page_cgroup is *not* used. This Used bit
 	 * is guarded by lock_page() because the page is SwapCache.
 	 */
 	if (!PageCgroupUsed(pc))
 		mem_cgroup_del_lru_list(page, page_lru(page));
-	spin_unlock_irqrestore(&zone->lru_lock, flags);
+	spin_unlock_irqrestore(&shard->lock, flags);
 }
 
 static void mem_cgroup_lru_add_after_commit_swapcache(struct page *page)
 {
 	unsigned long flags;
-	struct zone *zone = page_zone(page);
+	struct lru_shard *shard = page_lru_shard(page);
 	struct page_cgroup *pc = lookup_page_cgroup(page);
 
-	spin_lock_irqsave(&zone->lru_lock, flags);
+	spin_lock_irqsave(&shard->lock, flags);
 	/* link when the page is linked to LRU but page_cgroup isn't */
 	if (PageLRU(page) && !PageCgroupAcctLRU(pc))
 		mem_cgroup_add_lru_list(page, page_lru(page));
-	spin_unlock_irqrestore(&zone->lru_lock, flags);
+	spin_unlock_irqrestore(&shard->lock, flags);
 }
 
 
@@ -904,6 +904,7 @@ unsigned long mem_cgroup_isolate_pages(unsigned long nr_to_scan,
 					struct list_head *dst,
 					unsigned long *scanned, int order,
 					int mode, struct zone *z,
+					struct lru_shard *shard,
 					struct mem_cgroup *mem_cont,
 					int active, int file)
 {
@@ -2316,6 +2317,7 @@ static int mem_cgroup_force_empty_list(struct mem_cgroup *mem,
 				int node, int zid, enum lru_list lru)
 {
 	struct zone *zone;
+	spinlock_t *lru_lock;
 	struct mem_cgroup_per_zone *mz;
 	struct page_cgroup *pc, *busy;
 	unsigned long flags, loop;
@@ -2323,6 +2325,8 @@ static int mem_cgroup_force_empty_list(struct mem_cgroup *mem,
 	int ret = 0;
 
 	zone = &NODE_DATA(node)->node_zones[zid];
+	/* the zone LRU is not split with the memory controller */
+	lru_lock = &zone->lru_shard[0].lock;
 	mz = mem_cgroup_zoneinfo(mem, node, zid);
 	list = &mz->lists[lru];
 
@@ -2332,19 +2336,19 @@ static int mem_cgroup_force_empty_list(struct mem_cgroup *mem,
 	busy = NULL;
 	while (loop--) {
 		ret = 0;
-		spin_lock_irqsave(&zone->lru_lock, flags);
+		spin_lock_irqsave(lru_lock, flags);
 		if (list_empty(list)) {
-			spin_unlock_irqrestore(&zone->lru_lock, flags);
+			spin_unlock_irqrestore(lru_lock, flags);
 			break;
 		}
 		pc = list_entry(list->prev, struct page_cgroup, lru);
 		if (busy == pc) {
 			list_move(&pc->lru, list);
 			busy = 0;
-			spin_unlock_irqrestore(&zone->lru_lock, flags);
+			spin_unlock_irqrestore(lru_lock, flags);
 			continue;
 		}
-		spin_unlock_irqrestore(&zone->lru_lock, flags);
+		spin_unlock_irqrestore(lru_lock, flags);
 
 		ret = mem_cgroup_move_parent(pc, mem, GFP_KERNEL);
 		if (ret == -ENOMEM)
@@ -57,6 +57,7 @@
 #include <linux/swapops.h>
 #include <linux/elf.h>
 #include <linux/vmalloc.h>
+#include <linux/migrate.h>
 
 #include <asm/io.h>
 #include <asm/pgalloc.h>
@@ -776,6 +777,11 @@ static inline int copy_pmd_range(struct mm_struct *dst_mm, struct mm_struct *src
 	src_pmd = pmd_offset(src_pud, addr);
 	do {
 		next = pmd_addr_end(addr, end);
+		/*
+		 * Huge pmds are never shared with a child: the child gets
+		 * its own copy of the small pages through the pte path.
+		 */
+		split_huge_page_pmd(src_mm, src_pmd);
 		if (pmd_none_or_clear_bad(src_pmd))
 			continue;
 		if (copy_pte_range(dst_mm, src_mm, dst_pmd, src_pmd,
@@ -972,6 +978,15 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 	pmd = pmd_offset(pud, addr);
 	do {
 		next = pmd_addr_end(addr, end);
+		if (pmd_trans_huge(*pmd)) {
+			if (next - addr != HPAGE_PMD_SIZE)
+				split_huge_page_pmd(vma->vm_mm, pmd);
+			else if (zap_huge_pmd(tlb, vma, pmd)) {
+				(*zap_work) -= HPAGE_PMD_SIZE;
+				continue;
+			}
+			/* fall through */
+		}
 		if (pmd_none_or_clear_bad(pmd)) {
 			(*zap_work)--;
 			continue;
@@ -1237,6 +1252,12 @@ struct page *follow_page(struct vm_area_struct *vma, unsigned long address,
 	pmd = pmd_offset(pud, address);
 	if (pmd_none(*pmd))
 		goto no_page_table;
+	if (pmd_trans_huge(*pmd) && !is_vm_hugetlb_page(vma)) {
+		/* callers want a reference on a small page */
+		split_huge_page_pmd(mm, pmd);
+		if (pmd_none(*pmd))
+			goto no_page_table;
+	}
 	if (pmd_huge(*pmd)) {
 		BUG_ON(flags & FOLL_GET);
 		page = follow_huge_pmd(mm, address, pmd, flags & FOLL_WRITE);
@@ -2731,6 +2752,44 @@ oom:
 	return VM_FAULT_OOM;
 }
 
+/*
+ * Pages mapped around a read fault on a file, 0 or 1 for none.
+ */
+int sysctl_fault_around_pages = FAULT_AROUND_MAX_PAGES;
+
+/*
+ * do_fault_around() maps the pages of the file which are already in the page
+ * cache around a read fault, so that touching a mapped file sequentially does
+ * not take a fault per page.  The window of nr_pages, read once from
+ * sysctl_fault_around_pages by the caller, is aligned on its size and
+ * clamped to the vma and to the page table holding the pte of the fault,
+ * which is mapped and locked.
+ */
+static void do_fault_around(struct vm_area_struct *vma, unsigned long address,
+		pte_t *pte, pgoff_t pgoff, unsigned long nr_pages)
+{
+	unsigned long start_addr, end_addr, off;
+	struct vm_fault vmf;
+
+	address &= PAGE_MASK;
+	off = (address >> PAGE_SHIFT) % nr_pages;
+	start_addr = address - (off << PAGE_SHIFT);
+	start_addr = max(start_addr, vma->vm_start);
+	start_addr = max(start_addr, address & PMD_MASK);
+	end_addr = min(start_addr + (nr_pages << PAGE_SHIFT),
+		       pmd_addr_end(address, vma->vm_end));
+
+	off = (address - start_addr) >> PAGE_SHIFT;
+	vmf.virtual_address = (void __user *)start_addr;
+	vmf.pgoff = pgoff - off;
+	vmf.max_pgoff = vmf.pgoff + ((end_addr - start_addr) >> PAGE_SHIFT) - 1;
+	vmf.pte = pte - off;
+	vmf.flags = 0;
+	vmf.page = NULL;
+
+	vma->vm_ops->map_pages(vma, &vmf);
+}
+
 /*
  * __do_fault() tries to create a new page mapping. It aggressively
  * tries to share with existing pages, but makes a separate copy if
@@ -2879,6 +2938,15 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 
 		/* no need to invalidate: a not-present page won't be cached */
 		update_mmu_cache(vma, address, entry);
+
+		if (!(flags & (FAULT_FLAG_WRITE | FAULT_FLAG_NONLINEAR)) &&
+		    vma->vm_ops->map_pages) {
+			int nr_pages = ACCESS_ONCE(sysctl_fault_around_pages);
+
+			if (nr_pages > 1)
+				do_fault_around(vma, address, page_table,
+						pgoff, nr_pages);
+		}
 	} else {
 		if (charged)
 			mem_cgroup_uncharge_page(page);
@@ -2965,6 +3033,68 @@ static int do_nonlinear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte);
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * A NUMA hinting fault: make the pte accessible again, then move the page
+ * to the node of the faulting task if its policy says it is misplaced.
+ *
+ * We enter with non-exclusive mmap_sem and pte mapped but not yet locked.
+ * We return with mmap_sem still held, but pte unmapped and unlocked.
+ */
+static int do_numa_page(struct mm_struct *mm, struct vm_area_struct *vma,
+		unsigned long address, pte_t *page_table, pmd_t *pmd,
+		pte_t entry)
+{
+	struct page *page;
+	spinlock_t *ptl;
+	int page_nid, target_nid;
+	int migrated = 0;
+
+	ptl = pte_lockptr(mm, pmd);
+	spin_lock(ptl);
+	if (unlikely(!pte_same(*page_table, entry))) {
+		pte_unmap_unlock(page_table, ptl);
+		return 0;
+	}
+
+	entry = pte_mknonnuma(entry);
+	set_pte_at(mm, address, page_table, entry);
+	/* no need to invalidate: a not-present page won't be cached */
+	update_mmu_cache(vma, address, entry);
+
+	page = vm_normal_page(vma, address, entry);
+	if (!page) {
+		pte_unmap_unlock(page_table, ptl);
+		return 0;
+	}
+	count_vm_event(NUMA_HINT_FAULTS);
+	get_page(page);
+	page_nid = page_to_nid(page);
+	if (page_nid == numa_node_id())
+		count_vm_event(NUMA_HINT_FAULTS_LOCAL);
+	target_nid = mpol_misplaced(page, vma, address);
+	pte_unmap_unlock(page_table, ptl);
+
+	if (target_nid == -1)
+		put_page(page);
+	else if (migrate_misplaced_page(page, target_nid)) {
+		page_nid = target_nid;
+		migrated = 1;
+	}
+
+	task_numa_fault(page_nid, 1, migrated);
+	return 0;
+}
+#else
+static inline int do_numa_page(struct mm_struct *mm,
+		struct vm_area_struct *vma, unsigned long address,
+		pte_t *page_table, pmd_t *pmd, pte_t entry)
+{
+	BUG();
+	return 0;
+}
+#endif /* CONFIG_NUMA_BALANCING */
+
 /*
  * These routines also need to handle stuff like marking pages dirty
  * and/or accessed for architectures that don't do it in hardware (most
@@ -2978,7 +3108,7 @@ static int do_nonlinear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
  * but allow concurrent faults), and pte mapped but not yet locked.
  * We return with mmap_sem still held, but pte unmapped and unlocked.
  */
-static inline int handle_pte_fault(struct mm_struct *mm,
+int handle_pte_fault(struct mm_struct *mm,
 		struct vm_area_struct *vma, unsigned long address,
 		pte_t *pte, pmd_t *pmd, unsigned int flags)
 {
@@ -3003,6 +3133,9 @@ static inline int handle_pte_fault(struct mm_struct *mm,
 					pte, pmd, flags, entry);
 	}
 
+	if (pte_numa(entry))
+		return do_numa_page(mm, vma, address, pte, pmd, entry);
+
 	ptl = pte_lockptr(mm, pmd);
 	spin_lock(ptl);
 	if (unlikely(!pte_same(*pte, entry)))
@@ -3056,13 +3189,252 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	pmd = pmd_alloc(mm, pud, address);
 	if (!pmd)
 		return VM_FAULT_OOM;
-	pte = pte_alloc_map(mm, pmd, address);
-	if (!pte)
+	if (pmd_none(*pmd) && transparent_hugepage_enabled(vma)) {
+		return do_huge_pmd_anonymous_page(mm, vma, address,
+						  pmd, flags);
+	} else {
+		pmd_t orig_pmd = *pmd;
+		barrier();
+		if (pmd_trans_huge(orig_pmd)) {
+			if (flags & FAULT_FLAG_WRITE)
+				return do_huge_pmd_wp_page(mm, vma, address,
+							   pmd, orig_pmd);
+			return 0;
+		}
+	}
+
+	/*
+	 * Use __pte_alloc instead of pte_alloc_map, because we can't
+	 * run pte_offset_map on the pmd if a huge pmd could materialize
+	 * from under us from a different thread.
+	 */
+	if (unlikely(pmd_none(*pmd)) && __pte_alloc(mm, pmd, address))
 		return VM_FAULT_OOM;
+	/* if a huge pmd materialized from under us just retry later */
+	if (unlikely(pmd_trans_huge(*pmd)))
+		return 0;
+	pte = pte_offset_map(pmd, address);
 
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Speculative page faults.
+ *
+ * A fault on private anonymous memory whose page table already exists is
+ * handled without mmap_sem.  The vma is looked up under mm_rb_lock, pinned
+ * with vm_ref_count so that it is not freed under us, and copied together
+ * with its vm_sequence.  Everything that changes a vma, or that may not
+ * see ptes filled in behind its back, bumps vm_sequence under mmap_sem
+ * before touching the page tables, so finding the sequence unchanged once
+ * the pte lock is held proves the copy is still good: a change that starts
+ * later has to take the same pte lock to do anything to our pte.
+ *
+ * The page tables are walked with interrupts disabled, as in
+ * get_user_pages_fast(): page table pages are only freed after a TLB flush
+ * IPI, which cannot complete while this CPU is in the walk.  For the same
+ * reason the pte lock is only trylocked there, its holder may be waiting
+ * for that IPI.
+ *
+ * Whatever cannot be handled this way returns VM_FAULT_RETRY and is left
+ * to handle_mm_fault() under mmap_sem.
+ */
+
+static struct vm_area_struct *get_vma_speculative(struct mm_struct *mm,
+		unsigned long address, unsigned int *seq)
+{
+	struct vm_area_struct *vma = NULL;
+	struct rb_node *rb_node;
+
+	read_lock(&mm->mm_rb_lock);
+	rb_node = mm->mm_rb.rb_node;
+	while (rb_node) {
+		struct vm_area_struct *tmp;
+
+		tmp = rb_entry(rb_node, struct vm_area_struct, vm_rb);
+		if (tmp->vm_end > address) {
+			vma = tmp;
+			if (tmp->vm_start <= address)
+				break;
+			rb_node = rb_node->rb_left;
+		} else
+			rb_node = rb_node->rb_right;
+	}
+	if (vma) {
+		/*
+		 * The walk read the bounds before the sequence, and shrinking
+		 * a vma does not take mm_rb_lock.  The caller checks them on
+		 * its copy, which is read after the sequence.
+		 */
+		*seq = ACCESS_ONCE(vma->vm_sequence.sequence);
+		smp_rmb();
+		if (*seq & 1)
+			vma = NULL;
+		else
+			atomic_inc(&vma->vm_ref_count);
+	}
+	read_unlock(&mm->mm_rb_lock);
+	return vma;
+}
+
+/*
+ * Map and lock the pte of @address, if the page table is there and @vma
+ * has not changed since @seq was read.  Returns NULL with nothing held
+ * otherwise.
+ */
+static pte_t *spf_pte_map_lock(struct mm_struct *mm, struct vm_area_struct *vma,
+		unsigned long address, unsigned int seq, spinlock_t **ptlp)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd, pmdval;
+	pte_t *pte;
+	spinlock_t *ptl;
+
+	local_irq_disable();
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		goto out;
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		goto out;
+	pmd = pmd_offset(pud, address);
+	pmdval = *pmd;
+	barrier();
+	if (pmd_none(pmdval) || pmd_trans_huge(pmdval) ||
+	    unlikely(pmd_bad(pmdval)))
+		goto out;
+
+	ptl = pte_lockptr(mm, &pmdval);
+	pte = pte_offset_map(&pmdval, address);
+	if (!spin_trylock(ptl)) {
+		pte_unmap(pte);
+		goto out;
+	}
+	if (read_seqcount_retry(&vma->vm_sequence, seq)) {
+		pte_unmap_unlock(pte, ptl);
+		goto out;
+	}
+	local_irq_enable();
+	*ptlp = ptl;
+	return pte;
+out:
+	local_irq_enable();
+	return NULL;
+}
+
+/**
+ * handle_speculative_fault - handle a user fault without mmap_sem
+ * @mm:		mm_struct of the faulting task
+ * @address:	faulting address
+ * @flags:	FAULT_FLAG_* of the fault
+ *
+ * Returns 0 if the fault was handled, VM_FAULT_RETRY if it has to be
+ * handled with handle_mm_fault() under mmap_sem.
+ */
+int handle_speculative_fault(struct mm_struct *mm, unsigned long address,
+		unsigned int flags)
+{
+	struct vm_area_struct *vma, vmc;
+	struct page *page = NULL;
+	unsigned int seq;
+	spinlock_t *ptl;
+	pte_t *pte, entry;
+	int write = flags & FAULT_FLAG_WRITE;
+	int ret = VM_FAULT_RETRY;
+
+	vma = get_vma_speculative(mm, address, &seq);
+	if (!vma)
+		goto out;
+	/*
+	 * Work on a copy: the vma may change as soon as we look at it, the
+	 * copy is known to be consistent once the sequence is checked.
+	 */
+	vmc = *vma;
+
+	if (address < vmc.vm_start || address >= vmc.vm_end)
+		goto out_put;
+	if (vmc.vm_ops || !vmc.anon_vma || vma_policy(&vmc))
+		goto out_put;
+	if (vmc.vm_flags & (VM_SHARED | VM_GROWSDOWN | VM_GROWSUP |
+			    VM_HUGETLB | VM_PFNMAP | VM_MIXEDMAP | VM_IO))
+		goto out_put;
+	if (!(vmc.vm_flags & (write ? VM_WRITE : VM_READ)))
+		goto out_put;
+
+	pte = spf_pte_map_lock(mm, vma, address, seq, &ptl);
+	if (!pte)
+		goto out_put;
+	entry = *pte;
+
+	if (pte_none(entry)) {
+		if (!write) {
+			entry = pte_mkspecial(pfn_pte(my_zero_pfn(address),
+							vmc.vm_page_prot));
+			goto setpte;
+		}
+		pte_unmap_unlock(pte, ptl);
+
+		page = alloc_zeroed_user_highpage_movable(&vmc, address);
+		if (!page)
+			goto out_put;
+		__SetPageUptodate(page);
+		if (mem_cgroup_newpage_charge(page, mm, GFP_KERNEL))
+			goto out_free;
+
+		pte = spf_pte_map_lock(mm, vma, address, seq, &ptl);
+		if (!pte)
+			goto out_uncharge;
+		if (!pte_none(*pte)) {
+			/* Someone else faulted it in, go with theirs */
+			pte_unmap_unlock(pte, ptl);
+			ret = 0;
+			goto out_uncharge;
+		}
+		entry = mk_pte(page, vmc.vm_page_prot);
+		entry = pte_mkwrite(pte_mkdirty(entry));
+		inc_mm_counter(mm, anon_rss);
+		page_add_new_anon_rmap(page, &vmc, address);
+setpte:
+		set_pte_at(mm, address, pte, entry);
+		/* No need to invalidate - it was non-present before */
+		update_mmu_cache(&vmc, address, entry);
+	} else if (pte_present(entry) && !pte_numa(entry) &&
+		   (!write || pte_write(entry))) {
+		if (write)
+			entry = pte_mkdirty(entry);
+		entry = pte_mkyoung(entry);
+		if (ptep_set_access_flags(&vmc, address, pte, entry, write))
+			update_mmu_cache(&vmc, address, entry);
+		else if (write)
+			flush_tlb_page(&vmc, address);
+	} else {
+		/* swap, COW and NUMA hinting faults need the full handler */
+		pte_unmap_unlock(pte, ptl);
+		goto out_put;
+	}
+	pte_unmap_unlock(pte, ptl);
+	ret = 0;
+	goto out_put;
+
+out_uncharge:
+	mem_cgroup_uncharge_page(page);
+out_free:
+	page_cache_release(page);
+out_put:
+	put_vma(vma);
+out:
+	if (ret)
+		count_vm_event(SPECULATIVE_PGFAULT_ABORT);
+	else {
+		count_vm_event(PGFAULT);
+		count_vm_event(SPECULATIVE_PGFAULT);
+	}
+	return ret;
+}
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 #ifndef __PAGETABLE_PUD_FOLDED
 /*
  * Allocate page upper directory.
@@ -3461,6 +3833,9 @@ static inline int ipipe_pin_pmd_range(struct mm_struct *mm, pud_t *pud,
 	pmd = pmd_offset(pud, addr);
 	do {
 		next = pmd_addr_end(addr, end);
+		/* huge pmds are never shared copy-on-write */
+		if (pmd_trans_huge(*pmd))
+			continue;
 		if (pmd_none_or_clear_bad(pmd))
 			continue;
 		if (ipipe_pin_pte_range(mm, pmd, vma, addr, next))
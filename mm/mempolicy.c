@@ -450,6 +450,7 @@ static inline int check_pmd_range(struct vm_area_struct *vma, pud_t *pud,
 	pmd = pmd_offset(pud, addr);
 	do {
 		next = pmd_addr_end(addr, end);
+		split_huge_page_pmd(vma->vm_mm, pmd);
 		if (pmd_none_or_clear_bad(pmd))
 			continue;
 		if (check_pte_range(vma, pmd, addr, next, nodes,
@@ -499,6 +500,106 @@ static inline int check_pgd_range(struct vm_area_struct *vma,
 	return 0;
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Turn the ptes of private pages in a range into NUMA hinting ptes, so
+ * that the next access to each page tells which node it came from.  Pages
+ * mapped by several processes are left alone, as they are not migrated on
+ * hinting faults anyway.
+ */
+static unsigned long change_pte_range_numa(struct vm_area_struct *vma,
+		pmd_t *pmd, unsigned long addr, unsigned long end)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long pages = 0;
+	pte_t *orig_pte;
+	pte_t *pte;
+	spinlock_t *ptl;
+
+	orig_pte = pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	do {
+		struct page *page;
+		pte_t entry;
+
+		if (!pte_present(*pte) || pte_numa(*pte))
+			continue;
+		page = vm_normal_page(vma, addr, *pte);
+		if (!page || PageReserved(page) || page_mapcount(page) != 1)
+			continue;
+
+		entry = ptep_modify_prot_start(mm, addr, pte);
+		entry = pte_mknuma(entry);
+		ptep_modify_prot_commit(mm, addr, pte, entry);
+		pages++;
+	} while (pte++, addr += PAGE_SIZE, addr != end);
+	pte_unmap_unlock(orig_pte, ptl);
+	return pages;
+}
+
+static unsigned long change_pmd_range_numa(struct vm_area_struct *vma,
+		pud_t *pud, unsigned long addr, unsigned long end)
+{
+	unsigned long pages = 0;
+	unsigned long next;
+	pmd_t *pmd;
+
+	pmd = pmd_offset(pud, addr);
+	do {
+		next = pmd_addr_end(addr, end);
+		/* Huge pmds are left to the ptes around them for now */
+		if (pmd_trans_huge(*pmd) || pmd_none_or_clear_bad(pmd))
+			continue;
+		pages += change_pte_range_numa(vma, pmd, addr, next);
+	} while (pmd++, addr = next, addr != end);
+	return pages;
+}
+
+static unsigned long change_pud_range_numa(struct vm_area_struct *vma,
+		pgd_t *pgd, unsigned long addr, unsigned long end)
+{
+	unsigned long pages = 0;
+	unsigned long next;
+	pud_t *pud;
+
+	pud = pud_offset(pgd, addr);
+	do {
+		next = pud_addr_end(addr, end);
+		if (pud_none_or_clear_bad(pud))
+			continue;
+		pages += change_pmd_range_numa(vma, pud, addr, next);
+	} while (pud++, addr = next, addr != end);
+	return pages;
+}
+
+/*
+ * change_prot_numa - make the pages of a range fault on their next access
+ *
+ * Called with mmap_sem held for read.  Returns the number of ptes changed.
+ */
+unsigned long change_prot_numa(struct vm_area_struct *vma,
+			unsigned long start, unsigned long end)
+{
+	unsigned long addr = start;
+	unsigned long pages = 0;
+	unsigned long next;
+	pgd_t *pgd;
+
+	pgd = pgd_offset(vma->vm_mm, addr);
+	do {
+		next = pgd_addr_end(addr, end);
+		if (pgd_none_or_clear_bad(pgd))
+			continue;
+		pages += change_pud_range_numa(vma, pgd, addr, next);
+	} while (pgd++, addr = next, addr != end);
+
+	if (pages) {
+		flush_tlb_range(vma, start, end);
+		count_vm_events(NUMA_PTE_UPDATES, pages);
+	}
+	return pages;
+}
+#endif /* CONFIG_NUMA_BALANCING */
+
 /*
  * Check if all pages in a range are on a set of nodes.
  * If pagelist != NULL then isolate pages from the LRU and
@@ -560,7 +661,9 @@ static int policy_vma(struct vm_area_struct *vma, struct mempolicy *new)
 		err = vma->vm_ops->set_policy(vma, new);
 	if (!err) {
 		mpol_get(new);
+		vm_write_begin(vma);
 		vma->vm_policy = new;
+		vm_write_end(vma);
 		mpol_put(old);
 	}
 	return err;
@@ -1510,6 +1613,61 @@ static unsigned offset_il_node(struct mempolicy *pol,
 	return nid;
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+static inline unsigned interleave_nid(struct mempolicy *pol,
+		 struct vm_area_struct *vma, unsigned long addr, int shift);
+
+/**
+ * mpol_misplaced - check whether a page is where the policy wants it
+ * @page:	page mapped at @addr
+ * @vma:	vma of the NUMA hinting fault
+ * @addr:	address of the fault
+ *
+ * Returns the node @page should move to under the policy of @vma, or -1 if
+ * it is on a suitable node already.  Under the default (local) policy that
+ * is the node of the faulting CPU.  Called with the pte lock held.
+ */
+int mpol_misplaced(struct page *page, struct vm_area_struct *vma,
+		   unsigned long addr)
+{
+	struct mempolicy *pol;
+	int curnid = page_to_nid(page);
+	int thisnid = numa_node_id();
+	int polnid = -1;
+
+	pol = get_vma_policy(current, vma, addr);
+
+	switch (pol->mode) {
+	case MPOL_INTERLEAVE:
+		polnid = interleave_nid(pol, vma, addr, PAGE_SHIFT);
+		break;
+
+	case MPOL_PREFERRED:
+		if (pol->flags & MPOL_F_LOCAL)
+			polnid = thisnid;
+		else
+			polnid = pol->v.preferred_node;
+		break;
+
+	case MPOL_BIND:
+		/* Anywhere in the nodemask will do, but local is better */
+		if (node_isset(curnid, pol->v.nodes))
+			polnid = curnid;
+		else if (node_isset(thisnid, pol->v.nodes))
+			polnid = thisnid;
+		break;
+
+	default:
+		BUG();
+	}
+	mpol_cond_put(pol);
+
+	if (polnid == curnid)
+		return -1;
+	return polnid;
+}
+#endif /* CONFIG_NUMA_BALANCING */
+
 /* Determine a node number for interleave */
 static inline unsigned interleave_nid(struct mempolicy *pol,
 		 struct vm_area_struct *vma, unsigned long addr, int shift)
@@ -1583,7 +1741,7 @@ static struct page *alloc_page_interleave(gfp_t gfp, unsigned order,
 }
 
 /**
- * 	alloc_page_vma	- Allocate a page for a VMA.
+ * 	alloc_pages_vma	- Allocate a page for a VMA.
  *
  * 	@gfp:
  *      %GFP_USER    user allocation.
@@ -1592,6 +1750,7 @@ static struct page *alloc_page_interleave(gfp_t gfp, unsigned order,
  *      %GFP_FS      allocation should not call back into a file system.
  *      %GFP_ATOMIC  don't sleep.
  *
+ *	@order: Order of the allocation, 0 is a single page.
  * 	@vma:  Pointer to VMA or NULL if not available.
  *	@addr: Virtual Address of the allocation. Must be inside the VMA.
  *
@@ -1605,7 +1764,8 @@ static struct page *alloc_page_interleave(gfp_t gfp, unsigned order,
  *	Should be called with the mm_sem of the vma hold.
  */
 struct page *
-alloc_page_vma(gfp_t gfp, struct vm_area_struct *vma, unsigned long addr)
+alloc_pages_vma(gfp_t gfp, int order, struct vm_area_struct *vma,
+		unsigned long addr)
 {
 	struct mempolicy *pol = get_vma_policy(current, vma, addr);
 	struct zonelist *zl;
@@ -1613,16 +1773,16 @@ alloc_page_vma(gfp_t gfp, struct vm_area_struct *vma, unsigned long addr)
 	if (unlikely(pol->mode == MPOL_INTERLEAVE)) {
 		unsigned nid;
 
-		nid = interleave_nid(pol, vma, addr, PAGE_SHIFT);
+		nid = interleave_nid(pol, vma, addr, PAGE_SHIFT + order);
 		mpol_cond_put(pol);
-		return alloc_page_interleave(gfp, 0, nid);
+		return alloc_page_interleave(gfp, order, nid);
 	}
 	zl = policy_zonelist(gfp, pol);
 	if (unlikely(mpol_needs_cond_ref(pol))) {
 		/*
 		 * slow path: ref counted shared policy
 		 */
-		struct page *page =  __alloc_pages_nodemask(gfp, 0,
+		struct page *page =  __alloc_pages_nodemask(gfp, order,
 						zl, policy_nodemask(gfp, pol));
 		__mpol_put(pol);
 		return page;
@@ -1630,7 +1790,8 @@ alloc_page_vma(gfp_t gfp, struct vm_area_struct *vma, unsigned long addr)
 	/*
 	 * fast path:  default or task policy
 	 */
-	return __alloc_pages_nodemask(gfp, 0, zl, policy_nodemask(gfp, pol));
+	return __alloc_pages_nodemask(gfp, order, zl,
+				      policy_nodemask(gfp, pol));
 }
 
 /**
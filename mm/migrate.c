@@ -545,7 +545,8 @@ static int fallback_migrate_page(struct address_space *mapping,
  *   < 0 - error code
  *  == 0 - success
  */
-static int move_to_new_page(struct page *newpage, struct page *page)
+static int move_to_new_page(struct page *newpage, struct page *page,
+			    int remap_swapcache)
 {
 	struct address_space *mapping;
 	int rc;
@@ -581,7 +582,8 @@ static int move_to_new_page(struct page *newpage, struct page *page)
 		rc = fallback_migrate_page(mapping, newpage, page);
 
 	if (!rc) {
-		remove_migration_ptes(page, newpage);
+		if (remap_swapcache)
+			remove_migration_ptes(page, newpage);
 	} else
 		newpage->mapping = NULL;
 
@@ -603,6 +605,8 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 	int rcu_locked = 0;
 	int charge = 0;
 	struct mem_cgroup *mem = NULL;
+	int remap_swapcache = 1;
+	struct anon_vma *anon_vma = NULL;
 
 	if (!newpage)
 		return -ENOMEM;
@@ -611,6 +615,10 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 		/* page was freed from under us. So we are done. */
 		goto move_newpage;
 	}
+	/* only the small pages of a huge page can be migrated */
+	if (unlikely(PageTransHuge(page)))
+		if (unlikely(split_huge_page(page)))
+			goto move_newpage;
 
 	/* prepare cgroup just returns 0 or -ENOMEM */
 	rc = -EAGAIN;
@@ -645,6 +653,28 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 	if (PageAnon(page)) {
 		rcu_read_lock();
 		rcu_locked = 1;
+
+		if (!page_mapped(page)) {
+			/* the page is on its way to be freed */
+			if (!PageSwapCache(page))
+				goto rcu_unlock;
+
+			/*
+			 * The vmas an unmapped swapcache page belonged to
+			 * may be gone along with their anon_vma, so such a
+			 * page is migrated but never remapped.
+			 */
+			remap_swapcache = 0;
+		} else {
+			/*
+			 * The caller may not hold mmap_sem of any mm mapping
+			 * the page: pin the anon_vma so that it is still
+			 * there to remove the migration ptes.
+			 */
+			anon_vma = page_anon_vma(page);
+			if (anon_vma)
+				atomic_inc(&anon_vma->external_refcount);
+		}
 	}
 
 	/*
@@ -679,11 +709,15 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 
 skip_unmap:
 	if (!page_mapped(page))
-		rc = move_to_new_page(newpage, page);
+		rc = move_to_new_page(newpage, page, remap_swapcache);
 
-	if (rc)
+	if (rc && remap_swapcache)
 		remove_migration_ptes(page, page);
 rcu_unlock:
+	/* Drop an anon_vma reference if we took one */
+	if (anon_vma)
+		drop_anon_vma(anon_vma);
+
 	if (rcu_locked)
 		rcu_read_unlock();
 uncharge:
@@ -722,6 +756,69 @@ move_newpage:
 	return rc;
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * A misplaced page is only migrated if the node has room for it above its
+ * high watermark: NUMA balancing must not push a node into reclaim.
+ */
+static int numamigrate_node_has_room(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int z;
+
+	for (z = pgdat->nr_zones - 1; z >= 0; z--) {
+		struct zone *zone = pgdat->node_zones + z;
+
+		if (!populated_zone(zone) || zone_is_all_unreclaimable(zone))
+			continue;
+		if (zone_watermark_ok(zone, 0, high_wmark_pages(zone) + 1,
+				      0, 0))
+			return 1;
+	}
+	return 0;
+}
+
+static struct page *alloc_misplaced_dst_page(struct page *page,
+					     unsigned long nid, int **result)
+{
+	return alloc_pages_exact_node((int)nid, GFP_HIGHUSER_MOVABLE |
+				      __GFP_THISNODE | __GFP_NOMEMALLOC |
+				      __GFP_NORETRY | __GFP_NOWARN, 0);
+}
+
+/**
+ * migrate_misplaced_page - move a page found by a NUMA hinting fault
+ * @page:	page to move, with a reference that is dropped here
+ * @node:	node of the task that faulted on it
+ *
+ * Returns 1 if the page was migrated to @node.  Pages mapped by several
+ * processes stay where they are, as they would only bounce between the
+ * nodes of their users.
+ */
+int migrate_misplaced_page(struct page *page, int node)
+{
+	LIST_HEAD(migratepages);
+	int isolated;
+
+	if (page_mapcount(page) != 1 || !numamigrate_node_has_room(node)) {
+		put_page(page);
+		return 0;
+	}
+
+	isolated = !isolate_lru_page(page);
+	put_page(page);
+	if (!isolated)
+		return 0;
+
+	list_add(&page->lru, &migratepages);
+	if (migrate_pages(&migratepages, alloc_misplaced_dst_page, node))
+		return 0;
+
+	count_vm_event(NUMA_PAGE_MIGRATE);
+	return 1;
+}
+#endif /* CONFIG_NUMA_BALANCING */
+
 /*
  * migrate_pages
  *
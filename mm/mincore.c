@@ -132,6 +132,11 @@ static long do_mincore(unsigned long addr, unsigned char *vec, unsigned long pag
 	if (pud_none_or_clear_bad(pud))
 		goto none_mapped;
 	pmd = pmd_offset(pud, addr);
+	if (pmd_trans_huge(*pmd)) {
+		if (mincore_huge_pmd(vma, pmd, addr, addr + nr * PAGE_SIZE,
+				     vec))
+			return nr;
+	}
 	if (pmd_none_or_clear_bad(pmd))
 		goto none_mapped;
 
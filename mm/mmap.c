@@ -239,10 +239,24 @@ static struct vm_area_struct *remove_vma(struct vm_area_struct *vma)
 			removed_exe_file_vma(vma->vm_mm);
 	}
 	mpol_put(vma_policy(vma));
-	kmem_cache_free(vm_area_cachep, vma);
+	put_vma(vma);
 	return next;
 }
 
+/*
+ * Free a vma that has been unlinked from its mm.  A speculative page fault
+ * may still be using it, in which case the last of those frees it: the
+ * reference of the mm is the one not counted in vm_ref_count.
+ */
+void put_vma(struct vm_area_struct *vma)
+{
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	if (atomic_dec_return(&vma->vm_ref_count) >= 0)
+		return;
+#endif
+	kmem_cache_free(vm_area_cachep, vma);
+}
+
 SYSCALL_DEFINE1(brk, unsigned long, brk)
 {
 	unsigned long rlim, retval;
@@ -405,8 +419,10 @@ __vma_link_list(struct mm_struct *mm, struct vm_area_struct *vma,
 void __vma_link_rb(struct mm_struct *mm, struct vm_area_struct *vma,
 		struct rb_node **rb_link, struct rb_node *rb_parent)
 {
+	mm_rb_write_lock(mm);
 	rb_link_node(&vma->vm_rb, rb_parent, rb_link);
 	rb_insert_color(&vma->vm_rb, &mm->mm_rb);
+	mm_rb_write_unlock(mm);
 }
 
 static void __vma_link_file(struct vm_area_struct *vma)
@@ -488,7 +504,9 @@ __vma_unlink(struct mm_struct *mm, struct vm_area_struct *vma,
 		struct vm_area_struct *prev)
 {
 	prev->vm_next = vma->vm_next;
+	mm_rb_write_lock(mm);
 	rb_erase(&vma->vm_rb, &mm->mm_rb);
+	mm_rb_write_unlock(mm);
 	if (mm->mmap_cache == vma)
 		mm->mmap_cache = prev;
 }
@@ -513,6 +531,7 @@ void vma_adjust(struct vm_area_struct *vma, unsigned long start,
 	long adjust_next = 0;
 	int remove_next = 0;
 
+	vm_write_begin(vma);
 	if (next && !insert) {
 		if (end >= next->vm_end) {
 			/*
@@ -541,6 +560,9 @@ again:			remove_next = 1 + (end > next->vm_end);
 			anon_vma = next->anon_vma;
 			importer = next;
 		}
+		/* a removed next stays odd for good */
+		if (remove_next || adjust_next)
+			vm_write_begin(next);
 	}
 
 	if (file) {
@@ -568,6 +590,9 @@ again:			remove_next = 1 + (end > next->vm_end);
 		}
 	}
 
+	/* split_huge_page() takes the anon_vma lock */
+	vma_adjust_trans_huge(vma, start, end, adjust_next);
+
 	/*
 	 * When changing only vma->vm_end, we don't really need
 	 * anon_vma lock.
@@ -600,6 +625,7 @@ again:			remove_next = 1 + (end > next->vm_end);
 	if (adjust_next) {
 		next->vm_start += adjust_next << PAGE_SHIFT;
 		next->vm_pgoff += adjust_next;
+		vm_write_end(next);
 	}
 
 	if (root) {
@@ -641,7 +667,7 @@ again:			remove_next = 1 + (end > next->vm_end);
 		}
 		mm->map_count--;
 		mpol_put(vma_policy(next));
-		kmem_cache_free(vm_area_cachep, next);
+		put_vma(next);
 		/*
 		 * In mprotect's case 6 (see comments on vma_merge),
 		 * we must remove another next too. It would clutter
@@ -652,6 +678,7 @@ again:			remove_next = 1 + (end > next->vm_end);
 			goto again;
 		}
 	}
+	vm_write_end(vma);
 
 	validate_mm(mm);
 }
@@ -1798,12 +1825,16 @@ detach_vmas_to_be_unmapped(struct mm_struct *mm, struct vm_area_struct *vma,
 	unsigned long addr;
 
 	insertion_point = (prev ? &prev->vm_next : &mm->mmap);
+	mm_rb_write_lock(mm);
 	do {
+		/* unlinked for good: speculative faults must not use it */
+		vm_write_begin(vma);
 		rb_erase(&vma->vm_rb, &mm->mm_rb);
 		mm->map_count--;
 		tail_vma = vma;
 		vma = vma->vm_next;
 	} while (vma && vma->vm_start < end);
+	mm_rb_write_unlock(mm);
 	*insertion_point = vma;
 	tail_vma->vm_next = NULL;
 	if (mm->unmap_area == arch_unmap_area)
@@ -1837,6 +1868,7 @@ int split_vma(struct mm_struct * mm, struct vm_area_struct * vma,
 
 	/* most fields are the same, copy all, and then fixup */
 	*new = *vma;
+	vma_init_speculative(new);
 
 	if (new_below)
 		new->vm_end = addr;
@@ -2189,6 +2221,7 @@ struct vm_area_struct *copy_vma(struct vm_area_struct **vmap,
 		new_vma = kmem_cache_alloc(vm_area_cachep, GFP_KERNEL);
 		if (new_vma) {
 			*new_vma = *vma;
+			vma_init_speculative(new_vma);
 			pol = mpol_dup(vma_policy(vma));
 			if (IS_ERR(pol)) {
 				kmem_cache_free(vm_area_cachep, new_vma);
@@ -108,9 +108,12 @@ EXPORT_SYMBOL(read_cache_pages);
 static int read_pages(struct address_space *mapping, struct file *filp,
 		struct list_head *pages, unsigned nr_pages)
 {
+	struct blk_plug plug;
 	unsigned page_idx;
 	int ret;
 
+	blk_start_plug(&plug);
+
 	if (mapping->a_ops->readpages) {
 		ret = mapping->a_ops->readpages(filp, mapping, pages, nr_pages);
 		/* Clean up the remaining pages */
@@ -129,6 +132,7 @@ static int read_pages(struct address_space *mapping, struct file *filp,
 	}
 	ret = 0;
 out:
+	blk_finish_plug(&plug);
 	return ret;
 }
 
@@ -27,7 +27,7 @@
  *       mapping->i_mmap_lock
  *         anon_vma->lock
  *           mm->page_table_lock or pte_lock
- *             zone->lru_lock (in mark_page_accessed, isolate_lru_page)
+ *             lru_shard->lock (in mark_page_accessed, isolate_lru_page)
  *             swap_lock (in swap_duplicate, swap_info_get)
  *               mmlist_lock (in mmput, drain_mmlist and others)
  *               mapping->private_lock (in __set_page_dirty_buffers)
@@ -170,19 +170,41 @@ void anon_vma_unlink(struct vm_area_struct *vma)
 	spin_lock(&anon_vma->lock);
 	list_del(&vma->anon_vma_node);
 
-	/* We must garbage collect the anon_vma if it's empty */
-	empty = list_empty(&anon_vma->head);
+	/*
+	 * We must garbage collect the anon_vma if it's empty, unless
+	 * page migration still holds a reference to it.
+	 */
+	empty = list_empty(&anon_vma->head) &&
+		!anonvma_external_refcount(anon_vma);
 	spin_unlock(&anon_vma->lock);
 
 	if (empty)
 		anon_vma_free(anon_vma);
 }
 
+#ifdef CONFIG_MIGRATION
+/*
+ * Drop the reference page migration took on an anon_vma, freeing it if
+ * its last vma went away in the meantime.
+ */
+void drop_anon_vma(struct anon_vma *anon_vma)
+{
+	if (atomic_dec_and_lock(&anon_vma->external_refcount,
+				&anon_vma->lock)) {
+		int empty = list_empty(&anon_vma->head);
+		spin_unlock(&anon_vma->lock);
+		if (empty)
+			anon_vma_free(anon_vma);
+	}
+}
+#endif
+
 static void anon_vma_ctor(void *data)
 {
 	struct anon_vma *anon_vma = data;
 
 	spin_lock_init(&anon_vma->lock);
+	anonvma_external_refcount_init(anon_vma);
 	INIT_LIST_HEAD(&anon_vma->head);
 }
 
@@ -227,7 +249,7 @@ void page_unlock_anon_vma(struct anon_vma *anon_vma)
  * Returns virtual address or -EFAULT if page's index/offset is not
  * within the range mapped the @vma.
  */
-static inline unsigned long
+inline unsigned long
 vma_address(struct page *page, struct vm_area_struct *vma)
 {
 	pgoff_t pgoff = page->index << (PAGE_CACHE_SHIFT - PAGE_SHIFT);
@@ -289,6 +311,8 @@ pte_t *page_check_address(struct page *page, struct mm_struct *mm,
 	pmd = pmd_offset(pud, address);
 	if (!pmd_present(*pmd))
 		return NULL;
+	if (pmd_trans_huge(*pmd))
+		return NULL;
 
 	pte = pte_offset_map(pmd, address);
 	/* Make a quick check before getting the lock */
@@ -352,6 +376,23 @@ static int page_referenced_one(struct page *page,
 	if (address == -EFAULT)
 		goto out;
 
+	if (unlikely(PageTransHuge(page))) {
+		pmd_t *pmd;
+
+		/*
+		 * A huge page is mapped by a pmd in exactly one place and
+		 * never sits in a VM_LOCKED vma.
+		 */
+		spin_lock(&mm->page_table_lock);
+		pmd = page_check_address_pmd(page, mm, address);
+		if (pmd && pmdp_clear_flush_young_notify(vma, address, pmd))
+			referenced++;
+		spin_unlock(&mm->page_table_lock);
+		if (pmd)
+			(*mapcount)--;
+		goto out;
+	}
+
 	pte = page_check_address(page, mm, address, &ptl, 0);
 	if (!pte)
 		goto out;
@@ -627,7 +668,12 @@ static void __page_set_anon_rmap(struct page *page,
 	 * nr_mapped state can be updated without turning off
 	 * interrupts because it is not modified via interrupt.
 	 */
-	__inc_zone_page_state(page, NR_ANON_PAGES);
+	if (unlikely(PageTransHuge(page))) {
+		__mod_zone_page_state(page_zone(page), NR_ANON_PAGES,
+				      hpage_nr_pages(page));
+		__inc_zone_page_state(page, NR_ANON_TRANSPARENT_HUGEPAGES);
+	} else
+		__inc_zone_page_state(page, NR_ANON_PAGES);
 }
 
 /**
@@ -740,7 +786,13 @@ void page_remove_rmap(struct page *page)
 	}
 	if (PageAnon(page)) {
 		mem_cgroup_uncharge_page(page);
-		__dec_zone_page_state(page, NR_ANON_PAGES);
+		if (unlikely(PageTransHuge(page))) {
+			__mod_zone_page_state(page_zone(page), NR_ANON_PAGES,
+					      -hpage_nr_pages(page));
+			__dec_zone_page_state(page,
+					      NR_ANON_TRANSPARENT_HUGEPAGES);
+		} else
+			__dec_zone_page_state(page, NR_ANON_PAGES);
 	} else {
 		__dec_zone_page_state(page, NR_FILE_MAPPED);
 	}
@@ -0,0 +1,137 @@
+/*
+ * mm/slab-bulk-test.c
+ *
+ * Checks kmem_cache_alloc_bulk() and kmem_cache_free_bulk() and compares
+ * their cost per object with kmem_cache_alloc() and kmem_cache_free().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
+
+#define MAX_BULK	256
+
+static unsigned int loops = 10000;
+module_param(loops, uint, 0444);
+MODULE_PARM_DESC(loops, "Iterations of each benchmark");
+
+static unsigned int object_size = 256;
+module_param(object_size, uint, 0444);
+MODULE_PARM_DESC(object_size, "Size of the test cache objects");
+
+static const unsigned int bulk_sizes[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256 };
+
+static void *objs[MAX_BULK];
+
+static int __init check_bulk(struct kmem_cache *s, unsigned int nr)
+{
+	unsigned int i, j;
+	unsigned char *p;
+
+	if (kmem_cache_alloc_bulk(s, GFP_KERNEL | __GFP_ZERO, nr, objs) != nr) {
+		printk(KERN_ERR "slab-bulk-test: allocating %u objects failed\n",
+		       nr);
+		return -ENOMEM;
+	}
+	for (i = 0; i < nr; i++) {
+		p = objs[i];
+		for (j = 0; j < object_size; j++)
+			if (p[j])
+				goto bad_zero;
+		for (j = 0; j < i; j++)
+			if (objs[j] == objs[i])
+				goto bad_dup;
+		memset(p, 0xa5, object_size);
+	}
+	kmem_cache_free_bulk(s, nr, objs);
+	return 0;
+
+bad_zero:
+	printk(KERN_ERR "slab-bulk-test: object %u of %u not zeroed\n", i, nr);
+	kmem_cache_free_bulk(s, nr, objs);
+	return -EINVAL;
+bad_dup:
+	printk(KERN_ERR "slab-bulk-test: objects %u and %u of %u are the same\n",
+	       j, i, nr);
+	kmem_cache_free_bulk(s, nr, objs);
+	return -EINVAL;
+}
+
+static void __init bench_single(struct kmem_cache *s, unsigned int nr)
+{
+	cycles_t start, cycles;
+	unsigned int l, i;
+
+	start = get_cycles();
+	for (l = 0; l < loops; l++) {
+		for (i = 0; i < nr; i++) {
+			objs[i] = kmem_cache_alloc(s, GFP_KERNEL);
+			if (!objs[i])
+				break;
+		}
+		while (i--)
+			kmem_cache_free(s, objs[i]);
+	}
+	cycles = get_cycles() - start;
+	printk(KERN_INFO "slab-bulk-test: %3u objects: single %llu cycles/object",
+	       nr, (unsigned long long)cycles / loops / nr);
+}
+
+static void __init bench_bulk(struct kmem_cache *s, unsigned int nr)
+{
+	cycles_t start, cycles;
+	unsigned int l;
+
+	start = get_cycles();
+	for (l = 0; l < loops; l++) {
+		if (!kmem_cache_alloc_bulk(s, GFP_KERNEL, nr, objs))
+			continue;
+		kmem_cache_free_bulk(s, nr, objs);
+	}
+	cycles = get_cycles() - start;
+	printk(KERN_CONT ", bulk %llu cycles/object\n",
+	       (unsigned long long)cycles / loops / nr);
+}
+
+static int __init slab_bulk_test_init(void)
+{
+	struct kmem_cache *s;
+	unsigned int i;
+	int err = 0;
+
+	if (!loops || !object_size)
+		return -EINVAL;
+
+	s = kmem_cache_create("slab_bulk_test", object_size, 0, 0, NULL);
+	if (!s)
+		return -ENOMEM;
+
+	for (i = 1; i <= MAX_BULK && !err; i++)
+		err = check_bulk(s, i);
+	if (err)
+		goto out;
+	printk(KERN_INFO "slab-bulk-test: bulk allocation checks passed\n");
+
+	for (i = 0; i < ARRAY_SIZE(bulk_sizes); i++) {
+		bench_single(s, bulk_sizes[i]);
+		bench_bulk(s, bulk_sizes[i]);
+	}
+out:
+	kmem_cache_destroy(s);
+	return err;
+}
+
+static void __exit slab_bulk_test_exit(void)
+{
+}
+
+module_init(slab_bulk_test_init);
+module_exit(slab_bulk_test_exit);
+
+MODULE_LICENSE("GPL");
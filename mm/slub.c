@@ -28,6 +28,7 @@
 #include <linux/memory.h>
 #include <linux/math64.h>
 #include <linux/fault-inject.h>
+#include <linux/uaccess.h>
 
 /*
  * Lock order:
@@ -171,6 +172,7 @@
 /* Internal SLUB flags */
 #define __OBJECT_POISON		0x80000000 /* Poison object */
 #define __SYSFS_ADD_DEFERRED	0x40000000 /* Not yet visible via sysfs */
+#define __CMPXCHG_DOUBLE	0x20000000 /* Lockless cpu slab fastpath */
 
 static int kmem_size = sizeof(struct kmem_cache);
 
@@ -224,6 +226,20 @@ static inline void stat(struct kmem_cache_cpu *c, enum stat_item si)
 #endif
 }
 
+/*
+ * The lockless fastpaths exchange the freelist of the cpu slab together
+ * with its transaction id.  Everything else that changes the freelist or
+ * the slab of a kmem_cache_cpu, always with interrupts disabled, advances
+ * the tid, so that a fastpath it interrupted fails its cmpxchg and
+ * retries.
+ */
+static inline void advance_tid(struct kmem_cache_cpu *c)
+{
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	c->tid++;
+#endif
+}
+
 /********************************************************************
  * 			Core slab cache functions
  *******************************************************************/
@@ -1490,6 +1506,7 @@ static void deactivate_slab(struct kmem_cache *s, struct kmem_cache_cpu *c)
 		page->inuse--;
 	}
 	c->page = NULL;
+	advance_tid(c);
 	unfreeze_slab(s, page, tail);
 }
 
@@ -1649,6 +1666,7 @@ load_freelist:
 	c->page->freelist = NULL;
 	c->node = page_to_nid(c->page);
 unlock_out:
+	advance_tid(c);
 	slab_unlock(c->page);
 	stat(c, ALLOC_SLOWPATH);
 	return object;
@@ -1695,6 +1713,92 @@ debug:
 	goto unlock_out;
 }
 
+/*
+ * Take an object off the lockless freelist with interrupts disabled, or
+ * call __slab_alloc if that is not possible.
+ */
+static __always_inline void *slab_alloc_irqoff(struct kmem_cache *s,
+		gfp_t gfpflags, int node, unsigned long addr)
+{
+	void **object;
+	struct kmem_cache_cpu *c;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	c = get_cpu_slab(s, smp_processor_id());
+	if (unlikely(!c->freelist || !node_match(c, node)))
+
+		object = __slab_alloc(s, gfpflags, node, addr, c);
+
+	else {
+		object = c->freelist;
+		c->freelist = object[c->offset];
+		advance_tid(c);
+		stat(c, ALLOC_FASTPATH);
+	}
+	local_irq_restore(flags);
+	return object;
+}
+
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+/*
+ * The free pointer of an object at the head of the cpu freelist.  An
+ * interrupt may allocate the object, and even free its slab, between us
+ * reading the freelist and the free pointer: the cmpxchg then fails, but
+ * with DEBUG_PAGEALLOC the read itself must not fault.
+ */
+static inline void *get_freepointer_safe(struct kmem_cache_cpu *c,
+					 void **object)
+{
+	void *p;
+
+#ifdef CONFIG_DEBUG_PAGEALLOC
+	probe_kernel_read(&p, object + c->offset, sizeof(p));
+#else
+	p = object[c->offset];
+#endif
+	return p;
+}
+
+/*
+ * Lockless fastpath.  The first object of the cpu freelist is taken with
+ * cmpxchg_double_local() on the freelist and the tid, which fails if an
+ * interrupt allocated or freed on this cpu meanwhile, so interrupts stay
+ * enabled.  Preemption is disabled to keep the kmem_cache_cpu ours, which
+ * costs nothing without CONFIG_PREEMPT.
+ */
+static __always_inline void *slab_alloc_lockless(struct kmem_cache *s,
+		gfp_t gfpflags, int node, unsigned long addr)
+{
+	void **object;
+	void *next;
+	struct kmem_cache_cpu *c;
+	unsigned long tid;
+
+redo:
+	preempt_disable();
+	c = get_cpu_slab(s, smp_processor_id());
+	tid = c->tid;
+	barrier();
+	object = c->freelist;
+	if (unlikely(!object || !node_match(c, node))) {
+		preempt_enable();
+		return slab_alloc_irqoff(s, gfpflags, node, addr);
+	}
+
+	next = get_freepointer_safe(c, object);
+	if (unlikely(!cmpxchg_double_local(&c->freelist, &c->tid,
+					   object, tid, next, tid + 1))) {
+		stat(c, CMPXCHG_DOUBLE_CPU_FAIL);
+		preempt_enable();
+		goto redo;
+	}
+	stat(c, ALLOC_FASTPATH);
+	preempt_enable();
+	return object;
+}
+#endif
+
 /*
  * Inlined fastpath so that allocation functions (kmalloc, kmem_cache_alloc)
  * have the fastpath folded into their functions. So no function call
@@ -1703,15 +1807,14 @@ debug:
  * The fastpath works by first checking if the lockless freelist can be used.
  * If not then __slab_alloc is called for slow processing.
  *
- * Otherwise we can simply pick the next object from the lockless free list.
+ * Otherwise we can simply pick the next object from the lockless free list,
+ * without disabling interrupts if the cpu has cmpxchg_double.
  */
 static __always_inline void *slab_alloc(struct kmem_cache *s,
 		gfp_t gfpflags, int node, unsigned long addr)
 {
 	void **object;
-	struct kmem_cache_cpu *c;
-	unsigned long flags;
-	unsigned int objsize;
+	unsigned int objsize = s->objsize;
 
 	gfpflags &= gfp_allowed_mask;
 
@@ -1721,24 +1824,17 @@ static __always_inline void *slab_alloc(struct kmem_cache *s,
 	if (should_failslab(s->objsize, gfpflags))
 		return NULL;
 
-	local_irq_save(flags);
-	c = get_cpu_slab(s, smp_processor_id());
-	objsize = c->objsize;
-	if (unlikely(!c->freelist || !node_match(c, node)))
-
-		object = __slab_alloc(s, gfpflags, node, addr, c);
-
-	else {
-		object = c->freelist;
-		c->freelist = object[c->offset];
-		stat(c, ALLOC_FASTPATH);
-	}
-	local_irq_restore(flags);
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	if (likely(s->flags & __CMPXCHG_DOUBLE))
+		object = slab_alloc_lockless(s, gfpflags, node, addr);
+	else
+#endif
+		object = slab_alloc_irqoff(s, gfpflags, node, addr);
 
 	if (unlikely((gfpflags & __GFP_ZERO) && object))
 		memset(object, 0, objsize);
 
-	kmemcheck_slab_alloc(s, gfpflags, object, c->objsize);
+	kmemcheck_slab_alloc(s, gfpflags, object, objsize);
 	kmemleak_alloc_recursive(object, objsize, 1, s->flags, gfpflags);
 
 	return object;
@@ -1862,6 +1958,9 @@ debug:
  *
  * If fastpath is not possible then fall back to __slab_free where we deal
  * with all sorts of special processing.
+ *
+ * As on allocation, the fastpath pushes the object with cmpxchg_double and
+ * interrupts enabled if the cpu can.
  */
 static __always_inline void slab_free(struct kmem_cache *s,
 			struct page *page, void *x, unsigned long addr)
@@ -1871,15 +1970,44 @@ static __always_inline void slab_free(struct kmem_cache *s,
 	unsigned long flags;
 
 	kmemleak_free_recursive(x, s->flags);
+	kmemcheck_slab_free(s, object, s->objsize);
+	debug_check_no_locks_freed(object, s->objsize);
+	if (!(s->flags & SLAB_DEBUG_OBJECTS))
+		debug_check_no_obj_freed(object, s->objsize);
+
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	if (likely(s->flags & __CMPXCHG_DOUBLE)) {
+		void **freelist;
+		unsigned long tid;
+redo:
+		preempt_disable();
+		c = get_cpu_slab(s, smp_processor_id());
+		tid = c->tid;
+		barrier();
+		if (likely(page == c->page && c->node >= 0)) {
+			freelist = c->freelist;
+			object[c->offset] = freelist;
+			if (unlikely(!cmpxchg_double_local(&c->freelist,
+					&c->tid, freelist, tid,
+					object, tid + 1))) {
+				stat(c, CMPXCHG_DOUBLE_CPU_FAIL);
+				preempt_enable();
+				goto redo;
+			}
+			stat(c, FREE_FASTPATH);
+			preempt_enable();
+			return;
+		}
+		preempt_enable();
+	}
+#endif
+
 	local_irq_save(flags);
 	c = get_cpu_slab(s, smp_processor_id());
-	kmemcheck_slab_free(s, object, c->objsize);
-	debug_check_no_locks_freed(object, c->objsize);
-	if (!(s->flags & SLAB_DEBUG_OBJECTS))
-		debug_check_no_obj_freed(object, c->objsize);
 	if (likely(page == c->page && c->node >= 0)) {
 		object[c->offset] = c->freelist;
 		c->freelist = object;
+		advance_tid(c);
 		stat(c, FREE_FASTPATH);
 	} else
 		__slab_free(s, page, x, addr, c->offset);
@@ -1899,6 +2027,114 @@ void kmem_cache_free(struct kmem_cache *s, void *x)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/**
+ * kmem_cache_free_bulk - free an array of objects
+ * @s:		cache the objects were allocated from
+ * @size:	number of objects in @p
+ * @p:		the objects
+ *
+ * Like calling kmem_cache_free() on each object, but with interrupts
+ * disabled only once for the whole array.  Objects of the current cpu slab
+ * go straight onto its lockless freelist, all others through __slab_free().
+ */
+void kmem_cache_free_bulk(struct kmem_cache *s, size_t size, void **p)
+{
+	struct kmem_cache_cpu *c;
+	unsigned long flags;
+	size_t i;
+
+	local_irq_save(flags);
+	c = get_cpu_slab(s, smp_processor_id());
+	for (i = 0; i < size; i++) {
+		void **object = p[i];
+		struct page *page = virt_to_head_page(object);
+
+		kmemleak_free_recursive(object, s->flags);
+		kmemcheck_slab_free(s, object, c->objsize);
+		debug_check_no_locks_freed(object, c->objsize);
+		if (!(s->flags & SLAB_DEBUG_OBJECTS))
+			debug_check_no_obj_freed(object, c->objsize);
+		if (likely(page == c->page && c->node >= 0)) {
+			object[c->offset] = c->freelist;
+			c->freelist = object;
+			advance_tid(c);
+			stat(c, FREE_FASTPATH);
+		} else
+			__slab_free(s, page, object, _RET_IP_, c->offset);
+		trace_kmem_cache_free(_RET_IP_, object);
+	}
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
+/**
+ * kmem_cache_alloc_bulk - allocate an array of objects
+ * @s:		cache to allocate from
+ * @flags:	allocation flags
+ * @size:	number of objects to allocate
+ * @p:		array of at least @size pointers to fill in
+ *
+ * Like calling kmem_cache_alloc() @size times, but with interrupts
+ * disabled only once: objects are taken from the lockless freelist of the
+ * cpu slab for as long as it lasts, and __slab_alloc() refills it.
+ *
+ * Returns @size, or 0 if not all objects could be allocated, in which case
+ * those that were have been freed again.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
+			  void **p)
+{
+	struct kmem_cache_cpu *c;
+	unsigned long irqflags;
+	size_t i, j;
+
+	flags &= gfp_allowed_mask;
+
+	lockdep_trace_alloc(flags);
+	might_sleep_if(flags & __GFP_WAIT);
+
+	if (should_failslab(s->objsize, flags))
+		return 0;
+
+	local_irq_save(irqflags);
+	c = get_cpu_slab(s, smp_processor_id());
+	for (i = 0; i < size; i++) {
+		void **object = c->freelist;
+
+		if (unlikely(!object)) {
+			/*
+			 * __slab_alloc() may enable interrupts to allocate
+			 * a new slab, we may come back on another cpu.
+			 */
+			p[i] = __slab_alloc(s, flags, -1, _RET_IP_, c);
+			if (unlikely(!p[i]))
+				break;
+			c = get_cpu_slab(s, smp_processor_id());
+			continue;
+		}
+		c->freelist = object[c->offset];
+		advance_tid(c);
+		p[i] = object;
+		stat(c, ALLOC_FASTPATH);
+	}
+	local_irq_restore(irqflags);
+
+	for (j = 0; j < i; j++) {
+		if (unlikely(flags & __GFP_ZERO))
+			memset(p[j], 0, s->objsize);
+		kmemcheck_slab_alloc(s, flags, p[j], s->objsize);
+		kmemleak_alloc_recursive(p[j], s->objsize, 1, s->flags, flags);
+		trace_kmem_cache_alloc(_RET_IP_, p[j], s->objsize, s->size,
+				       flags);
+	}
+	if (unlikely(i < size)) {
+		kmem_cache_free_bulk(s, i, p);
+		return 0;
+	}
+	return size;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
 /* Figure out on which slab page the object resides */
 static struct page *get_object_page(const void *x)
 {
@@ -2074,6 +2310,12 @@ static void init_kmem_cache_cpu(struct kmem_cache *s,
 {
 	c->page = NULL;
 	c->freelist = NULL;
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	c->tid = 0;
+	/* slub_debug may leave kmalloc objects only word aligned */
+	if (!IS_ALIGNED((unsigned long)c, 2 * sizeof(void *)))
+		s->flags &= ~__CMPXCHG_DOUBLE;
+#endif
 	c->node = 0;
 	c->offset = s->offset / sizeof(void *);
 	c->objsize = s->objsize;
@@ -2472,6 +2714,10 @@ static int kmem_cache_open(struct kmem_cache *s, gfp_t gfpflags,
 	s->objsize = size;
 	s->align = align;
 	s->flags = kmem_cache_flags(size, flags, name, ctor);
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	if (system_has_cmpxchg_double())
+		s->flags |= __CMPXCHG_DOUBLE;
+#endif
 
 	if (!calculate_sizes(s, -1))
 		goto error;
@@ -4396,6 +4642,7 @@ STAT_ATTR(DEACTIVATE_TO_HEAD, deactivate_to_head);
 STAT_ATTR(DEACTIVATE_TO_TAIL, deactivate_to_tail);
 STAT_ATTR(DEACTIVATE_REMOTE_FREES, deactivate_remote_frees);
 STAT_ATTR(ORDER_FALLBACK, order_fallback);
+STAT_ATTR(CMPXCHG_DOUBLE_CPU_FAIL, cmpxchg_double_cpu_fail);
 #endif
 
 static struct attribute *slab_attrs[] = {
@@ -4450,6 +4697,7 @@ static struct attribute *slab_attrs[] = {
 	&deactivate_to_tail_attr.attr,
 	&deactivate_remote_frees_attr.attr,
 	&order_fallback_attr.attr,
+	&cmpxchg_double_cpu_fail_attr.attr,
 #endif
 	NULL
 };
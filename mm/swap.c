@@ -48,13 +48,19 @@ static void __page_cache_release(struct page *page)
 	if (PageLRU(page)) {
 		unsigned long flags;
 		struct zone *zone = page_zone(page);
+		struct lru_shard *shard = page_lru_shard(page);
 
-		spin_lock_irqsave(&zone->lru_lock, flags);
+		spin_lock_irqsave(&shard->lock, flags);
 		VM_BUG_ON(!PageLRU(page));
 		__ClearPageLRU(page);
 		del_page_from_lru(zone, page);
-		spin_unlock_irqrestore(&zone->lru_lock, flags);
+		spin_unlock_irqrestore(&shard->lock, flags);
 	}
+}
+
+static void __put_single_page(struct page *page)
+{
+	__page_cache_release(page);
 	free_hot_page(page);
 }
 
@@ -64,6 +70,8 @@ static void put_compound_page(struct page *page)
 	if (put_page_testzero(page)) {
 		compound_page_dtor *dtor;
 
+		/* transparent huge pages live on the LRU */
+		__page_cache_release(page);
 		dtor = get_compound_page_dtor(page);
 		(*dtor)(page);
 	}
@@ -74,7 +82,7 @@ void put_page(struct page *page)
 	if (unlikely(PageCompound(page)))
 		put_compound_page(page);
 	else if (put_page_testzero(page))
-		__page_cache_release(page);
+		__put_single_page(page);
 }
 EXPORT_SYMBOL(put_page);
 
@@ -105,26 +113,26 @@ static void pagevec_move_tail(struct pagevec *pvec)
 {
 	int i;
 	int pgmoved = 0;
-	struct zone *zone = NULL;
+	struct lru_shard *shard = NULL;
 
 	for (i = 0; i < pagevec_count(pvec); i++) {
 		struct page *page = pvec->pages[i];
-		struct zone *pagezone = page_zone(page);
+		struct lru_shard *pageshard = page_lru_shard(page);
 
-		if (pagezone != zone) {
-			if (zone)
-				spin_unlock(&zone->lru_lock);
-			zone = pagezone;
-			spin_lock(&zone->lru_lock);
+		if (pageshard != shard) {
+			if (shard)
+				spin_unlock(&shard->lock);
+			shard = pageshard;
+			spin_lock(&shard->lock);
 		}
 		if (PageLRU(page) && !PageActive(page) && !PageUnevictable(page)) {
 			int lru = page_lru_base_type(page);
-			list_move_tail(&page->lru, &zone->lru[lru].list);
+			list_move_tail(&page->lru, &shard->list[lru]);
 			pgmoved++;
 		}
 	}
-	if (zone)
-		spin_unlock(&zone->lru_lock);
+	if (shard)
+		spin_unlock(&shard->lock);
 	__count_vm_events(PGROTATED, pgmoved);
 	release_pages(pvec->pages, pvec->nr, pvec->cold);
 	pagevec_reinit(pvec);
@@ -151,10 +159,10 @@ void  rotate_reclaimable_page(struct page *page)
 	}
 }
 
-static void update_page_reclaim_stat(struct zone *zone, struct page *page,
-				     int file, int rotated)
+static void update_page_reclaim_stat(struct lru_shard *shard,
+				     struct page *page, int file, int rotated)
 {
-	struct zone_reclaim_stat *reclaim_stat = &zone->reclaim_stat;
+	struct zone_reclaim_stat *reclaim_stat = &shard->reclaim_stat;
 	struct zone_reclaim_stat *memcg_reclaim_stat;
 
 	memcg_reclaim_stat = mem_cgroup_get_reclaim_stat_from_page(page);
@@ -177,8 +185,9 @@ static void update_page_reclaim_stat(struct zone *zone, struct page *page,
 void activate_page(struct page *page)
 {
 	struct zone *zone = page_zone(page);
+	struct lru_shard *shard = page_lru_shard(page);
 
-	spin_lock_irq(&zone->lru_lock);
+	spin_lock_irq(&shard->lock);
 	if (PageLRU(page) && !PageActive(page) && !PageUnevictable(page)) {
 		int file = page_is_file_cache(page);
 		int lru = page_lru_base_type(page);
@@ -189,9 +198,9 @@ void activate_page(struct page *page)
 		add_page_to_lru_list(zone, page, lru);
 		__count_vm_event(PGACTIVATE);
 
-		update_page_reclaim_stat(zone, page, file, 1);
+		update_page_reclaim_stat(shard, page, file, 1);
 	}
-	spin_unlock_irq(&zone->lru_lock);
+	spin_unlock_irq(&shard->lock);
 }
 
 /*
@@ -256,12 +265,13 @@ void lru_cache_add_lru(struct page *page, enum lru_list lru)
 void add_page_to_unevictable_list(struct page *page)
 {
 	struct zone *zone = page_zone(page);
+	struct lru_shard *shard = page_lru_shard(page);
 
-	spin_lock_irq(&zone->lru_lock);
+	spin_lock_irq(&shard->lock);
 	SetPageUnevictable(page);
 	SetPageLRU(page);
 	add_page_to_lru_list(zone, page, LRU_UNEVICTABLE);
-	spin_unlock_irq(&zone->lru_lock);
+	spin_unlock_irq(&shard->lock);
 }
 
 /*
@@ -316,8 +326,8 @@ int lru_add_drain_all(void)
  * passed pages.  If it fell to zero then remove the page from the LRU and
  * free it.
  *
- * Avoid taking zone->lru_lock if possible, but if it is taken, retain it
- * for the remainder of the operation.
+ * Avoid taking an LRU shard lock if possible, but if it is taken, retain it
+ * for as long as the following pages belong to the same shard.
  *
  * The locking in this function is against shrink_inactive_list(): we recheck
  * the page count inside the lock to see whether shrink_inactive_list()
@@ -328,7 +338,7 @@ void release_pages(struct page **pages, int nr, int cold)
 {
 	int i;
 	struct pagevec pages_to_free;
-	struct zone *zone = NULL;
+	struct lru_shard *shard = NULL;
 	unsigned long uninitialized_var(flags);
 
 	pagevec_init(&pages_to_free, cold);
@@ -336,9 +346,9 @@ void release_pages(struct page **pages, int nr, int cold)
 		struct page *page = pages[i];
 
 		if (unlikely(PageCompound(page))) {
-			if (zone) {
-				spin_unlock_irqrestore(&zone->lru_lock, flags);
-				zone = NULL;
+			if (shard) {
+				spin_unlock_irqrestore(&shard->lock, flags);
+				shard = NULL;
 			}
 			put_compound_page(page);
 			continue;
@@ -348,31 +358,31 @@ void release_pages(struct page **pages, int nr, int cold)
 			continue;
 
 		if (PageLRU(page)) {
-			struct zone *pagezone = page_zone(page);
+			struct lru_shard *pageshard = page_lru_shard(page);
 
-			if (pagezone != zone) {
-				if (zone)
-					spin_unlock_irqrestore(&zone->lru_lock,
+			if (pageshard != shard) {
+				if (shard)
+					spin_unlock_irqrestore(&shard->lock,
 									flags);
-				zone = pagezone;
-				spin_lock_irqsave(&zone->lru_lock, flags);
+				shard = pageshard;
+				spin_lock_irqsave(&shard->lock, flags);
 			}
 			VM_BUG_ON(!PageLRU(page));
 			__ClearPageLRU(page);
-			del_page_from_lru(zone, page);
+			del_page_from_lru(page_zone(page), page);
 		}
 
 		if (!pagevec_add(&pages_to_free, page)) {
-			if (zone) {
-				spin_unlock_irqrestore(&zone->lru_lock, flags);
-				zone = NULL;
+			if (shard) {
+				spin_unlock_irqrestore(&shard->lock, flags);
+				shard = NULL;
 			}
 			__pagevec_free(&pages_to_free);
 			pagevec_reinit(&pages_to_free);
   		}
 	}
-	if (zone)
-		spin_unlock_irqrestore(&zone->lru_lock, flags);
+	if (shard)
+		spin_unlock_irqrestore(&shard->lock, flags);
 
 	pagevec_free(&pages_to_free);
 }
@@ -403,21 +413,21 @@ EXPORT_SYMBOL(__pagevec_release);
 void ____pagevec_lru_add(struct pagevec *pvec, enum lru_list lru)
 {
 	int i;
-	struct zone *zone = NULL;
+	struct lru_shard *shard = NULL;
 
 	VM_BUG_ON(is_unevictable_lru(lru));
 
 	for (i = 0; i < pagevec_count(pvec); i++) {
 		struct page *page = pvec->pages[i];
-		struct zone *pagezone = page_zone(page);
+		struct lru_shard *pageshard = page_lru_shard(page);
 		int file;
 		int active;
 
-		if (pagezone != zone) {
-			if (zone)
-				spin_unlock_irq(&zone->lru_lock);
-			zone = pagezone;
-			spin_lock_irq(&zone->lru_lock);
+		if (pageshard != shard) {
+			if (shard)
+				spin_unlock_irq(&shard->lock);
+			shard = pageshard;
+			spin_lock_irq(&shard->lock);
 		}
 		VM_BUG_ON(PageActive(page));
 		VM_BUG_ON(PageUnevictable(page));
@@ -427,11 +437,11 @@ void ____pagevec_lru_add(struct pagevec *pvec, enum lru_list lru)
 		file = is_file_lru(lru);
 		if (active)
 			SetPageActive(page);
-		update_page_reclaim_stat(zone, page, file, active);
-		add_page_to_lru_list(zone, page, lru);
+		update_page_reclaim_stat(shard, page, file, active);
+		add_page_to_lru_list(page_zone(page), page, lru);
 	}
-	if (zone)
-		spin_unlock_irq(&zone->lru_lock);
+	if (shard)
+		spin_unlock_irq(&shard->lock);
 	release_pages(pvec->pages, pvec->nr, pvec->cold);
 	pagevec_reinit(pvec);
 }
@@ -190,6 +190,37 @@ void kzfree(const void *p)
 }
 EXPORT_SYMBOL(kzfree);
 
+#ifndef CONFIG_SLUB
+/*
+ * Only SLUB has batched versions of these, the other allocators simply
+ * take one object at a time.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *s, size_t size, void **p)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		kmem_cache_free(s, p[i]);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
+int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
+			  void **p)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		p[i] = kmem_cache_alloc(s, flags);
+		if (unlikely(!p[i])) {
+			kmem_cache_free_bulk(s, i, p);
+			return 0;
+		}
+	}
+	return size;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+#endif
+
 /*
  * strndup_user - duplicate an existing string from user space
  * @s: The string to duplicate
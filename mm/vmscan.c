@@ -40,6 +40,7 @@
 #include <linux/memcontrol.h>
 #include <linux/delayacct.h>
 #include <linux/sysctl.h>
+#include <linux/compaction.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -90,8 +91,8 @@ struct scan_control {
 	/* Pluggable isolate pages callback */
 	unsigned long (*isolate_pages)(unsigned long nr, struct list_head *dst,
 			unsigned long *scanned, int order, int mode,
-			struct zone *z, struct mem_cgroup *mem_cont,
-			int active, int file);
+			struct zone *z, struct lru_shard *shard,
+			struct mem_cgroup *mem_cont, int active, int file);
 };
 
 #define lru_to_page(_head) (list_entry((_head)->prev, struct page, lru))
@@ -148,6 +149,42 @@ static struct zone_reclaim_stat *get_reclaim_stat(struct zone *zone,
 	return &zone->reclaim_stat;
 }
 
+/*
+ * The recent_rotated and recent_scanned counts of the global LRU are kept
+ * in each shard, under the shard lock.  The memory controller does not
+ * split the zone LRU, so its counts are simply those of the one shard.
+ */
+static struct zone_reclaim_stat *get_shard_reclaim_stat(struct zone *zone,
+				struct lru_shard *shard, struct scan_control *sc)
+{
+	if (!scanning_global_lru(sc))
+		return mem_cgroup_get_reclaim_stat(sc->mem_cgroup, zone);
+
+	return &shard->reclaim_stat;
+}
+
+/*
+ * Reclaim takes its batches from the LRU shards of a zone in turn, so that
+ * the shards of a list age at the same rate.  Shards whose list is empty
+ * are skipped.
+ */
+static struct lru_shard *next_lru_shard(struct zone *zone, enum lru_list lru)
+{
+	unsigned int next;
+	unsigned int i;
+
+	next = (unsigned int)atomic_inc_return(&zone->lru_shard_next[lru]) - 1;
+	for (i = 0; i < NR_LRU_SHARDS; i++) {
+		struct lru_shard *shard;
+
+		shard = &zone->lru_shard[(next + i) % NR_LRU_SHARDS];
+		if (!list_empty(&shard->list[lru]))
+			break;
+	}
+
+	return &zone->lru_shard[(next + i) % NR_LRU_SHARDS];
+}
+
 static unsigned long zone_nr_lru_pages(struct zone *zone,
 				struct scan_control *sc, enum lru_list lru)
 {
@@ -515,7 +552,7 @@ int remove_mapping(struct address_space *mapping, struct page *page)
  * Add previously isolated @page to appropriate LRU list.
  * Page may still be unevictable for other reasons.
  *
- * lru_lock must not be held, interrupts must be enabled.
+ * The LRU lock must not be held, interrupts must be enabled.
  */
 void putback_lru_page(struct page *page)
 {
@@ -661,6 +698,10 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		if (PageAnon(page) && !PageSwapCache(page)) {
 			if (!(sc->gfp_mask & __GFP_IO))
 				goto keep_locked;
+			/* swap works on small pages: break up a huge one */
+			if (unlikely(PageTransHuge(page)))
+				if (unlikely(split_huge_page(page)))
+					goto activate_locked;
 			if (!add_to_swap(page))
 				goto activate_locked;
 			may_enter_fs = 1;
@@ -804,11 +845,6 @@ keep:
 	return nr_reclaimed;
 }
 
-/* LRU Isolation modes. */
-#define ISOLATE_INACTIVE 0	/* Isolate inactive pages. */
-#define ISOLATE_ACTIVE 1	/* Isolate active pages. */
-#define ISOLATE_BOTH 2		/* Isolate both active and inactive pages. */
-
 /*
  * Attempt to remove the specified page from its LRU.  Only take this page
  * if it is of the appropriate PageActive status.  Pages which are being
@@ -862,7 +898,7 @@ int __isolate_lru_page(struct page *page, int mode, int file)
 }
 
 /*
- * zone->lru_lock is heavily contended.  Some of the functions that
+ * The LRU locks are heavily contended.  Some of the functions that
  * shrink the lists perform better by taking out a batch of pages
  * and working on them outside the LRU lock.
  *
@@ -904,7 +940,7 @@ static unsigned long isolate_lru_pages(unsigned long nr_to_scan,
 		case 0:
 			list_move(&page->lru, dst);
 			mem_cgroup_del_lru(page);
-			nr_taken++;
+			nr_taken += hpage_nr_pages(page);
 			break;
 
 		case -EBUSY:
@@ -927,7 +963,9 @@ static unsigned long isolate_lru_pages(unsigned long nr_to_scan,
 		 * round the target page pfn down to the requested order
 		 * as the mem_map is guarenteed valid out to MAX_ORDER,
 		 * where that page is in a different zone we will detect
-		 * it from its zone id and abort this block scan.
+		 * it from its zone id and abort this block scan.  The
+		 * block never spans LRU shards, so the lock we hold covers
+		 * all of it.
 		 */
 		zone_id = page_zone_id(page);
 		page_pfn = page_to_pfn(page);
@@ -962,7 +1000,7 @@ static unsigned long isolate_lru_pages(unsigned long nr_to_scan,
 			if (__isolate_lru_page(cursor_page, mode, file) == 0) {
 				list_move(&cursor_page->lru, dst);
 				mem_cgroup_del_lru(cursor_page);
-				nr_taken++;
+				nr_taken += hpage_nr_pages(cursor_page);
 				scan++;
 			}
 		}
@@ -976,6 +1014,7 @@ static unsigned long isolate_pages_global(unsigned long nr,
 					struct list_head *dst,
 					unsigned long *scanned, int order,
 					int mode, struct zone *z,
+					struct lru_shard *shard,
 					struct mem_cgroup *mem_cont,
 					int active, int file)
 {
@@ -984,7 +1023,7 @@ static unsigned long isolate_pages_global(unsigned long nr,
 		lru += LRU_ACTIVE;
 	if (file)
 		lru += LRU_FILE;
-	return isolate_lru_pages(nr, &z->lru[lru].list, dst, scanned, order,
+	return isolate_lru_pages(nr, &shard->list[lru], dst, scanned, order,
 								mode, file);
 }
 
@@ -1000,13 +1039,15 @@ static unsigned long clear_active_flags(struct list_head *page_list,
 	struct page *page;
 
 	list_for_each_entry(page, page_list, lru) {
+		int numpages = hpage_nr_pages(page);
+
 		lru = page_lru_base_type(page);
 		if (PageActive(page)) {
 			lru += LRU_ACTIVE;
 			ClearPageActive(page);
-			nr_active++;
+			nr_active += numpages;
 		}
-		count[lru]++;
+		count[lru] += numpages;
 	}
 
 	return nr_active;
@@ -1034,7 +1075,7 @@ static unsigned long clear_active_flags(struct list_head *page_list,
  * (1) Must be called with an elevated refcount on the page. This is a
  *     fundamentnal difference from isolate_lru_pages (which is called
  *     without a stable reference).
- * (2) the lru_lock must not be held.
+ * (2) the LRU lock must not be held.
  * (3) interrupts must be enabled.
  */
 int isolate_lru_page(struct page *page)
@@ -1043,8 +1084,9 @@ int isolate_lru_page(struct page *page)
 
 	if (PageLRU(page)) {
 		struct zone *zone = page_zone(page);
+		struct lru_shard *shard = page_lru_shard(page);
 
-		spin_lock_irq(&zone->lru_lock);
+		spin_lock_irq(&shard->lock);
 		if (PageLRU(page) && get_page_unless_zero(page)) {
 			int lru = page_lru(page);
 			ret = 0;
@@ -1052,7 +1094,7 @@ int isolate_lru_page(struct page *page)
 
 			del_page_from_lru_list(zone, page, lru);
 		}
-		spin_unlock_irq(&zone->lru_lock);
+		spin_unlock_irq(&shard->lock);
 	}
 	return ret;
 }
@@ -1094,7 +1136,6 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 	struct pagevec pvec;
 	unsigned long nr_scanned = 0;
 	unsigned long nr_reclaimed = 0;
-	struct zone_reclaim_stat *reclaim_stat = get_reclaim_stat(zone, sc);
 	int lumpy_reclaim = 0;
 
 	while (unlikely(too_many_isolated(zone, file, sc))) {
@@ -1120,7 +1161,6 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 	pagevec_init(&pvec, 1);
 
 	lru_add_drain();
-	spin_lock_irq(&zone->lru_lock);
 	do {
 		struct page *page;
 		unsigned long nr_taken;
@@ -1131,13 +1171,19 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 		int mode = lumpy_reclaim ? ISOLATE_BOTH : ISOLATE_INACTIVE;
 		unsigned long nr_anon;
 		unsigned long nr_file;
+		struct lru_shard *shard;
+		struct zone_reclaim_stat *reclaim_stat;
 
+		shard = next_lru_shard(zone, LRU_BASE + file * LRU_FILE);
+		reclaim_stat = get_shard_reclaim_stat(zone, shard, sc);
+
+		spin_lock_irq(&shard->lock);
 		nr_taken = sc->isolate_pages(sc->swap_cluster_max,
 			     &page_list, &nr_scan, sc->order, mode,
-				zone, sc->mem_cgroup, 0, file);
+				zone, shard, sc->mem_cgroup, 0, file);
 
 		if (scanning_global_lru(sc)) {
-			zone->pages_scanned += nr_scan;
+			atomic_long_add(nr_scan, &zone->pages_scanned);
 			if (current_is_kswapd())
 				__count_zone_vm_events(PGSCAN_KSWAPD, zone,
 						       nr_scan);
@@ -1146,8 +1192,10 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 						       nr_scan);
 		}
 
-		if (nr_taken == 0)
-			goto done;
+		if (nr_taken == 0) {
+			spin_unlock_irq(&shard->lock);
+			break;
+		}
 
 		nr_active = clear_active_flags(&page_list, count);
 		__count_vm_events(PGDEACTIVATE, nr_active);
@@ -1171,7 +1219,7 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 		reclaim_stat->recent_scanned[1] += count[LRU_INACTIVE_FILE];
 		reclaim_stat->recent_scanned[1] += count[LRU_ACTIVE_FILE];
 
-		spin_unlock_irq(&zone->lru_lock);
+		spin_unlock_irq(&shard->lock);
 
 		nr_scanned += nr_scan;
 		nr_freed = shrink_page_list(&page_list, sc, PAGEOUT_IO_ASYNC);
@@ -1204,9 +1252,10 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 			__count_vm_events(KSWAPD_STEAL, nr_freed);
 		__count_zone_vm_events(PGSTEAL, zone, nr_freed);
 
-		spin_lock(&zone->lru_lock);
+		spin_lock(&shard->lock);
 		/*
-		 * Put back any unfreeable pages.
+		 * Put back any unfreeable pages.  They all come from the
+		 * shard we isolated them from.
 		 */
 		while (!list_empty(&page_list)) {
 			int lru;
@@ -1214,9 +1263,9 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 			VM_BUG_ON(PageLRU(page));
 			list_del(&page->lru);
 			if (unlikely(!page_evictable(page, NULL))) {
-				spin_unlock_irq(&zone->lru_lock);
+				spin_unlock_irq(&shard->lock);
 				putback_lru_page(page);
-				spin_lock_irq(&zone->lru_lock);
+				spin_lock_irq(&shard->lock);
 				continue;
 			}
 			SetPageLRU(page);
@@ -1224,21 +1273,21 @@ static unsigned long shrink_inactive_list(unsigned long max_scan,
 			add_page_to_lru_list(zone, page, lru);
 			if (is_active_lru(lru)) {
 				int file = is_file_lru(lru);
-				reclaim_stat->recent_rotated[file]++;
+				reclaim_stat->recent_rotated[file] +=
+					hpage_nr_pages(page);
 			}
 			if (!pagevec_add(&pvec, page)) {
-				spin_unlock_irq(&zone->lru_lock);
+				spin_unlock_irq(&shard->lock);
 				__pagevec_release(&pvec);
-				spin_lock_irq(&zone->lru_lock);
+				spin_lock_irq(&shard->lock);
 			}
 		}
 		__mod_zone_page_state(zone, NR_ISOLATED_ANON, -nr_anon);
 		__mod_zone_page_state(zone, NR_ISOLATED_FILE, -nr_file);
+		spin_unlock_irq(&shard->lock);
 
   	} while (nr_scanned < max_scan);
 
-done:
-	spin_unlock_irq(&zone->lru_lock);
 	pagevec_release(&pvec);
 	return nr_reclaimed;
 }
@@ -1264,9 +1313,9 @@ static inline void note_zone_scanning_priority(struct zone *zone, int priority)
  * processes, from rmap.
  *
  * If the pages are mostly unmapped, the processing is fast and it is
- * appropriate to hold zone->lru_lock across the whole operation.  But if
+ * appropriate to hold the LRU lock across the whole operation.  But if
  * the pages are mapped, the processing is slow (page_referenced()) so we
- * should drop zone->lru_lock around each page.  It's impossible to balance
+ * should drop the LRU lock around each page.  It's impossible to balance
  * this, so instead we remove the pages from the LRU while processing them.
  * It is safe to rely on PG_active against the non-LRU pages in here because
  * nobody will play with that bit on a non-LRU page.
@@ -1276,6 +1325,7 @@ static inline void note_zone_scanning_priority(struct zone *zone, int priority)
  */
 
 static void move_active_pages_to_lru(struct zone *zone,
+				     struct lru_shard *shard,
 				     struct list_head *list,
 				     enum lru_list lru)
 {
@@ -1291,16 +1341,16 @@ static void move_active_pages_to_lru(struct zone *zone,
 		VM_BUG_ON(PageLRU(page));
 		SetPageLRU(page);
 
-		list_move(&page->lru, &zone->lru[lru].list);
+		list_move(&page->lru, &shard->list[lru]);
 		mem_cgroup_add_lru_list(page, lru);
-		pgmoved++;
+		pgmoved += hpage_nr_pages(page);
 
 		if (!pagevec_add(&pvec, page) || list_empty(list)) {
-			spin_unlock_irq(&zone->lru_lock);
+			spin_unlock_irq(&shard->lock);
 			if (buffer_heads_over_limit)
 				pagevec_strip(&pvec);
 			__pagevec_release(&pvec);
-			spin_lock_irq(&zone->lru_lock);
+			spin_lock_irq(&shard->lock);
 		}
 	}
 	__mod_zone_page_state(zone, NR_LRU_BASE + lru, pgmoved);
@@ -1318,20 +1368,24 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	LIST_HEAD(l_active);
 	LIST_HEAD(l_inactive);
 	struct page *page;
-	struct zone_reclaim_stat *reclaim_stat = get_reclaim_stat(zone, sc);
+	struct lru_shard *shard;
+	struct zone_reclaim_stat *reclaim_stat;
 	unsigned long nr_rotated = 0;
 
+	shard = next_lru_shard(zone, LRU_ACTIVE + file * LRU_FILE);
+	reclaim_stat = get_shard_reclaim_stat(zone, shard, sc);
+
 	lru_add_drain();
-	spin_lock_irq(&zone->lru_lock);
+	spin_lock_irq(&shard->lock);
 	nr_taken = sc->isolate_pages(nr_pages, &l_hold, &pgscanned, sc->order,
-					ISOLATE_ACTIVE, zone,
+					ISOLATE_ACTIVE, zone, shard,
 					sc->mem_cgroup, 1, file);
 	/*
 	 * zone->pages_scanned is used for detect zone's oom
 	 * mem_cgroup remembers nr_scan by itself.
 	 */
 	if (scanning_global_lru(sc)) {
-		zone->pages_scanned += pgscanned;
+		atomic_long_add(pgscanned, &zone->pages_scanned);
 	}
 	reclaim_stat->recent_scanned[file] += nr_taken;
 
@@ -1341,7 +1395,7 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	else
 		__mod_zone_page_state(zone, NR_ACTIVE_ANON, -nr_taken);
 	__mod_zone_page_state(zone, NR_ISOLATED_ANON + file, nr_taken);
-	spin_unlock_irq(&zone->lru_lock);
+	spin_unlock_irq(&shard->lock);
 
 	while (!list_empty(&l_hold)) {
 		cond_resched();
@@ -1356,7 +1410,7 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 		/* page_referenced clears PageReferenced */
 		if (page_mapping_inuse(page) &&
 		    page_referenced(page, 0, sc->mem_cgroup, &vm_flags)) {
-			nr_rotated++;
+			nr_rotated += hpage_nr_pages(page);
 			/*
 			 * Identify referenced, file-backed active pages and
 			 * give them one more trip around the active list. So
@@ -1379,7 +1433,7 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	/*
 	 * Move pages back to the lru list.
 	 */
-	spin_lock_irq(&zone->lru_lock);
+	spin_lock_irq(&shard->lock);
 	/*
 	 * Count referenced pages from currently used mappings as rotated,
 	 * even though only some of them are actually re-activated.  This
@@ -1388,12 +1442,12 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	 */
 	reclaim_stat->recent_rotated[file] += nr_rotated;
 
-	move_active_pages_to_lru(zone, &l_active,
+	move_active_pages_to_lru(zone, shard, &l_active,
 						LRU_ACTIVE + file * LRU_FILE);
-	move_active_pages_to_lru(zone, &l_inactive,
+	move_active_pages_to_lru(zone, shard, &l_inactive,
 						LRU_BASE   + file * LRU_FILE);
 	__mod_zone_page_state(zone, NR_ISOLATED_ANON + file, -nr_taken);
-	spin_unlock_irq(&zone->lru_lock);
+	spin_unlock_irq(&shard->lock);
 }
 
 static int inactive_anon_is_low_global(struct zone *zone)
@@ -1502,7 +1556,9 @@ static void get_scan_ratio(struct zone *zone, struct scan_control *sc,
 	unsigned long anon, file, free;
 	unsigned long anon_prio, file_prio;
 	unsigned long ap, fp;
-	struct zone_reclaim_stat *reclaim_stat = get_reclaim_stat(zone, sc);
+	unsigned long recent_scanned[2] = { 0, 0 };
+	unsigned long recent_rotated[2] = { 0, 0 };
+	int i;
 
 	anon  = zone_nr_lru_pages(zone, sc, LRU_ACTIVE_ANON) +
 		zone_nr_lru_pages(zone, sc, LRU_INACTIVE_ANON);
@@ -1530,19 +1586,35 @@ static void get_scan_ratio(struct zone *zone, struct scan_control *sc,
 	 * up weighing recent references more than old ones.
 	 *
 	 * anon in [0], file in [1]
+	 *
+	 * Each LRU shard ages its own share of the statistics.
 	 */
-	if (unlikely(reclaim_stat->recent_scanned[0] > anon / 4)) {
-		spin_lock_irq(&zone->lru_lock);
-		reclaim_stat->recent_scanned[0] /= 2;
-		reclaim_stat->recent_rotated[0] /= 2;
-		spin_unlock_irq(&zone->lru_lock);
-	}
+	for (i = 0; i < NR_LRU_SHARDS; i++) {
+		struct lru_shard *shard = &zone->lru_shard[i];
+		struct zone_reclaim_stat *reclaim_stat;
+
+		reclaim_stat = get_shard_reclaim_stat(zone, shard, sc);
+
+		if (unlikely(reclaim_stat->recent_scanned[0] >
+			     anon / 4 / NR_LRU_SHARDS)) {
+			spin_lock_irq(&shard->lock);
+			reclaim_stat->recent_scanned[0] /= 2;
+			reclaim_stat->recent_rotated[0] /= 2;
+			spin_unlock_irq(&shard->lock);
+		}
+
+		if (unlikely(reclaim_stat->recent_scanned[1] >
+			     file / 4 / NR_LRU_SHARDS)) {
+			spin_lock_irq(&shard->lock);
+			reclaim_stat->recent_scanned[1] /= 2;
+			reclaim_stat->recent_rotated[1] /= 2;
+			spin_unlock_irq(&shard->lock);
+		}
 
-	if (unlikely(reclaim_stat->recent_scanned[1] > file / 4)) {
-		spin_lock_irq(&zone->lru_lock);
-		reclaim_stat->recent_scanned[1] /= 2;
-		reclaim_stat->recent_rotated[1] /= 2;
-		spin_unlock_irq(&zone->lru_lock);
+		recent_scanned[0] += reclaim_stat->recent_scanned[0];
+		recent_rotated[0] += reclaim_stat->recent_rotated[0];
+		recent_scanned[1] += reclaim_stat->recent_scanned[1];
+		recent_rotated[1] += reclaim_stat->recent_rotated[1];
 	}
 
 	/*
@@ -1557,11 +1629,11 @@ static void get_scan_ratio(struct zone *zone, struct scan_control *sc,
 	 * proportional to the fraction of recently scanned pages on
 	 * each list that were recently referenced and in active use.
 	 */
-	ap = (anon_prio + 1) * (reclaim_stat->recent_scanned[0] + 1);
-	ap /= reclaim_stat->recent_rotated[0] + 1;
+	ap = (anon_prio + 1) * (recent_scanned[0] + 1);
+	ap /= recent_rotated[0] + 1;
 
-	fp = (file_prio + 1) * (reclaim_stat->recent_scanned[1] + 1);
-	fp /= reclaim_stat->recent_rotated[1] + 1;
+	fp = (file_prio + 1) * (recent_scanned[1] + 1);
+	fp /= recent_rotated[1] + 1;
 
 	/* Normalize to percentages */
 	percent[0] = 100 * ap / (ap + fp + 1);
@@ -2061,7 +2133,8 @@ loop_again:
 			total_scanned += sc.nr_scanned;
 			if (zone_is_all_unreclaimable(zone))
 				continue;
-			if (nr_slab == 0 && zone->pages_scanned >=
+			if (nr_slab == 0 &&
+			    atomic_long_read(&zone->pages_scanned) >=
 					(zone_reclaimable_pages(zone) * 6))
 					zone_set_flag(zone,
 						      ZONE_ALL_UNRECLAIMABLE);
@@ -2121,9 +2194,17 @@ out:
 		 * are the most important. If watermarks are ok, kswapd will go
 		 * back to sleep. High-order users can still perform direct
 		 * reclaim if they wish.
+		 *
+		 * Before giving up on the order, compact the zones that
+		 * reclaim could not balance: free memory that is merely
+		 * fragmented can still be assembled into the high-order
+		 * blocks the waker asked for.
 		 */
-		if (sc.nr_reclaimed < SWAP_CLUSTER_MAX)
+		if (sc.nr_reclaimed < SWAP_CLUSTER_MAX) {
+			if (order)
+				compact_pgdat(pgdat, order);
 			order = sc.order = 0;
+		}
 
 		goto loop_again;
 	}
@@ -2707,11 +2788,13 @@ int page_evictable(struct page *page, struct vm_area_struct *vma)
  * Checks a page for evictability and moves the page to the appropriate
  * zone lru list.
  *
- * Restrictions: zone->lru_lock must be held, page must be on LRU and must
- * have PageUnevictable set.
+ * Restrictions: the page's LRU shard lock must be held, page must be on LRU
+ * and must have PageUnevictable set.
  */
 static void check_move_unevictable_page(struct page *page, struct zone *zone)
 {
+	struct lru_shard *shard = page_lru_shard(page);
+
 	VM_BUG_ON(PageActive(page));
 
 retry:
@@ -2720,7 +2803,7 @@ retry:
 		enum lru_list l = page_lru_base_type(page);
 
 		__dec_zone_state(zone, NR_UNEVICTABLE);
-		list_move(&page->lru, &zone->lru[l].list);
+		list_move(&page->lru, &shard->list[l]);
 		mem_cgroup_move_lists(page, LRU_UNEVICTABLE, l);
 		__inc_zone_state(zone, NR_INACTIVE_ANON + l);
 		__count_vm_event(UNEVICTABLE_PGRESCUED);
@@ -2729,7 +2812,7 @@ retry:
 		 * rotate unevictable list
 		 */
 		SetPageUnevictable(page);
-		list_move(&page->lru, &zone->lru[LRU_UNEVICTABLE].list);
+		list_move(&page->lru, &shard->list[LRU_UNEVICTABLE]);
 		mem_cgroup_rotate_lru_list(page, LRU_UNEVICTABLE);
 		if (page_evictable(page, NULL))
 			goto retry;
@@ -2748,7 +2831,7 @@ void scan_mapping_unevictable_pages(struct address_space *mapping)
 	pgoff_t next = 0;
 	pgoff_t end   = (i_size_read(mapping->host) + PAGE_CACHE_SIZE - 1) >>
 			 PAGE_CACHE_SHIFT;
-	struct zone *zone;
+	struct lru_shard *shard;
 	struct pagevec pvec;
 
 	if (mapping->nrpages == 0)
@@ -2760,30 +2843,31 @@ void scan_mapping_unevictable_pages(struct address_space *mapping)
 		int i;
 		int pg_scanned = 0;
 
-		zone = NULL;
+		shard = NULL;
 
 		for (i = 0; i < pagevec_count(&pvec); i++) {
 			struct page *page = pvec.pages[i];
 			pgoff_t page_index = page->index;
-			struct zone *pagezone = page_zone(page);
+			struct lru_shard *pageshard = page_lru_shard(page);
 
 			pg_scanned++;
 			if (page_index > next)
 				next = page_index;
 			next++;
 
-			if (pagezone != zone) {
-				if (zone)
-					spin_unlock_irq(&zone->lru_lock);
-				zone = pagezone;
-				spin_lock_irq(&zone->lru_lock);
+			if (pageshard != shard) {
+				if (shard)
+					spin_unlock_irq(&shard->lock);
+				shard = pageshard;
+				spin_lock_irq(&shard->lock);
 			}
 
 			if (PageLRU(page) && PageUnevictable(page))
-				check_move_unevictable_page(page, zone);
+				check_move_unevictable_page(page,
+							    page_zone(page));
 		}
-		if (zone)
-			spin_unlock_irq(&zone->lru_lock);
+		if (shard)
+			spin_unlock_irq(&shard->lock);
 		pagevec_release(&pvec);
 
 		count_vm_events(UNEVICTABLE_PGSCANNED, pg_scanned);
@@ -2791,20 +2875,11 @@ void scan_mapping_unevictable_pages(struct address_space *mapping)
 
 }
 
-/**
- * scan_zone_unevictable_pages - check unevictable list for evictable pages
- * @zone - zone of which to scan the unevictable list
- *
- * Scan @zone's unevictable LRU lists to check for pages that have become
- * evictable.  Move those that have to @zone's inactive list where they
- * become candidates for reclaim, unless shrink_inactive_zone() decides
- * to reactivate them.  Pages that are still unevictable are rotated
- * back onto @zone's unevictable list.
- */
 #define SCAN_UNEVICTABLE_BATCH_SIZE 16UL /* arbitrary lock hold batch size */
-static void scan_zone_unevictable_pages(struct zone *zone)
+static void scan_shard_unevictable_pages(struct zone *zone,
+					 struct lru_shard *shard)
 {
-	struct list_head *l_unevictable = &zone->lru[LRU_UNEVICTABLE].list;
+	struct list_head *l_unevictable = &shard->list[LRU_UNEVICTABLE];
 	unsigned long scan;
 	unsigned long nr_to_scan = zone_page_state(zone, NR_UNEVICTABLE);
 
@@ -2812,9 +2887,15 @@ static void scan_zone_unevictable_pages(struct zone *zone)
 		unsigned long batch_size = min(nr_to_scan,
 						SCAN_UNEVICTABLE_BATCH_SIZE);
 
-		spin_lock_irq(&zone->lru_lock);
+		spin_lock_irq(&shard->lock);
 		for (scan = 0;  scan < batch_size; scan++) {
-			struct page *page = lru_to_page(l_unevictable);
+			struct page *page;
+
+			if (list_empty(l_unevictable)) {
+				spin_unlock_irq(&shard->lock);
+				return;
+			}
+			page = lru_to_page(l_unevictable);
 
 			if (!trylock_page(page))
 				continue;
@@ -2826,12 +2907,34 @@ static void scan_zone_unevictable_pages(struct zone *zone)
 
 			unlock_page(page);
 		}
-		spin_unlock_irq(&zone->lru_lock);
+		spin_unlock_irq(&shard->lock);
 
 		nr_to_scan -= batch_size;
 	}
 }
 
+/**
+ * scan_zone_unevictable_pages - check unevictable list for evictable pages
+ * @zone - zone of which to scan the unevictable list
+ *
+ * Scan @zone's unevictable LRU lists to check for pages that have become
+ * evictable.  Move those that have to @zone's inactive list where they
+ * become candidates for reclaim, unless shrink_inactive_zone() decides
+ * to reactivate them.  Pages that are still unevictable are rotated
+ * back onto @zone's unevictable list.
+ *
+ * The number of unevictable pages is only known for the whole zone, so
+ * each LRU shard is scanned until its list is empty or as many pages as
+ * the zone holds have been looked at.
+ */
+static void scan_zone_unevictable_pages(struct zone *zone)
+{
+	int i;
+
+	for (i = 0; i < NR_LRU_SHARDS; i++)
+		scan_shard_unevictable_pages(zone, &zone->lru_shard[i]);
+}
+
 
 /**
  * scan_all_zones_unevictable_pages - scan all unevictable lists for evictable pages
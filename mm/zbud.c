@@ -0,0 +1,336 @@
+/*
+ * zbud: a pool allocator for compressed pages
+ *
+ *  Every pool page ("zbud page") holds at most two objects ("buddies"),
+ *  one aligned to the start of the page right after a small header and
+ *  one aligned to its end.  Pages are sized in chunks of PAGE_SIZE/64 and
+ *  kept on lists by the number of free chunks, so that an allocation is
+ *  paired with the best fitting half-full page.  A pool LRU lets the user
+ *  evict whole pages through the evict callback when the pool has grown
+ *  too large.
+ *
+ *  Objects never straddle pages and pages never come from highmem, so a
+ *  handle is simply the address of the object.
+ */
+
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/zbud.h>
+
+#define NCHUNKS_ORDER	6
+
+#define CHUNK_SHIFT	(PAGE_SHIFT - NCHUNKS_ORDER)
+#define CHUNK_SIZE	(1 << CHUNK_SHIFT)
+#define NCHUNKS		(PAGE_SIZE >> CHUNK_SHIFT)
+#define ZHDR_SIZE_ALIGNED CHUNK_SIZE
+
+struct zbud_pool {
+	spinlock_t lock;
+	/* pages with one buddy, indexed by their number of free chunks */
+	struct list_head unbuddied[NCHUNKS];
+	/* pages with both buddies allocated */
+	struct list_head buddied;
+	struct list_head lru;
+	u64 pages_nr;
+	struct zbud_ops *ops;
+};
+
+/* Lives in the first chunk of every zbud page */
+struct zbud_header {
+	struct list_head buddy;
+	struct list_head lru;
+	unsigned int first_chunks;
+	unsigned int last_chunks;
+	bool under_reclaim;
+};
+
+enum buddy {
+	FIRST,
+	LAST
+};
+
+static int size_to_chunks(int size)
+{
+	return (size + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+}
+
+#define for_each_unbuddied_list(_iter, _begin) \
+	for ((_iter) = (_begin); (_iter) < NCHUNKS; (_iter)++)
+
+static struct zbud_header *init_zbud_page(struct page *page)
+{
+	struct zbud_header *zhdr = page_address(page);
+
+	zhdr->first_chunks = 0;
+	zhdr->last_chunks = 0;
+	INIT_LIST_HEAD(&zhdr->buddy);
+	INIT_LIST_HEAD(&zhdr->lru);
+	zhdr->under_reclaim = 0;
+	return zhdr;
+}
+
+static void free_zbud_page(struct zbud_header *zhdr)
+{
+	__free_page(virt_to_page(zhdr));
+}
+
+static unsigned long encode_handle(struct zbud_header *zhdr, enum buddy bud)
+{
+	unsigned long handle = (unsigned long)zhdr;
+
+	if (bud == FIRST)
+		handle += ZHDR_SIZE_ALIGNED;
+	else
+		handle += PAGE_SIZE - (zhdr->last_chunks << CHUNK_SHIFT);
+	return handle;
+}
+
+static struct zbud_header *handle_to_zbud_header(unsigned long handle)
+{
+	return (struct zbud_header *)(handle & PAGE_MASK);
+}
+
+/* The header takes up one chunk */
+static int num_free_chunks(struct zbud_header *zhdr)
+{
+	return NCHUNKS - zhdr->first_chunks - zhdr->last_chunks - 1;
+}
+
+/* Put a page that is not under reclaim back on the right buddy list */
+static void zbud_list_add(struct zbud_pool *pool, struct zbud_header *zhdr)
+{
+	if (zhdr->first_chunks == 0 || zhdr->last_chunks == 0)
+		list_add(&zhdr->buddy, &pool->unbuddied[num_free_chunks(zhdr)]);
+	else
+		list_add(&zhdr->buddy, &pool->buddied);
+}
+
+struct zbud_pool *zbud_create_pool(gfp_t gfp, struct zbud_ops *ops)
+{
+	struct zbud_pool *pool;
+	int i;
+
+	pool = kmalloc(sizeof(struct zbud_pool), gfp);
+	if (!pool)
+		return NULL;
+	spin_lock_init(&pool->lock);
+	for (i = 0; i < NCHUNKS; i++)
+		INIT_LIST_HEAD(&pool->unbuddied[i]);
+	INIT_LIST_HEAD(&pool->buddied);
+	INIT_LIST_HEAD(&pool->lru);
+	pool->pages_nr = 0;
+	pool->ops = ops;
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zbud_create_pool);
+
+void zbud_destroy_pool(struct zbud_pool *pool)
+{
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zbud_destroy_pool);
+
+/**
+ * zbud_alloc - allocate a region of a zbud page
+ * @pool:	pool to allocate from
+ * @size:	size of the region in bytes
+ * @gfp:	flags for a new pool page, must not contain __GFP_HIGHMEM
+ * @handle:	filled with the handle of the region on success
+ *
+ * Returns 0 on success, -ENOSPC if @size does not fit in half a zbud
+ * page, -ENOMEM if no new pool page could be allocated.
+ */
+int zbud_alloc(struct zbud_pool *pool, unsigned int size, gfp_t gfp,
+	       unsigned long *handle)
+{
+	int chunks, i;
+	struct zbud_header *zhdr = NULL;
+	enum buddy bud;
+	struct page *page;
+
+	if (!size || (gfp & __GFP_HIGHMEM))
+		return -EINVAL;
+	if (size > PAGE_SIZE - ZHDR_SIZE_ALIGNED - CHUNK_SIZE)
+		return -ENOSPC;
+	chunks = size_to_chunks(size);
+	spin_lock(&pool->lock);
+
+	/* First, try to find an unbuddied zbud page. */
+	for_each_unbuddied_list(i, chunks) {
+		if (!list_empty(&pool->unbuddied[i])) {
+			zhdr = list_first_entry(&pool->unbuddied[i],
+					struct zbud_header, buddy);
+			list_del(&zhdr->buddy);
+			if (zhdr->first_chunks == 0)
+				bud = FIRST;
+			else
+				bud = LAST;
+			goto found;
+		}
+	}
+
+	/* Couldn't find unbuddied zbud page, create new one */
+	spin_unlock(&pool->lock);
+	page = alloc_page(gfp);
+	if (!page)
+		return -ENOMEM;
+	spin_lock(&pool->lock);
+	pool->pages_nr++;
+	zhdr = init_zbud_page(page);
+	bud = FIRST;
+
+found:
+	if (bud == FIRST)
+		zhdr->first_chunks = chunks;
+	else
+		zhdr->last_chunks = chunks;
+	zbud_list_add(pool, zhdr);
+
+	/* Add/move zbud page to beginning of LRU */
+	if (!list_empty(&zhdr->lru))
+		list_del(&zhdr->lru);
+	list_add(&zhdr->lru, &pool->lru);
+
+	*handle = encode_handle(zhdr, bud);
+	spin_unlock(&pool->lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(zbud_alloc);
+
+/**
+ * zbud_free - free a region returned by zbud_alloc()
+ * @pool:	pool the region was allocated from
+ * @handle:	handle of the region
+ *
+ * A page that is being reclaimed is left to zbud_reclaim_page(), which
+ * frees it once both buddies are gone.
+ */
+void zbud_free(struct zbud_pool *pool, unsigned long handle)
+{
+	struct zbud_header *zhdr;
+
+	spin_lock(&pool->lock);
+	zhdr = handle_to_zbud_header(handle);
+
+	/* If first buddy, handle will be page aligned past the header */
+	if ((handle - ZHDR_SIZE_ALIGNED) & ~PAGE_MASK)
+		zhdr->last_chunks = 0;
+	else
+		zhdr->first_chunks = 0;
+
+	if (zhdr->under_reclaim) {
+		spin_unlock(&pool->lock);
+		return;
+	}
+
+	list_del(&zhdr->buddy);
+
+	if (zhdr->first_chunks == 0 && zhdr->last_chunks == 0) {
+		list_del(&zhdr->lru);
+		free_zbud_page(zhdr);
+		pool->pages_nr--;
+	} else
+		zbud_list_add(pool, zhdr);
+
+	spin_unlock(&pool->lock);
+}
+EXPORT_SYMBOL_GPL(zbud_free);
+
+/**
+ * zbud_reclaim_page - evict the least recently used zbud page
+ * @pool:	pool to shrink
+ * @retries:	number of pages to try before giving up
+ *
+ * The evict callback is called for each buddy of the page, without the
+ * pool lock held.  It must write the object back and free its handle
+ * with zbud_free(), or return an error if it cannot.  A page whose
+ * buddies could not all be evicted goes back to the head of the LRU.
+ *
+ * Returns 0 once a page has been freed, -EAGAIN if none could be freed
+ * in @retries attempts.
+ */
+int zbud_reclaim_page(struct zbud_pool *pool, unsigned int retries)
+{
+	int i, ret;
+	struct zbud_header *zhdr;
+	unsigned long first_handle, last_handle;
+
+	spin_lock(&pool->lock);
+	if (!pool->ops || !pool->ops->evict || list_empty(&pool->lru) ||
+	    retries == 0) {
+		spin_unlock(&pool->lock);
+		return -EINVAL;
+	}
+	for (i = 0; i < retries; i++) {
+		zhdr = list_entry(pool->lru.prev, struct zbud_header, lru);
+		list_del(&zhdr->lru);
+		list_del(&zhdr->buddy);
+		/* Protect zbud page against free */
+		zhdr->under_reclaim = true;
+		/*
+		 * We need encode the handles before unlocking, since we can
+		 * race with free that will set (first|last)_chunks to 0
+		 */
+		first_handle = 0;
+		last_handle = 0;
+		if (zhdr->first_chunks)
+			first_handle = encode_handle(zhdr, FIRST);
+		if (zhdr->last_chunks)
+			last_handle = encode_handle(zhdr, LAST);
+		spin_unlock(&pool->lock);
+
+		/* Issue the eviction callback(s) */
+		if (first_handle) {
+			ret = pool->ops->evict(pool, first_handle);
+			if (ret)
+				goto next;
+		}
+		if (last_handle) {
+			ret = pool->ops->evict(pool, last_handle);
+			if (ret)
+				goto next;
+		}
+next:
+		spin_lock(&pool->lock);
+		zhdr->under_reclaim = false;
+		if (zhdr->first_chunks == 0 && zhdr->last_chunks == 0) {
+			/*
+			 * Both buddies are now free, free the zbud page and
+			 * return success.
+			 */
+			free_zbud_page(zhdr);
+			pool->pages_nr--;
+			spin_unlock(&pool->lock);
+			return 0;
+		}
+		zbud_list_add(pool, zhdr);
+
+		/* add to beginning of LRU */
+		list_add(&zhdr->lru, &pool->lru);
+	}
+	spin_unlock(&pool->lock);
+	return -EAGAIN;
+}
+EXPORT_SYMBOL_GPL(zbud_reclaim_page);
+
+void *zbud_map(struct zbud_pool *pool, unsigned long handle)
+{
+	return (void *)(handle);
+}
+EXPORT_SYMBOL_GPL(zbud_map);
+
+void zbud_unmap(struct zbud_pool *pool, unsigned long handle)
+{
+}
+EXPORT_SYMBOL_GPL(zbud_unmap);
+
+/* Returns the size of the pool in pages */
+u64 zbud_get_pool_size(struct zbud_pool *pool)
+{
+	return pool->pages_nr;
+}
+EXPORT_SYMBOL_GPL(zbud_get_pool_size);
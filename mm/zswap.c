@@ -0,0 +1,594 @@
+/*
+ * zswap: compressed cache for swap pages
+ *
+ *  Pages on their way out to a swap device are compressed with LZO and
+ *  kept in a zbud pool instead, so that swapping them back in is a
+ *  decompression rather than a disk read.  The pool is capped at a
+ *  percentage of RAM; when it is full, the least recently stored pool
+ *  pages are decompressed into the swap cache and written to the real
+ *  swap device to make room.  Pages that do not compress well, or that
+ *  arrive while the pool cannot be shrunk, go straight to disk.
+ *
+ *  The compressed copy of a swap slot is looked up by its swap type and
+ *  offset in a per swap device rbtree.  It goes away when the slot is
+ *  freed.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/swap.h>
+#include <linux/swapops.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/percpu.h>
+#include <linux/lzo.h>
+#include <linux/zbud.h>
+#include <linux/zswap.h>
+#include <linux/debugfs.h>
+
+/*
+ * statistics, not serialized: they only need to be approximately right
+ */
+/* Number of compressed pages stored in zswap */
+static atomic_t zswap_stored_pages = ATOMIC_INIT(0);
+/* Pool limit was hit (see zswap_max_pool_percent) */
+static u64 zswap_pool_limit_hit;
+/* Pages written back when pool limit was reached */
+static u64 zswap_written_back_pages;
+/* Store failed due to a reclaim failure after pool limit was reached */
+static u64 zswap_reject_reclaim_fail;
+/* Compressed page was too big for the allocator to (optimally) store */
+static u64 zswap_reject_compress_poor;
+/* Store failed because the zbud or entry allocation failed */
+static u64 zswap_reject_alloc_fail;
+/* Store replaced the entry of a swap slot that was already stored */
+static u64 zswap_duplicate_entry;
+
+/*
+ * tunables: zswap.enabled=1 and zswap.max_pool_percent=N on the kernel
+ * command line, or under /sys/module/zswap/parameters at run time
+ */
+static int zswap_enabled;
+module_param_named(enabled, zswap_enabled, bool, 0644);
+
+/* The maximum percentage of memory that the compressed pool can occupy */
+static unsigned int zswap_max_pool_percent = 20;
+module_param_named(max_pool_percent, zswap_max_pool_percent, uint, 0644);
+
+static struct zbud_pool *zswap_pool;
+
+/*
+ * per-cpu compression buffers: a destination twice the size of a page,
+ * since LZO may expand incompressible input, and the LZO work memory
+ */
+static DEFINE_PER_CPU(unsigned char *, zswap_dstmem);
+static DEFINE_PER_CPU(void *, zswap_wrkmem);
+
+/*
+ * struct zswap_entry - the compressed copy of one swap slot
+ *
+ * @rbnode:	links the entry into the rbtree of its swap device
+ * @offset:	swap offset of the slot
+ * @refcount:	one reference for the tree, one for each user that looked
+ *		the entry up and dropped the tree lock; protected by the
+ *		tree lock.  The entry and its zbud region are freed when it
+ *		drops to zero.
+ * @length:	length of the compressed data
+ * @handle:	zbud handle of the data, preceded by a struct zswap_header
+ */
+struct zswap_entry {
+	struct rb_node rbnode;
+	pgoff_t offset;
+	int refcount;
+	unsigned int length;
+	unsigned long handle;
+};
+
+/* Stored in front of the data so that writeback can find the entry */
+struct zswap_header {
+	swp_entry_t swpentry;
+};
+
+struct zswap_tree {
+	struct rb_root rbroot;
+	spinlock_t lock;
+};
+
+static struct zswap_tree *zswap_trees[MAX_SWAPFILES];
+
+static struct kmem_cache *zswap_entry_cache;
+
+static struct zswap_entry *zswap_entry_cache_alloc(gfp_t gfp)
+{
+	struct zswap_entry *entry;
+
+	entry = kmem_cache_alloc(zswap_entry_cache, gfp);
+	if (!entry)
+		return NULL;
+	entry->refcount = 1;
+	RB_CLEAR_NODE(&entry->rbnode);
+	return entry;
+}
+
+static struct zswap_entry *zswap_rb_search(struct rb_root *root,
+					   pgoff_t offset)
+{
+	struct rb_node *node = root->rb_node;
+	struct zswap_entry *entry;
+
+	while (node) {
+		entry = rb_entry(node, struct zswap_entry, rbnode);
+		if (entry->offset > offset)
+			node = node->rb_left;
+		else if (entry->offset < offset)
+			node = node->rb_right;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * In the case that an entry with the same offset is found, a pointer to
+ * the existing entry is stored in dupentry and the function returns
+ * -EEXIST.
+ */
+static int zswap_rb_insert(struct rb_root *root, struct zswap_entry *entry,
+			   struct zswap_entry **dupentry)
+{
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+	struct zswap_entry *myentry;
+
+	while (*link) {
+		parent = *link;
+		myentry = rb_entry(parent, struct zswap_entry, rbnode);
+		if (myentry->offset > entry->offset)
+			link = &(*link)->rb_left;
+		else if (myentry->offset < entry->offset)
+			link = &(*link)->rb_right;
+		else {
+			*dupentry = myentry;
+			return -EEXIST;
+		}
+	}
+	rb_link_node(&entry->rbnode, parent, link);
+	rb_insert_color(&entry->rbnode, root);
+	return 0;
+}
+
+static void zswap_rb_erase(struct rb_root *root, struct zswap_entry *entry)
+{
+	if (!RB_EMPTY_NODE(&entry->rbnode)) {
+		rb_erase(&entry->rbnode, root);
+		RB_CLEAR_NODE(&entry->rbnode);
+	}
+}
+
+/* caller must hold the tree lock */
+static void zswap_entry_get(struct zswap_entry *entry)
+{
+	entry->refcount++;
+}
+
+/*
+ * caller must hold the tree lock; the entry must already be off the tree
+ * when the last reference goes
+ */
+static void zswap_entry_put(struct zswap_entry *entry)
+{
+	int refcount = --entry->refcount;
+
+	BUG_ON(refcount < 0);
+	if (refcount == 0) {
+		BUG_ON(!RB_EMPTY_NODE(&entry->rbnode));
+		zbud_free(zswap_pool, entry->handle);
+		kmem_cache_free(zswap_entry_cache, entry);
+		atomic_dec(&zswap_stored_pages);
+	}
+}
+
+static bool zswap_is_full(void)
+{
+	return totalram_pages * zswap_max_pool_percent / 100 <
+		zbud_get_pool_size(zswap_pool);
+}
+
+static void zswap_decompress(struct zswap_entry *entry, struct page *page)
+{
+	unsigned char *src, *dst;
+	size_t dlen = PAGE_SIZE;
+	int ret;
+
+	src = (unsigned char *)zbud_map(zswap_pool, entry->handle) +
+		sizeof(struct zswap_header);
+	dst = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_decompress_safe(src, entry->length, dst, &dlen);
+	kunmap_atomic(dst, KM_USER0);
+	zbud_unmap(zswap_pool, entry->handle);
+	BUG_ON(ret != LZO_E_OK || dlen != PAGE_SIZE);
+}
+
+/*
+ * Evict callback of the zbud pool: write the page stored at handle back
+ * to its swap slot, through a newly allocated swap cache page.
+ */
+static int zswap_writeback_entry(struct zbud_pool *pool, unsigned long handle)
+{
+	struct zswap_header *zhdr;
+	swp_entry_t swpentry;
+	struct zswap_tree *tree;
+	struct zswap_entry *entry;
+	struct page *page;
+	bool page_was_allocated;
+	pgoff_t offset;
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+	};
+
+	zhdr = zbud_map(pool, handle);
+	swpentry = zhdr->swpentry;
+	zbud_unmap(pool, handle);
+	tree = zswap_trees[swp_type(swpentry)];
+	offset = swp_offset(swpentry);
+
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, offset);
+	if (!entry) {
+		/* the slot was freed since, and the handle with it */
+		spin_unlock(&tree->lock);
+		return 0;
+	}
+	zswap_entry_get(entry);
+	spin_unlock(&tree->lock);
+
+	page = __read_swap_cache_async(swpentry, GFP_NOIO, NULL, 0,
+				       &page_was_allocated);
+	if (!page || !page_was_allocated) {
+		/*
+		 * Out of memory, or the slot is being freed or swapped in
+		 * right now: leave it alone.
+		 */
+		if (page)
+			page_cache_release(page);
+		spin_lock(&tree->lock);
+		zswap_entry_put(entry);
+		spin_unlock(&tree->lock);
+		return -EEXIST;
+	}
+
+	/* the slot may have been freed, or rewritten, while we allocated */
+	spin_lock(&tree->lock);
+	if (entry != zswap_rb_search(&tree->rbroot, offset)) {
+		zswap_entry_put(entry);
+		spin_unlock(&tree->lock);
+		delete_from_swap_cache(page);
+		unlock_page(page);
+		page_cache_release(page);
+		return 0;
+	}
+	spin_unlock(&tree->lock);
+
+	zswap_decompress(entry, page);
+	SetPageUptodate(page);
+
+	/* move it to the tail of the inactive list after end_writeback */
+	SetPageReclaim(page);
+	__swap_writepage(page, &wbc, end_swap_bio_write);
+	page_cache_release(page);
+	zswap_written_back_pages++;
+
+	spin_lock(&tree->lock);
+	/* drop the tree's reference, unless the slot was freed meanwhile */
+	if (entry == zswap_rb_search(&tree->rbroot, offset)) {
+		zswap_rb_erase(&tree->rbroot, entry);
+		zswap_entry_put(entry);
+	}
+	zswap_entry_put(entry);
+	spin_unlock(&tree->lock);
+
+	return 0;
+}
+
+static struct zbud_ops zswap_zbud_ops = {
+	.evict = zswap_writeback_entry
+};
+
+/**
+ * zswap_store - compress a page on its way to swap
+ * @page:	locked swap cache page
+ *
+ * Returns 0 if the page is now stored in zswap and does not need to be
+ * written to the swap device, a negative error otherwise.  On error any
+ * copy stored earlier for the same slot is dropped, since the page goes
+ * to the swap device instead and the copy is stale.
+ */
+int zswap_store(struct page *page)
+{
+	swp_entry_t swpentry = { .val = page_private(page), };
+	struct zswap_tree *tree = zswap_trees[swp_type(swpentry)];
+	struct zswap_entry *entry, *dupentry;
+	struct zswap_header *zhdr;
+	unsigned char *src, *dst;
+	unsigned long handle;
+	size_t dlen;
+	int ret;
+
+	if (!tree)
+		return -ENODEV;
+
+	if (!zswap_enabled) {
+		ret = -ENODEV;
+		goto reject;
+	}
+
+	/* reclaim space if needed */
+	if (zswap_is_full()) {
+		zswap_pool_limit_hit++;
+		if (zbud_reclaim_page(zswap_pool, 8)) {
+			zswap_reject_reclaim_fail++;
+			ret = -ENOMEM;
+			goto reject;
+		}
+	}
+
+	entry = zswap_entry_cache_alloc(GFP_NOIO);
+	if (!entry) {
+		zswap_reject_alloc_fail++;
+		ret = -ENOMEM;
+		goto reject;
+	}
+
+	dst = get_cpu_var(zswap_dstmem);
+	src = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_1_compress(src, PAGE_SIZE, dst, &dlen,
+			       __get_cpu_var(zswap_wrkmem));
+	kunmap_atomic(src, KM_USER0);
+	if (ret != LZO_E_OK) {
+		ret = -EINVAL;
+		goto put_dstmem;
+	}
+
+	ret = zbud_alloc(zswap_pool, dlen + sizeof(struct zswap_header),
+			 __GFP_NORETRY | __GFP_NOWARN, &handle);
+	if (ret == -ENOSPC) {
+		zswap_reject_compress_poor++;
+		goto put_dstmem;
+	}
+	if (ret) {
+		zswap_reject_alloc_fail++;
+		goto put_dstmem;
+	}
+	zhdr = zbud_map(zswap_pool, handle);
+	zhdr->swpentry = swpentry;
+	memcpy(zhdr + 1, dst, dlen);
+	zbud_unmap(zswap_pool, handle);
+	put_cpu_var(zswap_dstmem);
+
+	entry->offset = swp_offset(swpentry);
+	entry->handle = handle;
+	entry->length = dlen;
+
+	spin_lock(&tree->lock);
+	while (zswap_rb_insert(&tree->rbroot, entry, &dupentry) == -EEXIST) {
+		/* the slot is being rewritten: the old copy is stale */
+		zswap_duplicate_entry++;
+		zswap_rb_erase(&tree->rbroot, dupentry);
+		zswap_entry_put(dupentry);
+	}
+	spin_unlock(&tree->lock);
+	atomic_inc(&zswap_stored_pages);
+
+	return 0;
+
+put_dstmem:
+	put_cpu_var(zswap_dstmem);
+	kmem_cache_free(zswap_entry_cache, entry);
+reject:
+	zswap_invalidate_page(swp_type(swpentry), swp_offset(swpentry));
+	return ret;
+}
+
+/**
+ * zswap_load - fill a page from its compressed copy
+ * @page:	locked swap cache page that is not yet uptodate
+ *
+ * Returns 0 if the page was filled, -ENOENT if zswap does not have it and
+ * it must be read from the swap device.  The compressed copy stays around
+ * until the swap slot is freed, so a clean page can be dropped again
+ * without another store.
+ */
+int zswap_load(struct page *page)
+{
+	swp_entry_t swpentry = { .val = page_private(page), };
+	struct zswap_tree *tree = zswap_trees[swp_type(swpentry)];
+	struct zswap_entry *entry;
+
+	if (!tree)
+		return -ENODEV;
+
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, swp_offset(swpentry));
+	if (!entry) {
+		spin_unlock(&tree->lock);
+		return -ENOENT;
+	}
+	zswap_entry_get(entry);
+	spin_unlock(&tree->lock);
+
+	zswap_decompress(entry, page);
+
+	spin_lock(&tree->lock);
+	zswap_entry_put(entry);
+	spin_unlock(&tree->lock);
+
+	return 0;
+}
+
+/*
+ * Called under swap_lock when the last reference to a swap slot is
+ * dropped, and by zswap_store() when a slot is rewritten to the swap
+ * device.
+ */
+void zswap_invalidate_page(unsigned type, pgoff_t offset)
+{
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry;
+
+	if (!tree)
+		return;
+
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, offset);
+	if (entry) {
+		zswap_rb_erase(&tree->rbroot, entry);
+		zswap_entry_put(entry);
+	}
+	spin_unlock(&tree->lock);
+}
+
+/*
+ * Called by swapoff once every slot of the device has been freed.  The
+ * tree itself stays: zbud eviction may still be looking at it, and finds
+ * it empty.  The next swapon of the same type reuses it.
+ */
+void zswap_invalidate_area(unsigned type)
+{
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry;
+	struct rb_node *node;
+
+	if (!tree)
+		return;
+
+	spin_lock(&tree->lock);
+	while ((node = rb_first(&tree->rbroot))) {
+		entry = rb_entry(node, struct zswap_entry, rbnode);
+		zswap_rb_erase(&tree->rbroot, entry);
+		zswap_entry_put(entry);
+	}
+	spin_unlock(&tree->lock);
+}
+
+/* Called by swapon before the device is made available */
+void zswap_init_area(unsigned type)
+{
+	struct zswap_tree *tree;
+
+	if (!zswap_pool || zswap_trees[type])
+		return;
+
+	tree = kzalloc(sizeof(struct zswap_tree), GFP_KERNEL);
+	if (!tree) {
+		printk(KERN_ERR "zswap: no memory for the tree of swap "
+		       "area %u, not caching it\n", type);
+		return;
+	}
+	tree->rbroot = RB_ROOT;
+	spin_lock_init(&tree->lock);
+	zswap_trees[type] = tree;
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int zswap_stored_pages_get(void *data, u64 *val)
+{
+	*val = atomic_read(&zswap_stored_pages);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zswap_stored_pages_fops, zswap_stored_pages_get,
+			NULL, "%llu\n");
+
+static int zswap_pool_pages_get(void *data, u64 *val)
+{
+	*val = zbud_get_pool_size(zswap_pool);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zswap_pool_pages_fops, zswap_pool_pages_get,
+			NULL, "%llu\n");
+
+static int __init zswap_debugfs_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("zswap", NULL);
+	if (!dir)
+		return -ENOMEM;
+
+	debugfs_create_u64("pool_limit_hit", S_IRUGO, dir,
+			   &zswap_pool_limit_hit);
+	debugfs_create_u64("reject_reclaim_fail", S_IRUGO, dir,
+			   &zswap_reject_reclaim_fail);
+	debugfs_create_u64("reject_alloc_fail", S_IRUGO, dir,
+			   &zswap_reject_alloc_fail);
+	debugfs_create_u64("reject_compress_poor", S_IRUGO, dir,
+			   &zswap_reject_compress_poor);
+	debugfs_create_u64("written_back_pages", S_IRUGO, dir,
+			   &zswap_written_back_pages);
+	debugfs_create_u64("duplicate_entry", S_IRUGO, dir,
+			   &zswap_duplicate_entry);
+	debugfs_create_file("pool_pages", S_IRUGO, dir, NULL,
+			    &zswap_pool_pages_fops);
+	debugfs_create_file("stored_pages", S_IRUGO, dir, NULL,
+			    &zswap_stored_pages_fops);
+	return 0;
+}
+#else
+static int __init zswap_debugfs_init(void)
+{
+	return 0;
+}
+#endif
+
+static int __init zswap_init(void)
+{
+	int cpu;
+
+	zswap_entry_cache = KMEM_CACHE(zswap_entry, 0);
+	if (!zswap_entry_cache)
+		goto nomem;
+
+	for_each_possible_cpu(cpu) {
+		unsigned char *dst;
+		void *wrkmem;
+
+		dst = kmalloc_node(PAGE_SIZE * 2, GFP_KERNEL, cpu_to_node(cpu));
+		wrkmem = vmalloc(LZO1X_MEM_COMPRESS);
+		if (!dst || !wrkmem) {
+			kfree(dst);
+			vfree(wrkmem);
+			goto free_percpu;
+		}
+		per_cpu(zswap_dstmem, cpu) = dst;
+		per_cpu(zswap_wrkmem, cpu) = wrkmem;
+	}
+
+	zswap_pool = zbud_create_pool(GFP_KERNEL, &zswap_zbud_ops);
+	if (!zswap_pool)
+		goto free_percpu;
+
+	zswap_debugfs_init();
+	printk(KERN_INFO "zswap: using lzo compressor%s\n",
+	       zswap_enabled ? "" : ", disabled until zswap.enabled=1");
+	return 0;
+
+free_percpu:
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(zswap_dstmem, cpu));
+		vfree(per_cpu(zswap_wrkmem, cpu));
+		per_cpu(zswap_dstmem, cpu) = NULL;
+		per_cpu(zswap_wrkmem, cpu) = NULL;
+	}
+	kmem_cache_destroy(zswap_entry_cache);
+nomem:
+	printk(KERN_ERR "zswap: initialization failed, not enabling it\n");
+	zswap_enabled = 0;
+	return -ENOMEM;
+}
+/* must run before swapon can be called from userspace */
+late_initcall(zswap_init);
@@ -341,6 +341,8 @@ static void skb_release_data(struct sk_buff *skb)
 	if (!skb->cloned ||
 	    !atomic_sub_return(skb->nohdr ? (1 << SKB_DATAREF_SHIFT) + 1 : 1,
 			       &skb_shinfo(skb)->dataref)) {
+		struct ubuf_info *uarg = skb_zcopy(skb);
+
 		if (skb_shinfo(skb)->nr_frags) {
 			int i;
 			for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
@@ -351,6 +353,10 @@ static void skb_release_data(struct sk_buff *skb)
 			skb_drop_fraglist(skb);
 
 		kfree(skb->head);
+
+		/* The user pages are no longer referenced by this skb. */
+		if (uarg)
+			sock_zerocopy_put(uarg);
 	}
 }
 
@@ -765,6 +771,7 @@ struct sk_buff *pskb_copy(struct sk_buff *skb, gfp_t gfp_mask)
 			get_page(skb_shinfo(n)->frags[i].page);
 		}
 		skb_shinfo(n)->nr_frags = i;
+		skb_zerocopy_clone(n, skb);
 	}
 
 	if (skb_has_frags(skb)) {
@@ -833,6 +840,10 @@ int pskb_expand_head(struct sk_buff *skb, int nhead, int ntail,
 	if (skb_has_frags(skb))
 		skb_clone_fraglist(skb);
 
+	/* The new shared info carries its own zero-copy reference. */
+	if (skb_zcopy(skb))
+		sock_zerocopy_get(skb_zcopy(skb));
+
 	skb_release_data(skb);
 
 	off = (data + nhead) - skb->head;
@@ -2081,6 +2092,7 @@ void skb_split(struct sk_buff *skb, struct sk_buff *skb1, const u32 len)
 {
 	int pos = skb_headlen(skb);
 
+	skb_zerocopy_clone(skb1, skb);
 	if (len < pos)	/* Split line is inside header. */
 		skb_split_inside_header(skb, skb1, len, pos);
 	else		/* Second chunk has no header, nothing to copy. */
@@ -2123,6 +2135,9 @@ int skb_shift(struct sk_buff *tgt, struct sk_buff *skb, int shiftlen)
 	BUG_ON(shiftlen > skb->len);
 	BUG_ON(skb_headlen(skb));	/* Would corrupt stream */
 
+	if (skb_zerocopy_clone(tgt, skb))
+		return 0;
+
 	todo = shiftlen;
 	from = 0;
 	to = skb_shinfo(tgt)->nr_frags;
@@ -2593,6 +2608,7 @@ struct sk_buff *skb_segment(struct sk_buff *skb, int features)
 		}
 
 		frag = skb_shinfo(nskb)->frags;
+		skb_zerocopy_clone(nskb, skb);
 
 		skb_copy_from_linear_data_offset(skb, offset,
 						 skb_put(nskb, hsize), hsize);
@@ -3005,6 +3021,149 @@ void skb_tstamp_tx(struct sk_buff *orig_skb,
 }
 EXPORT_SYMBOL_GPL(skb_tstamp_tx);
 
+static void sock_zerocopy_callback(struct ubuf_info *uarg)
+{
+	struct sk_buff *skb = container_of((void *)uarg, struct sk_buff, cb);
+	struct sock_exterr_skb *serr;
+	struct sock *sk = uarg->sk;
+	u32 id = uarg->id;
+	u8 copied = uarg->copied;
+
+	serr = SKB_EXT_ERR(skb);
+	memset(serr, 0, sizeof(*serr));
+	serr->ee.ee_errno = 0;
+	serr->ee.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+	serr->ee.ee_info = id;
+	serr->ee.ee_data = id;
+	if (copied)
+		serr->ee.ee_code |= SO_EE_CODE_ZEROCOPY_COPIED;
+
+	if (sock_queue_err_skb(sk, skb))
+		kfree_skb(skb);
+	sock_put(sk);
+}
+
+/**
+ * sock_zerocopy_alloc - start tracking a zero-copy send
+ * @sk: sending socket, locked by the caller
+ *
+ * Allocates the completion notification up front so that the release
+ * path never has to allocate memory. The caller owns one reference and
+ * must drop it with sock_zerocopy_put() or sock_zerocopy_put_abort().
+ */
+struct ubuf_info *sock_zerocopy_alloc(struct sock *sk)
+{
+	struct ubuf_info *uarg;
+	struct sk_buff *skb;
+
+	BUILD_BUG_ON(sizeof(*uarg) > sizeof(skb->cb));
+
+	skb = alloc_skb(0, sk->sk_allocation);
+	if (!skb)
+		return NULL;
+
+	uarg = (void *)skb->cb;
+	uarg->callback = sock_zerocopy_callback;
+	atomic_set(&uarg->refcnt, 1);
+	uarg->id = sk->sk_zckey++;
+	uarg->copied = 0;
+	uarg->sk = sk;
+	sock_hold(sk);
+
+	return uarg;
+}
+EXPORT_SYMBOL_GPL(sock_zerocopy_alloc);
+
+/**
+ * sock_zerocopy_put_abort - drop the sender's reference after a failed send
+ * @uarg: state returned by sock_zerocopy_alloc()
+ *
+ * If no skb picked up the user pages, the notification is discarded and
+ * its sequence number handed back, so that ids seen by user space stay
+ * contiguous. Must be called with the socket still locked.
+ */
+void sock_zerocopy_put_abort(struct ubuf_info *uarg)
+{
+	struct sock *sk = uarg->sk;
+
+	if (atomic_read(&uarg->refcnt) == 1) {
+		sk->sk_zckey--;
+		kfree_skb(container_of((void *)uarg, struct sk_buff, cb));
+		sock_put(sk);
+		return;
+	}
+	sock_zerocopy_put(uarg);
+}
+EXPORT_SYMBOL_GPL(sock_zerocopy_put_abort);
+
+/**
+ * skb_zerocopy_clone - make @nskb share the user pages of @orig
+ * @nskb: buffer that received (or is about to receive) frags of @orig
+ * @orig: zero-copy buffer
+ *
+ * Returns -EIO if @nskb already tracks a different zero-copy send, in
+ * which case the frags must not be mixed.
+ */
+int skb_zerocopy_clone(struct sk_buff *nskb, struct sk_buff *orig)
+{
+	struct ubuf_info *uarg = skb_zcopy(orig);
+
+	if (!uarg)
+		return 0;
+	if (skb_zcopy(nskb))
+		return skb_zcopy(nskb) == uarg ? 0 : -EIO;
+
+	skb_zcopy_set(nskb, uarg);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(skb_zerocopy_clone);
+
+/**
+ * skb_zerocopy_add_frags - attach user memory to @skb without copying
+ * @sk: owning socket, accounted for the new frags
+ * @skb: buffer already carrying the zero-copy state
+ * @from: user address
+ * @copy: maximum number of bytes to attach
+ *
+ * Pins the user pages backing @from and appends them as frags. Returns
+ * the number of bytes attached, 0 if @skb has no free frag slot, or a
+ * negative error if the pages could not be pinned.
+ */
+int skb_zerocopy_add_frags(struct sock *sk, struct sk_buff *skb,
+			   unsigned char __user *from, int copy)
+{
+	int i = skb_shinfo(skb)->nr_frags;
+	int done = 0;
+
+	while (copy > 0 && i < MAX_SKB_FRAGS) {
+		unsigned long off = (unsigned long)from & ~PAGE_MASK;
+		struct page *page;
+		int size = min_t(int, copy, PAGE_SIZE - off);
+
+		if (get_user_pages_fast((unsigned long)from, 1, 0, &page) != 1)
+			return done ? done : -EFAULT;
+
+		if (skb_can_coalesce(skb, i, page, off)) {
+			skb_shinfo(skb)->frags[i - 1].size += size;
+			put_page(page);
+		} else {
+			skb_fill_page_desc(skb, i++, page, off, size);
+		}
+
+		skb->len += size;
+		skb->data_len += size;
+		skb->truesize += size;
+		sk->sk_wmem_queued += size;
+		sk_mem_charge(sk, size);
+
+		from += size;
+		copy -= size;
+		done += size;
+	}
+	return done;
+}
+EXPORT_SYMBOL_GPL(skb_zerocopy_add_frags);
+
 
 /**
  * skb_partial_csum_set - set up and verify partial csum values for packet
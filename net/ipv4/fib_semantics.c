@@ -145,6 +145,10 @@ void free_fib_info(struct fib_info *fi)
 		return;
 	}
 	change_nexthops(fi) {
+		if (nh->nh_pcpu_rth_input) {
+			rt_nexthop_cache_flush(nh);
+			free_percpu(nh->nh_pcpu_rth_input);
+		}
 		if (nh->nh_dev)
 			dev_put(nh->nh_dev);
 		nh->nh_dev = NULL;
@@ -739,6 +743,11 @@ struct fib_info *fib_create_info(struct fib_config *cfg)
 	fi->fib_nhs = nhs;
 	change_nexthops(fi) {
 		nh->nh_parent = fi;
+		nh->nh_pcpu_rth_input = alloc_percpu(struct rtable *);
+		if (!nh->nh_pcpu_rth_input) {
+			err = -ENOBUFS;
+			goto failure;
+		}
 	} endfor_nexthops(fi)
 
 	if (cfg->fc_mx) {
@@ -1080,6 +1089,9 @@ int fib_sync_down_dev(struct net_device *dev, int force)
 		prev_fi = fi;
 		dead = 0;
 		change_nexthops(fi) {
+			/* cached routes pin the device */
+			if (nh->nh_dev == dev)
+				rt_nexthop_cache_flush(nh);
 			if (nh->nh_flags&RTNH_F_DEAD)
 				dead++;
 			else if (nh->nh_dev == dev &&
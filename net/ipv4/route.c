@@ -1942,6 +1942,77 @@ static void ip_handle_martian_source(struct net_device *dev,
 #endif
 }
 
+/*
+ * With the route cache disabled, forwarding results for gateway routes
+ * are kept per CPU on the next hop instead of being allocated for every
+ * packet.  Such a route is shared by all destinations behind the next
+ * hop, so everything that depends on the individual packet (redirects,
+ * route classification, IP options, proxy ARP) bypasses it.
+ *
+ * Each slot is only read by its own CPU with BH disabled; writers swap
+ * it with xchg() and free the old route through rt_drop(), like routes
+ * unlinked from the hash table.
+ */
+static inline int rt_nexthop_cacheable(const struct sk_buff *skb,
+				       const struct fib_result *res,
+				       unsigned flags, u32 itag)
+{
+	const struct fib_nh *nh = &FIB_RES_NH(*res);
+
+	return res->fi && nh->nh_gw && nh->nh_scope == RT_SCOPE_LINK &&
+	       !itag && !(flags & RTCF_DOREDIRECT) &&
+	       skb->protocol == htons(ETH_P_IP) && ip_hdr(skb)->ihl == 5;
+}
+
+static struct rtable *rt_nexthop_cache_get(struct fib_nh *nh, int iif,
+					   u32 tos, u32 mark, unsigned flags)
+{
+	struct rtable *rth;
+
+	local_bh_disable();
+	rth = rcu_dereference(*per_cpu_ptr(nh->nh_pcpu_rth_input,
+					   smp_processor_id()));
+	if (rth && rth->fl.iif == iif && rth->fl.fl4_tos == tos &&
+	    rth->fl.mark == mark && rth->rt_flags == flags &&
+	    !rt_is_expired(rth))
+		dst_use(&rth->u.dst, jiffies);
+	else
+		rth = NULL;
+	local_bh_enable();
+
+	return rth;
+}
+
+static void rt_nexthop_cache_set(struct fib_nh *nh, struct rtable *rth)
+{
+	struct rtable *old;
+
+	dst_hold(&rth->u.dst);
+	local_bh_disable();
+	old = xchg(per_cpu_ptr(nh->nh_pcpu_rth_input, smp_processor_id()),
+		   rth);
+	local_bh_enable();
+	if (old)
+		rt_drop(old);
+}
+
+void rt_nexthop_cache_flush(struct fib_nh *nh)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct rtable *rth;
+
+		rth = xchg(per_cpu_ptr(nh->nh_pcpu_rth_input, cpu), NULL);
+		if (rth)
+			rt_drop(rth);
+	}
+}
+
+/*
+ * Returns with *result set to a new route for the caller to hash, or to
+ * NULL if the skb already got its route from the next hop cache.
+ */
 static int __mkroute_input(struct sk_buff *skb,
 			   struct fib_result *res,
 			   struct in_device *in_dev,
@@ -1955,6 +2026,7 @@ static int __mkroute_input(struct sk_buff *skb,
 	unsigned flags = 0;
 	__be32 spec_dst;
 	u32 itag;
+	int nh_cache;
 
 	/* get a working reference to the output device */
 	out_dev = in_dev_get(FIB_RES_DEV(*res));
@@ -1994,6 +2066,19 @@ static int __mkroute_input(struct sk_buff *skb,
 		}
 	}
 
+	nh_cache = !rt_caching(dev_net(in_dev->dev)) &&
+		   rt_nexthop_cacheable(skb, res, flags, itag);
+	if (nh_cache) {
+		rth = rt_nexthop_cache_get(&FIB_RES_NH(*res),
+					   in_dev->dev->ifindex, tos,
+					   skb->mark, flags);
+		if (rth) {
+			skb_dst_set(skb, &rth->u.dst);
+			*result = NULL;
+			err = 0;
+			goto cleanup;
+		}
+	}
 
 	rth = dst_alloc(&ipv4_dst_ops);
 	if (!rth) {
@@ -2030,6 +2115,12 @@ static int __mkroute_input(struct sk_buff *skb,
 
 	rth->rt_flags = flags;
 
+	if (nh_cache && !arp_bind_neighbour(&rth->u.dst)) {
+		rt_nexthop_cache_set(&FIB_RES_NH(*res), rth);
+		skb_dst_set(skb, &rth->u.dst);
+		rth = NULL;
+	}
+
 	*result = rth;
 	err = 0;
  cleanup:
@@ -2055,7 +2146,7 @@ static int ip_mkroute_input(struct sk_buff *skb,
 
 	/* create a routing cache entry */
 	err = __mkroute_input(skb, res, in_dev, daddr, saddr, tos, &rth);
-	if (err)
+	if (err || !rth)
 		return err;
 
 	/* put it into the cache */
@@ -2266,10 +2357,10 @@ int ip_route_input(struct sk_buff *skb, __be32 daddr, __be32 saddr,
 
 	net = dev_net(dev);
 
+	tos &= IPTOS_RT_MASK;
 	if (!rt_caching(net))
 		goto skip_cache;
 
-	tos &= IPTOS_RT_MASK;
 	hash = rt_hash(daddr, saddr, iif, rt_genid(net));
 
 	rcu_read_lock();
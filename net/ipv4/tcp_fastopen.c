@@ -0,0 +1,219 @@
+/*
+ * TCP Fast Open: send and accept data in the SYN of a connection.
+ *
+ * The server hands out a cookie, a MAC of the client address keyed with
+ * a local secret, in the SYN-ACK of a cookie request. The client caches
+ * it per destination in the inet_peer and presents it with data in the
+ * SYN of later connections, letting the server create the child socket
+ * and deliver the data before the three-way handshake completes.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/tcp.h>
+#include <linux/init.h>
+#include <linux/random.h>
+#include <linux/cryptohash.h>
+#include <linux/seqlock.h>
+#include <linux/kernel.h>
+#include <net/inetpeer.h>
+#include <net/tcp.h>
+
+int sysctl_tcp_fastopen __read_mostly;
+
+static __u32 fastopen_secret[16 - 2 + SHA_DIGEST_WORDS];
+
+static __init int tcp_fastopen_init(void)
+{
+	get_random_bytes(fastopen_secret, sizeof(fastopen_secret));
+	return 0;
+}
+__initcall(tcp_fastopen_init);
+
+static DEFINE_PER_CPU(__u32 [16 + 5 + SHA_WORKSPACE_WORDS],
+		      fastopen_cookie_scratch);
+
+/* Called in softirq context from tcp_v4_conn_request(). */
+static void tcp_fastopen_cookie_gen(__be32 saddr, __be32 daddr,
+				    struct tcp_fastopen_cookie *foc)
+{
+	__u32 *tmp = __get_cpu_var(fastopen_cookie_scratch);
+
+	memcpy(tmp + 2, fastopen_secret, sizeof(fastopen_secret));
+	tmp[0] = (__force u32)saddr;
+	tmp[1] = (__force u32)daddr;
+	sha_transform(tmp + 16, (const char *)tmp, tmp + 16 + 5);
+
+	foc->len = TCP_FASTOPEN_COOKIE_SIZE;
+	memcpy(foc->val, tmp + 16, TCP_FASTOPEN_COOKIE_SIZE);
+}
+
+/*
+ * Decide whether the data in the SYN @skb may be accepted. On return
+ * @foc holds the cookie to echo in the SYN-ACK: a fresh one when the
+ * client asked for it or presented an invalid one, none (len -1)
+ * otherwise.
+ */
+bool tcp_fastopen_check(struct sock *sk, struct sk_buff *skb,
+			struct tcp_fastopen_cookie *foc)
+{
+	struct tcp_fastopen_cookie valid_foc;
+	bool syn_data = TCP_SKB_CB(skb)->end_seq != TCP_SKB_CB(skb)->seq + 1;
+	struct tcp_sock *tp = tcp_sk(sk);
+
+	if (!(sysctl_tcp_fastopen & TFO_SERVER_ENABLE) || foc->len < 0) {
+		foc->len = -1;
+		return false;
+	}
+
+	tcp_fastopen_cookie_gen(ip_hdr(skb)->saddr, ip_hdr(skb)->daddr,
+				&valid_foc);
+
+	if (foc->len == valid_foc.len &&
+	    !memcmp(foc->val, valid_foc.val, foc->len)) {
+		foc->len = -1;
+		if (!syn_data)
+			return false;
+		if (!tcp_hdr(skb)->fin && tp->fastopen_qlen &&
+		    sk->sk_ack_backlog < tp->fastopen_qlen) {
+			NET_INC_STATS_BH(sock_net(sk),
+					 LINUX_MIB_TCPFASTOPENPASSIVE);
+			return true;
+		}
+		NET_INC_STATS_BH(sock_net(sk), LINUX_MIB_TCPFASTOPENPASSIVEFAIL);
+		return false;
+	}
+
+	if (foc->len == 0)
+		NET_INC_STATS_BH(sock_net(sk), LINUX_MIB_TCPFASTOPENCOOKIEREQD);
+	else if (syn_data)
+		NET_INC_STATS_BH(sock_net(sk), LINUX_MIB_TCPFASTOPENPASSIVEFAIL);
+	*foc = valid_foc;
+	return false;
+}
+
+/*
+ * Create the child socket for a SYN whose data was accepted, queue the
+ * data on it and put it on the accept queue of the listener @sk right
+ * away. @req stays attached to the child for SYN-ACK retransmits until
+ * the final ACK of the handshake arrives. Consumes @dst.
+ */
+struct sock *tcp_fastopen_create_child(struct sock *sk, struct sk_buff *skb,
+				       struct request_sock *req,
+				       struct dst_entry *dst)
+{
+	struct request_sock *areq;
+	struct sk_buff *data;
+	struct tcp_sock *tp;
+	struct sock *child;
+
+	data = skb_clone(skb, GFP_ATOMIC);
+	if (!data)
+		goto out_dst;
+
+	/* The accept queue frees its entry on accept(), give it its own. */
+	areq = reqsk_alloc(req->rsk_ops);
+	if (!areq)
+		goto out_data;
+
+	tcp_rsk(req)->rcv_nxt = TCP_SKB_CB(skb)->end_seq;
+	child = inet_csk(sk)->icsk_af_ops->syn_recv_sock(sk, skb, req, dst);
+	if (!child) {
+		__reqsk_free(areq);
+		kfree_skb(data);
+		return NULL;
+	}
+
+	tp = tcp_sk(child);
+	tp->fastopen_rsk = req;
+
+	/* The SYN-ACK is retransmitted by the child's retransmit timer,
+	 * see tcp_fastopen_synack_timer().
+	 */
+	inet_csk_reset_xmit_timer(child, ICSK_TIME_RETRANS,
+				  TCP_TIMEOUT_INIT, TCP_RTO_MAX);
+
+	inet_csk_reqsk_queue_add(sk, areq, child);
+
+	/* Finish the setup tcp_rcv_state_process() does on the final ACK. */
+	inet_csk(child)->icsk_af_ops->rebuild_header(child);
+	tcp_init_congestion_control(child);
+	tcp_mtup_init(child);
+	tcp_init_buffer_space(child);
+	tcp_init_metrics(child);
+
+	/* Queue the SYN data. The skb keeps the SYN sequence number, like
+	 * the first segment of a simultaneous open, and copied_seq already
+	 * points past the SYN.
+	 */
+	__skb_pull(data, tcp_hdrlen(skb));
+	skb_set_owner_r(data, child);
+	__skb_queue_tail(&child->sk_receive_queue, data);
+	tp->rcv_nxt = TCP_SKB_CB(skb)->end_seq;
+	tp->rcv_wup = tp->rcv_nxt;
+
+	sk->sk_data_ready(sk, 0);
+	bh_unlock_sock(child);
+	sock_put(child);
+	return child;
+
+out_data:
+	kfree_skb(data);
+out_dst:
+	dst_release(dst);
+	return NULL;
+}
+
+/* Client side cookie cache, kept in the inet_peer of the destination. */
+static DEFINE_SEQLOCK(fastopen_seqlock);
+
+void tcp_fastopen_cache_get(struct sock *sk, u16 *mss,
+			    struct tcp_fastopen_cookie *cookie)
+{
+	struct inet_peer *peer;
+	unsigned int seq;
+
+	if (sk->sk_family != AF_INET)
+		return;
+
+	peer = inet_getpeer(inet_sk(sk)->daddr, 0);
+	if (!peer)
+		return;
+
+	do {
+		seq = read_seqbegin(&fastopen_seqlock);
+		if (peer->tcp_fastopen_mss)
+			*mss = peer->tcp_fastopen_mss;
+		cookie->len = peer->tcp_fastopen_cookie_len;
+		memcpy(cookie->val, peer->tcp_fastopen_cookie, cookie->len);
+	} while (read_seqretry(&fastopen_seqlock, seq));
+
+	inet_putpeer(peer);
+}
+
+void tcp_fastopen_cache_set(struct sock *sk, u16 mss,
+			    struct tcp_fastopen_cookie *cookie)
+{
+	struct inet_peer *peer;
+
+	if (sk->sk_family != AF_INET || (!mss && cookie->len <= 0))
+		return;
+
+	peer = inet_getpeer(inet_sk(sk)->daddr, 1);
+	if (!peer)
+		return;
+
+	write_seqlock_bh(&fastopen_seqlock);
+	if (mss)
+		peer->tcp_fastopen_mss = mss;
+	if (cookie->len > 0) {
+		peer->tcp_fastopen_cookie_len = cookie->len;
+		memcpy(peer->tcp_fastopen_cookie, cookie->val, cookie->len);
+	}
+	write_sequnlock_bh(&fastopen_seqlock);
+
+	inet_putpeer(peer);
+}
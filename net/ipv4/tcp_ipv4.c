@@ -742,7 +742,8 @@ static void tcp_v4_reqsk_send_ack(struct sock *sk, struct sk_buff *skb,
  *	socket.
  */
 static int __tcp_v4_send_synack(struct sock *sk, struct request_sock *req,
-				struct dst_entry *dst)
+				struct dst_entry *dst,
+				struct tcp_fastopen_cookie *foc)
 {
 	const struct inet_request_sock *ireq = inet_rsk(req);
 	int err = -1;
@@ -752,7 +753,7 @@ static int __tcp_v4_send_synack(struct sock *sk, struct request_sock *req,
 	if (!dst && (dst = inet_csk_route_req(sk, req)) == NULL)
 		return -1;
 
-	skb = tcp_make_synack(sk, dst, req);
+	skb = tcp_make_synack(sk, dst, req, foc);
 
 	if (skb) {
 		struct tcphdr *th = tcp_hdr(skb);
@@ -775,7 +776,49 @@ static int __tcp_v4_send_synack(struct sock *sk, struct request_sock *req,
 
 static int tcp_v4_send_synack(struct sock *sk, struct request_sock *req)
 {
-	return __tcp_v4_send_synack(sk, req, NULL);
+	return __tcp_v4_send_synack(sk, req, NULL, NULL);
+}
+
+/*
+ *	Accept the data of a Fast Open SYN: create the child socket right
+ *	away and answer with a SYN-ACK that acknowledges the data.
+ */
+static int tcp_v4_conn_req_fastopen(struct sock *sk, struct sk_buff *skb,
+				    struct request_sock *req,
+				    struct dst_entry *dst)
+{
+	const struct inet_request_sock *ireq = inet_rsk(req);
+	struct sk_buff *skb_synack;
+	struct sock *child;
+	struct tcphdr *th;
+
+	if (!dst && (dst = inet_csk_route_req(sk, req)) == NULL)
+		return -1;
+
+	tcp_rsk(req)->rcv_nxt = TCP_SKB_CB(skb)->end_seq;
+	skb_synack = tcp_make_synack(sk, dst, req, NULL);
+	if (!skb_synack) {
+		dst_release(dst);
+		return -1;
+	}
+
+	child = tcp_fastopen_create_child(sk, skb, req, dst);
+	if (!child) {
+		kfree_skb(skb_synack);
+		return -1;
+	}
+
+	th = tcp_hdr(skb_synack);
+	th->check = tcp_v4_check(skb_synack->len,
+				 ireq->loc_addr,
+				 ireq->rmt_addr,
+				 csum_partial(th, skb_synack->len,
+					      skb_synack->csum));
+
+	/* A lost SYN-ACK is retransmitted by the child's timer. */
+	ip_build_and_send_pkt(skb_synack, sk, ireq->loc_addr,
+			      ireq->rmt_addr, inet_sk(child)->opt);
+	return 0;
 }
 
 /*
@@ -1212,6 +1255,7 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 {
 	struct inet_request_sock *ireq;
 	struct tcp_options_received tmp_opt;
+	struct tcp_fastopen_cookie foc = { .len = -1 };
 	struct request_sock *req;
 	__be32 saddr = ip_hdr(skb)->saddr;
 	__be32 daddr = ip_hdr(skb)->daddr;
@@ -1260,7 +1304,7 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	tmp_opt.mss_clamp = 536;
 	tmp_opt.user_mss  = tcp_sk(sk)->rx_opt.user_mss;
 
-	tcp_parse_options(skb, &tmp_opt, 0);
+	tcp_parse_options(skb, &tmp_opt, 0, want_cookie ? NULL : &foc);
 
 	if (want_cookie && !tmp_opt.saw_tstamp)
 		tcp_clear_options(&tmp_opt);
@@ -1333,7 +1377,13 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	}
 	tcp_rsk(req)->snt_isn = isn;
 
-	if (__tcp_v4_send_synack(sk, req, dst) || want_cookie)
+	if (!want_cookie && tcp_fastopen_check(sk, skb, &foc)) {
+		if (tcp_v4_conn_req_fastopen(sk, skb, req, dst))
+			goto drop_and_free;
+		return 0;
+	}
+
+	if (__tcp_v4_send_synack(sk, req, dst, &foc) || want_cookie)
 		goto drop_and_free;
 
 	inet_csk_reqsk_queue_hash_add(sk, req, TCP_TIMEOUT_INIT);
@@ -1765,6 +1815,7 @@ const struct inet_connection_sock_af_ops ipv4_specific = {
 	.net_header_len	   = sizeof(struct iphdr),
 	.setsockopt	   = ip_setsockopt,
 	.getsockopt	   = ip_getsockopt,
+	.recv_error	   = ip_recv_error,
 	.addr2sockaddr	   = inet_csk_addr2sockaddr,
 	.sockaddr_len	   = sizeof(struct sockaddr_in),
 	.bind_conflict	   = inet_csk_bind_conflict,
@@ -1879,6 +1930,13 @@ void tcp_v4_destroy_sock(struct sock *sk)
 		sk->sk_sndmsg_page = NULL;
 	}
 
+	/* A passive Fast Open child still owns its request sock. */
+	if (tp->fastopen_rsk) {
+		reqsk_free(tp->fastopen_rsk);
+		tp->fastopen_rsk = NULL;
+	}
+	tcp_free_fastopen_req(tp);
+
 	percpu_counter_dec(&tcp_sockets_allocated);
 }
 
@@ -2430,6 +2488,7 @@ struct proto tcp_prot = {
 	.getsockopt		= tcp_getsockopt,
 	.recvmsg		= tcp_recvmsg,
 	.backlog_rcv		= tcp_v4_do_rcv,
+	.release_cb		= tcp_release_cb,
 	.hash			= inet_hash,
 	.unhash			= inet_unhash,
 	.get_port		= inet_csk_get_port,
@@ -841,6 +841,184 @@ out:
 	return ret;
 }
 
+/*
+ * Receive memory accounting.
+ *
+ * Datagrams are charged to the socket from softirq context without the
+ * socket lock: sk_rmem_alloc is reserved with an atomic add and the
+ * forward allocation is adjusted under the receive queue spinlock, which
+ * the enqueue path takes anyway.  The skb destructor undoes both.
+ */
+static void udp_rmem_release(struct sock *sk, int size)
+{
+	struct sk_buff_head *rcvq = &sk->sk_receive_queue;
+
+	atomic_sub(size, &sk->sk_rmem_alloc);
+
+	spin_lock_bh(&rcvq->lock);
+	sk->sk_forward_alloc += size;
+	sk_mem_reclaim_partial(sk);
+	spin_unlock_bh(&rcvq->lock);
+}
+
+static void udp_rfree(struct sk_buff *skb)
+{
+	udp_rmem_release(skb->sk, skb->truesize);
+}
+
+/**
+ *	__udp_enqueue_schedule_skb - charge and queue a datagram
+ *	@sk: socket
+ *	@skb: datagram, already run through the socket filter
+ *
+ *	Lockless counterpart of sock_queue_rcv_skb().  Returns 0 on success,
+ *	-ENOMEM if the receive buffer is full and -ENOBUFS if the protocol
+ *	memory limits refused the charge.  The caller frees @skb on error.
+ */
+int __udp_enqueue_schedule_skb(struct sock *sk, struct sk_buff *skb)
+{
+	struct sk_buff_head *rcvq = &sk->sk_receive_queue;
+	int rmem, size = skb->truesize;
+	int err = -ENOMEM;
+	int skb_len;
+
+	/* Cheap check first, then reserve; a single datagram is always
+	 * accepted by an empty socket, as sock_queue_rcv_skb() does.
+	 */
+	rmem = atomic_read(&sk->sk_rmem_alloc);
+	if (rmem && rmem + size > sk->sk_rcvbuf)
+		goto drop;
+
+	rmem = atomic_add_return(size, &sk->sk_rmem_alloc);
+	if (rmem > size && rmem > sk->sk_rcvbuf)
+		goto uncharge_drop;
+
+	spin_lock(&rcvq->lock);
+	if (!sk_rmem_schedule(sk, size)) {
+		err = -ENOBUFS;
+		spin_unlock(&rcvq->lock);
+		goto uncharge_drop;
+	}
+	sk_mem_charge(sk, size);
+
+	skb->sk = sk;
+	skb->destructor = udp_rfree;
+	skb->dev = NULL;
+
+	/* The skb may be consumed as soon as the lock is dropped */
+	skb_len = skb->len;
+	__skb_queue_tail(rcvq, skb);
+	spin_unlock(&rcvq->lock);
+
+	if (!sock_flag(sk, SOCK_DEAD))
+		sk->sk_data_ready(sk, skb_len);
+	return 0;
+
+uncharge_drop:
+	atomic_sub(size, &sk->sk_rmem_alloc);
+drop:
+	atomic_inc(&sk->sk_drops);
+	return err;
+}
+EXPORT_SYMBOL(__udp_enqueue_schedule_skb);
+
+static struct sk_buff *__udp_try_dequeue(struct sk_buff_head *queue,
+					 unsigned int flags, int *peeked)
+{
+	struct sk_buff *skb = skb_peek(queue);
+
+	if (skb) {
+		*peeked = skb->peeked;
+		if (flags & MSG_PEEK) {
+			skb->peeked = 1;
+			atomic_inc(&skb->users);
+		} else
+			__skb_unlink(skb, queue);
+	}
+	return skb;
+}
+
+/**
+ *	__skb_recv_udp - receive a datagram from a UDP socket
+ *	@sk: socket
+ *	@flags: MSG_ flags
+ *	@noblock: do not block
+ *	@peeked: returns non-zero if this packet has been seen before
+ *	@err: error code returned
+ *
+ *	Readers consume the private reader_queue and only take the lock
+ *	shared with the softirq producers to splice everything that has
+ *	accumulated on sk_receive_queue in one go, so a busy socket pays
+ *	for the contended lock once per batch rather than once per packet.
+ */
+struct sk_buff *__skb_recv_udp(struct sock *sk, unsigned int flags,
+			       int noblock, int *peeked, int *err)
+{
+	struct sk_buff_head *sk_queue = &sk->sk_receive_queue;
+	struct sk_buff_head *queue = &udp_sk(sk)->reader_queue;
+	struct sk_buff *skb;
+	long timeo;
+	int error;
+
+	timeo = sock_rcvtimeo(sk, noblock || (flags & MSG_DONTWAIT));
+
+	do {
+		error = sock_error(sk);
+		if (error)
+			break;
+
+		spin_lock_bh(&queue->lock);
+		skb = __udp_try_dequeue(queue, flags, peeked);
+		if (!skb && !skb_queue_empty(sk_queue)) {
+			spin_lock(&sk_queue->lock);
+			skb_queue_splice_tail_init(sk_queue, queue);
+			spin_unlock(&sk_queue->lock);
+
+			skb = __udp_try_dequeue(queue, flags, peeked);
+		}
+		spin_unlock_bh(&queue->lock);
+		if (skb)
+			return skb;
+
+		error = -EAGAIN;
+		if (!timeo)
+			break;
+	} while (!__skb_wait_for_more_packets(sk, &error, &timeo));
+
+	*err = error;
+	return NULL;
+}
+EXPORT_SYMBOL(__skb_recv_udp);
+
+/**
+ *	udp_kill_datagram - drop a datagram returned by __skb_recv_udp()
+ *	@sk: socket
+ *	@skb: datagram
+ *	@flags: MSG_ flags passed to __skb_recv_udp()
+ *
+ *	Returns 0 if the packet was removed by us, -ENOENT if a concurrent
+ *	reader got to a peeked packet first.
+ */
+int udp_kill_datagram(struct sock *sk, struct sk_buff *skb, unsigned int flags)
+{
+	struct sk_buff_head *queue = &udp_sk(sk)->reader_queue;
+	int err = 0;
+
+	if (flags & MSG_PEEK) {
+		err = -ENOENT;
+		spin_lock_bh(&queue->lock);
+		if (skb == skb_peek(queue)) {
+			__skb_unlink(skb, queue);
+			kfree_skb(skb);
+			err = 0;
+		}
+		spin_unlock_bh(&queue->lock);
+	}
+
+	kfree_skb(skb);
+	return err;
+}
+EXPORT_SYMBOL(udp_kill_datagram);
 
 /**
  *	first_packet_length	- return length of first packet in receive queue
@@ -851,13 +1029,19 @@ out:
  */
 static unsigned int first_packet_length(struct sock *sk)
 {
-	struct sk_buff_head list_kill, *rcvq = &sk->sk_receive_queue;
+	struct sk_buff_head *sk_queue = &sk->sk_receive_queue;
+	struct sk_buff_head list_kill, *rcvq = &udp_sk(sk)->reader_queue;
 	struct sk_buff *skb;
 	unsigned int res;
 
 	__skb_queue_head_init(&list_kill);
 
 	spin_lock_bh(&rcvq->lock);
+	if (skb_queue_empty(rcvq)) {
+		spin_lock(&sk_queue->lock);
+		skb_queue_splice_tail_init(sk_queue, rcvq);
+		spin_unlock(&sk_queue->lock);
+	}
 	while ((skb = skb_peek(rcvq)) != NULL &&
 		udp_lib_checksum_complete(skb)) {
 		UDP_INC_STATS_BH(sock_net(sk), UDP_MIB_INERRORS,
@@ -868,12 +1052,7 @@ static unsigned int first_packet_length(struct sock *sk)
 	res = skb ? skb->len : 0;
 	spin_unlock_bh(&rcvq->lock);
 
-	if (!skb_queue_empty(&list_kill)) {
-		lock_sock(sk);
-		__skb_queue_purge(&list_kill);
-		sk_mem_reclaim_partial(sk);
-		release_sock(sk);
-	}
+	__skb_queue_purge(&list_kill);
 	return res;
 }
 
@@ -940,8 +1119,7 @@ int udp_recvmsg(struct kiocb *iocb, struct sock *sk, struct msghdr *msg,
 		return ip_recv_error(sk, msg, len);
 
 try_again:
-	skb = __skb_recv_datagram(sk, flags | (noblock ? MSG_DONTWAIT : 0),
-				  &peeked, &err);
+	skb = __skb_recv_udp(sk, flags, noblock, &peeked, &err);
 	if (!skb)
 		goto out;
 
@@ -991,6 +1169,7 @@ try_again:
 		sin->sin_addr.s_addr = ip_hdr(skb)->saddr;
 		memset(sin->sin_zero, 0, sizeof(sin->sin_zero));
 	}
+	udp_cmsg_recv(msg, sk, skb);
 	if (inet->cmsg_flags)
 		ip_cmsg_recv(msg, skb);
 
@@ -999,15 +1178,13 @@ try_again:
 		err = ulen;
 
 out_free:
-	skb_free_datagram_locked(sk, skb);
+	consume_skb(skb);
 out:
 	return err;
 
 csum_copy_err:
-	lock_sock(sk);
-	if (!skb_kill_datagram(sk, skb, flags))
+	if (!udp_kill_datagram(sk, skb, flags))
 		UDP_INC_STATS_USER(sock_net(sk), UDP_MIB_INERRORS, is_udplite);
-	release_sock(sk);
 
 	if (noblock)
 		return -EAGAIN;
@@ -1060,13 +1237,14 @@ static int __udp_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
 	int is_udplite = IS_UDPLITE(sk);
 	int rc;
 
-	if ((rc = sock_queue_rcv_skb(sk, skb)) < 0) {
+	if (sk_filter(sk, skb))
+		goto drop;
+
+	if ((rc = __udp_enqueue_schedule_skb(sk, skb)) < 0) {
 		/* Note that an ENOMEM error is charged twice */
-		if (rc == -ENOMEM) {
+		if (rc == -ENOMEM)
 			UDP_INC_STATS_BH(sock_net(sk), UDP_MIB_RCVBUFERRORS,
 					 is_udplite);
-			atomic_inc(&sk->sk_drops);
-		}
 		goto drop;
 	}
 
@@ -1086,10 +1264,9 @@ drop:
  * Note that in the success and error cases, the skb is assumed to
  * have either been requeued or freed.
  */
-int udp_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
+static int udp_queue_rcv_one_skb(struct sock *sk, struct sk_buff *skb)
 {
 	struct udp_sock *up = udp_sk(sk);
-	int rc;
 	int is_udplite = IS_UDPLITE(sk);
 
 	/*
@@ -1169,16 +1346,8 @@ int udp_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
 			goto drop;
 	}
 
-	rc = 0;
-
-	bh_lock_sock(sk);
-	if (!sock_owned_by_user(sk))
-		rc = __udp_queue_rcv_skb(sk, skb);
-	else
-		sk_add_backlog(sk, skb);
-	bh_unlock_sock(sk);
-
-	return rc;
+	/* No socket lock: receive memory is reserved atomically */
+	return __udp_queue_rcv_skb(sk, skb);
 
 drop:
 	UDP_INC_STATS_BH(sock_net(sk), UDP_MIB_INERRORS, is_udplite);
@@ -1186,6 +1355,104 @@ drop:
 	return -1;
 }
 
+/*
+ * Segment a SKB_GSO_UDP_L4 packet back into the datagrams it was built
+ * from: every segment gets its own UDP length and checksum.
+ */
+static struct sk_buff *__udp4_gso_segment(struct sk_buff *skb, int features)
+{
+	struct sk_buff *segs, *seg;
+	unsigned int mss = skb_shinfo(skb)->gso_size;
+	__be32 saddr, daddr;
+	struct udphdr *uh;
+
+	if (!pskb_may_pull(skb, sizeof(*uh)))
+		return ERR_PTR(-EINVAL);
+	if (skb->len <= sizeof(*uh) + mss)
+		return ERR_PTR(-EINVAL);
+
+	saddr = ip_hdr(skb)->saddr;
+	daddr = ip_hdr(skb)->daddr;
+
+	__skb_pull(skb, sizeof(*uh));
+	segs = skb_segment(skb, features);
+	if (IS_ERR(segs))
+		return segs;
+
+	for (seg = segs; seg; seg = seg->next) {
+		unsigned int len = seg->len - skb_transport_offset(seg);
+
+		uh = udp_hdr(seg);
+		uh->len = htons(len);
+		uh->check = 0;
+		if (seg->ip_summed == CHECKSUM_PARTIAL) {
+			uh->check = ~csum_tcpudp_magic(saddr, daddr, len,
+						       IPPROTO_UDP, 0);
+			seg->csum_start = skb_transport_header(seg) - seg->head;
+			seg->csum_offset = offsetof(struct udphdr, check);
+		} else {
+			/* skb_segment() summed the payload into seg->csum */
+			uh->check = csum_tcpudp_magic(saddr, daddr, len,
+					IPPROTO_UDP,
+					csum_partial(uh, sizeof(*uh), seg->csum));
+			if (uh->check == 0)
+				uh->check = CSUM_MANGLED_0;
+		}
+	}
+	return segs;
+}
+
+/*
+ * A coalesced GRO datagram reached a socket that did not ask for one
+ * (the option was cleared after the GRO lookup, or it is one of several
+ * multicast receivers).  Split it back into the original datagrams.
+ */
+static struct sk_buff *udp_rcv_segment(struct sock *sk, struct sk_buff *skb)
+{
+	struct sk_buff *segs, *seg;
+
+	segs = __udp4_gso_segment(skb, NETIF_F_SG);
+	if (IS_ERR(segs) || !segs) {
+		UDP_INC_STATS_BH(sock_net(sk), UDP_MIB_INERRORS,
+				 IS_UDPLITE(sk));
+		atomic_inc(&sk->sk_drops);
+		kfree_skb(skb);
+		return NULL;
+	}
+	consume_skb(skb);
+
+	/* skb_segment() leaves data at the MAC header, rewind to UDP */
+	for (seg = segs; seg; seg = seg->next) {
+		ip_hdr(seg)->tot_len = htons(seg->len -
+					     skb_network_offset(seg));
+		__skb_pull(seg, skb_transport_offset(seg));
+		seg->ip_summed = CHECKSUM_UNNECESSARY;
+	}
+	return segs;
+}
+
+/* Same return convention as udp_queue_rcv_one_skb() */
+int udp_queue_rcv_skb(struct sock *sk, struct sk_buff *skb)
+{
+	struct udp_sock *up = udp_sk(sk);
+	struct sk_buff *next, *segs;
+
+	if (likely(!skb_is_gso(skb)) ||
+	    (up->gro_enabled && !up->encap_type))
+		return udp_queue_rcv_one_skb(sk, skb);
+
+	segs = udp_rcv_segment(sk, skb);
+	for (skb = segs; skb; skb = next) {
+		next = skb->next;
+		skb->next = NULL;
+
+		/* segments cannot be resubmitted to another protocol */
+		if (udp_queue_rcv_one_skb(sk, skb) > 0)
+			kfree_skb(skb);
+	}
+	return 0;
+}
+
 /*
  *	Multicasts and broadcasts go to each listener.
  *
@@ -1378,11 +1645,43 @@ int udp_rcv(struct sk_buff *skb)
 	return __udp4_lib_rcv(skb, &udp_table, IPPROTO_UDP);
 }
 
+/* Readers take sk_receive_queue.lock nested inside reader_queue.lock */
+static struct lock_class_key udp_reader_queue_key;
+
+int udp_init_sock(struct sock *sk)
+{
+	skb_queue_head_init(&udp_sk(sk)->reader_queue);
+	lockdep_set_class(&udp_sk(sk)->reader_queue.lock,
+			  &udp_reader_queue_key);
+	return 0;
+}
+EXPORT_SYMBOL(udp_init_sock);
+
+/* Sockets with UDP_GRO set: GRO does no socket lookup while there are none */
+static atomic_t udp_gro_sockets = ATOMIC_INIT(0);
+
+/* Called with the socket locked */
+void udp_lib_set_gro(struct sock *sk, int on)
+{
+	struct udp_sock *up = udp_sk(sk);
+
+	if (on == up->gro_enabled)
+		return;
+	up->gro_enabled = on;
+	if (on)
+		atomic_inc(&udp_gro_sockets);
+	else
+		atomic_dec(&udp_gro_sockets);
+}
+EXPORT_SYMBOL(udp_lib_set_gro);
+
 void udp_destroy_sock(struct sock *sk)
 {
 	lock_sock(sk);
 	udp_flush_pending_frames(sk);
+	udp_lib_set_gro(sk, 0);
 	release_sock(sk);
+	skb_queue_purge(&udp_sk(sk)->reader_queue);
 }
 
 /*
@@ -1431,6 +1730,15 @@ int udp_lib_setsockopt(struct sock *sk, int level, int optname,
 		}
 		break;
 
+	case UDP_GRO:
+		/* UDP-Lite datagrams are never coalesced */
+		if (is_udplite)
+			return -ENOPROTOOPT;
+		lock_sock(sk);
+		udp_lib_set_gro(sk, val ? 1 : 0);
+		release_sock(sk);
+		break;
+
 	/*
 	 * 	UDP-Lite's partial checksum coverage (RFC 3828).
 	 */
@@ -1513,6 +1821,10 @@ int udp_lib_getsockopt(struct sock *sk, int level, int optname,
 		val = up->encap_type;
 		break;
 
+	case UDP_GRO:
+		val = up->gro_enabled;
+		break;
+
 	/* The following two cannot be changed on UDP sockets, the return is
 	 * always 0 (which corresponds to the full checksum coverage of UDP). */
 	case UDPLITE_SEND_CSCOV:
@@ -1570,6 +1882,10 @@ unsigned int udp_poll(struct file *file, struct socket *sock, poll_table *wait)
 	unsigned int mask = datagram_poll(file, sock, wait);
 	struct sock *sk = sock->sk;
 
+	/* Datagrams already moved to the reader queue are readable too */
+	if (!skb_queue_empty(&udp_sk(sk)->reader_queue))
+		mask |= POLLIN | POLLRDNORM;
+
 	/* Check for false positives due to checksum errors */
 	if ((mask & POLLRDNORM) && !(file->f_flags & O_NONBLOCK) &&
 	    !(sk->sk_shutdown & RCV_SHUTDOWN) && !first_packet_length(sk))
@@ -1587,13 +1903,13 @@ struct proto udp_prot = {
 	.connect	   = ip4_datagram_connect,
 	.disconnect	   = udp_disconnect,
 	.ioctl		   = udp_ioctl,
+	.init		   = udp_init_sock,
 	.destroy	   = udp_destroy_sock,
 	.setsockopt	   = udp_setsockopt,
 	.getsockopt	   = udp_getsockopt,
 	.sendmsg	   = udp_sendmsg,
 	.recvmsg	   = udp_recvmsg,
 	.sendpage	   = udp_sendpage,
-	.backlog_rcv	   = __udp_queue_rcv_skb,
 	.hash		   = udp_lib_hash,
 	.unhash		   = udp_lib_unhash,
 	.get_port	   = udp_v4_get_port,
@@ -1872,6 +2188,10 @@ struct sk_buff *udp4_ufo_fragment(struct sk_buff *skb, int features)
 	int offset;
 	__wsum csum;
 
+	/* Coalesced datagrams are split per datagram, not fragmented */
+	if (skb_shinfo(skb)->gso_type & SKB_GSO_UDP_L4)
+		return __udp4_gso_segment(skb, features);
+
 	mss = skb_shinfo(skb)->gso_size;
 	if (unlikely(skb->len <= mss))
 		goto out;
@@ -1907,3 +2227,129 @@ out:
 	return segs;
 }
 
+/*
+ * UDP GRO: consecutive datagrams of one flow with the same payload size
+ * (the last one may be shorter) are chained into a single SKB_GSO_UDP_L4
+ * packet.  Only flows terminating at a local socket that enabled UDP_GRO
+ * are aggregated, everyone else keeps seeing one skb per datagram.
+ */
+struct sk_buff **udp4_gro_receive(struct sk_buff **head, struct sk_buff *skb)
+{
+	struct iphdr *iph = skb_gro_network_header(skb);
+	struct sk_buff **pp = NULL;
+	struct sk_buff *p;
+	struct udphdr *uh, *uh2;
+	unsigned int off, hlen, len;
+	unsigned int mss = 1;
+	struct sock *sk;
+	int gro = 0;
+	int flush = 1;
+
+	off = skb_gro_offset(skb);
+	hlen = off + sizeof(*uh);
+	uh = skb_gro_header_fast(skb, off);
+	if (skb_gro_header_hard(skb, hlen)) {
+		uh = skb_gro_header_slow(skb, hlen, off);
+		if (unlikely(!uh))
+			goto out;
+	}
+
+	switch (skb->ip_summed) {
+	case CHECKSUM_COMPLETE:
+		if (!csum_tcpudp_magic(iph->saddr, iph->daddr,
+				       skb_gro_len(skb), IPPROTO_UDP,
+				       skb->csum)) {
+			skb->ip_summed = CHECKSUM_UNNECESSARY;
+			break;
+		}
+		goto out;
+
+	case CHECKSUM_NONE:
+		if (uh->check)
+			goto out;
+		break;
+	}
+
+	/* Padded or truncated datagrams are left to udp_rcv() */
+	if (ntohs(uh->len) != skb_gro_len(skb) ||
+	    ntohs(uh->len) <= sizeof(*uh))
+		goto out;
+
+	if (!atomic_read(&udp_gro_sockets) ||
+	    ipv4_is_multicast(iph->daddr) || ipv4_is_lbcast(iph->daddr))
+		goto out;
+
+	sk = __udp4_lib_lookup(dev_net(skb->dev), iph->saddr, uh->source,
+			       iph->daddr, uh->dest, skb->dev->ifindex,
+			       &udp_table);
+	if (sk) {
+		gro = udp_sk(sk)->gro_enabled && !udp_sk(sk)->encap_type;
+		sock_put(sk);
+	}
+	if (!gro)
+		goto out;
+
+	skb_gro_pull(skb, sizeof(*uh));
+	len = skb_gro_len(skb);
+
+	for (; (p = *head); head = &p->next) {
+		if (!NAPI_GRO_CB(p)->same_flow)
+			continue;
+
+		uh2 = udp_hdr(p);
+		if (*(u32 *)&uh->source != *(u32 *)&uh2->source) {
+			NAPI_GRO_CB(p)->same_flow = 0;
+			continue;
+		}
+
+		goto found;
+	}
+
+	goto out_check_final;
+
+found:
+	flush = NAPI_GRO_CB(p)->flush;
+	mss = skb_shinfo(p)->gso_size;
+
+	/* A datagram larger than the first one cannot be appended */
+	flush |= len > mss;
+
+	if (flush || skb_gro_receive(head, skb)) {
+		mss = 1;
+		goto out_check_final;
+	}
+
+	p = *head;
+
+out_check_final:
+	/* A short datagram terminates the train */
+	flush = len < mss;
+
+	if (p && (!NAPI_GRO_CB(skb)->same_flow || flush))
+		pp = head;
+
+out:
+	NAPI_GRO_CB(skb)->flush |= flush;
+
+	return pp;
+}
+
+int udp4_gro_complete(struct sk_buff *skb)
+{
+	const struct iphdr *iph = ip_hdr(skb);
+	struct udphdr *uh = udp_hdr(skb);
+	unsigned int len = skb->len - skb_transport_offset(skb);
+
+	uh->len = htons(len);
+	uh->check = ~csum_tcpudp_magic(iph->saddr, iph->daddr, len,
+				       IPPROTO_UDP, 0);
+	skb->csum_start = skb_transport_header(skb) - skb->head;
+	skb->csum_offset = offsetof(struct udphdr, check);
+	skb->ip_summed = CHECKSUM_PARTIAL;
+
+	skb_shinfo(skb)->gso_type = SKB_GSO_UDP_L4;
+	skb_shinfo(skb)->gso_segs = NAPI_GRO_CB(skb)->count;
+
+	return 0;
+}
+